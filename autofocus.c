@@ -0,0 +1,467 @@
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#include "header.h"
+#include "capture.h"
+#include "autofocus.h"
+#include "metrics.h"
+#include "trace.h"
+
+/*
+ * Contrast autofocus in software for cameras whose own autofocus is slow or hunts. Every frame the sharpness
+ * of a centred ROI is measured as the Tenengrad, the mean squared Sobel gradient of the luma. A search drives
+ * V4L2_CID_FOCUS_ABSOLUTE while the frames keep flowing: from the current position it climbs in coarse steps
+ * while the sharpness rises, and each time it falls tries the other side and halves the step, down to the
+ * control's own step. A move only shows settle frames later, the frames in between are not measured. Once
+ * locked the lens stays put until the sharpness falls by refocus percent for a few frames.
+ */
+
+#define AF_MARGIN 0.02          /* a position must be this much sharper to count as better, for sensor noise */
+#define AF_CONFIRM 3            /* frames below the refocus threshold in a row before searching again */
+
+enum af_state { AF_START, AF_SEARCH, AF_RETURN, AF_LOCKED, AF_OFF };
+
+struct autofocus_config autofocus_config = { 40, 2, 0, 0 };
+struct autofocus_stats autofocus_stats;
+int autofocus_enabled;
+
+static enum af_state state;
+static int ctrl_min, ctrl_max, ctrl_step, position;     /* position is where the lens was last sent */
+static int best_pos, dir, step, tried, have_best;
+static double best, locked;
+static unsigned int wait, low, cur_width, cur_height;
+static unsigned long long search_t0, search_frames;
+static unsigned char *rows;                             /* three luma rows of the ROI of a YUYV frame */
+static unsigned int rows_width;
+static int unsupported_reported;
+
+/**
+Function Name : autofocus_parse
+Function Description : Parses the -a argument: "on", or comma separated roi=<percent>, settle=<frames>,
+                       step=<units> and refocus=<percent>
+Parameter : option string
+Return : 0 for success -1 for a bad option
+**/
+int autofocus_parse(const char *spec)
+{
+	char *opts = strdup(spec), *item, *save;
+	int ret = 0;
+
+	autofocus_enabled = 1;
+	for (item = strtok_r(opts, ",", &save); item; item = strtok_r(NULL, ",", &save)) {
+		if (strcmp(item, "on") == 0)
+			continue;
+		else if (strncmp(item, "roi=", 4) == 0)
+			autofocus_config.roi = strtol(item + 4, NULL, 10);
+		else if (strncmp(item, "settle=", 7) == 0)
+			autofocus_config.settle = strtol(item + 7, NULL, 10);
+		else if (strncmp(item, "step=", 5) == 0)
+			autofocus_config.step = strtol(item + 5, NULL, 10);
+		else if (strncmp(item, "refocus=", 8) == 0)
+			autofocus_config.refocus = strtol(item + 8, NULL, 10);
+		else {
+			fprintf(stderr, "Unknown autofocus option %s\n", item);
+			ret = -1;
+		}
+	}
+	free(opts);
+	if (autofocus_config.roi < 5 || autofocus_config.roi > 100) {
+		fprintf(stderr, "Autofocus roi must be 5 to 100 percent\n");
+		ret = -1;
+	}
+	if (autofocus_config.refocus > 90) {
+		fprintf(stderr, "Autofocus refocus must be 0 to 90 percent\n");
+		ret = -1;
+	}
+
+	return ret;
+}
+
+/* Sum of Gx^2 + Gy^2 of the 3x3 Sobel over the inner pixels of row m, a above and b below */
+static unsigned long long tenengrad_row(const unsigned char *a, const unsigned char *m, const unsigned char *b,
+	unsigned int width)
+{
+	unsigned long long sum = 0;
+	unsigned int x = 1;
+	int gx, gy;
+
+#if defined(__SSE2__)
+	const __m128i zero = _mm_setzero_si128();
+	__m128i acc = zero, al, ac, ar, bl, bc, br, vx, vy;
+	unsigned int lanes[4];
+
+	/* 8 pixels a step in 16 bits; a lane sums 4 squares of at most 1020^2 a step, 32 bits unsigned hold 1000 steps */
+#define LOAD8(p) _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(p)), zero)
+	for (; x + 9 <= width; x += 8) {
+		al = LOAD8(a + x - 1);
+		ac = LOAD8(a + x);
+		ar = LOAD8(a + x + 1);
+		bl = LOAD8(b + x - 1);
+		bc = LOAD8(b + x);
+		br = LOAD8(b + x + 1);
+		vx = _mm_sub_epi16(LOAD8(m + x + 1), LOAD8(m + x - 1));
+		vx = _mm_add_epi16(_mm_add_epi16(vx, vx), _mm_sub_epi16(_mm_add_epi16(ar, br), _mm_add_epi16(al, bl)));
+		vy = _mm_sub_epi16(_mm_add_epi16(_mm_add_epi16(bl, br), _mm_add_epi16(bc, bc)),
+			_mm_add_epi16(_mm_add_epi16(al, ar), _mm_add_epi16(ac, ac)));
+		acc = _mm_add_epi32(acc, _mm_add_epi32(_mm_madd_epi16(vx, vx), _mm_madd_epi16(vy, vy)));
+	}
+#undef LOAD8
+	_mm_storeu_si128((__m128i *)lanes, acc);
+	sum = (unsigned long long)lanes[0] + lanes[1] + lanes[2] + lanes[3];
+#elif defined(__ARM_NEON)
+	int16x8_t al, ac, ar, bl, bc, br, vx, vy;
+	uint32x4_t acc = vdupq_n_u32(0);
+
+#define LOAD8(p) vreinterpretq_s16_u16(vmovl_u8(vld1_u8(p)))
+	for (; x + 9 <= width; x += 8) {
+		al = LOAD8(a + x - 1);
+		ac = LOAD8(a + x);
+		ar = LOAD8(a + x + 1);
+		bl = LOAD8(b + x - 1);
+		bc = LOAD8(b + x);
+		br = LOAD8(b + x + 1);
+		vx = vsubq_s16(LOAD8(m + x + 1), LOAD8(m + x - 1));
+		vx = vaddq_s16(vaddq_s16(vx, vx), vsubq_s16(vaddq_s16(ar, br), vaddq_s16(al, bl)));
+		vy = vsubq_s16(vaddq_s16(vaddq_s16(bl, br), vaddq_s16(bc, bc)),
+			vaddq_s16(vaddq_s16(al, ar), vaddq_s16(ac, ac)));
+		acc = vreinterpretq_u32_s32(vmlal_s16(vreinterpretq_s32_u32(acc), vget_low_s16(vx), vget_low_s16(vx)));
+		acc = vreinterpretq_u32_s32(vmlal_s16(vreinterpretq_s32_u32(acc), vget_high_s16(vx), vget_high_s16(vx)));
+		acc = vreinterpretq_u32_s32(vmlal_s16(vreinterpretq_s32_u32(acc), vget_low_s16(vy), vget_low_s16(vy)));
+		acc = vreinterpretq_u32_s32(vmlal_s16(vreinterpretq_s32_u32(acc), vget_high_s16(vy), vget_high_s16(vy)));
+	}
+#undef LOAD8
+	sum = vgetq_lane_u64(vpaddlq_u32(acc), 0) + vgetq_lane_u64(vpaddlq_u32(acc), 1);
+#endif
+	for (; x + 1 < width; ++x) {
+		gx = a[x + 1] - a[x - 1] + 2 * (m[x + 1] - m[x - 1]) + b[x + 1] - b[x - 1];
+		gy = b[x - 1] + 2 * b[x] + b[x + 1] - a[x - 1] - 2 * a[x] - a[x + 1];
+		sum += gx * gx + gy * gy;
+	}
+
+	return sum;
+}
+
+/* The luma of width pixels of a YUYV row */
+static void yuyv_luma(unsigned char *dst, const unsigned char *src, unsigned int width)
+{
+	unsigned int x = 0;
+
+#if defined(__SSE2__)
+	const __m128i lo = _mm_set1_epi16(0xff);
+
+	for (; x + 16 <= width; x += 16)
+		_mm_storeu_si128((__m128i *)(dst + x),
+			_mm_packus_epi16(_mm_and_si128(_mm_loadu_si128((const __m128i *)(src + 2 * x)), lo),
+			_mm_and_si128(_mm_loadu_si128((const __m128i *)(src + 2 * x + 16)), lo)));
+#elif defined(__ARM_NEON)
+	for (; x + 16 <= width; x += 16)
+		vst1q_u8(dst + x, vld2q_u8(src + 2 * x).val[0]);
+#endif
+	for (; x < width; ++x)
+		dst[x] = src[2 * x];
+}
+
+/**
+Function Name : autofocus_sharpness
+Function Description : Tenengrad of the centred ROI of a frame: the mean of Gx^2 + Gy^2 of the Sobel over the
+                       luma, larger the sharper the image
+Parameter : the frame, ROI size in percent of the width and height
+Return : sharpness per pixel, -1 for a format without a luma plane or a frame too small
+**/
+double autofocus_sharpness(const struct frame_view *view, unsigned int roi)
+{
+	unsigned int rw = view->width * roi / 100, rh = view->height * roi / 100, x0, y0, y, step;
+	const unsigned char *base, *r[3];
+	unsigned long long sum = 0;
+
+	if (view->fourcc != V4L2_PIX_FMT_YUYV && view->fourcc != V4L2_PIX_FMT_NV12 &&
+	    view->fourcc != V4L2_PIX_FMT_GREY)
+		return -1;
+	if (rw < 3 || rh < 3)
+		return -1;
+	x0 = (view->width - rw) / 2;
+	y0 = (view->height - rh) / 2;
+	step = view->fourcc == V4L2_PIX_FMT_YUYV ? 2 : 1;
+	base = view->plane[0] + y0 * view->pitch[0] + x0 * step;
+	if (step == 1) {
+		for (y = 1; y + 1 < rh; ++y)
+			sum += tenengrad_row(base + (y - 1) * view->pitch[0], base + y * view->pitch[0],
+				base + (y + 1) * view->pitch[0], rw);
+	} else {
+		/* YUYV rows are unpacked to luma as the three row window slides down */
+		if (rw > rows_width) {
+			free(rows);
+			if (!(rows = malloc(3 * rw))) {
+				rows_width = 0;
+				return -1;
+			}
+			rows_width = rw;
+		}
+		yuyv_luma(rows, base, rw);
+		yuyv_luma(rows + rw, base + view->pitch[0], rw);
+		for (y = 1; y + 1 < rh; ++y) {
+			yuyv_luma(rows + (y + 1) % 3 * rw, base + (y + 1) * view->pitch[0], rw);
+			r[0] = rows + (y - 1) % 3 * rw;
+			r[1] = rows + y % 3 * rw;
+			r[2] = rows + (y + 1) % 3 * rw;
+			sum += tenengrad_row(r[0], r[1], r[2], rw);
+		}
+	}
+	autofocus_stats.roi_width = rw;
+	autofocus_stats.roi_height = rh;
+
+	return (double)sum / ((rw - 2) * (rh - 2));
+}
+
+/* Nearest position the control accepts */
+static int af_snap(int pos)
+{
+	pos = ctrl_min + (pos - ctrl_min + ctrl_step / 2) / ctrl_step * ctrl_step;
+
+	return pos < ctrl_min ? ctrl_min : pos > ctrl_max ? ctrl_max : pos;
+}
+
+static int af_move(int pos)
+{
+	struct v4l2_control ctrl;
+	unsigned long long t0 = metric_now_ns();
+
+	CLEAR(ctrl);
+	ctrl.id = V4L2_CID_FOCUS_ABSOLUTE;
+	ctrl.value = pos;
+	if (-1 == xioctl(fd, VIDIOC_S_CTRL, &ctrl)) {
+		perror("autofocus: VIDIOC_S_CTRL");
+		state = AF_OFF;
+		return -1;
+	}
+	autofocus_stats.control_ns += metric_now_ns() - t0;
+	autofocus_stats.moves++;
+	position = pos;
+	wait = autofocus_config.settle;
+
+	return 0;
+}
+
+/* Finds the focus control, takes the lens from the camera's own autofocus and reads where it is */
+static int af_open(void)
+{
+	struct v4l2_queryctrl qc;
+	struct v4l2_control ctrl;
+
+	CLEAR(qc);
+	qc.id = V4L2_CID_FOCUS_ABSOLUTE;
+	if (-1 == xioctl(fd, VIDIOC_QUERYCTRL, &qc) || (qc.flags & V4L2_CTRL_FLAG_DISABLED) || qc.maximum <= qc.minimum) {
+		fprintf(stderr, "autofocus: %s has no absolute focus control\n", dev_path);
+		return -1;
+	}
+	ctrl_min = qc.minimum;
+	ctrl_max = qc.maximum;
+	ctrl_step = qc.step > 0 ? qc.step : 1;
+
+	CLEAR(ctrl);
+	ctrl.id = V4L2_CID_FOCUS_AUTO;
+	if (-1 == xioctl(fd, VIDIOC_S_CTRL, &ctrl) && errno != EINVAL)
+		perror("autofocus: switching off V4L2_CID_FOCUS_AUTO");
+	ctrl.id = V4L2_CID_FOCUS_ABSOLUTE;
+	position = -1 == xioctl(fd, VIDIOC_G_CTRL, &ctrl) ? qc.default_value : ctrl.value;
+	autofocus_stats.minimum = ctrl_min;
+	autofocus_stats.maximum = ctrl_max;
+
+	return 0;
+}
+
+static void af_search(void)
+{
+	int range = ctrl_max - ctrl_min;
+
+	state = AF_SEARCH;
+	have_best = tried = 0;
+	step = autofocus_config.step ? (int)autofocus_config.step : range / 8;
+	step = step < ctrl_step ? ctrl_step : step / ctrl_step * ctrl_step;
+	/* the longer way first, the peak is more likely on that side */
+	dir = position - ctrl_min < ctrl_max - position ? 1 : -1;
+	search_t0 = metric_now_ns();
+	search_frames = 0;
+	autofocus_stats.searches++;
+}
+
+static int af_halve(int s)
+{
+	int h = s / 2 / ctrl_step * ctrl_step;
+
+	return h < ctrl_step && s > ctrl_step ? ctrl_step : h;
+}
+
+static void af_lock(double sharpness)
+{
+	unsigned long long ns = metric_now_ns() - search_t0;
+
+	state = AF_LOCKED;
+	locked = sharpness;
+	low = 0;
+	autofocus_stats.locked++;
+	autofocus_stats.search_frames += search_frames;
+	autofocus_stats.focus_ns += ns;
+	if (ns > autofocus_stats.focus_max_ns)
+		autofocus_stats.focus_max_ns = ns;
+	autofocus_stats.position = position;
+	autofocus_stats.sharpness = sharpness;
+}
+
+/* The next position to look at; once the step is below the control's, back to the best and lock */
+static void af_next(void)
+{
+	int next;
+
+	while (step >= ctrl_step) {
+		next = best_pos + dir * step;
+		if (next >= ctrl_min && next <= ctrl_max) {
+			af_move(af_snap(next));
+			return;
+		}
+		if (!tried) {
+			dir = -dir;
+			tried = 1;
+		} else {
+			step = af_halve(step);
+			tried = 0;
+		}
+	}
+	if (position == best_pos)
+		af_lock(best);
+	else if (af_move(best_pos) == 0)
+		state = AF_RETURN;
+}
+
+/* The sharpness at position came in: keep climbing, turn round, or halve the step */
+static void af_measured(double sharpness)
+{
+	if (!have_best || sharpness > best * (1 + AF_MARGIN)) {
+		tried = have_best;      /* rising this way, the other side of the old best is known to be lower */
+		have_best = 1;
+		best = sharpness;
+		best_pos = position;
+	} else if (!tried) {
+		dir = -dir;
+		tried = 1;
+	} else {
+		step = af_halve(step);
+		tried = 0;
+	}
+	af_next();
+}
+
+/**
+Function Name : autofocus_frame
+Function Description : Measures the sharpness of a captured frame and moves the lens on when a search is due
+Parameter : the captured frame
+Return : void
+**/
+void autofocus_frame(const struct frame_view *view)
+{
+	unsigned long long t0, ns;
+	double sharpness;
+
+	if (state == AF_OFF || !frame_view_complete(view))
+		return;
+	TRACE_BEGIN(ta);
+	t0 = metric_now_ns();
+	sharpness = autofocus_sharpness(view, autofocus_config.roi);
+	ns = metric_now_ns() - t0;
+	TRACE_END(ta, "autofocus");
+	if (sharpness < 0) {
+		if (!unsupported_reported++)
+			fprintf(stderr, "autofocus: only YUYV, NV12 and GREY frames are measured\n");
+		return;
+	}
+	autofocus_stats.frames++;
+	autofocus_stats.metric_ns += ns;
+	if (ns > autofocus_stats.metric_max_ns)
+		autofocus_stats.metric_max_ns = ns;
+	/* a new size measures on a different scale, what was locked is compared from here on */
+	if (view->width != cur_width || view->height != cur_height) {
+		cur_width = view->width;
+		cur_height = view->height;
+		locked = sharpness;
+	}
+
+	switch (state) {
+	case AF_START:
+		if (af_open() != 0) {
+			state = AF_OFF;
+			break;
+		}
+		af_search();
+		wait = autofocus_config.settle;         /* the camera's autofocus may have left the lens moving */
+		search_frames++;
+		break;
+	case AF_SEARCH:
+	case AF_RETURN:
+		search_frames++;
+		if (wait) {
+			wait--;
+			break;
+		}
+		if (state == AF_RETURN)
+			af_lock(sharpness);
+		else
+			af_measured(sharpness);
+		break;
+	case AF_LOCKED:
+		if (!autofocus_config.refocus || sharpness >= locked * (100 - autofocus_config.refocus) / 100)
+			low = 0;
+		else if (++low >= AF_CONFIRM)
+			af_search();
+		break;
+	case AF_OFF:
+		break;
+	}
+}
+
+/**
+Function Name : autofocus_reset
+Function Description : Starts over with a search on the next frame, for a device that was reopened, and frees
+                       the row buffer
+Parameter : void
+Return : void
+**/
+void autofocus_reset(void)
+{
+	state = AF_START;
+	wait = low = 0;
+	cur_width = cur_height = 0;
+	free(rows);
+	rows = NULL;
+	rows_width = 0;
+}
+
+/**
+Function Name : autofocus_finish
+Function Description : Prints the time and frames it took to focus, the lens moves and the cost of the
+                       sharpness per frame
+Parameter : void
+Return : void
+**/
+void autofocus_finish(void)
+{
+	struct autofocus_stats *st = &autofocus_stats;
+
+	if (st->frames) {
+		printf("Autofocus: %llu searches %llu locked, %.1f ms avg %.1f ms max and %.1f frames avg to focus, "
+			"%llu lens moves at %.3f ms each\n", st->searches, st->locked,
+			st->locked ? st->focus_ns / 1e6 / st->locked : 0.0, st->focus_max_ns / 1e6,
+			st->locked ? (double)st->search_frames / st->locked : 0.0, st->moves,
+			st->moves ? st->control_ns / 1e6 / st->moves : 0.0);
+		if (st->locked)
+			printf("\tLens : at %d of %d to %d, sharpness %.1f\n", st->position, st->minimum, st->maximum,
+				st->sharpness);
+		printf("\tSharpness : Tenengrad over a %ux%u ROI, %.3f ms avg %.3f ms max per frame over %llu frames\n",
+			st->roi_width, st->roi_height, st->metric_ns / 1e6 / st->frames, st->metric_max_ns / 1e6,
+			st->frames);
+	}
+	autofocus_reset();
+	unsupported_reported = 0;
+}
@@ -0,0 +1,31 @@
+#pragma once
+#include "frameview.h"
+
+struct autofocus_config {
+	unsigned int roi;               /* percent of the width and height measured, centred */
+	unsigned int settle;            /* frames after a lens move that still show the old position */
+	unsigned int step;              /* first step of the search in control units, 0 for an eighth of the range */
+	unsigned int refocus;           /* percent the sharpness may fall from the locked value before searching again, 0 never */
+};
+
+struct autofocus_stats {
+	unsigned long long frames;                      /* measured */
+	unsigned long long metric_ns, metric_max_ns;
+	unsigned long long searches, locked;
+	unsigned long long search_frames;               /* frames from a search starting to the lens resting in focus */
+	unsigned long long focus_ns, focus_max_ns;      /* the same in time */
+	unsigned long long moves, control_ns;           /* VIDIOC_S_CTRL of the focus */
+	unsigned int roi_width, roi_height;
+	int position, minimum, maximum;                 /* lens position when last locked and the control range */
+	double sharpness;                               /* Tenengrad per pixel of the ROI when last locked */
+};
+
+extern struct autofocus_config autofocus_config;
+extern struct autofocus_stats autofocus_stats;
+extern int autofocus_enabled;
+
+int autofocus_parse(const char *spec);
+double autofocus_sharpness(const struct frame_view *view, unsigned int roi);
+void autofocus_frame(const struct frame_view *view);
+void autofocus_reset(void);
+void autofocus_finish(void);
@@ -0,0 +1,3074 @@
+#define _GNU_SOURCE
+#include <math.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <linux/fs.h>
+#include <linux/fiemap.h>
+
+#include "header.h"
+#include "capture.h"
+#include "bench.h"
+#include "encode.h"
+#include "lossless.h"
+#include "metrics.h"
+#include "rt.h"
+#include "synth.h"
+#include "pipeout.h"
+#include "crc32c.h"
+#include "framecheck.h"
+#include "policy.h"
+#include "hotplug.h"
+#include "texfill.h"
+#include "isp.h"
+#include "tilepool.h"
+#include "snapshot.h"
+#include "pyramid.h"
+#include "segment.h"
+#include "stabilize.h"
+#include "autofocus.h"
+#include "hdr.h"
+#include "denoise.h"
+#include "h264.h"
+#include "mp4.h"
+
+struct bench_case {
+	const char *name;
+	const char *desc;
+	int (*run)(int argc, char **argv);
+};
+
+double bench_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+double bench_cpu_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static const char *fourcc_name(unsigned int fourcc, char *buf)
+{
+	buf[0] = fourcc & 0xff;
+	buf[1] = (fourcc >> 8) & 0xff;
+	buf[2] = (fourcc >> 16) & 0xff;
+	buf[3] = (fourcc >> 24) & 0xff;
+	buf[4] = '\0';
+
+	return buf;
+}
+
+/**
+Function Name : bench_codec
+Function Description : Compression speed, decompression speed and ratio of every recording codec per pixel
+                       format on synthetic frames. Lossless round trips are verified byte for byte
+Parameter : optional width height frame-count
+Return : 0 for success -1 when a round trip mismatched
+**/
+static int bench_codec(int argc, char **argv)
+{
+	static const unsigned int formats[] = { V4L2_PIX_FMT_YUYV, V4L2_PIX_FMT_NV12, V4L2_PIX_FMT_GREY };
+	static const struct {
+		const char *name;
+		enum encode_codec codec;
+		int level;
+		enum delta_filter filter;
+	} codecs[] = {
+		{ "lz4",       ENCODE_LZ4,  0,  DELTA_NONE },
+		{ "lz4+row",   ENCODE_LZ4,  0,  DELTA_ROW },
+		{ "zstd:1",    ENCODE_ZSTD, 1,  DELTA_NONE },
+		{ "zstd:1+row", ENCODE_ZSTD, 1, DELTA_ROW },
+		{ "zstd:3+row", ENCODE_ZSTD, 3, DELTA_ROW },
+		{ "jpeg:85",   ENCODE_JPEG, 85, DELTA_NONE },
+	};
+	unsigned int width = argc > 1 ? strtol(argv[1], NULL, 10) : 1920;
+	unsigned int height = argc > 2 ? strtol(argv[2], NULL, 10) : 1080;
+	unsigned int n_frames = argc > 3 ? strtol(argv[3], NULL, 10) : 30;
+	unsigned int f, c, i, size;
+	unsigned char *frames, *decoded;
+	struct encode_worker worker;
+	struct encode_job job;
+	double t0, enc_time, dec_time;
+	unsigned long long out_bytes;
+	int failed = 0, ok;
+	char name[5];
+
+	frames = malloc((size_t)width * height * 2 * n_frames);
+	decoded = malloc(width * height * 2);
+	memset(&worker, 0, sizeof(worker));
+	memset(&job, 0, sizeof(job));
+	job.raw = malloc(width * height * 2);
+	job.out_capacity = width * height * 2;
+	job.out = malloc(job.out_capacity);
+
+	printf("codec benchmark %ux%u, %u frames per run\n", width, height, n_frames);
+	printf("%-6s %-11s %8s %10s %10s %s\n", "format", "codec", "ratio", "enc MB/s", "dec MB/s", "round trip");
+	for (f = 0; f < sizeof(formats) / sizeof(formats[0]); ++f) {
+		size = synth_frame_size(width, height, formats[f]);
+		for (i = 0; i < n_frames; ++i)
+			synth_fill_frame(frames + (size_t)i * size, width, height, formats[f], i);
+
+		for (c = 0; c < sizeof(codecs) / sizeof(codecs[0]); ++c) {
+			if (codecs[c].codec == ENCODE_JPEG && formats[f] == V4L2_PIX_FMT_GREY)
+				continue;
+			encode_codec = codecs[c].codec;
+			lossless_filter = codecs[c].filter;
+			if (encode_codec == ENCODE_JPEG)
+				encode_quality = codecs[c].level;
+			else
+				lossless_level = codecs[c].level;
+			encode_worker_release(&worker);
+
+			enc_time = dec_time = 0;
+			out_bytes = 0;
+			ok = 1;
+			for (i = 0; i < n_frames; ++i) {
+				memcpy(job.raw, frames + (size_t)i * size, size);
+				job.raw_size = size;
+				job.seq = i;
+				job.width = width;
+				job.height = height;
+				job.fourcc = formats[f];
+
+				t0 = bench_cpu_now();
+				if (encode_codec == ENCODE_JPEG)
+					jpeg_encode_frame(&worker, &job);
+				else
+					lossless_encode_frame(&worker, &job);
+				enc_time += bench_cpu_now() - t0;
+				out_bytes += job.out_size;
+
+				if (encode_codec == ENCODE_JPEG)
+					continue;
+				t0 = bench_cpu_now();
+				if (lossless_decode_frame(job.out, job.out_size, decoded, width * height * 2) != (long)size
+				    || memcmp(decoded, frames + (size_t)i * size, size) != 0)
+					ok = 0;
+				dec_time += bench_cpu_now() - t0;
+			}
+
+			printf("%-6s %-11s %7.2f:1 %10.1f ", fourcc_name(formats[f], name), codecs[c].name,
+				(double)size * n_frames / out_bytes, size / 1e6 * n_frames / enc_time);
+			if (encode_codec == ENCODE_JPEG)
+				printf("%10s lossy\n", "-");
+			else
+				printf("%10.1f %s\n", size / 1e6 * n_frames / dec_time, ok ? "ok" : "MISMATCH");
+			failed |= !ok;
+		}
+	}
+
+	encode_worker_release(&worker);
+	encode_codec = ENCODE_NONE;
+	free(job.raw);
+	free(job.out);
+	free(decoded);
+	free(frames);
+
+	return failed ? -1 : 0;
+}
+
+/**
+Function Name : bench_metrics
+Function Description : Cost of the per-frame instrumentation done by read_frame(), as a share of a frame interval
+Parameter : optional iteration count and frame rate
+Return : 0
+**/
+static int bench_metrics(int argc, char **argv)
+{
+	unsigned int iterations = argc > 1 ? strtol(argv[1], NULL, 10) : 1000000;
+	double fps = argc > 2 ? strtod(argv[2], NULL) : 60, t0, per_frame;
+	unsigned long long ts;
+	unsigned int i;
+	char *text = malloc(16384);
+	size_t len;
+
+	t0 = bench_cpu_now();
+	for (i = 0; i < iterations; ++i) {
+		/* mirrors the calls made for one dequeued frame */
+		ts = metric_now_ns();
+		metric_observe(MH_DQBUF_WAIT, metric_now_ns() - ts);
+		metric_inc(MC_FRAMES_DEQUEUED, 1);
+		metric_add(MG_BUFFERS_QUEUED, -1);
+		ts = metric_now_ns();
+		metric_observe(MH_WRITE, metric_now_ns() - ts);
+		metric_add(MG_BUFFERS_QUEUED, 1);
+	}
+	per_frame = (bench_cpu_now() - t0) / iterations;
+
+	t0 = bench_cpu_now();
+	len = metrics_format(text, 16384);
+	printf("metrics benchmark, %u frames\n", iterations);
+	printf("\tinstrumentation : %.1f ns/frame, %.4f%% of a %.0f fps frame interval\n",
+		per_frame * 1e9, per_frame * fps * 100, fps);
+	printf("\tscrape : %zu bytes in %.1f us\n", len, (bench_cpu_now() - t0) * 1e6);
+	free(text);
+
+	return 0;
+}
+
+struct jitter_run {
+	double fps, seconds;
+	const char *device;
+	int realtime;
+	unsigned int n_intervals, n_done;
+	double *intervals;                  /* milliseconds */
+};
+
+static volatile int jitter_load_stop;
+
+/* Synthetic load: streams through 8 MB so it competes for both CPU and cache */
+static void *jitter_load_main(void *arg)
+{
+	unsigned char *mem = malloc(8 << 20);
+	unsigned int pass = 0;
+
+	(void)arg;
+	while (!jitter_load_stop)
+		memset(mem, pass++, 8 << 20);
+	free(mem);
+
+	return NULL;
+}
+
+/* The capture path itself: the interval between successive dequeues of the device, synthetic or real */
+static void *jitter_capture_main(void *arg)
+{
+	struct jitter_run *run = arg;
+	struct v4l2cap_config config;
+	struct v4l2cap_frame frame;
+	struct v4l2cap *ctx;
+	double prev = 0, now;
+	unsigned int i = 0;
+	int ret;
+
+	if (run->realtime)
+		rt_apply(RT_CAPTURE);
+
+	if ((ret = v4l2cap_open(&ctx, run->device, O_RDWR)) < 0) {
+		fprintf(stderr, "jitter: cannot open %s: %s\n", run->device, strerror(-ret));
+		return NULL;
+	}
+	memset(&config, 0, sizeof(config));
+	config.width = 640;
+	config.height = 480;
+	config.pixelformat = V4L2_PIX_FMT_YUYV;
+	config.io = V4L2CAP_IO_MMAP;
+	if ((ret = v4l2cap_configure(ctx, &config)) < 0 || (ret = v4l2cap_start(ctx)) < 0) {
+		fprintf(stderr, "jitter: cannot capture from %s: %s\n", run->device, strerror(-ret));
+		v4l2cap_close(ctx);
+		return NULL;
+	}
+
+	/* the first dequeue only starts the clock: it includes stream start-up */
+	while (i <= run->n_intervals) {
+		if ((ret = v4l2cap_dequeue(ctx, &frame)) < 0) {
+			if (ret == -EAGAIN || ret == -EINTR)
+				continue;
+			fprintf(stderr, "jitter: dequeue: %s\n", strerror(-ret));
+			break;
+		}
+		now = bench_now();
+		if (i)
+			run->intervals[i - 1] = (now - prev) * 1e3;
+		prev = now;
+		i++;
+		v4l2cap_release(ctx, &frame);
+	}
+	run->n_done = i ? i - 1 : 0;
+	v4l2cap_stop(ctx);
+	v4l2cap_unconfigure(ctx);
+	v4l2cap_close(ctx);
+
+	return NULL;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void jitter_report(const char *label, struct jitter_run *run)
+{
+	double period = 1e3 / run->fps, sum = 0, sq = 0, mean;
+	unsigned int i, n = run->n_done, late = 0;
+
+	if (n < 2) {
+		printf("%-9s no frames dequeued\n", label);
+		return;
+	}
+	for (i = 0; i < n; ++i) {
+		sum += run->intervals[i];
+		sq += run->intervals[i] * run->intervals[i];
+		if (run->intervals[i] > period * 1.5)
+			late++;
+	}
+	mean = sum / n;
+	qsort(run->intervals, n, sizeof(double), cmp_double);
+	printf("%-9s %8.3f %8.3f %8.3f %8.3f %8.3f %8.3f %8.3f %6u\n", label, mean, sqrt(sq / n - mean * mean),
+		run->intervals[n / 2], run->intervals[n * 9 / 10], run->intervals[n * 99 / 100], run->intervals[n * 999 / 1000],
+		run->intervals[n - 1], late);
+}
+
+/**
+Function Name : bench_jitter
+Function Description : Distribution of the interval between DQBUFs under synthetic CPU load, first with default
+                       scheduling, then with the -P/-S/-l settings (SCHED_FIFO 50 and mlockall when none were
+                       given). The capture thread dequeues from the synthetic device paced at fps, or from a
+                       real node, through the same library calls as a recording
+Parameter : optional fps, seconds, number of load threads and device
+Return : 0 for success -1 when no frames could be dequeued
+**/
+static int bench_jitter(int argc, char **argv)
+{
+	struct jitter_run run;
+	pthread_t capture_thread, *load;
+	long n_load = argc > 3 ? strtol(argv[3], NULL, 10) : sysconf(_SC_NPROCESSORS_ONLN) * 2;
+	int pass, saved_priority = rt_fifo_priority, saved_mlock = rt_mlock, ret = 0;
+	char device[64];
+	long i;
+
+	run.fps = argc > 1 ? strtod(argv[1], NULL) : 60;
+	run.seconds = argc > 2 ? strtod(argv[2], NULL) : 5;
+	/* a static synthetic frame: its interval is the driver's pacing and the thread's wakeup, no rendering */
+	snprintf(device, sizeof(device), "synth:fps=%.0f,static", run.fps);
+	run.device = argc > 4 ? argv[4] : device;
+	run.n_intervals = run.fps * run.seconds;
+	if (run.n_intervals < 2)
+		run.n_intervals = 2;
+	run.intervals = calloc(run.n_intervals, sizeof(double));
+	load = calloc(n_load, sizeof(*load));
+
+	printf("jitter benchmark, DQBUF intervals from %s, %.0f fps for %.0f s with %ld load threads (period %.3f ms)\n",
+		run.device, run.fps, run.seconds, n_load, 1e3 / run.fps);
+	printf("%-9s %8s %8s %8s %8s %8s %8s %8s %6s\n", "mode", "mean ms", "stddev", "p50", "p90", "p99", "p99.9", "max",
+		"late");
+	for (pass = 0; pass < 2; ++pass) {
+		run.realtime = pass;
+		if (pass) {
+			if (!rt_fifo_priority)
+				rt_fifo_priority = 50;
+			rt_mlock = 1;
+			rt_lock_memory();
+		}
+
+		jitter_load_stop = 0;
+		run.n_done = 0;
+		for (i = 0; i < n_load; ++i)
+			pthread_create(&load[i], NULL, jitter_load_main, NULL);
+		pthread_create(&capture_thread, NULL, jitter_capture_main, &run);
+		pthread_join(capture_thread, NULL);
+		jitter_load_stop = 1;
+		for (i = 0; i < n_load; ++i)
+			pthread_join(load[i], NULL);
+
+		/* the benchmarks after this one run unlocked, as they would on their own */
+		if (pass && !saved_mlock)
+			rt_unlock_memory();
+		jitter_report(pass ? "realtime" : "default", &run);
+		if (run.n_done < 2)
+			ret = -1;
+	}
+	printf("late = intervals over 1.5 periods, i.e. a frame the driver would have dropped\n");
+
+	rt_fifo_priority = saved_priority;
+	rt_mlock = saved_mlock;
+	free(run.intervals);
+	free(load);
+
+	return ret;
+}
+
+static unsigned long long bench_capture_frames;
+
+static int bench_capture_count(const struct v4l2cap_frame *frame, void *user)
+{
+	(void)frame;
+	(void)user;
+	return 0;
+}
+
+/* run_library skips the CLI's read_frame() and sink and drives v4l2cap_run() with an empty callback */
+static void bench_capture_run(const char *label, const char *device, enum io_method method, unsigned int n_frames,
+	int run_library)
+{
+	static const char *io_names[] = { "read", "mmap", "userptr" };
+	const struct v4l2cap_stats *stats;
+	unsigned long long syscalls;
+	double t0, c0, wall, cpu;
+	unsigned int i;
+
+	openDevice((char *)device);
+	io = method;
+	streaming = 0;
+	init_device();
+	start_capturing();
+
+	stats = v4l2cap_get_stats(capture_ctx);
+	memset(&synth_stats, 0, sizeof(synth_stats));
+	v4l2cap_reset_stats(capture_ctx);
+	t0 = bench_now();
+	c0 = bench_cpu_now();
+	if (run_library)
+		v4l2cap_run(capture_ctx, n_frames, bench_capture_count, NULL);
+	else
+		for (i = 0; i < n_frames; ++i)
+			if (read_frame() < 0)
+				break;
+	cpu = bench_cpu_now() - c0;
+	wall = bench_now() - t0;
+
+	/* every synthetic ioctl or read stands for one syscall, plus the write() of the sink */
+	syscalls = synth_stats.ioctls + synth_stats.reads + (run_library ? 0 : stats->frames);
+	printf("%-12s %-8s %9.2f %9.2f %9.2f %10.0f %10.0f %8llu\n", label, io_names[method],
+		(double)(synth_stats.dqbuf + synth_stats.reads) / stats->frames,
+		(double)synth_stats.qbuf / stats->frames, (double)syscalls / stats->frames,
+		wall * 1e9 / stats->frames, cpu * 1e9 / stats->frames, stats->errors);
+	bench_capture_frames = stats->frames;
+
+	stop_capturing();
+	uninit_device();
+	close_device();
+}
+
+/**
+Function Name : bench_capture
+Function Description : Runs the real capture engine against the synthetic device and reports DQBUF, QBUF and
+                       total syscalls per delivered frame, wall and CPU ns per frame, and the corrupted frames
+                       requeued when errors are injected
+Parameter : optional frame count, width and height
+Return : 0 for success -1 when the steady state needs more than one DQBUF and one QBUF per frame
+**/
+static int bench_capture(int argc, char **argv)
+{
+	unsigned int n_frames = argc > 1 ? strtol(argv[1], NULL, 10) : 100000;
+	unsigned int saved_width = width, saved_height = height, saved_streaming = streaming;
+	enum io_method saved_io = io;
+	enum crc_mode saved_mode = crc_mode;
+	double steady;
+	int ret = 0;
+
+	width = argc > 2 ? strtol(argv[2], NULL, 10) : 640;
+	height = argc > 3 ? strtol(argv[3], NULL, 10) : 480;
+	pix_format = V4L2_PIX_FMT_YUYV;
+	file = open("/dev/null", O_WRONLY);
+	crc_mode = CRC_OFF;     /* the loop itself; "--bench crc" prices the checksum */
+
+	printf("capture benchmark, %u frames %ux%u from the synthetic device, sink write() to /dev/null\n",
+		n_frames, width, height);
+	printf("%-12s %-8s %9s %9s %9s %10s %10s %8s\n", "device", "io", "DQBUF/fr", "QBUF/fr", "sys/fr",
+		"ns/frame", "cpu ns/fr", "errors");
+	bench_capture_run("steady", "synth:fps=0,static", IO_METHOD_MMAP, n_frames, 0);
+	steady = (double)synth_stats.ioctls / bench_capture_frames;
+	if (synth_stats.dqbuf != bench_capture_frames || synth_stats.qbuf != bench_capture_frames)
+		ret = -1;
+	bench_capture_run("steady", "synth:fps=0,static", IO_METHOD_USERPTR, n_frames, 0);
+	bench_capture_run("steady", "synth:fps=0,static", IO_METHOD_READ, n_frames, 0);
+	bench_capture_run("error=4", "synth:fps=0,static,error=4", IO_METHOD_MMAP, n_frames, 0);
+	bench_capture_run("library", "synth:fps=0,static", IO_METHOD_MMAP, n_frames, 1);
+	bench_capture_run("rendered", "synth:fps=0", IO_METHOD_MMAP, n_frames / 100 + 1, 0);
+	printf("steady state: %.2f ioctls per frame%s\n", steady, ret ? " (expected exactly DQBUF + QBUF)" : "");
+
+	close(file);
+	file = -1;
+	width = saved_width;
+	height = saved_height;
+	streaming = saved_streaming;
+	io = saved_io;
+	crc_mode = saved_mode;
+
+	return ret;
+}
+
+#define PIPE_BENCH_BUFFERS 4
+
+struct pipe_reader {
+	int fd;
+	unsigned int frame_size;
+	int verify;                         /* raw frames: check the stamps the producer wrote */
+	unsigned long long bytes;
+	unsigned int frames, mismatches;
+};
+
+static unsigned char *pipe_bench_bufs[PIPE_BENCH_BUFFERS];
+static unsigned int pipe_bench_busy;    /* bitmask of buffers the pipe still references */
+static unsigned int pipe_bench_reused;
+
+static void pipe_bench_release(const struct v4l2cap_frame *frame, void *user)
+{
+	(void)user;
+	pipe_bench_busy &= ~(1u << frame->index);
+}
+
+/* Stands in for the encoder at the other end: reads every frame and checks it was not overwritten in flight */
+static void *pipe_reader_main(void *arg)
+{
+	struct pipe_reader *r = arg;
+	unsigned char *frame = malloc(r->frame_size);
+	unsigned int got = 0, stamp;
+	ssize_t n;
+
+	for (;;) {
+		n = read(r->fd, frame + got, r->frame_size - got);
+		if (n <= 0)
+			break;
+		r->bytes += n;
+		got += n;
+		if (got < r->frame_size)
+			continue;
+		got = 0;
+		if (r->verify) {
+			memcpy(&stamp, frame, sizeof(stamp));
+			if (stamp != r->frames || memcmp(frame, frame + r->frame_size - sizeof(stamp), sizeof(stamp)) != 0)
+				r->mismatches++;
+		}
+		r->frames++;
+	}
+	free(frame);
+
+	return NULL;
+}
+
+/* Pushes n_frames through pipeout the way the capture loop does, round robin over PIPE_BENCH_BUFFERS buffers */
+static int bench_pipe_run(const char *label, unsigned int width, unsigned int height, unsigned int fourcc,
+	enum pipe_framing framing, int zero_copy, int to_file, unsigned int n_frames)
+{
+	unsigned int frame_size = synth_frame_size(width, height, fourcc), i, idx;
+	struct pipe_reader reader;
+	struct v4l2cap_frame frame;
+	pthread_t reader_thread;
+	char path[] = "/tmp/v4l2_pipe_benchXXXXXX";
+	double t0, c0, wall, cpu;
+	int fds[2], ret, out;
+
+	memset(&reader, 0, sizeof(reader));
+	if (to_file) {
+		out = mkstemp(path);
+		unlink(path);
+	} else {
+		if (pipe(fds) != 0) {
+			perror("pipe");
+			return -1;
+		}
+		out = fds[1];
+		reader.fd = fds[0];
+		reader.frame_size = framing == PIPE_RAW ? frame_size : 1 << 20;
+		reader.verify = framing == PIPE_RAW;
+		pthread_create(&reader_thread, NULL, pipe_reader_main, &reader);
+	}
+
+	pipe_framing = framing;
+	pipe_vmsplice = zero_copy;
+	pipe_bench_busy = 0;
+	pipe_bench_reused = 0;
+	if (pipeout_init(out, width, height, fourcc, 30, PIPE_BENCH_BUFFERS - 1, pipe_bench_release, NULL) != 0)
+		return -1;
+
+	t0 = bench_now();
+	c0 = bench_cpu_now();
+	for (i = 0; i < n_frames; ++i) {
+		idx = i % PIPE_BENCH_BUFFERS;
+		if (pipe_bench_busy & (1u << idx))
+			pipe_bench_reused++;
+		/* the "driver" fills the buffer: stamp the frame number at both ends */
+		memcpy(pipe_bench_bufs[idx], &i, sizeof(i));
+		memcpy(pipe_bench_bufs[idx] + frame_size - sizeof(i), &i, sizeof(i));
+
+		CLEAR(frame);
+		frame.data = pipe_bench_bufs[idx];
+		frame.bytesused = frame_size;
+		frame.index = idx;
+		frame.sequence = i;
+		ret = pipeout_frame(&frame);
+		if (ret < 0) {
+			perror("pipeout_frame");
+			break;
+		}
+		if (ret > 0)
+			pipe_bench_busy |= 1u << idx;
+	}
+	wall = bench_now() - t0;
+	cpu = bench_cpu_now() - c0;
+
+	if (!to_file) {
+		close(out);
+		pthread_join(reader_thread, NULL);
+		close(fds[0]);
+		wall = bench_now() - t0;
+	} else
+		close(out);
+
+	printf("%-16s %8.0f %9.0f %9.1f %9.1f %7llu %5u %8u\n", label,
+		(double)frame_size * n_frames / wall / 1e6, cpu * 1e9 / n_frames,
+		pipeout_stats.spliced_bytes / 1e6, pipeout_stats.copied_bytes / 1e6, pipeout_stats.waits,
+		pipeout_stats.max_held, reader.mismatches + pipe_bench_reused);
+
+	return reader.mismatches + pipe_bench_reused ? -1 : 0;
+}
+
+/**
+Function Name : bench_pipe
+Function Description : Raw and Y4M frames into a pipe drained by a reader thread, copied with write() against
+                       spliced with vmsplice, plus write() to a file as the current recording path. The reader
+                       checks every raw frame for being overwritten while the pipe still referenced it
+Parameter : optional width height frame-count
+Return : 0 for success -1 when a frame was corrupted in flight
+**/
+static int bench_pipe(int argc, char **argv)
+{
+	unsigned int width = argc > 1 ? strtol(argv[1], NULL, 10) : 1280;
+	unsigned int height = argc > 2 ? strtol(argv[2], NULL, 10) : 720;
+	unsigned int n_frames = argc > 3 ? strtol(argv[3], NULL, 10) : 2000, i;
+	enum pipe_framing saved_framing = pipe_framing;
+	int saved_vmsplice = pipe_vmsplice, ret = 0;
+
+	for (i = 0; i < PIPE_BENCH_BUFFERS; ++i) {
+		pipe_bench_bufs[i] = malloc(synth_frame_size(width, height, V4L2_PIX_FMT_YUYV));
+		synth_fill_frame(pipe_bench_bufs[i], width, height, V4L2_PIX_FMT_YUYV, i);
+	}
+
+	printf("pipe benchmark %ux%u, %u frames, reader thread draining the pipe\n", width, height, n_frames);
+	printf("%-16s %8s %9s %9s %9s %7s %5s %8s\n", "output", "MB/s", "cpu ns/fr", "spliced", "copied",
+		"waits", "held", "corrupt");
+	ret |= bench_pipe_run("file write()", width, height, V4L2_PIX_FMT_YUYV, PIPE_RAW, 0, 1, n_frames);
+	ret |= bench_pipe_run("raw write()", width, height, V4L2_PIX_FMT_YUYV, PIPE_RAW, 0, 0, n_frames);
+	ret |= bench_pipe_run("raw vmsplice", width, height, V4L2_PIX_FMT_YUYV, PIPE_RAW, 1, 0, n_frames);
+	ret |= bench_pipe_run("y4m nv12 write()", width, height, V4L2_PIX_FMT_NV12, PIPE_Y4M, 0, 0, n_frames);
+	ret |= bench_pipe_run("y4m nv12 splice", width, height, V4L2_PIX_FMT_NV12, PIPE_Y4M, 1, 0, n_frames);
+	ret |= bench_pipe_run("y4m yuyv", width, height, V4L2_PIX_FMT_YUYV, PIPE_Y4M, 1, 0, n_frames);
+	printf("spliced/copied in MB; held = most frames the pipe referenced at once\n");
+
+	for (i = 0; i < PIPE_BENCH_BUFFERS; ++i)
+		free(pipe_bench_bufs[i]);
+	pipe_framing = saved_framing;
+	pipe_vmsplice = saved_vmsplice;
+
+	return ret ? -1 : 0;
+}
+
+/* Runs the capture engine on a synthetic device and compares what framecheck caught with what was injected */
+static int bench_crc_detect(const char *label, const char *device, unsigned int n_frames,
+	unsigned long long want_repeated, unsigned long long want_truncated)
+{
+	unsigned int i;
+	int ok;
+
+	openDevice((char *)device);
+	init_device();
+	start_capturing();
+	for (i = 0; i < n_frames; ++i)
+		if (read_frame() < 0)
+			break;
+	stop_capturing();
+	uninit_device();
+	close_device();
+
+	ok = framecheck_stats.repeated == want_repeated && framecheck_stats.truncated == want_truncated;
+	printf("%-28s %8llu/%-6llu %8llu/%-6llu %6u %s\n", label, framecheck_stats.repeated, want_repeated,
+		framecheck_stats.truncated, want_truncated, framecheck_stats.stuck_events, ok ? "ok" : "MISSED");
+
+	return ok ? 0 : -1;
+}
+
+/**
+Function Name : bench_crc
+Function Description : CRC32C cost per frame for the table, the CPU instruction and sparse sampling, against
+                       the 60 fps frame budget, then stuck and truncated frame detection on synthetic streams
+Parameter : optional width height iterations
+Return : 0 for success -1 when the implementations disagree or an injected fault was missed
+**/
+static int bench_crc(int argc, char **argv)
+{
+	unsigned int frame_width = argc > 1 ? strtol(argv[1], NULL, 10) : 1920;
+	unsigned int frame_height = argc > 2 ? strtol(argv[2], NULL, 10) : 1080;
+	unsigned int iters = argc > 3 ? strtol(argv[3], NULL, 10) : 200, i, pass;
+	unsigned int size = synth_frame_size(frame_width, frame_height, V4L2_PIX_FMT_YUYV);
+	unsigned int saved_width = width, saved_height = height, saved_streaming = streaming;
+	unsigned char *frame = malloc(size);
+	enum crc_mode saved_mode = crc_mode;
+	uint32_t crc[3] = { 0 }, sink = 0;
+	double t0, ns;
+	int ret = 0;
+
+	synth_fill_frame(frame, frame_width, frame_height, V4L2_PIX_FMT_YUYV, 1);
+	if (crc32c(0, "123456789", 9) != 0xe3069283 || crc32c_sw(0, "123456789", 9) != 0xe3069283) {
+		printf("crc32c check value mismatch\n");
+		ret = -1;
+	}
+
+	printf("crc benchmark %ux%u YUYV (%.1f MB per frame), %u iterations, CPU path %s\n", frame_width, frame_height,
+		size / 1e6, iters, crc32c_impl());
+	printf("%-28s %10s %9s %14s\n", "method", "us/frame", "GB/s", "% of 60fps");
+	for (pass = 0; pass < 3; ++pass) {
+		t0 = bench_now();
+		for (i = 0; i < iters; ++i) {
+			frame[i % size] ^= 1;       /* keep the compiler from hoisting the checksum */
+			crc[pass] = pass == 0 ? crc32c_sw(0, frame, size) : pass == 1 ? crc32c(0, frame, size)
+				: crc32c_sparse(frame, size, FRAMECHECK_SPARSE_STEP);
+			sink ^= crc[pass];
+			frame[i % size] ^= 1;
+		}
+		ns = (bench_now() - t0) * 1e9 / iters;
+		printf("%-28s %10.1f %9.2f %13.2f%%\n", pass == 0 ? "table (slicing-by-8)" : pass == 1 ? "full, CPU instruction"
+			: "sparse 64 B every 4 KiB", ns / 1e3, size / ns, ns / (1e9 / 60) * 100);
+	}
+	if (crc[0] != crc[1]) {
+		printf("table and CPU crc32c disagree: %08x %08x\n", crc[0], crc[1]);
+		ret = -1;
+	}
+	free(frame);
+
+	/* injected faults at 320x240 so the live renderer keeps up */
+	width = 320;
+	height = 240;
+	pix_format = V4L2_PIX_FMT_YUYV;
+	streaming = 0;
+	file = open("/dev/null", O_WRONLY);
+	printf("\n%-28s %15s %15s %6s\n", "stream (300 frames)", "repeated/want", "truncated/want", "stuck");
+	for (pass = 0; pass < 2; ++pass) {
+		crc_mode = pass ? CRC_FULL : CRC_SPARSE;
+		printf("%s:\n", pass ? "full" : "sparse");
+		ret |= bench_crc_detect("  live", "synth:fps=0", 300, 0, 0);
+		ret |= bench_crc_detect("  freeze=100", "synth:fps=0,freeze=100", 300, 200, 0);
+		ret |= bench_crc_detect("  short=25", "synth:fps=0,short=25", 300, 0, 12);
+	}
+	close(file);
+	file = -1;
+
+	crc_mode = saved_mode;
+	width = saved_width;
+	height = saved_height;
+	streaming = saved_streaming;
+	(void)sink;
+
+	return ret;
+}
+
+/* A disk that sometimes cannot keep up: drains the pipe at rate bytes per second, or as fast as it can at 0 */
+struct slow_reader {
+	int fd;
+	volatile double rate;
+	unsigned long long bytes;
+};
+
+static void *slow_reader_main(void *arg)
+{
+	struct slow_reader *r = arg;
+	static unsigned char chunk[65536];
+	struct timespec ts;
+	double rate;
+	ssize_t n;
+
+	while ((n = read(r->fd, chunk, sizeof(chunk))) > 0) {
+		r->bytes += n;
+		if ((rate = r->rate) > 0) {
+			ts.tv_sec = 0;
+			ts.tv_nsec = n / rate * 1e9;
+			nanosleep(&ts, NULL);
+		}
+	}
+
+	return NULL;
+}
+
+/* One capture run through a slow then a fast phase, with one report line per phase */
+static void bench_policy_run(const char *device, int adaptive, double seconds, double slow_rate)
+{
+	static const char *level_names[] = { "normal", "skip-display", "decimate", "renegotiate" };
+	const struct v4l2cap_stats *stats;
+	unsigned long long frames0, overruns0, shed0, bytes0;
+	struct slow_reader reader;
+	pthread_t reader_thread;
+	unsigned int phase;
+	int fds[2];
+	double t0;
+
+	if (pipe(fds) != 0) {
+		perror("pipe");
+		return;
+	}
+	memset(&reader, 0, sizeof(reader));
+	reader.fd = fds[0];
+	reader.rate = slow_rate;
+	pthread_create(&reader_thread, NULL, slow_reader_main, &reader);
+	file = fds[1];
+
+	width = 640;
+	height = 480;
+	pix_format = V4L2_PIX_FMT_YUYV;
+	pix_format_str = "YUYV";
+	openDevice((char *)device);
+	init_device();
+	start_capturing();
+	policy_enabled = adaptive;
+	capture_policy_init();
+	/* the bench reader takes any frame size, so the raw sink may renegotiate too */
+	policy_init(1u << POLICY_DECIMATE | 1u << POLICY_RENEGOTIATE);
+	memset(&synth_stats, 0, sizeof(synth_stats));
+	stats = v4l2cap_get_stats(capture_ctx);
+
+	for (phase = 0; phase < 2; ++phase) {
+		reader.rate = phase ? 0 : slow_rate;
+		frames0 = stats->frames;
+		overruns0 = synth_stats.overruns;
+		shed0 = policy_stats.shed;
+		bytes0 = reader.bytes;
+		t0 = bench_now();
+		while (bench_now() - t0 < (phase ? 2 * seconds : seconds))
+			if (read_frame() < 0)
+				break;
+		printf("%-8s %-10s %8llu %8llu %8llu %8.1f %6u %5ux%-5u %s\n", adaptive ? "adaptive" : "off",
+			phase ? "fast disk" : "slow disk", stats->frames - frames0, synth_stats.overruns - overruns0,
+			policy_stats.shed - shed0, (reader.bytes - bytes0) / (bench_now() - t0) / 1e6,
+			policy_stats.steps, width, height, level_names[adaptive ? policy_level() : POLICY_NORMAL]);
+	}
+
+	stop_capturing();
+	uninit_device();
+	close_device();
+	close(fds[1]);
+	pthread_join(reader_thread, NULL);
+	close(fds[0]);
+	file = -1;
+}
+
+/**
+Function Name : bench_policy
+Function Description : Records raw frames from a paced synthetic camera into a "disk" that drains slower than
+                       the camera for a while and then catches up, without and with the adaptive policy. Without
+                       it the driver overruns; with it the policy sheds load while the disk is slow and restores
+                       the full format once it is fast again. Every step is logged on stderr
+Parameter : optional fps, seconds per phase and slow disk rate in MB/s
+Return : 0 for success -1 when the policy did not cut the overruns or did not step back to normal
+**/
+static int bench_policy(int argc, char **argv)
+{
+	unsigned int fps = argc > 1 ? strtol(argv[1], NULL, 10) : 120;
+	double seconds = argc > 2 ? strtod(argv[2], NULL) : 4;
+	double slow_rate = (argc > 3 ? strtod(argv[3], NULL) : 40) * 1e6;
+	unsigned int saved_width = width, saved_height = height, saved_streaming = streaming, saved_format = pix_format;
+	char *saved_format_str = pix_format_str;
+	struct policy_config saved_config = policy_config;
+	enum crc_mode saved_mode = crc_mode;
+	int saved_enabled = policy_enabled, saved_codec = encode_codec;
+	unsigned long long overruns[2];
+	char device[64];
+	int ret = 0;
+
+	snprintf(device, sizeof(device), "synth:fps=%u,static", fps);
+	streaming = 0;
+	encode_codec = ENCODE_NONE;
+	crc_mode = CRC_OFF;
+	policy_config.window = fps / 10 > 2 ? fps / 10 : 2;        /* a tenth of a second per window */
+	policy_config.hold = 3;
+
+	printf("policy benchmark, %s 640x480 YUYV (%.1f MB/s) recorded to a disk draining %.1f MB/s for %.1f s "
+		"then unthrottled for %.1f s\n", device, synth_frame_size(640, 480, V4L2_PIX_FMT_YUYV) * fps / 1e6, slow_rate / 1e6,
+		seconds, 2 * seconds);
+	printf("%-8s %-10s %8s %8s %8s %8s %6s %11s %s\n", "policy", "phase", "frames", "overrun", "shed", "MB/s",
+		"steps", "size", "level");
+	bench_policy_run(device, 0, seconds, slow_rate);
+	overruns[0] = synth_stats.overruns;
+	bench_policy_run(device, 1, seconds, slow_rate);
+	overruns[1] = synth_stats.overruns;
+	printf("overruns: %llu without the policy, %llu with it\n", overruns[0], overruns[1]);
+	if (overruns[1] >= overruns[0] || policy_level() != POLICY_NORMAL)
+		ret = -1;
+
+	width = saved_width;
+	height = saved_height;
+	pix_format = saved_format;
+	pix_format_str = saved_format_str;
+	streaming = saved_streaming;
+	policy_config = saved_config;
+	policy_enabled = saved_enabled;
+	encode_codec = saved_codec;
+	crc_mode = saved_mode;
+
+	return ret;
+}
+
+/* Captures from a synthetic device that unplugs every unplug_every frames and comes back after replug_ms */
+static int bench_recover_run(enum io_method method, unsigned int fps, unsigned int unplug_every, unsigned int replug_ms,
+	double seconds)
+{
+	static const char *io_names[] = { "read", "mmap", "userptr" };
+	const struct v4l2cap_stats *stats;
+	unsigned long long frames = 0;
+	char device[96];
+	double t0, avg;
+	int ret;
+
+	snprintf(device, sizeof(device), "synth:fps=%u,static,unplug=%u,replug=%u", fps, unplug_every, replug_ms);
+	memset(&hotplug_stats, 0, sizeof(hotplug_stats));
+	memset(&synth_stats, 0, sizeof(synth_stats));
+	dev_path = device;
+	openDevice(device);
+	io = method;
+	init_device();
+	start_capturing();
+	stats = v4l2cap_get_stats(capture_ctx);
+	v4l2cap_reset_stats(capture_ctx);
+	t0 = bench_now();
+	/* an unplug near the end still gets its recovery timed */
+	while (bench_now() - t0 < seconds || hotplug_stats.recoveries < hotplug_stats.losses)
+		if ((ret = read_frame()) < 0)
+			break;
+	frames = stats->frames;
+	stop_capturing();
+	uninit_device();
+	close_device();
+
+	avg = hotplug_stats.recoveries ? hotplug_stats.recover_ms_total / hotplug_stats.recoveries : 0;
+	printf("%-8s %7u %8llu %6llu %6u %8.1f %8.1f %8.1f %8.2f\n", io_names[method], replug_ms, frames,
+		synth_stats.unplugs, hotplug_stats.recoveries, avg, hotplug_stats.recover_ms_max,
+		avg - replug_ms, (double)hotplug_stats.attempts / (hotplug_stats.losses ? hotplug_stats.losses : 1));
+
+	return synth_stats.unplugs && hotplug_stats.recoveries == synth_stats.unplugs ? 0 : -1;
+}
+
+/**
+Function Name : bench_recover
+Function Description : Unplugs the synthetic device over and over in the middle of a capture and reports how
+                       long the in-process recovery takes from the failed dequeue to the next frame, and how much
+                       of that is more than the time the device was away
+Parameter : optional fps, seconds per run and frames between unplugs
+Return : 0 for success -1 when an unplug was not recovered
+**/
+static int bench_recover(int argc, char **argv)
+{
+	unsigned int fps = argc > 1 ? strtol(argv[1], NULL, 10) : 120;
+	double seconds = argc > 2 ? strtod(argv[2], NULL) : 2;
+	unsigned int unplug_every = argc > 3 ? strtol(argv[3], NULL, 10) : 60;
+	unsigned int saved_width = width, saved_height = height, saved_streaming = streaming, saved_timeout = hotplug_timeout;
+	enum io_method saved_io = io;
+	enum crc_mode saved_mode = crc_mode;
+	char *saved_path = dev_path;
+	int ret = 0;
+
+	width = 640;
+	height = 480;
+	pix_format = V4L2_PIX_FMT_YUYV;
+	streaming = 0;
+	crc_mode = CRC_OFF;
+	hotplug_timeout = 5;
+	file = open("/dev/null", O_WRONLY);
+
+	printf("recover benchmark, synthetic 640x480 at %u fps unplugged every %u frames, %.1f s per run\n", fps,
+		unplug_every, seconds);
+	printf("%-8s %7s %8s %6s %6s %8s %8s %8s %8s\n", "io", "away ms", "frames", "lost", "back", "avg ms",
+		"max ms", "overhead", "reopens");
+	ret |= bench_recover_run(IO_METHOD_MMAP, fps, unplug_every, 0, seconds);
+	ret |= bench_recover_run(IO_METHOD_MMAP, fps, unplug_every, 50, seconds);
+	ret |= bench_recover_run(IO_METHOD_MMAP, fps, unplug_every, 200, seconds);
+	ret |= bench_recover_run(IO_METHOD_USERPTR, fps, unplug_every, 50, seconds);
+	ret |= bench_recover_run(IO_METHOD_READ, fps, unplug_every, 50, seconds);
+	printf("avg/max: failed dequeue to the next frame; overhead: avg beyond the time the device was away\n");
+
+	close(file);
+	file = -1;
+	width = saved_width;
+	height = saved_height;
+	streaming = saved_streaming;
+	io = saved_io;
+	crc_mode = saved_mode;
+	hotplug_timeout = saved_timeout;
+	dev_path = saved_path;
+
+	return ret;
+}
+
+/* one frame into a texture-like buffer whose pitch is wider than the frame, directly or through a staging copy */
+static int bench_render_run(const char *label, unsigned int fourcc, const unsigned char *frame, unsigned int len,
+	unsigned int width, unsigned int height, unsigned int n_frames)
+{
+	static const unsigned int texel_bytes[] = { [TEXFILL_YUY2] = 2, [TEXFILL_NV12] = 1, [TEXFILL_RGB24] = 3 };
+	int layout = texfill_layout(fourcc);
+	unsigned int row_bytes = width * texel_bytes[layout];
+	unsigned int rows = layout == TEXFILL_NV12 ? height * 3 / 2 : height;
+	int pitch = (row_bytes + 63) / 64 * 64 + 64;
+	unsigned char *tex = malloc((size_t)pitch * rows), *staging = malloc((size_t)row_bytes * rows);
+	double t0, staged, direct;
+	unsigned long long staged_bytes, direct_bytes;
+	unsigned int i, y;
+	char name[5];
+
+	/* before: convert or decode into a tight buffer, then copy it into the texture as SDL_UpdateTexture() did */
+	memset(&texfill_stats, 0, sizeof(texfill_stats));
+	t0 = bench_cpu_now();
+	for (i = 0; i < n_frames; ++i) {
+		if (fourcc == V4L2_PIX_FMT_YUYV || fourcc == V4L2_PIX_FMT_NV12) {
+			for (y = 0; y < rows; ++y)
+				memcpy(tex + (size_t)y * pitch, frame + (size_t)y * row_bytes, row_bytes);
+			texfill_stats.written_bytes += (unsigned long long)row_bytes * rows;
+			continue;
+		}
+		texfill_frame(staging, row_bytes, frame, len, width, height, fourcc);
+		for (y = 0; y < rows; ++y)
+			memcpy(tex + (size_t)y * pitch, staging + (size_t)y * row_bytes, row_bytes);
+		texfill_stats.written_bytes += (unsigned long long)row_bytes * rows;
+	}
+	staged = (bench_cpu_now() - t0) / n_frames;
+	staged_bytes = texfill_stats.written_bytes / n_frames;
+
+	memset(&texfill_stats, 0, sizeof(texfill_stats));
+	t0 = bench_cpu_now();
+	for (i = 0; i < n_frames; ++i)
+		texfill_frame(tex, pitch, frame, len, width, height, fourcc);
+	direct = (bench_cpu_now() - t0) / n_frames;
+	direct_bytes = texfill_stats.written_bytes / n_frames;
+
+	printf("%-6s %-10s %10.1f %10.1f %12llu %12llu %8llu\n", fourcc_name(fourcc, name), label, staged * 1e6,
+		direct * 1e6, staged_bytes, direct_bytes, texfill_stats.decode_errors);
+	free(tex);
+	free(staging);
+
+	return texfill_stats.decode_errors ? -1 : 0;
+}
+
+/**
+Function Name : bench_render
+Function Description : Time and bytes written per frame to get a captured frame into texture memory, through
+                       a staging buffer and copy versus converted or decoded straight into the locked texture
+Parameter : optional width height frame-count
+Return : 0 for success -1 when a frame could not be written
+**/
+static int bench_render(int argc, char **argv)
+{
+	static const unsigned int formats[] = { V4L2_PIX_FMT_YUYV, V4L2_PIX_FMT_NV12, V4L2_PIX_FMT_GREY };
+	unsigned int width = argc > 1 ? strtol(argv[1], NULL, 10) : 1280;
+	unsigned int height = argc > 2 ? strtol(argv[2], NULL, 10) : 720;
+	unsigned int n_frames = argc > 3 ? strtol(argv[3], NULL, 10) : 200;
+	unsigned int saved_quality = encode_quality, f;
+	struct encode_worker worker;
+	struct encode_job job;
+	unsigned char *frame;
+	int ret = 0;
+
+	frame = malloc(synth_frame_size(width, height, V4L2_PIX_FMT_YUYV));
+	printf("render benchmark %ux%u, %u frames per run, texture pitch padded past the row\n", width, height,
+		n_frames);
+	printf("%-6s %-10s %10s %10s %12s %12s %8s\n", "format", "texture", "staged us", "direct us",
+		"staged B", "direct B", "errors");
+	for (f = 0; f < sizeof(formats) / sizeof(formats[0]); ++f) {
+		synth_fill_frame(frame, width, height, formats[f], 1);
+		ret |= bench_render_run(formats[f] == V4L2_PIX_FMT_NV12 ? "NV12" : "YUY2", formats[f], frame,
+			synth_frame_size(width, height, formats[f]), width, height, n_frames);
+	}
+
+	/* MJPG through the same JPEG encoder the recorder uses */
+	memset(&worker, 0, sizeof(worker));
+	memset(&job, 0, sizeof(job));
+	synth_fill_frame(frame, width, height, V4L2_PIX_FMT_YUYV, 1);
+	job.raw = frame;
+	job.raw_size = synth_frame_size(width, height, V4L2_PIX_FMT_YUYV);
+	job.out_capacity = job.raw_size;
+	job.out = malloc(job.out_capacity);
+	job.width = width;
+	job.height = height;
+	job.fourcc = V4L2_PIX_FMT_YUYV;
+	encode_quality = 85;
+	jpeg_encode_frame(&worker, &job);
+	ret |= bench_render_run("RGB24", V4L2_PIX_FMT_MJPEG, job.out, job.out_size, width, height, n_frames / 4 + 1);
+	printf("B: bytes written per frame into the staging buffer and the texture; staged YUYV/NV12 is the old "
+		"SDL_UpdateTexture() copy\n");
+
+	encode_worker_release(&worker);
+	encode_quality = saved_quality;
+	texfill_finish();
+	memset(&texfill_stats, 0, sizeof(texfill_stats));
+	free(job.out);
+	free(frame);
+
+	return ret;
+}
+
+enum { ISP_SCENE_DETAIL, ISP_SCENE_EDGES, ISP_SCENE_SMOOTH, ISP_SCENE_REGIONS };
+
+static unsigned int isp_bench_region(unsigned int x, unsigned int y, unsigned int width, unsigned int height)
+{
+	double dx = x - width / 4.0, dy = y - height / 2.0;
+
+	if (dx * dx + dy * dy < (height / 3.0) * (height / 3.0))
+		return ISP_SCENE_DETAIL;
+
+	return x > width / 2 ? ISP_SCENE_EDGES : ISP_SCENE_SMOOTH;
+}
+
+/* fine rings, hard edges between tinted bars and soft gradients, and the RGGB mosaic sampled from them */
+static void isp_bench_scene(unsigned char *rgb, unsigned char *mosaic, unsigned int width, unsigned int height)
+{
+	static const double tints[4][3] = { { 1, 0.8, 0.6 }, { 0.5, 0.7, 1 }, { 0.7, 1, 0.6 }, { 1, 1, 1 } };
+	unsigned int x, y, c;
+	double dx, dy, lum;
+	unsigned char *p;
+
+	for (y = 0; y < height; ++y)
+		for (x = 0; x < width; ++x) {
+			p = rgb + ((size_t)y * width + x) * 3;
+			switch (isp_bench_region(x, y, width, height)) {
+			case ISP_SCENE_DETAIL:
+				/* zone plate, the rings get finer towards the rim */
+				dx = x - width / 4.0;
+				dy = y - height / 2.0;
+				p[0] = p[1] = p[2] = 128 + 100 * cos((dx * dx + dy * dy) * M_PI / (height * 3.0));
+				break;
+			case ISP_SCENE_EDGES:
+				/* diagonal bars, dark and bright under different tints as surfaces are */
+				lum = (x + y) / 48 & 1 ? 230 : 60;
+				for (c = 0; c < 3; ++c)
+					p[c] = lum * tints[((x + 2 * y) / 96) % 4][c];
+				break;
+			default:
+				p[0] = 40 + 150 * x / width;
+				p[1] = 60 + 120 * y / height;
+				p[2] = 180 - 100 * x / width;
+			}
+			mosaic[(size_t)y * width + x] = p[(y & 1) + (x & 1)];
+		}
+}
+
+/* PSNR per region, leaving out the outer rows and columns that are mirrored */
+static void isp_bench_psnr(const unsigned char *a, const unsigned char *b, unsigned int width, unsigned int height,
+	double *psnr)
+{
+	double se[ISP_SCENE_REGIONS] = { 0 }, n[ISP_SCENE_REGIONS] = { 0 }, d;
+	unsigned int x, y, c, r;
+	size_t i;
+
+	for (y = 2; y < height - 2; ++y)
+		for (x = 2; x < width - 2; ++x) {
+			r = isp_bench_region(x, y, width, height);
+			for (c = 0; c < 3; ++c) {
+				i = ((size_t)y * width + x) * 3 + c;
+				d = (double)a[i] - b[i];
+				se[r] += d * d;
+			}
+			n[r] += 3;
+		}
+	for (r = 0; r < ISP_SCENE_REGIONS; ++r)
+		psnr[r] = se[r] ? 10 * log10(255.0 * 255 * n[r] / se[r]) : 99;
+}
+
+static int bench_isp_run(enum isp_demosaic demosaic, unsigned int threads, const uint16_t *raw, unsigned char *rgb,
+	unsigned int width, unsigned int height, unsigned int n_frames)
+{
+	unsigned int i, s;
+	int ret = 0;
+	double fps;
+
+	isp_config.demosaic = demosaic;
+	isp_config.bands = 0;
+	tile_threads = threads;
+	tile_pool_shutdown();
+	isp_release();
+	memset(&isp_stats, 0, sizeof(isp_stats));
+	for (i = 0; i < n_frames; ++i)
+		if (isp_process(rgb, width * 3, raw, width * height * 2, width, height, V4L2_PIX_FMT_SBGGR10) < 0)
+			ret = -1;
+	fps = isp_stats.frames * 1e9 / isp_stats.wall_ns;
+	printf("%-8s %7u", demosaic == ISP_EDGE ? "edge" : "bilinear", tile_pool_threads());
+	for (s = 0; s < ISP_STAGES; ++s)
+		printf(" %9.0f", isp_stats.stage_ns[s] / 1e3 / isp_stats.frames);
+	printf(" %8.2f %8.2f %6.1f %s\n", isp_stats.wall_ns / 1e6 / isp_stats.frames, isp_stats.max_wall_ns / 1e6, fps,
+		fps >= 30 ? "yes" : "no");
+
+	return ret;
+}
+
+/**
+Function Name : bench_isp
+Function Description : Quality of both demosaics against the scene a mosaic was sampled from, then the time
+                       of every ISP stage on 10-bit frames with a full colour pipeline, per thread count
+Parameter : optional width height frame-count
+Return : 0 for success -1 when a frame was not developed
+**/
+static int bench_isp(int argc, char **argv)
+{
+	static const unsigned int thread_counts[] = { 1, 2, 4 };
+	unsigned int width = argc > 1 ? strtol(argv[1], NULL, 10) : 1920;
+	unsigned int height = argc > 2 ? strtol(argv[2], NULL, 10) : 1080;
+	unsigned int n_frames = argc > 3 ? strtol(argv[3], NULL, 10) : 30;
+	struct isp_config saved = isp_config;
+	unsigned int saved_threads = tile_threads;
+	static const double ccm[9] = { 1.6, -0.4, -0.2, -0.3, 1.5, -0.2, -0.1, -0.5, 1.6 };
+	unsigned char *truth, *mosaic, *rgb;
+	uint16_t *raw;
+	double psnr[ISP_SCENE_REGIONS];
+	unsigned int i, t, x, y, cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	int ret = 0;
+
+	width &= ~1u;
+	height &= ~1u;
+	truth = malloc((size_t)width * height * 3);
+	rgb = malloc((size_t)width * height * 3);
+	mosaic = malloc((size_t)width * height);
+	raw = malloc((size_t)width * height * 2);
+	isp_bench_scene(truth, mosaic, width, height);
+
+	/* neutral pipeline, so the only loss is the demosaic */
+	printf("isp benchmark %ux%u, %u frames per run, %u CPUs online\n", width, height, n_frames, cpus);
+	isp_config.black = 0;
+	isp_config.wb[0] = isp_config.wb[1] = isp_config.wb[2] = 1;
+	isp_config.awb = 0;
+	memcpy(isp_config.ccm, (double[9]){ 1, 0, 0, 0, 1, 0, 0, 0, 1 }, sizeof(isp_config.ccm));
+	isp_config.gamma = 1;
+	printf("%-8s %11s %11s %11s\n", "demosaic", "detail dB", "edges dB", "smooth dB");
+	for (i = ISP_BILINEAR; i <= ISP_EDGE; ++i) {
+		isp_config.demosaic = i;
+		isp_release();
+		if (isp_process(rgb, width * 3, mosaic, width * height, width, height, V4L2_PIX_FMT_SRGGB8) < 0)
+			ret = -1;
+		isp_bench_psnr(truth, rgb, width, height, psnr);
+		printf("%-8s %11.2f %11.2f %11.2f\n", i == ISP_EDGE ? "edge" : "bilinear", psnr[ISP_SCENE_DETAIL],
+			psnr[ISP_SCENE_EDGES], psnr[ISP_SCENE_SMOOTH]);
+	}
+
+	/* 10-bit BGGR with a black level, white balance, a colour matrix and gamma */
+	for (y = 0; y < height; ++y)
+		for (x = 0; x < width; ++x)
+			raw[(size_t)y * width + x] = 64 + truth[((size_t)y * width + x) * 3 + 2 - (y & 1) - (x & 1)] * 3;
+	isp_config.black = 64;
+	isp_config.wb[0] = 1.9;
+	isp_config.wb[2] = 1.5;
+	memcpy(isp_config.ccm, ccm, sizeof(ccm));
+	isp_config.gamma = 2.2;
+	printf("%-8s %7s %9s %9s %9s %9s %8s %8s %6s %s\n", "demosaic", "threads", "lin us", "demosaic", "ccm us",
+		"gamma us", "wall ms", "max ms", "fps", "30fps");
+	for (i = ISP_BILINEAR; i <= ISP_EDGE; ++i)
+		for (t = 0; t < sizeof(thread_counts) / sizeof(thread_counts[0]); ++t)
+			ret |= bench_isp_run(i, thread_counts[t], raw, rgb, width, height, n_frames);
+	printf("stage times are summed over the bands; with fewer CPUs than threads the bands take turns\n");
+
+	isp_release();
+	memset(&isp_stats, 0, sizeof(isp_stats));
+	isp_config = saved;
+	tile_threads = saved_threads;
+	tile_pool_shutdown();
+	free(truth);
+	free(rgb);
+	free(mosaic);
+	free(raw);
+
+	return ret;
+}
+
+/* the same three filters run one after the other over whole frames, each pass split into tiles */
+static void bench_tiles_unfused(const struct tile_filter *filters, struct tile_chain *chain, unsigned char *rgb,
+	unsigned char *graded)
+{
+	struct tile_chain pass[3];
+	unsigned char *bufs[4] = { (unsigned char *)chain->src, rgb, graded, chain->dst };
+	unsigned int bpp[4] = { 2, 3, 3, 1 }, i;
+
+	for (i = 0; i < 3; ++i) {
+		pass[i] = *chain;
+		pass[i].filters = &filters[i];
+		pass[i].n_filters = 1;
+		pass[i].src = bufs[i];
+		pass[i].src_pitch = chain->width * bpp[i];
+		pass[i].src_bpp = bpp[i];
+		pass[i].dst = bufs[i + 1];
+		pass[i].dst_pitch = chain->width * bpp[i + 1];
+		tile_chain_submit(&pass[i]);
+		tile_wait(&pass[i].future);
+	}
+}
+
+/**
+Function Name : bench_tiles
+Function Description : Frames per second of a YUYV to RGB, grade and luma chain on synthetic 1080p and 4K
+                       frames for 1 to N pool workers, fused into one pass per tile versus one pass per filter
+Parameter : optional frame-count and maximum workers
+Return : 0 for success -1 when the fused and unfused outputs differ
+**/
+static int bench_tiles(int argc, char **argv)
+{
+	static const unsigned int sizes[][2] = { { 1920, 1080 }, { 3840, 2160 } };
+	unsigned int n_frames = argc > 1 ? strtol(argv[1], NULL, 10) : 20;
+	unsigned int cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	unsigned int max_threads = argc > 2 ? strtol(argv[2], NULL, 10) : cpus > 4 ? cpus : 4;
+	unsigned int saved_threads = tile_threads, s, t, i, width, height;
+	unsigned char lut[256], *frame, *rgb, *graded, *fused_out, *unfused_out;
+	struct tile_filter filters[3] = {
+		{ "yuyv-rgb", 3, tile_yuyv_rgb, NULL },
+		{ "grade", 3, tile_rgb_lut, lut },
+		{ "luma", 1, tile_rgb_luma, NULL },
+	};
+	struct tile_chain chain;
+	struct tile_stats stats;
+	double t0, fused, unfused, base = 0;
+	int ret = 0;
+
+	for (i = 0; i < 256; ++i)
+		lut[i] = 255 * pow(i / 255.0, 0.8) + 0.5;
+	printf("tiles benchmark, YUYV -> RGB24 -> grade LUT -> luma, %u frames per run, %u CPUs online\n", n_frames,
+		cpus);
+	printf("%-10s %7s %6s %10s %10s %8s %8s %8s\n", "size", "workers", "tiles", "fused fps", "split fps", "speedup",
+		"stolen", "match");
+	for (s = 0; s < sizeof(sizes) / sizeof(sizes[0]); ++s) {
+		width = sizes[s][0];
+		height = sizes[s][1];
+		frame = malloc((size_t)width * height * 2);
+		rgb = malloc((size_t)width * height * 3);
+		graded = malloc((size_t)width * height * 3);
+		fused_out = malloc((size_t)width * height);
+		unfused_out = malloc((size_t)width * height);
+		synth_fill_frame(frame, width, height, V4L2_PIX_FMT_YUYV, 1);
+
+		for (t = 1; t <= max_threads; t = t < 4 ? t + 1 : t * 2) {
+			tile_threads = t;
+			tile_pool_shutdown();
+			memset(&chain, 0, sizeof(chain));
+			chain.filters = filters;
+			chain.n_filters = 3;
+			chain.src = frame;
+			chain.src_pitch = width * 2;
+			chain.src_bpp = 2;
+			chain.width = width;
+			chain.height = height;
+
+			chain.dst = unfused_out;
+			chain.dst_pitch = width;
+			t0 = bench_now();
+			for (i = 0; i < n_frames; ++i)
+				bench_tiles_unfused(filters, &chain, rgb, graded);
+			unfused = n_frames / (bench_now() - t0);
+
+			chain.dst = fused_out;
+			t0 = bench_now();
+			for (i = 0; i < n_frames; ++i) {
+				tile_chain_submit(&chain);
+				tile_wait(&chain.future);
+			}
+			fused = n_frames / (bench_now() - t0);
+			if (t == 1)
+				base = fused;
+			tile_pool_stats(&stats);
+			printf("%4ux%-5u %7u %6u %10.1f %10.1f %7.2fx %8llu %8s\n", width, height, tile_pool_threads(),
+				(height + chain.tile_rows - 1) / chain.tile_rows, fused, unfused, fused / base, stats.steals,
+				memcmp(fused_out, unfused_out, (size_t)width * height) ? "NO" : "yes");
+			ret |= memcmp(fused_out, unfused_out, (size_t)width * height) ? -1 : 0;
+		}
+		free(frame);
+		free(rgb);
+		free(graded);
+		free(fused_out);
+		free(unfused_out);
+	}
+	printf("speedup: fused fps against one worker; split: a pass per filter through full-frame intermediates\n");
+
+	tile_threads = saved_threads;
+	tile_pool_shutdown();
+
+	return ret;
+}
+
+/* Asks for a snapshot every interval, every other one a still, until told to stop */
+struct snapshot_requester {
+	atomic_int stop;
+	double interval;
+	unsigned int sent;
+};
+
+static void *snapshot_requester_main(void *arg)
+{
+	struct snapshot_requester *r = arg;
+	struct timespec ts;
+
+	while (!r->stop) {
+		ts.tv_sec = r->interval;
+		ts.tv_nsec = (r->interval - ts.tv_sec) * 1e9;
+		nanosleep(&ts, NULL);
+		if (r->stop)
+			break;
+		snapshot_request(r->sent++ % 2 ? SNAPSHOT_STILL : SNAPSHOT_FRAME);
+	}
+
+	return NULL;
+}
+
+/* What a still cost before: close the device, reopen it at the still size, grab a frame past the settle frames */
+static double bench_snapshot_rerun(const char *device, unsigned int still_width, unsigned int still_height)
+{
+	unsigned int preview_width = width, preview_height = height;
+	struct v4l2cap_frame frame;
+	double t0 = bench_now();
+	unsigned int n = 0;
+	int ret;
+
+	stop_capturing();
+	uninit_device();
+	close_device();
+	openDevice((char *)device);
+	width = still_width;
+	height = still_height;
+	init_device();
+	start_capturing();
+	while (n <= snapshot_config.settle)
+		if ((ret = v4l2cap_dequeue(capture_ctx, &frame)) == 0) {
+			v4l2cap_release(capture_ctx, &frame);
+			n++;
+		} else if (ret != -EAGAIN)
+			break;
+	stop_capturing();
+	uninit_device();
+	close_device();
+	openDevice((char *)device);
+	width = preview_width;
+	height = preview_height;
+	init_device();
+	start_capturing();
+
+	return bench_now() - t0;
+}
+
+/* JPEG files start with SOI, raw ones must hold a whole frame */
+static unsigned int bench_snapshot_check(const char *dir)
+{
+	unsigned char head[2];
+	unsigned int good = 0;
+	char path[512];
+	struct dirent *de;
+	struct stat st;
+	DIR *d = opendir(dir);
+	int f;
+
+	if (!d)
+		return 0;
+	while ((de = readdir(d))) {
+		if (de->d_name[0] == '.')
+			continue;
+		snprintf(path, sizeof(path), "%s/%s", dir, de->d_name);
+		if ((f = open(path, O_RDONLY)) >= 0) {
+			if (fstat(f, &st) == 0 && read(f, head, 2) == 2 && head[0] == 0xff && head[1] == 0xd8 && st.st_size > 2)
+				good++;
+			close(f);
+		}
+		unlink(path);
+	}
+	closedir(d);
+
+	return good;
+}
+
+/**
+Function Name : bench_snapshot
+Function Description : Records a paced synthetic 640x480 preview while a second thread asks for a snapshot now
+                       and then, every other one a still at the largest size. Reports how long each request took
+                       to reach a frame and a file, how much longer the preview interval spanning a snapshot
+                       was, and what a still cost by closing and reopening the device instead
+Parameter : optional fps, seconds and milliseconds between requests
+Return : 0 for success -1 when a request was dropped or a file is not a JPEG
+**/
+static int bench_snapshot(int argc, char **argv)
+{
+	unsigned int fps = argc > 1 ? strtol(argv[1], NULL, 10) : 60;
+	double seconds = argc > 2 ? strtod(argv[2], NULL) : 3;
+	double interval = (argc > 3 ? strtod(argv[3], NULL) : 250) / 1e3;
+	unsigned int saved_width = width, saved_height = height, saved_streaming = streaming, saved_format = pix_format;
+	char *saved_format_str = pix_format_str, *saved_path = dev_path, dir[] = "/tmp/v4l2snapXXXXXX", prefix[64];
+	struct snapshot_config saved_config = snapshot_config;
+	enum crc_mode saved_mode = crc_mode;
+	struct snapshot_requester req;
+	pthread_t req_thread;
+	char device[64];
+	double t0, rerun;
+	unsigned int good;
+	int ret = 0;
+
+	if (!mkdtemp(dir)) {
+		perror("mkdtemp");
+		return -1;
+	}
+	snprintf(device, sizeof(device), "synth:fps=%u,static", fps);
+	snprintf(prefix, sizeof(prefix), "%s/snap", dir);
+	snapshot_config.prefix = prefix;
+	snapshot_config.raw = 0;
+	width = 640;
+	height = 480;
+	pix_format = V4L2_PIX_FMT_YUYV;
+	pix_format_str = "YUYV";
+	streaming = 0;
+	crc_mode = CRC_OFF;
+	dev_path = device;
+	file = open("/dev/null", O_WRONLY);
+	memset(&snapshot_stats, 0, sizeof(snapshot_stats));
+
+	printf("snapshot benchmark, %s 640x480 YUYV preview for %.1f s, a snapshot every %.0f ms alternating with a "
+		"still at the largest size, %u settle frames\n", device, seconds, interval * 1e3, snapshot_config.settle);
+	openDevice(device);
+	init_device();
+	start_capturing();
+	memset(&req, 0, sizeof(req));
+	req.interval = interval;
+	pthread_create(&req_thread, NULL, snapshot_requester_main, &req);
+	t0 = bench_now();
+	while (bench_now() - t0 < seconds)
+		if (read_frame() < 0)
+			break;
+	req.stop = 1;
+	pthread_join(req_thread, NULL);
+	/* a request made during the last frame is still served */
+	while (atomic_load(&snapshot_pending))
+		if (read_frame() < 0)
+			break;
+	rerun = bench_snapshot_rerun(device, 3840, 2160);
+	stop_capturing();
+	uninit_device();
+	close_device();
+	snapshot_finish();
+
+	good = bench_snapshot_check(dir);
+	rmdir(dir);
+	printf("files: %u of %llu written are JPEGs; a still by closing and reopening the device took %.1f ms\n", good,
+		snapshot_stats.written, rerun * 1e3);
+	if (snapshot_stats.dropped || snapshot_stats.failed || good != snapshot_stats.written ||
+	    snapshot_stats.written != snapshot_stats.requested - snapshot_stats.coalesced)
+		ret = -1;
+
+	close(file);
+	file = -1;
+	width = saved_width;
+	height = saved_height;
+	pix_format = saved_format;
+	pix_format_str = saved_format_str;
+	streaming = saved_streaming;
+	crc_mode = saved_mode;
+	dev_path = saved_path;
+	snapshot_config = saved_config;
+
+	return ret;
+}
+
+/* The render sink drawing into plain memory laid out like a locked texture */
+static unsigned char *loop_bench_tex;
+static int loop_bench_pitch;
+static unsigned long long loop_bench_shown;
+
+static void *loop_bench_lock(int *pitch)
+{
+	*pitch = loop_bench_pitch;
+	return loop_bench_tex;
+}
+
+static void loop_bench_present(int written)
+{
+	loop_bench_shown += written >= 0;
+}
+
+static const struct render_target loop_bench_target = { loop_bench_lock, loop_bench_present };
+
+/* ns per frame of n_frames through read_frame(), generic or specialized, best of three runs */
+static double bench_loops_run(enum io_method method, unsigned int fourcc, int render, int specialized,
+	unsigned int n_frames)
+{
+	double best = 0, t0, ns;
+	unsigned int run, i;
+
+	io = method;
+	pix_format = fourcc;
+	streaming = render;
+	capture_specialized = specialized;
+	openDevice("synth:fps=0,static");
+	init_device();
+	start_capturing();
+	for (run = 0; run < 3; ++run) {
+		t0 = bench_now();
+		for (i = 0; i < n_frames; ++i)
+			if (read_frame() < 0)
+				break;
+		ns = (bench_now() - t0) * 1e9 / n_frames;
+		if (!run || ns < best)
+			best = ns;
+	}
+	stop_capturing();
+	uninit_device();
+	close_device();
+
+	return best;
+}
+
+/**
+Function Name : bench_loops
+Function Description : ns per frame of the capture loop on the synthetic device for each i/o method class,
+                       sink (render into memory laid out like a texture, or write() to /dev/null) and raw
+                       format, through the generic read_frame() that decides per frame and through the
+                       build specialized for that combination
+Parameter : optional frame count, width and height
+Return : 0 for success -1 when a rendered frame was not shown
+**/
+static int bench_loops(int argc, char **argv)
+{
+	static const unsigned int formats[] = { V4L2_PIX_FMT_YUYV, V4L2_PIX_FMT_NV12, V4L2_PIX_FMT_GREY };
+	static const enum io_method methods[] = { IO_METHOD_MMAP, IO_METHOD_READ };
+	static const char *io_names[] = { "read", "mmap", "userptr" };
+	unsigned int n_frames = argc > 1 ? strtol(argv[1], NULL, 10) : 5000;
+	unsigned int saved_width = width, saved_height = height, saved_streaming = streaming, saved_format = pix_format;
+	enum io_method saved_io = io;
+	enum crc_mode saved_mode = crc_mode;
+	int saved_codec = encode_codec, render;
+	unsigned int f, m;
+	double generic, special;
+	char name[8];
+	int ret = 0;
+
+	width = argc > 2 ? strtol(argv[2], NULL, 10) : 640;
+	height = argc > 3 ? strtol(argv[3], NULL, 10) : 480;
+	loop_bench_pitch = (width * 2 + 63) & ~63;
+	loop_bench_tex = malloc((size_t)loop_bench_pitch * height * 2);
+	render_target = &loop_bench_target;
+	file = open("/dev/null", O_WRONLY);
+	crc_mode = CRC_OFF;
+	encode_codec = ENCODE_NONE;
+
+	printf("loops benchmark, %u frames %ux%u from the synthetic device, generic read_frame() vs the build for "
+		"the i/o method, sink and format\n", n_frames, width, height);
+	printf("%-6s %-6s %-7s %11s %11s %8s\n", "format", "io", "sink", "generic ns", "special ns", "saved");
+	for (f = 0; f < sizeof(formats) / sizeof(formats[0]); ++f)
+		for (m = 0; m < sizeof(methods) / sizeof(methods[0]); ++m)
+			for (render = 1; render >= 0; --render) {
+				loop_bench_shown = 0;
+				generic = bench_loops_run(methods[m], formats[f], render, 0, n_frames);
+				special = bench_loops_run(methods[m], formats[f], render, 1, n_frames);
+				if (render && loop_bench_shown != 6ull * n_frames)
+					ret = -1;
+				printf("%-6s %-6s %-7s %11.0f %11.0f %7.1f%%\n", fourcc_name(formats[f], name),
+					io_names[methods[m]], render ? "render" : "write", generic, special,
+					100 * (generic - special) / generic);
+			}
+
+	capture_specialized = 1;
+	render_target = NULL;
+	free(loop_bench_tex);
+	close(file);
+	file = -1;
+	width = saved_width;
+	height = saved_height;
+	pix_format = saved_format;
+	streaming = saved_streaming;
+	io = saved_io;
+	crc_mode = saved_mode;
+	encode_codec = saved_codec;
+
+	return ret;
+}
+
+/* The last picture each output got, for checking against a plain 2x2 box of the frame */
+static struct pyramid_image pyramid_bench_last[PYRAMID_MAX_OUTPUTS];
+
+static void pyramid_bench_sink(const struct pyramid_image *image, void *user)
+{
+	pyramid_bench_last[(uintptr_t)user] = *image;
+}
+
+/* ms per frame building the levels and delivering to n outputs from first, best of three runs */
+static double bench_pyramid_run(const struct frame_view *view, const unsigned int (*sizes)[2], unsigned int first,
+	unsigned int n, unsigned int n_frames)
+{
+	double t0, ms, best = 0;
+	unsigned int i, run;
+
+	pyramid_reset();
+	for (i = first; i < first + n; ++i)
+		pyramid_add_output(sizes[i][0], sizes[i][1], pyramid_bench_sink, (void *)(uintptr_t)i);
+	pyramid_frame(view);    /* plans the levels outside the timing */
+	for (run = 0; run < 3; ++run) {
+		t0 = bench_cpu_now();
+		for (i = 0; i < n_frames; ++i)
+			pyramid_frame(view);
+		ms = (bench_cpu_now() - t0) * 1e3 / n_frames;
+		if (!run || ms < best)
+			best = ms;
+	}
+
+	return best;
+}
+
+/* Luma of level 1 and 2 against a scalar 2x2 box of the frame, the count of differing pixels */
+static unsigned int bench_pyramid_check(const struct frame_view *view, const struct pyramid_image *l1,
+	const struct pyramid_image *l2)
+{
+	unsigned int step = view->fourcc == V4L2_PIX_FMT_YUYV ? 2 : 1, x, y, bad = 0;
+	const unsigned char *r0, *r1, *q0, *q1;
+	unsigned char ref;
+
+	for (y = 0; y < l1->height; ++y)
+		for (x = 0; x < l1->width; ++x) {
+			r0 = view->plane[0] + 2 * y * view->pitch[0] + 2 * x * step;
+			r1 = r0 + view->pitch[0];
+			ref = (r0[0] + r0[step] + r1[0] + r1[step] + 2) >> 2;
+			bad += l1->plane[0][y * l1->pitch[0] + x] != ref;
+		}
+	for (y = 0; y < l2->height; ++y)
+		for (x = 0; x < l2->width; ++x) {
+			q0 = l1->plane[0] + 2 * y * l1->pitch[0] + 2 * x;
+			q1 = q0 + l1->pitch[0];
+			ref = (q0[0] + q0[1] + q1[0] + q1[1] + 2) >> 2;
+			bad += l2->plane[0][y * l2->pitch[0] + x] != ref;
+		}
+
+	return bad;
+}
+
+/**
+Function Name : bench_pyramid
+Function Description : ms per frame to give 1 to 4 smaller outputs of one YUYV or NV12 frame, the levels built
+                       in one strip pass for all of them versus a separate pass per output, and a check of the
+                       first two levels against a plain 2x2 box
+Parameter : optional width height frame-count
+Return : 0 for success -1 when a level differs from the reference
+**/
+static int bench_pyramid(int argc, char **argv)
+{
+	static const unsigned int formats[] = { V4L2_PIX_FMT_YUYV, V4L2_PIX_FMT_NV12 };
+	unsigned int width = argc > 1 ? strtol(argv[1], NULL, 10) : 1920;
+	unsigned int height = argc > 2 ? strtol(argv[2], NULL, 10) : 1080;
+	unsigned int n_frames = argc > 3 ? strtol(argv[3], NULL, 10) : 100;
+	unsigned int sizes[4][2], f, n, i, bad;
+	struct frame_view view;
+	unsigned char *frame = malloc(synth_frame_size(width, height, V4L2_PIX_FMT_YUYV));
+	double shared, separate;
+	char name[8];
+	int ret = 0;
+
+	/* three levels as they are, then one resampled between levels */
+	for (i = 0; i < 3; ++i) {
+		sizes[i][0] = (width >> (i + 1)) & ~1u;
+		sizes[i][1] = (height >> (i + 1)) & ~1u;
+	}
+	sizes[3][0] = (width / 3) & ~1u;
+	sizes[3][1] = (height / 3) & ~1u;
+
+	printf("pyramid benchmark %ux%u, %u frames per run, outputs %ux%u %ux%u %ux%u %ux%u (bilinear)\n", width,
+		height, n_frames, sizes[0][0], sizes[0][1], sizes[1][0], sizes[1][1], sizes[2][0], sizes[2][1],
+		sizes[3][0], sizes[3][1]);
+	printf("%-6s %7s %10s %12s %8s %7s\n", "format", "outputs", "shared ms", "separate ms", "saved", "errors");
+	for (f = 0; f < sizeof(formats) / sizeof(formats[0]); ++f) {
+		synth_fill_frame(frame, width, height, formats[f], 1);
+		frame_view_init(&view, frame, synth_frame_size(width, height, formats[f]), 0, width, height, formats[f], 0);
+		bench_pyramid_run(&view, sizes, 0, 2, 1);
+		bad = bench_pyramid_check(&view, &pyramid_bench_last[0], &pyramid_bench_last[1]);
+		ret |= bad ? -1 : 0;
+		for (n = 1; n <= 4; ++n) {
+			shared = bench_pyramid_run(&view, sizes, 0, n, n_frames);
+			for (separate = 0, i = 0; i < n; ++i)
+				separate += bench_pyramid_run(&view, sizes, i, 1, n_frames);
+			printf("%-6s %7u %10.3f %12.3f %7.1f%% %7u\n", fourcc_name(formats[f], name), n, shared, separate,
+				100 * (separate - shared) / separate, bad);
+		}
+	}
+	printf("shared: one pass builds every level the outputs need; separate: each output scales the frame on "
+		"its own\n");
+
+	pyramid_reset();
+	memset(&pyramid_stats, 0, sizeof(pyramid_stats));
+	free(frame);
+
+	return ret;
+}
+
+enum { SEGMENT_BENCH_ONE_FILE, SEGMENT_BENCH_INLINE, SEGMENT_BENCH_THREAD };
+
+static int bench_ns_cmp(const void *a, const void *b)
+{
+	unsigned long long x = *(const unsigned long long *)a, y = *(const unsigned long long *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* Files, extents and allocated bytes left in dir, then removes them */
+static unsigned long long bench_segment_sweep(const char *dir, unsigned int *files, unsigned int *extents)
+{
+	struct fiemap fm;
+	unsigned long long bytes = 0;
+	char path[512];
+	struct dirent *de;
+	struct stat st;
+	DIR *d = opendir(dir);
+	int f;
+
+	*files = *extents = 0;
+	if (!d)
+		return 0;
+	while ((de = readdir(d))) {
+		if (de->d_name[0] == '.')
+			continue;
+		snprintf(path, sizeof(path), "%s/%s", dir, de->d_name);
+		if ((f = open(path, O_RDONLY)) >= 0) {
+			/* FIEMAP_FLAG_SYNC makes delayed allocation pick its blocks before they are counted */
+			memset(&fm, 0, sizeof(fm));
+			fm.fm_length = FIEMAP_MAX_OFFSET;
+			fm.fm_flags = FIEMAP_FLAG_SYNC;
+			if (ioctl(f, FS_IOC_FIEMAP, &fm) == 0)
+				*extents += fm.fm_mapped_extents;
+			if (fstat(f, &st) == 0)
+				bytes += (unsigned long long)st.st_blocks * 512;
+			close(f);
+		}
+		(*files)++;
+		unlink(path);
+	}
+	closedir(d);
+
+	return bytes;
+}
+
+/* One recording of n_frames writes paced at fps, latency of each into ns; returns the longest rotation */
+static unsigned long long bench_segment_run(int mode, const char *dir, const unsigned char *frame, size_t size,
+	unsigned int n_frames, unsigned int fps, unsigned long long seg_bytes, unsigned long long *ns)
+{
+	unsigned long long t0, written = 0, rotate, rotate_max = 0;
+	unsigned int i, index = 0;
+	struct timespec due;
+	char path[512];
+	int f = -1;
+
+	if (mode == SEGMENT_BENCH_THREAD) {
+		snprintf(path, sizeof(path), "%s/rec", dir);
+		segment_enabled = 1;
+		if (segment_open(path, ".YUYV") < 0)
+			return 0;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &due);
+	for (i = 0; i < n_frames; ++i) {
+		due.tv_nsec += 1000000000 / fps;
+		if (due.tv_nsec >= 1000000000) {
+			due.tv_nsec -= 1000000000;
+			due.tv_sec++;
+		}
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &due, NULL);
+		t0 = metric_now_ns();
+		if (mode == SEGMENT_BENCH_THREAD) {
+			segment_write(frame, size);
+		} else {
+			/* what a recorder rotating on its own thread would do: close, create, fallocate, then write */
+			if (f < 0 || (mode == SEGMENT_BENCH_INLINE && written + size > seg_bytes)) {
+				if (f >= 0)
+					close(f);
+				snprintf(path, sizeof(path), "%s/rec_%05u.YUYV", dir, index++);
+				f = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0660);
+				if (mode == SEGMENT_BENCH_INLINE && fallocate(f, FALLOC_FL_KEEP_SIZE, 0, seg_bytes) != 0)
+					perror("fallocate");
+				written = 0;
+				rotate = metric_now_ns() - t0;
+				if (i && rotate > rotate_max)
+					rotate_max = rotate;
+			}
+			if (write(f, frame, size) != (ssize_t)size)
+				perror("write");
+			written += size;
+		}
+		ns[i] = metric_now_ns() - t0;
+	}
+	if (mode == SEGMENT_BENCH_THREAD) {
+		rotate_max = segment_stats.rotate_max_ns;
+		segment_finish();
+		segment_enabled = 0;
+	} else
+		close(f);
+
+	return rotate_max;
+}
+
+/**
+Function Name : bench_segment
+Function Description : Writes the same frames as one growing file, as segments the writer rotates and
+                       fallocates itself, and through the segment thread with a byte budget. Reports write
+                       latency on the recording thread, the longest rotation, and the files, extents and
+                       disk space left behind
+Parameter : optional frame KB, frame count, segment MB and fps
+Return : 0 for success -1 when the segments passed their budget
+**/
+static int bench_segment(int argc, char **argv)
+{
+	static const char *modes[] = { "one file", "inline", "thread" };
+	size_t size = (argc > 1 ? strtoul(argv[1], NULL, 10) : 600) << 10;
+	unsigned int n_frames = argc > 2 ? strtol(argv[2], NULL, 10) : 500;
+	unsigned long long seg_bytes = (argc > 3 ? strtoull(argv[3], NULL, 10) : 32) << 20;
+	unsigned int fps = argc > 4 ? strtol(argv[4], NULL, 10) : 250;
+	struct segment_config saved_config = segment_config;
+	unsigned long long *ns = malloc(n_frames * sizeof(*ns)), sum, rotate, disk;
+	unsigned char *frame = malloc(size);
+	char dir[] = "/tmp/v4l2segXXXXXX";
+	unsigned int files, extents, i;
+	int mode, ret = 0;
+
+	if (!mkdtemp(dir)) {
+		perror("mkdtemp");
+		return -1;
+	}
+	for (i = 0; i < size; ++i)
+		frame[i] = i * 131 >> 3;
+	segment_config.seconds = 0;
+	segment_config.max_bytes = seg_bytes;
+	segment_config.budget = 4 * seg_bytes;
+	printf("segment benchmark, %u frames of %zu KB at %u fps into %s, %llu MB segments, budget %llu MB for the "
+		"thread\n", n_frames, size >> 10, fps, dir, seg_bytes >> 20, segment_config.budget >> 20);
+	printf("%-9s %9s %9s %10s %12s %6s %8s %9s\n", "recording", "avg us", "p99 us", "max us", "rotate max us",
+		"files", "extents", "disk MB");
+	for (mode = SEGMENT_BENCH_ONE_FILE; mode <= SEGMENT_BENCH_THREAD; ++mode) {
+		memset(&segment_stats, 0, sizeof(segment_stats));
+		rotate = bench_segment_run(mode, dir, frame, size, n_frames, fps, seg_bytes, ns);
+		qsort(ns, n_frames, sizeof(*ns), bench_ns_cmp);
+		for (sum = 0, i = 0; i < n_frames; ++i)
+			sum += ns[i];
+		disk = bench_segment_sweep(dir, &files, &extents);
+		printf("%-9s %9.1f %9.1f %10.1f %12.1f %6u %8u %9.1f\n", modes[mode], sum / 1e3 / n_frames,
+			ns[n_frames * 99 / 100] / 1e3, ns[n_frames - 1] / 1e3, rotate / 1e3, files, extents,
+			disk / 1048576.0);
+		if (mode == SEGMENT_BENCH_THREAD && disk > segment_config.budget)
+			ret = -1;
+	}
+	printf("thread: %llu rotations, %llu late, %llu files deleted by the budget\n", segment_stats.rotations,
+		segment_stats.late, segment_stats.deleted);
+
+	rmdir(dir);
+	segment_config = saved_config;
+	memset(&segment_stats, 0, sizeof(segment_stats));
+	free(frame);
+	free(ns);
+
+	return ret;
+}
+
+/* Lattice noise for the stabilizer's scene, the same value for the same cell every time */
+static double stab_bench_cell(int x, int y, unsigned int octave)
+{
+	unsigned int h = x * 374761393u + y * 668265263u + octave * 2147483647u;
+
+	h = (h ^ (h >> 13)) * 1274126177u;
+	return (h ^ (h >> 16)) / 4294967295.0;
+}
+
+/* Detail at every scale from 4 to 64 pixels, so blocks match at 1/8 as well as at 1/4 */
+static void stab_bench_scene(unsigned char *scene, unsigned int width, unsigned int height)
+{
+	unsigned int x, y, o, cell;
+	double v, amp, fx, fy;
+	int cx, cy;
+
+	for (y = 0; y < height; ++y)
+		for (x = 0; x < width; ++x) {
+			for (v = 0, amp = 64, o = 0, cell = 64; cell >= 4; cell /= 2, amp /= 1.6, ++o) {
+				cx = x / cell;
+				cy = y / cell;
+				fx = (double)(x % cell) / cell;
+				fy = (double)(y % cell) / cell;
+				v += amp * ((stab_bench_cell(cx, cy, o) * (1 - fx) + stab_bench_cell(cx + 1, cy, o) * fx) * (1 - fy) +
+					(stab_bench_cell(cx, cy + 1, o) * (1 - fx) + stab_bench_cell(cx + 1, cy + 1, o) * fx) * fy);
+			}
+			scene[(size_t)y * width + x] = v > 255 ? 255 : v;
+		}
+}
+
+/* The camera of frame n: a slow pan with a fast shake and roll on top */
+static void stab_bench_camera(unsigned int n, double *x, double *y, double *a)
+{
+	*x = 0.4 * n + 6 * sin(n * 2 * M_PI / 7.3) + 3 * (stab_bench_cell(n, 0, 9) - 0.5);
+	*y = 0.2 * n + 5 * sin(n * 2 * M_PI / 5.9 + 1) + 3 * (stab_bench_cell(n, 1, 9) - 0.5);
+	*a = 0.008 * sin(n * 2 * M_PI / 9.1);
+}
+
+/* Frame n as the camera sees the scene, luma from the scene and flat chroma */
+static void stab_bench_frame(unsigned char *frame, const unsigned char *scene, unsigned int scene_width,
+	unsigned int pad, unsigned int width, unsigned int height, unsigned int fourcc, unsigned int n)
+{
+	double cx = width / 2.0, cy = height / 2.0, px, py, a, qx, qy, fx, fy;
+	unsigned int x, y, ix, iy;
+	const unsigned char *r;
+	unsigned char v;
+
+	stab_bench_camera(n, &px, &py, &a);
+	for (y = 0; y < height; ++y)
+		for (x = 0; x < width; ++x) {
+			qx = pad + cx + px + cos(a) * (x - cx) + sin(a) * (y - cy);
+			qy = pad + cy + py - sin(a) * (x - cx) + cos(a) * (y - cy);
+			ix = qx;
+			iy = qy;
+			fx = qx - ix;
+			fy = qy - iy;
+			r = scene + (size_t)iy * scene_width + ix;
+			v = (r[0] * (1 - fx) + r[1] * fx) * (1 - fy) + (r[scene_width] * (1 - fx) + r[scene_width + 1] * fx) * fy;
+			if (fourcc == V4L2_PIX_FMT_YUYV) {
+				frame[((size_t)y * width + x) * 2] = v;
+				frame[((size_t)y * width + x) * 2 + 1] = 128;
+			} else
+				frame[(size_t)y * width + x] = v;
+		}
+	if (fourcc == V4L2_PIX_FMT_NV12)
+		memset(frame + (size_t)width * height, 128, (size_t)width * height / 2);
+}
+
+/* RMS of the second difference, what is left of the shake once a steady pan is taken out */
+static double stab_bench_shake(const double *pos, unsigned int n)
+{
+	double d, sum = 0;
+	unsigned int i;
+
+	for (i = 2; i < n; ++i) {
+		d = pos[i] - 2 * pos[i - 1] + pos[i - 2];
+		sum += d * d;
+	}
+
+	return n > 2 ? sqrt(sum / (n - 2)) : 0;
+}
+
+/* One run of n_frames, the shake of the camera in and of what the stabilized frames show */
+static int bench_stabilize_run(const unsigned char *scene, unsigned int scene_width, unsigned int pad,
+	unsigned int width, unsigned int height, unsigned int fourcc, unsigned int lookahead, unsigned int n_frames)
+{
+	double *in[3], *out[3], px, py, a;
+	unsigned char *frame = malloc(synth_frame_size(width, height, fourcc));
+	unsigned int i, c, shown = 0;
+	struct stabilize_stats *st = &stabilize_stats;
+	struct frame_view view, stab;
+	double shake_in, shake_out, frame_ms;
+	char name[8];
+	int ret;
+
+	for (c = 0; c < 3; ++c) {
+		in[c] = malloc(n_frames * sizeof(double));
+		out[c] = malloc(n_frames * sizeof(double));
+	}
+	stabilize_config.lookahead = lookahead;
+	memset(st, 0, sizeof(*st));
+	for (i = 0; i <= n_frames; ++i) {
+		if (i < n_frames) {
+			stab_bench_frame(frame, scene, scene_width, pad, width, height, fourcc, i);
+			frame_view_init(&view, frame, synth_frame_size(width, height, fourcc), i, width, height, fourcc, 0);
+			ret = stabilize_frame(&view, &stab);
+		} else
+			ret = stabilize_flush(&stab);
+		for (; ret > 0; ret = i == n_frames ? stabilize_flush(&stab) : 0) {
+			/* the correction moves the source window by (x, y) in the frame, so the scene by R(-a) of it */
+			stab_bench_camera(shown, &px, &py, &a);
+			in[0][shown] = px;
+			in[1][shown] = py;
+			in[2][shown] = a;
+			out[0][shown] = px - (cos(a) * st->last_x + sin(a) * st->last_y);
+			out[1][shown] = py - (-sin(a) * st->last_x + cos(a) * st->last_y);
+			out[2][shown] = a + st->last_a;
+			shown++;
+		}
+	}
+
+	shake_in = hypot(stab_bench_shake(in[0], shown), stab_bench_shake(in[1], shown));
+	shake_out = hypot(stab_bench_shake(out[0], shown), stab_bench_shake(out[1], shown));
+	frame_ms = (st->copy_ns + st->estimate_ns + st->warp_ns) / 1e6 / st->frames;
+	printf("%-6s %9u %8.2f %8.2f %8.2f %9.2f %9.2f %9.3f %9.3f %8.1f %6llu\n", fourcc_name(fourcc, name), lookahead,
+		st->copy_ns / 1e6 / st->frames, st->estimate_ns / 1e6 / st->frames, st->warp_ns / 1e6 / st->shown,
+		shake_in, shake_out, stab_bench_shake(in[2], shown) * 180 / M_PI,
+		stab_bench_shake(out[2], shown) * 180 / M_PI, lookahead * 1000 / 30.0 + frame_ms, st->lost);
+
+	stabilize_reset();
+	for (c = 0; c < 3; ++c) {
+		free(in[c]);
+		free(out[c]);
+	}
+	free(frame);
+
+	/* two frames either side is too short a window to take out a shake of a few frames period */
+	return shown == n_frames && (lookahead < 4 || shake_out < shake_in / 2) ? 0 : -1;
+}
+
+/**
+Function Name : bench_stabilize
+Function Description : Films a textured scene with a shaking, rolling, slowly panning camera and stabilizes
+                       it. Reports ms per frame for the copy, the motion estimate and the warp, how much shake is
+                       left in what is shown, and the latency added at 30 fps for each lookahead
+Parameter : optional width height frame-count
+Return : 0 for success -1 when a lookahead of 4 or more did not halve the shake, or a frame was lost
+**/
+static int bench_stabilize(int argc, char **argv)
+{
+	static const unsigned int lookaheads[] = { 2, 4, 8, 16 };
+	unsigned int width = argc > 1 ? strtol(argv[1], NULL, 10) : 1280;
+	unsigned int height = argc > 2 ? strtol(argv[2], NULL, 10) : 720;
+	unsigned int n_frames = argc > 3 ? strtol(argv[3], NULL, 10) : 240;
+	unsigned int pad = 64, scene_width = width + 2 * pad + (unsigned int)(0.4 * n_frames) + 2 * height / 50;
+	unsigned int scene_height = height + 2 * pad + (unsigned int)(0.2 * n_frames) + 2 * width / 50;
+	struct stabilize_config saved_config = stabilize_config;
+	unsigned char *scene = malloc((size_t)scene_width * scene_height);
+	unsigned int i;
+	int ret = 0;
+
+	stab_bench_scene(scene, scene_width, scene_height);
+	printf("stabilize benchmark %ux%u, %u frames, shake of up to 8 px and 0.5 deg over a slow pan, crop %u%%, "
+		"%u threads\n", width, height, n_frames, stabilize_config.crop, tile_pool_threads());
+	printf("%-6s %9s %8s %8s %8s %9s %9s %9s %9s %8s %6s\n", "format", "lookahead", "copy ms", "est ms", "warp ms",
+		"shake px", "left px", "roll deg", "left deg", "lat ms", "lost");
+	for (i = 0; i < sizeof(lookaheads) / sizeof(lookaheads[0]); ++i)
+		ret |= bench_stabilize_run(scene, scene_width, pad, width, height, V4L2_PIX_FMT_YUYV, lookaheads[i],
+			n_frames);
+	ret |= bench_stabilize_run(scene, scene_width, pad, width, height, V4L2_PIX_FMT_NV12, 8, n_frames);
+	printf("shake: RMS frame to frame change of the camera's velocity; lat: lookahead at 30 fps plus the work\n");
+
+	stabilize_config = saved_config;
+	memset(&stabilize_stats, 0, sizeof(stabilize_stats));
+	free(scene);
+
+	return ret;
+}
+
+/* Focuses the synthetic lens with the capture engine running; the error is in control units from the sharp position */
+static int bench_autofocus_run(const char *label, int focus_at, unsigned int lens, unsigned int settle, int moving,
+	unsigned int n_frames)
+{
+	struct autofocus_stats *st = &autofocus_stats;
+	char device[96];
+	unsigned int i;
+	int error;
+
+	snprintf(device, sizeof(device), "synth:fps=0,focus=%d,lens=%u%s", focus_at, lens, moving ? "" : ",freeze=1");
+	memset(st, 0, sizeof(*st));
+	autofocus_config.settle = settle;
+	autofocus_reset();
+	openDevice(device);
+	io = IO_METHOD_MMAP;
+	streaming = 0;
+	init_device();
+	start_capturing();
+	for (i = 0; i < n_frames; ++i)
+		if (read_frame() < 0)
+			break;
+	stop_capturing();
+	uninit_device();
+	close_device();
+
+	error = st->locked ? abs(st->position - focus_at) : -1;
+	printf("%-7s %6d %5u %7u %6d %6d %7.1f %9.0f %6llu %9.3f\n", label, focus_at, lens, settle, st->position, error,
+		st->locked ? (double)st->search_frames / st->locked : 0.0,
+		st->locked ? st->search_frames * 1000.0 / st->locked / 30 : 0.0, st->moves,
+		st->frames ? st->metric_ns / 1e6 / st->frames : 0.0);
+
+	/* measuring before the lens has moved is expected to miss, the row is there to show it */
+	return settle < lens || (st->locked && error <= 5) ? 0 : -1;
+}
+
+/**
+Function Name : bench_autofocus
+Function Description : Prices the Tenengrad sharpness per frame and format and checks that it falls as the
+                       image blurs, then focuses the synthetic lens from the far end with the capture engine
+                       running, for several sharp positions, lens delays and settle counts. Reports the position
+                       reached, the frames and the time at 30 fps to focus, and the lens moves
+Parameter : optional width height frame-count
+Return : 0 for success -1 when the sharpness does not fall with blur or a search that waited for the lens did
+         not end within one control step of the sharp position
+**/
+static int bench_autofocus(int argc, char **argv)
+{
+	static const unsigned int formats[] = { V4L2_PIX_FMT_YUYV, V4L2_PIX_FMT_NV12, V4L2_PIX_FMT_GREY };
+	static const char *format_names[] = { "YUYV", "NV12", "GREY" };
+	static const unsigned int rois[] = { 40, 100 };
+	unsigned int bench_width = argc > 1 ? strtol(argv[1], NULL, 10) : 1280;
+	unsigned int bench_height = argc > 2 ? strtol(argv[2], NULL, 10) : 720;
+	unsigned int n_frames = argc > 3 ? strtol(argv[3], NULL, 10) : 200;
+	unsigned int saved_width = width, saved_height = height, saved_streaming = streaming, f, r, i, reps = 50;
+	struct autofocus_config saved_config = autofocus_config;
+	enum io_method saved_io = io;
+	enum crc_mode saved_mode = crc_mode;
+	unsigned char *frame = malloc(synth_frame_size(bench_width, bench_height, V4L2_PIX_FMT_YUYV));
+	struct frame_view view;
+	double t0, s, last;
+	int ret = 0;
+
+	printf("autofocus benchmark, Tenengrad sharpness of a %ux%u frame\n", bench_width, bench_height);
+	printf("%-6s %5s %10s %10s\n", "format", "roi %", "ms/frame", "ns/pixel");
+	for (f = 0; f < sizeof(formats) / sizeof(formats[0]); ++f) {
+		synth_fill_frame(frame, bench_width, bench_height, formats[f], 1);
+		frame_view_init(&view, frame, synth_frame_size(bench_width, bench_height, formats[f]), 1, bench_width,
+			bench_height, formats[f], 0);
+		for (r = 0; r < sizeof(rois) / sizeof(rois[0]); ++r) {
+			autofocus_sharpness(&view, rois[r]);
+			t0 = bench_now();
+			for (i = 0; i < reps; ++i)
+				autofocus_sharpness(&view, rois[r]);
+			s = (bench_now() - t0) / reps;
+			printf("%-6s %5u %10.3f %10.2f\n", format_names[f], rois[r], s * 1e3,
+				s * 1e9 / autofocus_stats.roi_width / autofocus_stats.roi_height);
+		}
+	}
+	printf("sharpness by blur radius:");
+	for (r = 0, last = 0; r <= 8; ++r) {
+		synth_fill_frame(frame, bench_width, bench_height, V4L2_PIX_FMT_YUYV, 1);
+		synth_defocus(frame, bench_width, bench_height, V4L2_PIX_FMT_YUYV, r);
+		frame_view_init(&view, frame, synth_frame_size(bench_width, bench_height, V4L2_PIX_FMT_YUYV), 1,
+			bench_width, bench_height, V4L2_PIX_FMT_YUYV, 0);
+		s = autofocus_sharpness(&view, 40);
+		printf(" %.1f", s);
+		if (r && s >= last)
+			ret = -1;
+		last = s;
+	}
+	printf("%s\n", ret ? " (expected to fall)" : "");
+	free(frame);
+
+	/* the lens steps 5 units and blurs one more pixel per step; it starts at 0 under the camera's autofocus */
+	width = 640;
+	height = 480;
+	pix_format = V4L2_PIX_FMT_YUYV;
+	file = open("/dev/null", O_WRONLY);
+	crc_mode = CRC_OFF;     /* a still scene with the lens at rest repeats frames on purpose */
+	autofocus_enabled = 1;
+	autofocus_config.roi = 40;
+	autofocus_config.step = 0;
+	autofocus_config.refocus = 0;
+	printf("focusing the synthetic lens (0 to 250) from 0, %ux%u, %u frames a run\n", width, height, n_frames);
+	printf("%-7s %6s %5s %7s %6s %6s %7s %9s %6s %9s\n", "scene", "sharp", "lens", "settle", "at", "error",
+		"frames", "ms@30fps", "moves", "metric ms");
+	ret |= bench_autofocus_run("still", 35, 2, 2, 0, n_frames);
+	ret |= bench_autofocus_run("still", 125, 2, 2, 0, n_frames);
+	ret |= bench_autofocus_run("still", 220, 2, 2, 0, n_frames);
+	ret |= bench_autofocus_run("still", 125, 2, 0, 0, n_frames);
+	ret |= bench_autofocus_run("still", 125, 4, 4, 0, n_frames);
+	ret |= bench_autofocus_run("moving", 125, 2, 2, 1, n_frames);
+	printf("lens: frames a move takes to show; settle: frames the search skips after a move; error: control units\n");
+
+	close(file);
+	file = -1;
+	autofocus_enabled = 0;
+	autofocus_config = saved_config;
+	autofocus_reset();
+	memset(&autofocus_stats, 0, sizeof(autofocus_stats));
+	width = saved_width;
+	height = saved_height;
+	streaming = saved_streaming;
+	io = saved_io;
+	crc_mode = saved_mode;
+
+	return ret;
+}
+
+/* Percent of luma samples crushed to black or clipped to white */
+static double hdr_bench_clipped(const struct frame_view *v)
+{
+	unsigned int step = v->fourcc == V4L2_PIX_FMT_YUYV ? 2 : 1, x, y, n = 0;
+	const unsigned char *p;
+
+	for (y = 0; y < v->height; ++y)
+		for (x = 0, p = v->plane[0] + (size_t)y * v->pitch[0]; x < v->width; ++x, p += step)
+			n += *p <= 2 || *p >= 253;
+
+	return 100.0 * n / v->width / v->height;
+}
+
+/* Brackets the synthetic camera with the capture engine running and the exposure control lagging lag frames */
+static int bench_hdr_run(const char *label, unsigned int lag, unsigned int latency, unsigned int drop,
+	unsigned int n_frames)
+{
+	struct hdr_stats *st = &hdr_stats;
+	unsigned int n = hdr_config.brackets;
+	unsigned long long expected;
+	char device[96];
+	double t0, s;
+	unsigned int i;
+
+	snprintf(device, sizeof(device), "synth:fps=0,hdr,lag=%u,drop=%u", lag, drop);
+	memset(st, 0, sizeof(*st));
+	hdr_config.latency = latency;
+	hdr_reset();
+	openDevice(device);
+	io = IO_METHOD_MMAP;
+	streaming = 0;
+	init_device();
+	start_capturing();
+	t0 = bench_now();
+	for (i = 0; i < n_frames; ++i)
+		if (read_frame() < 0)
+			break;
+	s = bench_now() - t0;
+	stop_capturing();
+	uninit_device();
+	close_device();
+
+	printf("%-9s %4u %8u %5u %7llu %7llu %10llu %8llu %10llu %8.2f %9.1f\n", label, lag, latency, drop, st->frames,
+		st->merged, st->incomplete, st->untagged, st->misordered, st->merged ? st->merge_ns / 1e6 / st->merged : 0.0,
+		st->merged / s);
+
+	/*
+	 * a control set too late is expected to misorder and a dropped frame to lose its group, and the next one
+	 * when the control it skipped fell there, the rows show it;
+	 * the first group is taken before the first control applies and the last merge is still in flight
+	 */
+	expected = st->frames / n - 2;
+	if (latency != lag)
+		return st->misordered ? 0 : -1;
+	if (drop)
+		return st->incomplete && st->merged + st->incomplete >= expected ? 0 : -1;
+	return st->misordered == 0 && st->merged >= expected ? 0 : -1;
+}
+
+/**
+Function Name : bench_hdr
+Function Description : Prices the exposure fusion per format and bracket count on synthetic frames exposed
+                       1/4, 1 and 4 times, with the clipped share of the single exposure against the merge,
+                       then brackets the synthetic camera with the capture engine running, with the control
+                       latency matching its lag, too short, and with dropped frames. Reports the frames merged,
+                       the groups lost or misordered and the merge time and rate
+Parameter : optional width height frame-count
+Return : 0 for success -1 when the merge clips more than the single exposure, or the capture runs merge fewer
+         groups than expected or miss the misordering and lost groups they provoke
+**/
+static int bench_hdr(int argc, char **argv)
+{
+	static const unsigned int formats[] = { V4L2_PIX_FMT_YUYV, V4L2_PIX_FMT_NV12, V4L2_PIX_FMT_GREY };
+	static const char *format_names[] = { "YUYV", "NV12", "GREY" };
+	static const unsigned int counts[] = { 2, 3, 5 };
+	unsigned int bench_width = argc > 1 ? strtol(argv[1], NULL, 10) : 1280;
+	unsigned int bench_height = argc > 2 ? strtol(argv[2], NULL, 10) : 720;
+	unsigned int n_frames = argc > 3 ? strtol(argv[3], NULL, 10) : 300;
+	unsigned int saved_width = width, saved_height = height, saved_streaming = streaming, f, c, i, r, reps = 20;
+	size_t size = synth_frame_size(bench_width, bench_height, V4L2_PIX_FMT_YUYV);
+	struct hdr_config saved_config = hdr_config;
+	struct frame_view brackets[HDR_MAX_BRACKETS], merged;
+	enum io_method saved_io = io;
+	unsigned char *data[HDR_MAX_BRACKETS], *dst = malloc(size);
+	unsigned long long ns;
+	double single, fused;
+	int ret = 0;
+
+	for (i = 0; i < HDR_MAX_BRACKETS; ++i)
+		data[i] = malloc(size);
+	printf("hdr benchmark, exposure fusion of %ux%u brackets 2 EV apart on %u threads\n", bench_width, bench_height,
+		tile_pool_threads());
+	printf("%-6s %8s %10s %10s %12s %12s\n", "format", "brackets", "ms/merge", "ns/pixel", "clipped 1x %",
+		"clipped hdr %");
+	for (f = 0; f < sizeof(formats) / sizeof(formats[0]); ++f) {
+		for (c = 0; c < sizeof(counts) / sizeof(counts[0]); ++c) {
+			for (i = 0; i < counts[c]; ++i) {
+				synth_fill_frame(data[i], bench_width, bench_height, formats[f], 1);
+				synth_expose(data[i], bench_width, bench_height, formats[f],
+					exp2(2.0 * (i - (counts[c] - 1) / 2.0)));
+				frame_view_init(&brackets[i], data[i], synth_frame_size(bench_width, bench_height, formats[f]),
+					1, bench_width, bench_height, formats[f], 0);
+			}
+			hdr_merge(brackets, counts[c], dst);
+			for (r = 0, ns = 0; r < reps; ++r)
+				ns += hdr_merge(brackets, counts[c], dst);
+			frame_view_init(&merged, dst, synth_frame_size(bench_width, bench_height, formats[f]), 1,
+				bench_width, bench_height, formats[f], 0);
+			single = hdr_bench_clipped(&brackets[(counts[c] - 1) / 2]);
+			fused = hdr_bench_clipped(&merged);
+			printf("%-6s %8u %10.3f %10.2f %12.1f %12.1f\n", format_names[f], counts[c], ns / 1e6 / reps,
+				(double)ns / reps / bench_width / bench_height, single, fused);
+			if (fused >= single)
+				ret = -1;
+		}
+	}
+	for (i = 0; i < HDR_MAX_BRACKETS; ++i)
+		free(data[i]);
+	free(dst);
+
+	/* the synthetic camera starts at exposure 156 of 3 to 2047, so 3 brackets 2 EV apart are 39 156 624 */
+	width = 640;
+	height = 480;
+	pix_format = V4L2_PIX_FMT_YUYV;
+	file = open("/dev/null", O_WRONLY);
+	hdr_enabled = 1;
+	hdr_config.brackets = 3;
+	hdr_config.stops = 2.0;
+	hdr_config.gain = 0;
+	printf("bracketing the synthetic camera, %ux%u, %u frames a run\n", width, height, n_frames);
+	printf("%-9s %4s %8s %5s %7s %7s %10s %8s %10s %8s %9s\n", "run", "lag", "latency", "drop", "frames", "merged",
+		"incomplete", "untagged", "misordered", "merge ms", "merged/s");
+	ret |= bench_hdr_run("matched", 2, 2, 0, n_frames);
+	ret |= bench_hdr_run("matched", 1, 1, 0, n_frames);
+	ret |= bench_hdr_run("early", 2, 1, 0, n_frames);
+	ret |= bench_hdr_run("dropping", 2, 2, 10, n_frames);
+	printf("lag: frames the camera takes to apply a control; latency: frames ahead the control is set; drop: every "
+		"nth frame lost\n");
+
+	close(file);
+	file = -1;
+	hdr_enabled = 0;
+	hdr_config = saved_config;
+	hdr_reset();
+	memset(&hdr_stats, 0, sizeof(hdr_stats));
+	width = saved_width;
+	height = saved_height;
+	streaming = saved_streaming;
+	io = saved_io;
+
+	return ret;
+}
+
+/* Squared error of a frame against the clean one it was rendered from, over every sample */
+static double denoise_bench_se(const unsigned char *a, const unsigned char *b, size_t n)
+{
+	double d, sum = 0;
+	size_t i;
+
+	for (i = 0; i < n; ++i) {
+		d = (double)a[i] - b[i];
+		sum += d * d;
+	}
+
+	return sum;
+}
+
+/* zstd:1 with the row delta, as a recording would store the frame */
+static unsigned long denoise_bench_packed(struct encode_worker *worker, struct encode_job *job,
+	const unsigned char *frame, unsigned int size, unsigned int width, unsigned int height)
+{
+	memcpy(job->raw, frame, size);
+	job->raw_size = size;
+	job->width = width;
+	job->height = height;
+	job->fourcc = V4L2_PIX_FMT_YUYV;
+	lossless_encode_frame(worker, job);
+
+	return job->out_size;
+}
+
+/* Times the filter on the pre-rendered noisy frames, played in turn; the output stays in out */
+static double bench_denoise_speed(unsigned char *const *noisy, unsigned int n_noisy, unsigned int width,
+	unsigned int height, unsigned int n_frames, struct frame_view *out)
+{
+	unsigned int size = width * height * 2, i;
+	struct frame_view in;
+
+	denoise_reset();
+	memset(&denoise_stats, 0, sizeof(denoise_stats));
+	for (i = 0; i < n_frames; ++i) {
+		frame_view_init(&in, noisy[i % n_noisy], size, i, width, height, V4L2_PIX_FMT_YUYV, 0);
+		denoise_frame(&in, out);
+	}
+
+	return denoise_stats.filter_ns / 1e6 / (denoise_stats.frames - denoise_stats.restarts);
+}
+
+/* Filters a noisy rendering of the synthetic scene and measures it against the clean one */
+static int bench_denoise_quality(const char *label, int moving, unsigned int sigma, unsigned int strength,
+	unsigned int threshold, unsigned int n_frames, struct encode_worker *worker, struct encode_job *job)
+{
+	unsigned int width = 640, height = 480, size = width * height * 2, warmup = 10, i, n = 0;
+	unsigned char *clean = malloc(size), *noisy = malloc(size);
+	unsigned long long raw_bytes = 0, noisy_bytes = 0, filtered_bytes = 0;
+	double se_in = 0, se_out = 0, psnr_in, psnr_out;
+	struct frame_view in, out;
+
+	denoise_config.strength = strength;
+	denoise_config.threshold = threshold;
+	denoise_reset();
+	memset(&denoise_stats, 0, sizeof(denoise_stats));
+	for (i = 0; i < n_frames; ++i) {
+		synth_fill_clean(clean, width, height, V4L2_PIX_FMT_YUYV, moving ? i + 1 : 1);
+		memcpy(noisy, clean, size);
+		synth_grain(noisy, width, height, V4L2_PIX_FMT_YUYV, sigma, i);
+		frame_view_init(&in, noisy, size, i, width, height, V4L2_PIX_FMT_YUYV, 0);
+		denoise_frame(&in, &out);
+		/* the reference needs a few frames to settle, as the eye would see it after a cut */
+		if (i < warmup)
+			continue;
+		se_in += denoise_bench_se(noisy, clean, size);
+		se_out += denoise_bench_se(out.plane[0], clean, size);
+		raw_bytes += size;
+		noisy_bytes += denoise_bench_packed(worker, job, noisy, size, width, height);
+		filtered_bytes += denoise_bench_packed(worker, job, out.plane[0], size, width, height);
+		n++;
+	}
+	psnr_in = se_in ? 10 * log10(255.0 * 255 * size * n / se_in) : 99;
+	psnr_out = se_out ? 10 * log10(255.0 * 255 * size * n / se_out) : 99;
+	printf("%-7s %5u %8u %9u %9.2f %9.2f %7.2f %8.1f %9.2f %9.2f\n", label, sigma, strength, threshold, psnr_in,
+		psnr_out, psnr_out - psnr_in, denoise_stats.samples ? 100.0 * denoise_stats.moving / denoise_stats.samples : 0,
+		(double)raw_bytes / noisy_bytes, (double)raw_bytes / filtered_bytes);
+	free(clean);
+	free(noisy);
+
+	return psnr_out > psnr_in ? 0 : -1;
+}
+
+/**
+Function Name : bench_denoise
+Function Description : Times the temporal denoiser per kernel and per tile pool thread count on noisy YUYV
+                       frames, checking that every kernel gives the scalar bytes, then measures the noise
+                       removed as PSNR against the clean synthetic scene, still and moving, per noise level and
+                       setting, with the zstd:1+row ratio a recording gets before and after. Last it runs the
+                       capture engine on the synthetic camera in low light with the filter on
+Parameter : optional width height frame-count
+Return : 0 for success -1 when a kernel differs from the scalar one, a setting leaves more noise than it
+         found or the capture run did not filter every frame
+**/
+static int bench_denoise(int argc, char **argv)
+{
+	static const char *kernels[] = { "scalar", "sse2", "avx2", "neon" };
+	static const unsigned int thread_counts[] = { 1, 2, 4 };
+	static const unsigned int settings[][2] = { { 50, 16 }, { 75, 32 }, { 90, 48 } };
+	static const unsigned int sigmas[] = { 3, 6 };
+	unsigned int bench_width = argc > 1 ? strtol(argv[1], NULL, 10) : 1920;
+	unsigned int bench_height = argc > 2 ? strtol(argv[2], NULL, 10) : 1080;
+	unsigned int n_frames = argc > 3 ? strtol(argv[3], NULL, 10) : 60;
+	unsigned int saved_width = width, saved_height = height, saved_streaming = streaming, saved_threads = tile_threads;
+	unsigned int size = bench_width * bench_height * 2, n_noisy = 8, i, k, t, s, m;
+	struct denoise_config saved_config = denoise_config;
+	enum encode_codec saved_codec = encode_codec;
+	enum delta_filter saved_filter = lossless_filter;
+	int saved_level = lossless_level;
+	enum io_method saved_io = io;
+	unsigned char *noisy[8], *expected = malloc(size);
+	struct encode_worker worker;
+	struct encode_job job;
+	struct frame_view out;
+	double ms;
+	int ret = 0, same;
+
+	for (i = 0; i < n_noisy; ++i) {
+		noisy[i] = malloc(size);
+		synth_fill_clean(noisy[i], bench_width, bench_height, V4L2_PIX_FMT_YUYV, i + 1);
+		synth_grain(noisy[i], bench_width, bench_height, V4L2_PIX_FMT_YUYV, 6, i);
+	}
+	printf("denoise benchmark, %ux%u YUYV with noise of sigma 6, %u frames a run\n", bench_width, bench_height,
+		n_frames);
+	printf("%-7s %7s %9s %9s %8s %6s\n", "kernel", "threads", "ms/frame", "ns/byte", "30 fps", "bytes");
+	for (k = 0; k < sizeof(kernels) / sizeof(kernels[0]); ++k) {
+		if (denoise_select(kernels[k]) != 0)
+			continue;
+		ms = bench_denoise_speed(noisy, n_noisy, bench_width, bench_height, n_frames, &out);
+		if (k == 0)
+			memcpy(expected, out.plane[0], size);
+		same = memcmp(expected, out.plane[0], size) == 0;
+		printf("%-7s %7u %9.3f %9.3f %8s %6s\n", kernels[k], tile_pool_threads(), ms, ms * 1e6 / size,
+			ms < 1000.0 / 30 ? "yes" : "no", same ? "same" : "DIFFER");
+		if (!same)
+			ret = -1;
+	}
+	denoise_select(NULL);
+	for (t = 0; t < sizeof(thread_counts) / sizeof(thread_counts[0]); ++t) {
+		tile_threads = thread_counts[t];
+		tile_pool_shutdown();
+		ms = bench_denoise_speed(noisy, n_noisy, bench_width, bench_height, n_frames, &out);
+		printf("%-7s %7u %9.3f %9.3f %8s\n", denoise_stats.kernel, tile_pool_threads(), ms, ms * 1e6 / size,
+			ms < 1000.0 / 30 ? "yes" : "no");
+	}
+	tile_threads = saved_threads;
+	tile_pool_shutdown();
+	for (i = 0; i < n_noisy; ++i)
+		free(noisy[i]);
+	free(expected);
+
+	memset(&worker, 0, sizeof(worker));
+	memset(&job, 0, sizeof(job));
+	job.raw = malloc(640 * 480 * 2);
+	job.out_capacity = 640 * 480 * 2 + 4096;
+	job.out = malloc(job.out_capacity);
+	encode_codec = ENCODE_ZSTD;
+	lossless_level = 1;
+	lossless_filter = DELTA_ROW;
+	printf("noise removed from 640x480 YUYV against the clean scene, %u frames a run after 10 to settle\n", n_frames);
+	printf("%-7s %5s %8s %9s %9s %9s %7s %8s %9s %9s\n", "scene", "sigma", "strength", "threshold", "psnr in",
+		"psnr out", "gain dB", "motion %", "zstd in", "zstd out");
+	for (m = 0; m < 2; ++m)
+		for (i = 0; i < sizeof(sigmas) / sizeof(sigmas[0]); ++i)
+			for (s = 0; s < sizeof(settings) / sizeof(settings[0]); ++s)
+				ret |= bench_denoise_quality(m ? "moving" : "still", m, sigmas[i], settings[s][0],
+					settings[s][1], n_frames + 10, &worker, &job);
+	printf("strength: percent of the reference kept where a sample matches it; threshold: levels of difference "
+		"taken as motion\n");
+	encode_worker_release(&worker);
+	free(job.raw);
+	free(job.out);
+	encode_codec = saved_codec;
+	lossless_level = saved_level;
+	lossless_filter = saved_filter;
+
+	/* the engine path: frames come off the synthetic camera, go through the filter and out to /dev/null */
+	denoise_config = saved_config;
+	denoise_reset();
+	memset(&denoise_stats, 0, sizeof(denoise_stats));
+	width = 640;
+	height = 480;
+	pix_format = V4L2_PIX_FMT_YUYV;
+	file = open("/dev/null", O_WRONLY);
+	denoise_enabled = 1;
+	openDevice("synth:fps=0,noise=6");
+	io = IO_METHOD_MMAP;
+	streaming = 0;
+	init_device();
+	start_capturing();
+	for (i = 0; i < n_frames; ++i)
+		if (read_frame() < 0)
+			break;
+	stop_capturing();
+	uninit_device();
+	close_device();
+	printf("capture engine, synth:noise=6 %ux%u: %llu of %u frames filtered, %.3f ms a frame, %.1f%% motion\n",
+		width, height, denoise_stats.frames, i, denoise_stats.filter_ns / 1e6 / (denoise_stats.frames - 1),
+		denoise_stats.samples ? 100.0 * denoise_stats.moving / denoise_stats.samples : 0.0);
+	if (denoise_stats.frames != n_frames)
+		ret = -1;
+
+	close(file);
+	file = -1;
+	denoise_enabled = 0;
+	denoise_config = saved_config;
+	denoise_reset();
+	memset(&denoise_stats, 0, sizeof(denoise_stats));
+	width = saved_width;
+	height = saved_height;
+	streaming = saved_streaming;
+	io = saved_io;
+
+	return ret;
+}
+
+static unsigned int bench_rd32(const unsigned char *p)
+{
+	return (unsigned int)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+static unsigned long long bench_rd64(const unsigned char *p)
+{
+	return (unsigned long long)bench_rd32(p) << 32 | bench_rd32(p + 4);
+}
+
+/* The first box of the given type among the siblings in [p, end), NULL when there is none or a size is bad */
+static const unsigned char *bench_mp4_box(const unsigned char *p, const unsigned char *end, const char *type)
+{
+	unsigned int size;
+
+	while (end - p >= 8) {
+		size = bench_rd32(p);
+		if (size < 8 || size > end - p)
+			return NULL;
+		if (memcmp(p + 4, type, 4) == 0)
+			return p;
+		p += size;
+	}
+
+	return NULL;
+}
+
+/*
+ * Walks a fragmented MP4 as a player would: ftyp, moov, moof + mdat pairs, mfra. Every trun must point at the
+ * payload of the mdat after it and account for all of it in whole NAL units, the first fragment open on a
+ * keyframe, the decode times run on without a gap and the mfra name every moof that opens on one. Returns the
+ * samples found, -1 on a fault.
+ */
+static long bench_mp4_walk(const unsigned char *buf, size_t len, unsigned long long *fragments,
+	unsigned long long *edit)
+{
+	const unsigned char *p = buf, *end = buf + len, *moof, *traf, *trun, *tfdt, *box, *nal, *sample_end;
+	unsigned long long dts = 0, offsets[4096];
+	unsigned int size, n, i, total, n_moofs = 0;
+	long samples = 0;
+	int key;
+
+	*fragments = 0;
+	*edit = 0;
+	if (!bench_mp4_box(p, end, "ftyp") || !(box = bench_mp4_box(p, end, "moov")) ||
+	    !bench_mp4_box(box + 8, box + bench_rd32(box), "mvex"))
+		return -1;
+	if ((box = bench_mp4_box(box + 8, box + bench_rd32(box), "trak")) &&
+	    (box = bench_mp4_box(box + 8, box + bench_rd32(box), "edts")) &&
+	    (box = bench_mp4_box(box + 8, box + bench_rd32(box), "elst")))
+		*edit = bench_rd32(box + 20);
+	while (end - p >= 8) {
+		size = bench_rd32(p);
+		if (size < 8 || size > end - p)
+			return -1;
+		if (memcmp(p + 4, "moof", 4) == 0) {
+			moof = p;
+			p += size;
+			if (end - p < 8 || memcmp(p + 4, "mdat", 4) != 0)
+				return -1;
+			if (!(traf = bench_mp4_box(moof + 8, moof + size, "traf")) ||
+			    !(tfdt = bench_mp4_box(traf + 8, traf + bench_rd32(traf), "tfdt")) ||
+			    !(trun = bench_mp4_box(traf + 8, traf + bench_rd32(traf), "trun")))
+				return -1;
+			n = bench_rd32(trun + 12);
+			key = bench_rd32(trun + 28) == 0x02000000;
+			if (bench_rd64(tfdt + 12) != dts || moof + bench_rd32(trun + 16) != p + 8 || (!*fragments && !key))
+				return -1;
+			for (i = 0, total = 0; i < n; ++i) {
+				nal = p + 8 + total;
+				total += bench_rd32(trun + 24 + i * 16);
+				if (total > bench_rd32(p) - 8)
+					return -1;
+				for (sample_end = p + 8 + total; nal < sample_end; nal += 4 + bench_rd32(nal))
+					;
+				if (nal != sample_end)
+					return -1;
+				dts += bench_rd32(trun + 20 + i * 16);
+			}
+			if (total != bench_rd32(p) - 8)
+				return -1;
+			if (key && n_moofs < sizeof(offsets) / sizeof(offsets[0]))
+				offsets[n_moofs++] = moof - buf;
+			samples += n;
+			++*fragments;
+			size = bench_rd32(p);
+		} else if (memcmp(p + 4, "mfra", 4) == 0) {
+			if (p + size != end || bench_rd32(end - 4) != size || !(box = bench_mp4_box(p + 8, end, "tfra")) ||
+			    bench_rd32(box + 20) != n_moofs)
+				return -1;
+			for (i = 0; i < n_moofs; ++i)
+				if (bench_rd64(box + 24 + i * 19 + 8) != offsets[i])
+					return -1;
+		} else if (memcmp(p + 4, "ftyp", 4) != 0 && memcmp(p + 4, "moov", 4) != 0)
+			return -1;
+		p += size;
+	}
+
+	return p == end ? samples : -1;
+}
+
+/* Reads back an MP4 the bench wrote to fd and walks it */
+static long bench_mp4_check(int fd, unsigned long long *fragments, unsigned long long *edit)
+{
+	struct stat sb;
+	unsigned char *buf;
+	long samples = -1;
+
+	if (fstat(fd, &sb) != 0 || !(buf = malloc(sb.st_size)))
+		return -1;
+	if (pread(fd, buf, sb.st_size, 0) == sb.st_size)
+		samples = bench_mp4_walk(buf, sb.st_size, fragments, edit);
+	free(buf);
+
+	return samples;
+}
+
+/* Muxes a synthetic IPBB... stream of n_samples at 30 fps, a keyframe every gop, and checks what comes out */
+static int bench_h264_mux(unsigned int n_samples, unsigned int gop)
+{
+	static const unsigned char sps[] = { 0x67, 100, 0, 40, 0xac, 0xd9, 0x40, 0x50 }, pps[] = { 0x68, 0xeb, 0xe3 };
+	char path[] = "/tmp/v4l2_mp4_benchXXXXXX";
+	unsigned char *sample = malloc(64 * 1024);
+	unsigned long long payload = 0, fragments = 0, edit = 0, expected = 0;
+	unsigned int i, size;
+	struct mp4_writer *w;
+	struct mp4_stats st;
+	long long dts, pts;
+	long samples = -1;
+	double t0, t = 0;
+	int fd, ok;
+
+	if ((fd = mkstemp(path)) < 0) {
+		perror("mkstemp");
+		free(sample);
+		return -1;
+	}
+	unlink(path);
+	t0 = bench_now();
+	w = mp4_open(fd, 1280, 720, sps, sizeof(sps), pps, sizeof(pps), 6000, 0);
+	for (i = 0; w && i < n_samples; ++i) {
+		/* the B-frames show as they decode, the I and P frames two frames later */
+		dts = i * 3000LL;
+		pts = i % gop && i % 3 == 2 ? dts : dts + 6000;
+		size = i % gop ? 2000 + i * 37 % 1500 : 40000 + i % 7 * 100;
+		sample[0] = (size - 4) >> 24;
+		sample[1] = (size - 4) >> 16;
+		sample[2] = (size - 4) >> 8;
+		sample[3] = size - 4;
+		memset(sample + 4, i, size - 4);
+		mp4_sample(w, sample, size, pts, dts, i % gop == 0);
+		payload += size;
+		/* a fragment per keyframe, and another each 1024 samples without one */
+		expected += i % gop % 1024 == 0;
+	}
+	if (w && mp4_close(w, &st) == 0) {
+		t = bench_now() - t0;
+		samples = bench_mp4_check(fd, &fragments, &edit);
+	}
+	ok = samples == (long)n_samples && fragments == expected && edit == 6000 &&
+		st.duration == n_samples * 3000ULL;
+	printf("%-8u %4u %8ld %9llu %6llu %9.1f %10.3f %9.0f %s\n", n_samples, gop, samples, fragments, edit,
+		w ? (double)st.duration / MP4_TIMESCALE : 0, w ? 100.0 * (st.bytes - payload) / payload : 0,
+		t > 0 ? payload / 1e6 / t : 0, ok ? "ok" : "BROKEN");
+	close(fd);
+	free(sample);
+
+	return ok ? 0 : -1;
+}
+
+/* One row of the storage table: what a codec makes of the frames, per frame and per hour at 30 fps */
+static void bench_h264_row(const char *scene, const char *codec, unsigned int threads, unsigned long long bytes,
+	unsigned int n_frames, unsigned int raw_size, double cpu)
+{
+	double per_frame = (double)bytes / n_frames;
+
+	printf("%-7s %-17s %7u %10.1f %9.3f %8.1f:1 ", scene, codec, threads, per_frame / 1024,
+		per_frame * 30 * 3600 / 1e9, raw_size / per_frame);
+	if (cpu > 0)
+		printf("%9.1f\n", n_frames / cpu);
+	else
+		printf("%9s\n", "-");
+}
+
+#ifdef V4L2_H264
+static double bench_process_cpu_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Encodes the frames at 30 fps timestamps through x264 into an MP4 and walks the file; returns its size */
+static long long bench_h264_encode(const unsigned char *frames, unsigned int n_frames, unsigned int width,
+	unsigned int height, struct encode_job *job, double *cpu)
+{
+	char path[] = "/tmp/v4l2_h264_benchXXXXXX";
+	unsigned int size = width * height * 2, i;
+	unsigned long long bytes, fragments, edit;
+	struct encode_worker worker;
+	long samples;
+	double t0;
+	int fd;
+
+	if ((fd = mkstemp(path)) < 0) {
+		perror("mkstemp");
+		return -1;
+	}
+	unlink(path);
+	memset(&worker, 0, sizeof(worker));
+	memset(&h264_stats, 0, sizeof(h264_stats));
+	t0 = bench_process_cpu_now();
+	for (i = 0; i < n_frames; ++i) {
+		memcpy(job->raw, frames + (size_t)i * size, size);
+		job->raw_size = size;
+		job->seq = i;
+		job->width = width;
+		job->height = height;
+		job->fourcc = V4L2_PIX_FMT_YUYV;
+		job->ts_ns = i * 1000000000ULL / 30;
+		if (h264_encode_frame(&worker, job) < 0 || h264_write(&worker, fd, job) < 0)
+			break;
+	}
+	bytes = h264_finish(&worker, fd);
+	*cpu = bench_process_cpu_now() - t0;
+	encode_worker_release(&worker);
+	samples = bench_mp4_check(fd, &fragments, &edit);
+	close(fd);
+
+	return i == n_frames && samples == (long)n_frames ? (long long)bytes : -1;
+}
+#endif
+
+/**
+Function Name : bench_h264
+Function Description : Muxes synthetic H.264 streams into fragmented MP4 and walks the files back box by box,
+                       then sets the storage an hour of recording takes, and the encode rate per core, of the
+                       codecs there are against raw, on a still and a moving noisy scene. With make H264=1 the
+                       x264 presets and CRFs are among them, each file walked as well, and the capture engine
+                       records the synthetic camera through the encode queue
+Parameter : optional width height frame-count
+Return : 0 for success -1 when a file does not walk or a frame was lost
+**/
+static int bench_h264(int argc, char **argv)
+{
+#ifdef V4L2_H264
+	static const char *presets[] = { "ultrafast", "veryfast", "medium" };
+	static const unsigned int crfs[] = { 23, 28 };
+	struct h264_config saved_h264 = h264_config;
+	unsigned int saved_width = width, saved_height = height, saved_streaming = streaming, p, q;
+	enum io_method saved_io = io;
+	char path[] = "/tmp/v4l2_h264_benchXXXXXX", label[32];
+	unsigned long long fragments, edit;
+	long long bytes;
+	long samples;
+#endif
+	unsigned int bench_width = argc > 1 ? strtol(argv[1], NULL, 10) : 1280;
+	unsigned int bench_height = argc > 2 ? strtol(argv[2], NULL, 10) : 720;
+	unsigned int n_frames = argc > 3 ? strtol(argv[3], NULL, 10) : 60;
+	static const enum encode_codec codecs[] = { ENCODE_JPEG, ENCODE_ZSTD };
+	unsigned int size = bench_width * bench_height * 2, i, m, c;
+	enum encode_codec saved_codec = encode_codec;
+	enum delta_filter saved_filter = lossless_filter;
+	int saved_level = lossless_level, saved_quality = encode_quality, ret = 0;
+	unsigned char *frames = malloc((size_t)size * n_frames);
+	unsigned long long out_bytes;
+	struct encode_worker worker;
+	struct encode_job job;
+	double t0, cpu;
+
+	printf("fragmented MP4 muxing of synthetic IPBB streams at 30 fps, each file walked back box by box\n");
+	printf("%-8s %4s %8s %9s %6s %9s %10s %9s %s\n", "samples", "gop", "walked", "fragments", "edit", "seconds",
+		"overhead %", "MB/s", "file");
+	ret |= bench_h264_mux(1, 30);
+	ret |= bench_h264_mux(300, 30);
+	ret |= bench_h264_mux(3000, 300);
+	ret |= bench_h264_mux(2500, 2000);      /* past the 1024 samples a fragment holds: no keyframe to open one */
+
+	memset(&worker, 0, sizeof(worker));
+	memset(&job, 0, sizeof(job));
+	job.raw = malloc(size);
+	job.out_capacity = size;
+	job.out = malloc(job.out_capacity);
+	printf("storage of %ux%u YUYV at 30 fps, noise of sigma 3, %u frames a run\n", bench_width, bench_height,
+		n_frames);
+	printf("%-7s %-17s %7s %10s %9s %10s %9s\n", "scene", "codec", "threads", "KB/frame", "GB/hour", "ratio",
+		"fps/core");
+	for (m = 0; m < 2; ++m) {
+		for (i = 0; i < n_frames; ++i) {
+			synth_fill_clean(frames + (size_t)i * size, bench_width, bench_height, V4L2_PIX_FMT_YUYV,
+				m ? i + 1 : 1);
+			synth_grain(frames + (size_t)i * size, bench_width, bench_height, V4L2_PIX_FMT_YUYV, 3, i);
+		}
+		bench_h264_row(m ? "moving" : "still", "raw", 0, (unsigned long long)size * n_frames, n_frames, size, 0);
+		for (c = 0; c < sizeof(codecs) / sizeof(codecs[0]); ++c) {
+			encode_codec = codecs[c];
+			encode_quality = 85;
+			lossless_level = 1;
+			lossless_filter = DELTA_ROW;
+			encode_worker_release(&worker);
+			out_bytes = 0;
+			cpu = 0;
+			for (i = 0; i < n_frames; ++i) {
+				memcpy(job.raw, frames + (size_t)i * size, size);
+				job.raw_size = size;
+				job.seq = i;
+				job.width = bench_width;
+				job.height = bench_height;
+				job.fourcc = V4L2_PIX_FMT_YUYV;
+				t0 = bench_cpu_now();
+				if (encode_codec == ENCODE_JPEG)
+					jpeg_encode_frame(&worker, &job);
+				else
+					lossless_encode_frame(&worker, &job);
+				cpu += bench_cpu_now() - t0;
+				out_bytes += job.out_size;
+			}
+			bench_h264_row(m ? "moving" : "still", encode_codec == ENCODE_JPEG ? "jpeg:85" : "zstd:1+row", 1,
+				out_bytes, n_frames, size, cpu);
+		}
+		encode_worker_release(&worker);
+#ifdef V4L2_H264
+		h264_config.fps = 30;
+		for (p = 0; p < sizeof(presets) / sizeof(presets[0]); ++p)
+			for (q = 0; q < sizeof(crfs) / sizeof(crfs[0]); ++q) {
+				snprintf(h264_config.preset, sizeof(h264_config.preset), "%s", presets[p]);
+				h264_config.crf = crfs[q];
+				h264_config.kbps = 0;
+				if ((bytes = bench_h264_encode(frames, n_frames, bench_width, bench_height, &job, &cpu)) < 0) {
+					printf("%-7s h264 %s crf %u: MP4 BROKEN\n", m ? "moving" : "still", presets[p], crfs[q]);
+					ret = -1;
+					continue;
+				}
+				snprintf(label, sizeof(label), "h264 %s:%u", presets[p], crfs[q]);
+				bench_h264_row(m ? "moving" : "still", label, h264_stats.threads, bytes, n_frames, size, cpu);
+			}
+#endif
+	}
+#ifndef V4L2_H264
+	printf("built without H.264: make H264=1 to compare x264 presets and CRFs\n");
+#endif
+	printf("fps/core: frames encoded per second of CPU, the whole process for x264 and its frame threads\n");
+	encode_worker_release(&worker);
+	free(job.raw);
+	free(job.out);
+	free(frames);
+	encode_codec = saved_codec;
+	encode_quality = saved_quality;
+	lossless_level = saved_level;
+	lossless_filter = saved_filter;
+
+#ifdef V4L2_H264
+	/* the engine path: the synthetic camera at its own rate through the bounded encode queue into one MP4 */
+	h264_config = saved_h264;
+	h264_config.fps = 30;
+	width = bench_width;
+	height = bench_height;
+	pix_format = V4L2_PIX_FMT_YUYV;
+	if ((file = mkstemp(path)) < 0) {
+		perror("mkstemp");
+		return -1;
+	}
+	unlink(path);
+	encode_codec = ENCODE_H264;
+	openDevice("synth:fps=30");
+	io = IO_METHOD_MMAP;
+	streaming = 0;
+	init_device();
+	if (encoder_init(file, width, height, pix_format, bytesperline, sizeimage) != 0)
+		ret = -1;
+	start_capturing();
+	for (i = 0; i < n_frames; ++i)
+		if (read_frame() < 0)
+			break;
+	stop_capturing();
+	encoder_finish();
+	uninit_device();
+	close_device();
+	samples = bench_mp4_check(file, &fragments, &edit);
+	printf("capture engine, synth:fps=30 %ux%u: %ld of %u frames in %llu fragments, file %s\n", width, height,
+		samples, i, fragments, samples > 0 ? "walks" : "BROKEN");
+	if (samples <= 0 || (unsigned long long)samples != h264_stats.frames)
+		ret = -1;
+	close(file);
+	file = -1;
+	encode_codec = saved_codec;
+	h264_config = saved_h264;
+	width = saved_width;
+	height = saved_height;
+	streaming = saved_streaming;
+	io = saved_io;
+#endif
+
+	return ret;
+}
+
+static const struct bench_case bench_cases[] = {
+	{ "codec", "recording codec speed and ratio per pixel format [width height frames]", bench_codec },
+	{ "metrics", "per-frame instrumentation cost [iterations fps]", bench_metrics },
+	{ "jitter", "DQBUF interval percentiles under CPU load, default vs realtime [fps seconds load-threads device]", bench_jitter },
+	{ "capture", "syscalls and ns per frame of the capture engine on the synthetic device [frames width height]", bench_capture },
+	{ "pipe", "raw/Y4M output to a pipe, write() vs vmsplice [width height frames]", bench_pipe },
+	{ "crc", "CRC32C cost per frame and stuck/truncated frame detection [width height iterations]", bench_crc },
+	{ "recover", "time to recover from a device unplugged mid-capture [fps seconds unplug-every]", bench_recover },
+	{ "policy", "adaptive load shedding against a disk that falls behind [fps seconds slow-MB/s]", bench_policy },
+	{ "render", "frame to texture memory, staging copy vs direct into the locked texture [width height frames]", bench_render },
+	{ "isp", "raw Bayer ISP demosaic quality and per-stage time per thread count [width height frames]", bench_isp },
+	{ "tiles", "tile pool scaling over workers, fused filter chain vs a pass per filter [frames max-workers]", bench_tiles },
+	{ "snapshot", "snapshot latency and preview gap while recording, frame and still [fps seconds interval-ms]", bench_snapshot },
+	{ "loops", "ns per frame of the generic capture loop vs the one built per io, sink and format [frames width height]", bench_loops },
+	{ "pyramid", "1 to 4 downscaled outputs from one frame, shared levels vs a pass per output [width height frames]", bench_pyramid },
+	{ "segment", "recording write latency and disk left, one file vs rotating inline vs the segment thread [frame-KB frames segment-MB fps]", bench_segment },
+	{ "stabilize", "shake left, ms per frame and latency added per lookahead on a shaking synthetic camera [width height frames]", bench_stabilize },
+	{ "autofocus", "sharpness cost per frame, and frames to focus the synthetic lens per lens delay [width height frames]", bench_autofocus },
+	{ "hdr", "exposure fusion ms per merge and clipping left, and groups merged or lost bracketing the synthetic camera [width height frames]", bench_hdr },
+	{ "denoise", "temporal denoise ms per frame per kernel and thread count, and PSNR gained against the clean synthetic scene [width height frames]", bench_denoise },
+	{ "h264", "fragmented MP4 files walked back, and storage per hour and encode fps per core of H.264 presets against raw, JPEG and zstd [width height frames]", bench_h264 },
+	{ NULL, NULL, NULL },
+};
+
+/**
+Function Name : run_benchmarks
+Function Description : Runs the named benchmark (or all of them) without opening a capture device
+Parameter : argc and argv starting at --bench
+Return : 0 for success 1 for unknown benchmark, otherwise the benchmark result
+**/
+int run_benchmarks(int argc, char **argv)
+{
+	const struct bench_case *bc;
+	int ret = 0, found = 0;
+
+	if (argc < 2) {
+		printf("Benchmarks:\n");
+		for (bc = bench_cases; bc->name; ++bc)
+			printf("\t%-10s %s\n", bc->name, bc->desc);
+		return 0;
+	}
+
+	for (bc = bench_cases; bc->name; ++bc) {
+		if (strcmp(argv[1], "all") != 0 && strcmp(argv[1], bc->name) != 0)
+			continue;
+		found = 1;
+		if (bc->run(argc - 1, argv + 1) != 0)
+			ret = -1;
+	}
+	if (!found) {
+		fprintf(stderr, "Unknown benchmark %s\n", argv[1]);
+		return 1;
+	}
+
+	return ret ? 1 : 0;
+}
@@ -0,0 +1,5 @@
+#pragma once
+
+double bench_now(void);
+double bench_cpu_now(void);
+int run_benchmarks(int argc, char **argv);
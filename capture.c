@@ -2,7 +2,45 @@
 #include "header.h"
 //#include "main.h"
 #include "capture.h"
-extern void frame_handler(void *pframe, int length);
+#include "encode.h"
+#include "h264.h"
+#include "metrics.h"
+#include "trace.h"
+#include "rt.h"
+#include "synth.h"
+#include "pipeout.h"
+#include "framecheck.h"
+#include "policy.h"
+#include "hotplug.h"
+#include "snapshot.h"
+#include "texfill.h"
+#include "pyramid.h"
+#include "segment.h"
+#include "stabilize.h"
+#include "autofocus.h"
+#include "hdr.h"
+#include "denoise.h"
+
+int file = -1;
+unsigned int bytesperline, sizeimage;
+struct v4l2cap *capture_ctx;
+static int pipe_sink;   /* raw frames go to a pipe with pipeout instead of write(file) */
+const struct render_target *render_target;
+int capture_specialized = 1;
+
+/* The v4l2_ctrl queries run on the library's device; fd is the same descriptor and kept for those callers */
+int xioctl(int fd, unsigned long request, void *arg)
+{
+        int r = v4l2cap_ioctl(capture_ctx, request, arg);
+
+        (void)fd;
+        if (r < 0) {
+                errno = -r;
+                return -1;
+        }
+
+        return r;
+}
 
 void errno_exit(const char *s)
 {
@@ -11,144 +49,387 @@ void errno_exit(const char *s)
 }
 
 
+/*
+ * read_frame() is built once per i/o method class, sink and (for rendering) pixel format from the
+ * always-inlined read_frame_as(); with those constant the per-frame branches fold away and the texture copy
+ * is inlined into the loop. SINK_ANY and a zero fourcc are the generic build that decides per frame.
+ */
+#define CAPTURE_INLINE static inline __attribute__((always_inline))
+
+enum capture_sink {
+        SINK_RENDER,            /* locked texture of the render target */
+        SINK_WRITE,             /* write(file) */
+        SINK_ENCODE,            /* encoder_submit() */
+        SINK_PIPE,              /* pipeout, which may keep the buffer */
+        SINK_ANY,
+};
+
+static enum capture_sink capture_sink(void)
+{
+        if (streaming == 1)
+                return SINK_RENDER;
+        if (pipe_sink)
+                return SINK_PIPE;
+
+        return encode_codec != ENCODE_NONE ? SINK_ENCODE : SINK_WRITE;
+}
+
+CAPTURE_INLINE void store_frame(enum capture_sink sink, const void *data, unsigned int size)
+{
+        TRACE_BEGIN(ts);
+        if (sink == SINK_ENCODE) {
+                encoder_submit(data, size);
+                TRACE_END(ts, "encoder_submit");
+                return;
+        }
+        if ((segment_enabled ? segment_write(data, size) : write(file, data, size)) < 0)
+                perror("write");
+        TRACE_END(ts, "write");
+}
+
 void process_image(const void *buffer_start, int size)
 {
-        /*int file;
-        time_t rawtime;
-   		struct tm *info;
-   		
-		time( &rawtime );
-   		info = localtime( &rawtime );
-   		
-        char name_buf[100], suffix[10] = ".", width_height_time_str[50];
-        sprintf(width_height_time_str, "_%uX%u_%d_%d_%d_%d_%d_%d", width, height, 1900 + info->tm_year, info->tm_yday, info->tm_hour, info->tm_min, (int)info->tm_sec, (int)start_time.tv_usec/1000); 
-        
-        strcpy(name_buf, outfile);
-        strcat(name_buf, width_height_time_str);
-        strcat(suffix, pix_format_str);
-        strcat(name_buf, suffix);
-		if((file = open(name_buf, O_WRONLY | O_CREAT, 0660)) < 0)
-		{
-			perror("open");
-			exit(1);
-		}*/
-		write(file, buffer_start, size);
-		//close(file);
+        store_frame(encode_codec != ENCODE_NONE ? SINK_ENCODE : SINK_WRITE, buffer_start, size);
+}
 
+CAPTURE_INLINE void render_frame(const struct v4l2cap_frame *frame, unsigned int fourcc)
+{
+        struct frame_view view;
+        unsigned char *pixels;
+        int pitch, written;
+
+        TRACE_BEGIN(t_fill);
+        if (!(pixels = render_target->lock(&pitch)))
+                return;
+        frame_view_init(&view, frame->data, frame->bytesused, frame->sequence, width, height, fourcc, bytesperline);
+        written = texfill_view(pixels, pitch, &view);
+        TRACE_END(t_fill, "texfill");
+        render_target->present(written);
 }
 
-int read_frame()
+/* DQBUF is already timed for the metrics, so its trace event reuses that timestamp */
+static inline void trace_span(unsigned long long t0, const char *name)
 {
-        struct v4l2_buffer buf;
-        unsigned int i;
+#ifdef V4L2_TRACE
+        trace_record(name, t0, trace_now_ns());
+#else
+        (void)t0;
+        (void)name;
+#endif
+}
 
-        switch (io) {
-        case IO_METHOD_READ:
-                if (-1 == read(fd, buffers[0].start, buffers[0].length)) {
-                        switch (errno) {
-                        case EAGAIN:
-                                return 0;
+static void capture_renegotiate(int dir);
+static int capture_snapshot(const struct v4l2cap_frame *frame);
+static void capture_still(void);
 
-                        case EIO:
-                                /* Could ignore EIO, see spec. */
+/* The device went away: drop what it still owned and reopen it in place */
+static int capture_recover(int err)
+{
+        if (pipe_sink)
+                pipeout_forget();
+        if (hotplug_recover(capture_ctx, dev_path, err) < 0)
+                return -1;
+        fd = v4l2cap_fd(capture_ctx);
+        metric_set(MG_BUFFERS_QUEUED, v4l2cap_get_stats(capture_ctx)->queued);
+        autofocus_reset();      /* a reopened camera is back on its own autofocus */
+        hdr_reset();            /* and exposure, the brackets held came from before */
+        denoise_reset();
+
+        return 0;
+}
 
-                                /* fall through */
+CAPTURE_INLINE void account_dequeue(enum io_method io_, const struct v4l2cap_frame *frame, unsigned long long errors)
+{
+        static unsigned int last_sequence;
+        static int have_sequence;
+
+        metric_inc(MC_FRAMES_DEQUEUED, 1 + errors);
+        metric_set(MG_BUFFERS_QUEUED, v4l2cap_get_stats(capture_ctx)->queued);
+        if (errors)
+                metric_inc(MC_FRAMES_ERROR, errors);
+        if (io_ == IO_METHOD_READ)
+                return;
+        if (have_sequence && frame->sequence > last_sequence + 1)
+                metric_inc(MC_FRAMES_DROPPED, frame->sequence - last_sequence - 1);
+        last_sequence = frame->sequence;
+        have_sequence = 1;
+}
 
-                        default:
-                                errno_exit("read");
-                        }
-                }
+/* One frame through the sink; returns 1 when the sink still holds the buffer */
+CAPTURE_INLINE int sink_frame(enum capture_sink sink, const struct v4l2cap_frame *frame, unsigned int fourcc)
+{
+        unsigned long long t0 = metric_now_ns();
+        int ret;
+
+        switch (sink) {
+        case SINK_RENDER:
+                render_frame(frame, fourcc);
+                metric_observe(MH_RENDER, metric_now_ns() - t0);
+                return 0;
+        case SINK_PIPE:
+                ret = pipeout_frame(frame);
+                metric_observe(MH_WRITE, metric_now_ns() - t0);
+                if (ret < 0)
+                        errno_exit("pipe");
+                return ret > 0;
+        default:
+                store_frame(sink, frame->data, frame->bytesused);
+                metric_observe(MH_WRITE, metric_now_ns() - t0);
+                return 0;
+        }
+}
 
-                process_image(buffers[0].start, buffers[0].length);
-                break;
+/* The stabilizer keeps a copy of each frame and hands back the one lookahead frames older, so nothing is held */
+CAPTURE_INLINE int stabilized_sink(enum capture_sink sink, const struct v4l2cap_frame *frame, unsigned int fourcc)
+{
+        struct v4l2cap_frame shown = *frame;
+        struct frame_view in, out;
+        int ret;
+
+        frame_view_init(&in, frame->data, frame->bytesused, frame->sequence, width, height, fourcc, bytesperline);
+        if ((ret = stabilize_frame(&in, &out)) < 0)
+                return sink_frame(sink, frame, fourcc);
+        if (ret == 0)
+                return 0;
+        shown.data = (void *)out.plane[0];
+        shown.bytesused = out.bytesused;
+        shown.sequence = out.sequence;
+        sink_frame(sink, &shown, fourcc);
+
+        return 0;
+}
 
-        case IO_METHOD_MMAP:
-                CLEAR(buf);
+/* The filtered frame is the denoiser's reference, it goes on to the stabilizer or the sink before the next one */
+CAPTURE_INLINE int denoised_sink(enum capture_sink sink, const struct v4l2cap_frame *frame, unsigned int fourcc)
+{
+        struct v4l2cap_frame shown = *frame;
+        struct frame_view in, out;
 
-                buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-                buf.memory = V4L2_MEMORY_MMAP;
+        frame_view_init(&in, frame->data, frame->bytesused, frame->sequence, width, height, fourcc, bytesperline);
+        if (denoise_frame(&in, &out) > 0) {
+                shown.data = (void *)out.plane[0];
+                shown.bytesused = out.bytesused;
+        }
 
-                if (-1 == ioctl(fd, VIDIOC_DQBUF, &buf)) {
-                        switch (errno) {
-                        case EAGAIN:
-                                return 0;
+        return stabilize_enabled ? stabilized_sink(sink, &shown, fourcc) : sink_frame(sink, &shown, fourcc);
+}
 
-                        case EIO:
-                                /* Could ignore EIO, see spec. */
+/* Brackets are kept until their group is merged; the merged frame goes on to be denoised, stabilized or sunk */
+CAPTURE_INLINE int hdr_sink(enum capture_sink sink, const struct v4l2cap_frame *frame, unsigned int fourcc)
+{
+        struct v4l2cap_frame shown = *frame;
+        struct frame_view in, out;
+        int ret;
+
+        frame_view_init(&in, frame->data, frame->bytesused, frame->sequence, width, height, fourcc, bytesperline);
+        if ((ret = hdr_frame(&in, &out)) == 0)
+                return 0;
+        if (ret > 0) {
+                shown.data = (void *)out.plane[0];
+                shown.bytesused = out.bytesused;
+                shown.sequence = out.sequence;
+        }
 
-                                /* fall through */
+        return denoise_enabled ? denoised_sink(sink, &shown, fourcc) :
+                stabilize_enabled ? stabilized_sink(sink, &shown, fourcc) : sink_frame(sink, &shown, fourcc);
+}
 
-                        default:
-                                errno_exit("VIDIOC_DQBUF");
-                        }
-                }
+/* The last HDR merge and what the stabilizer still holds go out at the end of a recording */
+static void stabilized_flush(void)
+{
+        struct v4l2cap_frame shown;
+        struct frame_view out;
+
+        CLEAR(shown);
+        if (hdr_enabled && hdr_flush(&out)) {
+                shown.data = (void *)out.plane[0];
+                shown.bytesused = out.bytesused;
+                shown.sequence = out.sequence;
+                if (denoise_enabled)
+                        denoised_sink(capture_sink(), &shown, out.fourcc);
+                else if (stabilize_enabled)
+                        stabilized_sink(capture_sink(), &shown, out.fourcc);
+                else
+                        sink_frame(capture_sink(), &shown, out.fourcc);
+        }
+        while (stabilize_enabled && stabilize_flush(&out)) {
+                shown.data = (void *)out.plane[0];
+                shown.bytesused = out.bytesused;
+                shown.sequence = out.sequence;
+                sink_frame(capture_sink(), &shown, out.fourcc);
+        }
+}
 
-                assert(buf.index < n_buffers);
-                
-                if(buf.flags & 0x00040)
-                {
-                	if (-1 == ioctl(fd, VIDIOC_QBUF, &buf))
-                        errno_exit("VIDIOC_QBUF");
-                    //printf("\nFrame crashed");
-                    return read_frame(); 
+CAPTURE_INLINE int read_frame_as(enum io_method io_, enum capture_sink sink_, unsigned int fourcc_)
+{
+        const struct v4l2cap_stats *stats = v4l2cap_get_stats(capture_ctx);
+        const char *dq_name = io_ == IO_METHOD_READ ? "read" : "VIDIOC_DQBUF";
+        enum capture_sink sink = sink_ == SINK_ANY ? capture_sink() : sink_;
+        unsigned int fourcc = fourcc_ ? fourcc_ : pix_format;
+        unsigned long long t0, errors = stats->errors;
+        struct v4l2cap_frame frame;
+        unsigned int queued;
+        int ret, held = 0, still = 0;
+
+        t0 = metric_now_ns();
+        ret = v4l2cap_dequeue(capture_ctx, &frame);
+        if (ret == -EAGAIN)
+                return 0;
+        if (ret < 0) {
+                if (stats->error_run >= V4L2CAP_MAX_ERROR_RUN) {
+                        fprintf(stderr, "%s: %u corrupted frames in a row\n", dev_path, stats->error_run);
+                        return -1;
                 }
-				
-				if(streaming == 1)	//Streaming
-					frame_handler(buffers[buf.index].start, buf.bytesused);
-				else //Capturing	
-                	process_image(buffers[buf.index].start, buf.bytesused);
-
-                if (-1 == ioctl(fd, VIDIOC_QBUF, &buf))
-                        errno_exit("VIDIOC_QBUF");
-                break;
+                if (hotplug_lost(ret))
+                        return capture_recover(ret);
+                errno = -ret;
+                errno_exit(dq_name);
+        }
+        hotplug_frame();
+        metric_observe(MH_DQBUF_WAIT, metric_now_ns() - t0);
+        trace_span(t0, dq_name);
+        account_dequeue(io_, &frame, stats->errors - errors);
+        snapshot_tick();
+        if (atomic_load_explicit(&snapshot_pending, memory_order_relaxed))
+                still = capture_snapshot(&frame);
+        if (crc_mode != CRC_OFF) {
+                TRACE_BEGIN(tc);
+                framecheck_frame(&frame, NULL);
+                TRACE_END(tc, "crc32c");
+        }
+        if (pyramid_outputs || autofocus_enabled) {
+                struct frame_view view;
+
+                frame_view_init(&view, frame.data, frame.bytesused, frame.sequence, width, height, fourcc,
+                        bytesperline);
+                if (pyramid_outputs)
+                        pyramid_frame(&view);
+                if (autofocus_enabled)
+                        autofocus_frame(&view);
+        }
 
-        case IO_METHOD_USERPTR:
-                CLEAR(buf);
+        queued = stats->queued;
+        t0 = metric_now_ns();
+        if (!policy_skip())     /* a shed frame's buffer goes straight back */
+                held = hdr_enabled ? hdr_sink(sink, &frame, fourcc) :
+                        denoise_enabled ? denoised_sink(sink, &frame, fourcc) :
+                        stabilize_enabled ? stabilized_sink(sink, &frame, fourcc) : sink_frame(sink, &frame, fourcc);
+        if (policy_enabled)
+                policy_observe(metric_now_ns() - t0, queued, v4l2cap_buffer_count(capture_ctx));
+        if (held)
+                return 1;               /* the pipe still references the buffer, release_drained() requeues it */
+
+        TRACE_BEGIN(ts);
+        ret = v4l2cap_release(capture_ctx, &frame);
+        TRACE_END(ts, "VIDIOC_QBUF");
+        if (ret < 0 && hotplug_lost(ret))
+                return capture_recover(ret) < 0 ? -1 : 1;
+        if (ret < 0) {
+                errno = -ret;
+                errno_exit("VIDIOC_QBUF");
+        }
+        metric_set(MG_BUFFERS_QUEUED, stats->queued);
+        if ((ret = policy_poll()) != 0)
+                capture_renegotiate(ret);
+        if (still)
+                capture_still();
 
-                buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-                buf.memory = V4L2_MEMORY_USERPTR;
+        return 1;
+}
 
-                if (-1 == ioctl(fd, VIDIOC_DQBUF, &buf)) {
-                        switch (errno) {
-                        case EAGAIN:
-                                return 0;
+typedef int (*read_frame_fn)(void);
 
-                        case EIO:
-                                /* Could ignore EIO, see spec. */
+static int read_frame_generic(void)
+{
+        return read_frame_as(io, SINK_ANY, 0);
+}
 
-                                /* fall through */
+#define FMT_YUYV V4L2_PIX_FMT_YUYV
+#define FMT_NV12 V4L2_PIX_FMT_NV12
+#define FMT_GREY V4L2_PIX_FMT_GREY
+#define FMT_ANY 0
+
+/* mmap and userptr only differ inside the library, so MMAP stands for both; a fourcc of 0 takes any format */
+#define READ_FRAME_LOOPS(X) \
+        X(READ, RENDER, YUYV) X(READ, RENDER, NV12) X(READ, RENDER, GREY) X(READ, RENDER, ANY) \
+        X(READ, WRITE, ANY) X(READ, ENCODE, ANY) X(READ, PIPE, ANY) \
+        X(MMAP, RENDER, YUYV) X(MMAP, RENDER, NV12) X(MMAP, RENDER, GREY) X(MMAP, RENDER, ANY) \
+        X(MMAP, WRITE, ANY) X(MMAP, ENCODE, ANY) X(MMAP, PIPE, ANY)
+
+#define READ_FRAME_DEFINE(io_, sink_, fmt_) \
+        static int read_frame_##io_##_##sink_##_##fmt_(void) \
+        { \
+                return read_frame_as(IO_METHOD_##io_, SINK_##sink_, FMT_##fmt_); \
+        }
+#define READ_FRAME_ENTRY(io_, sink_, fmt_) \
+        { IO_METHOD_##io_, SINK_##sink_, FMT_##fmt_, read_frame_##io_##_##sink_##_##fmt_ },
+
+READ_FRAME_LOOPS(READ_FRAME_DEFINE)
+
+static const struct {
+        enum io_method io;
+        enum capture_sink sink;
+        unsigned int fourcc;
+        read_frame_fn fn;
+} read_frame_loops[] = {
+        READ_FRAME_LOOPS(READ_FRAME_ENTRY)
+};
+
+static read_frame_fn read_frame_loop = read_frame_generic;
+
+/**
+Function Name : capture_specialize
+Function Description : Picks the read_frame() build for the current i/o method, sink and pixel format, or the
+                       generic one when capture_specialized is off or there is none. Called whenever one of
+                       them may have changed: after init_device() and once the sink is known
+Parameter : void
+Return : void
+**/
+void capture_specialize(void)
+{
+        enum io_method io_class = io == IO_METHOD_READ ? IO_METHOD_READ : IO_METHOD_MMAP;
+        enum capture_sink sink = capture_sink();
+        unsigned int i;
 
-                        default:
-                                errno_exit("VIDIOC_DQBUF");
-                        }
+        read_frame_loop = read_frame_generic;
+        if (!capture_specialized)
+                return;
+        for (i = 0; i < sizeof(read_frame_loops) / sizeof(read_frame_loops[0]); ++i)
+                if (read_frame_loops[i].io == io_class && read_frame_loops[i].sink == sink &&
+                    (!read_frame_loops[i].fourcc || read_frame_loops[i].fourcc == pix_format)) {
+                        read_frame_loop = read_frame_loops[i].fn;
+                        return;
                 }
+}
 
-                for (i = 0; i < n_buffers; ++i)
-                        if (buf.m.userptr == (unsigned long)buffers[i].start
-                            && buf.length == buffers[i].length)
-                                break;
-
-                assert(i < n_buffers);
-                
-                if(buf.flags & 0x00040)
-                {
-                	if (-1 == ioctl(fd, VIDIOC_QBUF, &buf))
-                        errno_exit("VIDIOC_QBUF");
-                    //printf("\nFrame crashed");
-                    return read_frame(); 
-                }
+int read_frame()
+{
+        return read_frame_loop();
+}
+static void release_drained(const struct v4l2cap_frame *frame, void *user)
+{
+        int ret = v4l2cap_release(capture_ctx, frame);
+
+        (void)user;
+        if (ret < 0 && hotplug_lost(ret))
+                return;         /* the next dequeue finds the device gone and recovers */
+        if (ret < 0) {
+                errno = -ret;
+                errno_exit("VIDIOC_QBUF");
+        }
+        metric_set(MG_BUFFERS_QUEUED, v4l2cap_get_stats(capture_ctx)->queued);
+}
 
-                if(streaming == 1)	//Streaming
-					frame_handler(buffers[buf.index].start, buf.bytesused);
-				else //Capturing	
-                	process_image(buffers[buf.index].start, buf.bytesused);
+static unsigned int capture_fps(void)
+{
+        struct v4l2_streamparm parm;
 
-                if (-1 == ioctl(fd, VIDIOC_QBUF, &buf))
-                        errno_exit("VIDIOC_QBUF");
-                break;
-        }
+        CLEAR(parm);
+        parm.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        if (-1 == xioctl(fd, VIDIOC_G_PARM, &parm) || !parm.parm.capture.timeperframe.numerator)
+                return 0;
 
-        return 1;
+        return parm.parm.capture.timeperframe.denominator / parm.parm.capture.timeperframe.numerator;
 }
 
 void mainloop(void)
@@ -162,359 +443,408 @@ void mainloop(void)
     char name_buf[100], suffix[10] = ".", width_height_time_str[50];
     sprintf(width_height_time_str, "_%uX%u_%d_%d_%d_%d_%d_%d", width, height, 1900 + info->tm_year, info->tm_yday, info->tm_hour, info->tm_min, (int)info->tm_sec, (int)start_time.tv_usec/1000); 
     
-    strcpy(name_buf, outfile);
-    strcat(name_buf, width_height_time_str);
-    if(strcmp(pix_format_str, "MJPG") == 0 && frame_count > 1)
-    	strcat(suffix, "mpg");
-    else if(strcmp(pix_format_str, "MJPG") == 0 && frame_count == 1)
-    	strcat(suffix, "jpg");
-   	else
-    	strcat(suffix, pix_format_str);
-    strcat(name_buf, suffix);
-	if((file = open(name_buf, O_WRONLY | O_CREAT, 0660)) < 0)
-	{
-		perror("open");
-		exit(1);
-	}
+    pipe_sink = 0;
+    if((file = pipeout_target(outfile)) >= 0)
+    {
+    	/* stdout or a FIFO: no file name to build, raw frames are spliced into the pipe */
+    	pipe_sink = encode_codec == ENCODE_NONE;
+    	if(!pipe_sink && pipe_framing == PIPE_Y4M)
+    		fprintf(stderr, "Y4M framing is only used for raw frames\n");
+    	if(segment_enabled)
+    		fprintf(stderr, "Segments are only written to files, streaming unsplit\n");
+    	segment_enabled = 0;
+    	if(pipe_sink && stabilize_enabled)
+    		fprintf(stderr, "Frames spliced into a pipe are not stabilized\n");
+    	stabilize_enabled &= !pipe_sink;
+    	if(pipe_sink && hdr_enabled)
+    		fprintf(stderr, "Frames spliced into a pipe are not merged into HDR\n");
+    	hdr_enabled &= !pipe_sink;
+    	if(pipe_sink && denoise_enabled)
+    		fprintf(stderr, "Frames spliced into a pipe are not denoised\n");
+    	denoise_enabled &= !pipe_sink;
+    }
+    else
+    {
+	    if(segment_enabled && encode_codec == ENCODE_H264)
+	    	fprintf(stderr, "H.264 is recorded into one MP4, not segments\n");
+	    segment_enabled &= encode_codec != ENCODE_H264;
+	    strcpy(name_buf, outfile);
+	    strcat(name_buf, width_height_time_str);
+	    if(encode_codec == ENCODE_JPEG)
+	    	strcat(suffix, frame_count > 1 ? "mpg" : "jpg");
+	    else if(encode_codec == ENCODE_LZ4 || encode_codec == ENCODE_ZSTD)
+	    	strcat(suffix, "v4lz");
+	    else if(encode_codec == ENCODE_H264)
+	    	strcat(suffix, "mp4");
+	    else if(strcmp(pix_format_str, "MJPG") == 0 && frame_count > 1)
+	    	strcat(suffix, "mpg");
+	    else if(strcmp(pix_format_str, "MJPG") == 0 && frame_count == 1)
+	    	strcat(suffix, "jpg");
+	   	else
+	    	strcat(suffix, pix_format_str);
+	    if(segment_enabled)
+	    {
+	    	/* <name>_00000<suffix>, <name>_00001<suffix>, ... each allocated before it is written */
+	    	if((file = segment_open(name_buf, suffix)) < 0)
+	    		exit(1);
+	    	strcat(name_buf, suffix);
+	    }
+	    else
+	    {
+		    strcat(name_buf, suffix);
+			if((file = open(name_buf, O_WRONLY | O_CREAT, 0660)) < 0)
+			{
+				perror("open");
+				exit(1);
+			}
+		}
+		if(framecheck_open_sidecar(name_buf) != 0)
+			exit(EXIT_FAILURE);
+    }
+	h264_config.fps = capture_fps();
+	if(encode_codec != ENCODE_NONE && encoder_init(file, width, height, pix_format, bytesperline, sizeimage) != 0)
+		exit(EXIT_FAILURE);
+	/* all but one driver buffer may sit in the pipe; read() has a single buffer, so it is always copied */
+	if(pipe_sink && pipeout_init(file, width, height, pix_format, capture_fps(),
+			io == IO_METHOD_READ ? 0 : v4l2cap_buffer_count(capture_ctx) - 1, release_drained, NULL) != 0)
+		exit(EXIT_FAILURE);
 	
     unsigned int count;
-    struct v4l2_streamparm sparm;
-    sparm.type = type;
-    sparm.parm.capture.capability |= V4L2_CAP_TIMEPERFRAME;
-    
+    int ret;
+    struct timespec loop_start, loop_end;
+
     count = frame_count;
-	
-	printf("\nRemaincount Frame interval(ms) - Frames per second(fps)\n");
-	gettimeofday(&start_time, NULL);
-    while (count-- > 0) 
+	TRACE_THREAD("capture");
+	rt_apply(RT_CAPTURE);
+	capture_policy_init();
+	const struct v4l2cap_stats *stats = v4l2cap_get_stats(capture_ctx);
+
+	capture_specialize();
+	v4l2cap_reset_stats(capture_ctx);
+
+	/* Nothing but DQBUF, the sink and QBUF runs per frame; the timing is reported once at the end */
+	printf("\nCapturing %u frames\n", frame_count);
+	clock_gettime(CLOCK_MONOTONIC, &loop_start);
+    while (count > 0) 
     {
-	
-    	read_frame();
-    	
-    	if (-1 == ioctl(fd, VIDIOC_G_PARM, &sparm))
-        	errno_exit("VIDIOC_G_PARM");
-     
-        //printf("\r%d \t\t\t%.2fms \t%.2ffps", count, (sparm.parm.capture.timeperframe.numerator*1.0)/(sparm.parm.capture.timeperframe.denominator) * 1000, (sparm.parm.capture.timeperframe.denominator)/(sparm.parm.capture.timeperframe.numerator*1.0));
-        fflush(stdout);
-		
-		gettimeofday(&end_time, NULL);
-
-		elapsed_time = (end_time.tv_sec - start_time.tv_sec) * 1000.0;      // sec to ms
-		elapsed_time += (end_time.tv_usec - start_time.tv_usec) / 1000.0;   // us to ms
-
-		printf("\r%d \t\t%.2lf - %.1lf", count, elapsed_time, 1000/elapsed_time);
-	
-		start_time = end_time;
-
+    	/* 0 is a dequeue that delivered nothing, e.g. the one that found the device gone */
+    	if ((ret = read_frame()) < 0)
+    		break;
+    	count -= ret;
+    	trace_poll();
     }
+	clock_gettime(CLOCK_MONOTONIC, &loop_end);
+	stabilized_flush();
+
+	elapsed_time = (loop_end.tv_sec - loop_start.tv_sec) * 1000.0;      // sec to ms
+	elapsed_time += (loop_end.tv_nsec - loop_start.tv_nsec) / 1000000.0;   // ns to ms
+	printf("%llu frames in %.2lf ms - %.1lf fps, %llu corrupted frames requeued (longest run %u)",
+		stats->frames, elapsed_time, stats->frames * 1000 / elapsed_time,
+		stats->errors, stats->longest_error_run);
 	printf("\n");
-	close(file);
+	policy_finish();
+	hotplug_finish();
+	if(pipe_sink)
+		pipeout_finish();
+	framecheck_finish();
+	encoder_finish();
+	snapshot_finish();
+	pyramid_finish();
+	stabilize_finish();
+	autofocus_finish();
+	hdr_finish();
+	denoise_finish();
+	if(segment_enabled)
+		segment_finish();       /* the segments own their descriptors, file was only the first */
+	else
+		close(file);
 }
 
-void stop_capturing(void)
+static void capture_check(int ret, const char *what)
 {
-        enum v4l2_buf_type type;
-
-        switch (io) {
-        case IO_METHOD_READ:
-                /* Nothing to do. */
-                break;
-
-        case IO_METHOD_MMAP:
-        case IO_METHOD_USERPTR:
-                type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-                if (-1 == ioctl(fd, VIDIOC_STREAMOFF, &type))
-                        errno_exit("VIDIOC_STREAMOFF");
-                break;
+        if (ret < 0) {
+                errno = -ret;
+                errno_exit(what);
         }
 }
 
-void start_capturing(void)
+void stop_capturing(void)
 {
-        unsigned int i;
-        enum v4l2_buf_type type;
-
-        switch (io) {
-        case IO_METHOD_READ:
-                /* Nothing to do. */
-                break;
-
-        case IO_METHOD_MMAP:
-                for (i = 0; i < n_buffers; ++i) {
-                        struct v4l2_buffer buf;
-
-                        CLEAR(buf);
-                        buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-                        buf.memory = V4L2_MEMORY_MMAP;
-                        buf.index = i;
+        capture_check(v4l2cap_stop(capture_ctx), "VIDIOC_STREAMOFF");
+        metric_set(MG_BUFFERS_QUEUED, 0);
+}
 
-                        if (-1 == ioctl(fd, VIDIOC_QBUF, &buf))
-                                errno_exit("VIDIOC_QBUF");
-                }
-                type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-                if (-1 == ioctl(fd, VIDIOC_STREAMON, &type))
-                        errno_exit("VIDIOC_STREAMON");
-                break;
-
-        case IO_METHOD_USERPTR:
-                for (i = 0; i < n_buffers; ++i) {
-                        struct v4l2_buffer buf;
-
-                        CLEAR(buf);
-                        buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-                        buf.memory = V4L2_MEMORY_USERPTR;
-                        buf.index = i;
-                        buf.m.userptr = (unsigned long)buffers[i].start;
-                        buf.length = buffers[i].length;
-
-                        if (-1 == ioctl(fd, VIDIOC_QBUF, &buf))
-                                errno_exit("VIDIOC_QBUF");
-                }
-                type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-                if (-1 == ioctl(fd, VIDIOC_STREAMON, &type))
-                        errno_exit("VIDIOC_STREAMON");
-                break;
-        }
+void start_capturing(void)
+{
+        capture_check(v4l2cap_start(capture_ctx), "VIDIOC_STREAMON");
+        metric_set(MG_BUFFERS_QUEUED, v4l2cap_get_stats(capture_ctx)->queued);
 }
 
 void uninit_device(void)
 {
-        unsigned int i;
-
-        switch (io) {
-        case IO_METHOD_READ:
-                free(buffers[0].start);
-                break;
-
-        case IO_METHOD_MMAP:
-                for (i = 0; i < n_buffers; ++i)
-                        if (-1 == munmap(buffers[i].start, buffers[i].length))
-                                errno_exit("munmap");
-                break;
-
-        case IO_METHOD_USERPTR:
-                for (i = 0; i < n_buffers; ++i)
-                        free(buffers[i].start);
-                break;
-        }
-
-        free(buffers);
+        capture_check(v4l2cap_unconfigure(capture_ctx), "VIDIOC_REQBUFS");
 }
 
-void init_read(unsigned int buffer_size)
+void init_device(void)
 {
-        buffers = calloc(1, sizeof(*buffers));
-
-        if (!buffers) {
-                fprintf(stderr, "Out of memory\\n");
-                exit(EXIT_FAILURE);
-        }
-
-        buffers[0].length = buffer_size;
-        buffers[0].start = malloc(buffer_size);
-
-        if (!buffers[0].start) {
-                fprintf(stderr, "Out of memory\\n");
+        struct v4l2cap_config config;
+        int ret;
+
+        CLEAR(config);
+        config.width = width;
+        config.height = height;
+        config.pixelformat = pix_format;
+        config.io = (enum v4l2cap_io)io;
+
+        ret = v4l2cap_configure(capture_ctx, &config);
+        if (ret == -EINVAL) {
+                fprintf(stderr, "%s cannot capture %s with %s i/o\n", dev_path, pix_format_str,
+                        io == IO_METHOD_READ ? "read" : io == IO_METHOD_MMAP ? "memory mapped" : "user pointer");
                 exit(EXIT_FAILURE);
         }
+        capture_check(ret, "init_device");
+
+        width = config.width;
+        height = config.height;
+        bytesperline = config.bytesperline;
+        sizeimage = config.sizeimage;
+        framecheck_init(config.sizeimage, pix_format);
+        capture_specialize();
 }
 
-void init_mmap(void)
+/* Largest size the device lists for the current format below the current one, half the size on a stepwise range */
+static int smaller_size(unsigned int *w, unsigned int *h)
 {
-        struct v4l2_requestbuffers req;
-
-        CLEAR(req);
-
-        req.count = 4;
-        req.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-        req.memory = V4L2_MEMORY_MMAP;
-
-        if (-1 == ioctl(fd, VIDIOC_REQBUFS, &req)) {
-                if (EINVAL == errno) {
-                        fprintf(stderr, "%s does not support "
-                                 "memory mappingn", dev_path);
-                        exit(EXIT_FAILURE);
-                } else {
-                        errno_exit("VIDIOC_REQBUFS");
+        struct v4l2_frmsizeenum fs;
+        unsigned int best_w = 0, best_h = 0, step;
+
+        CLEAR(fs);
+        fs.pixel_format = pix_format;
+        for (fs.index = 0; -1 != xioctl(fd, VIDIOC_ENUM_FRAMESIZES, &fs); fs.index++) {
+                if (fs.type != V4L2_FRMSIZE_TYPE_DISCRETE) {
+                        step = fs.stepwise.step_width ? fs.stepwise.step_width : 1;
+                        best_w = width / 2 > fs.stepwise.min_width ? fs.stepwise.min_width +
+                                (width / 2 - fs.stepwise.min_width) / step * step : fs.stepwise.min_width;
+                        step = fs.stepwise.step_height ? fs.stepwise.step_height : 1;
+                        best_h = height / 2 > fs.stepwise.min_height ? fs.stepwise.min_height +
+                                (height / 2 - fs.stepwise.min_height) / step * step : fs.stepwise.min_height;
+                        break;
+                }
+                if (fs.discrete.width * fs.discrete.height < width * height &&
+                    fs.discrete.width * fs.discrete.height > best_w * best_h) {
+                        best_w = fs.discrete.width;
+                        best_h = fs.discrete.height;
                 }
         }
+        if (!best_w || best_w * best_h >= width * height)
+                return 0;
+        *w = best_w;
+        *h = best_h;
 
-        if (req.count < 2) {
-                fprintf(stderr, "Insufficient buffer memory on %s\\n",
-                         dev_path);
-                exit(EXIT_FAILURE);
-        }
+        return 1;
+}
 
-        buffers = calloc(req.count, sizeof(*buffers));
+/* MJPG only helps a recording whose container carries the format per frame, and the device must offer it */
+static int mjpg_usable(void)
+{
+        struct v4l2_fmtdesc desc;
+
+        if (!policy_config.allow_mjpg || pix_format == V4L2_PIX_FMT_MJPEG ||
+            (encode_codec != ENCODE_LZ4 && encode_codec != ENCODE_ZSTD))
+                return 0;
+        CLEAR(desc);
+        desc.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        for (desc.index = 0; -1 != xioctl(fd, VIDIOC_ENUM_FMT, &desc); desc.index++)
+                if (desc.pixelformat == V4L2_PIX_FMT_MJPEG)
+                        return 1;
+
+        return 0;
+}
 
-        if (!buffers) {
-                fprintf(stderr, "Out of memory\\n");
-                exit(EXIT_FAILURE);
+/* Largest size the device lists for the current format, the maximum of a stepwise range */
+static int largest_size(unsigned int *w, unsigned int *h)
+{
+        struct v4l2_frmsizeenum fs;
+        unsigned int best_w = 0, best_h = 0;
+
+        CLEAR(fs);
+        fs.pixel_format = pix_format;
+        for (fs.index = 0; -1 != xioctl(fd, VIDIOC_ENUM_FRAMESIZES, &fs); fs.index++) {
+                if (fs.type != V4L2_FRMSIZE_TYPE_DISCRETE) {
+                        best_w = fs.stepwise.max_width;
+                        best_h = fs.stepwise.max_height;
+                        break;
+                }
+                if (fs.discrete.width * fs.discrete.height > best_w * best_h) {
+                        best_w = fs.discrete.width;
+                        best_h = fs.discrete.height;
+                }
         }
+        if (best_w * best_h <= width * height)
+                return 0;
+        *w = best_w;
+        *h = best_h;
 
-        for (n_buffers = 0; n_buffers < req.count; ++n_buffers) {
-                struct v4l2_buffer buf;
-
-                CLEAR(buf);
-
-                buf.type        = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-                buf.memory      = V4L2_MEMORY_MMAP;
-                buf.index       = n_buffers;
-
-                if (-1 == ioctl(fd, VIDIOC_QUERYBUF, &buf))
-                        errno_exit("VIDIOC_QUERYBUF");
-
-                buffers[n_buffers].length = buf.length;
-                buffers[n_buffers].start =
-                        mmap(NULL /* start anywhere */,
-                              buf.length,
-                              PROT_READ | PROT_WRITE /* required */,
-                              MAP_SHARED /* recommended */,
-                              fd, buf.m.offset);
-
-                if (MAP_FAILED == buffers[n_buffers].start)
-                        errno_exit("mmap");
-        }
+        return 1;
 }
 
-void init_userp(unsigned int buffer_size)
+static void capture_reconfigure(unsigned int w, unsigned int h, unsigned int fourcc, char *fourcc_str)
 {
-        struct v4l2_requestbuffers req;
-
-        CLEAR(req);
+        stop_capturing();
+        uninit_device();
+        width = w;
+        height = h;
+        pix_format = fourcc;
+        pix_format_str = fourcc_str;
+        init_device();
+        start_capturing();
+}
 
-        req.count  = 4;
-        req.type   = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-        req.memory = V4L2_MEMORY_USERPTR;
+static unsigned int base_width, base_height, base_format;
+static char *base_format_str;
 
-        if (-1 == ioctl(fd, VIDIOC_REQBUFS, &req)) {
-                if (EINVAL == errno) {
-                        fprintf(stderr, "%s does not support "
-                                 "user pointer i/on", dev_path);
-                        exit(EXIT_FAILURE);
-                } else {
-                        errno_exit("VIDIOC_REQBUFS");
+/*
+ * Carries out a policy step between frames: down to the next smaller size (or MJPG when there is none and
+ * it is allowed), or back to the format the run started with
+ */
+static void capture_renegotiate(int dir)
+{
+        unsigned int old_width = width, old_height = height, old_format = pix_format;
+        unsigned int w = width, h = height, fourcc = pix_format;
+        char *old_format_str = pix_format_str, *fourcc_str = pix_format_str;
+        unsigned long long t0 = metric_now_ns();
+
+        if (dir > 0) {
+                if (!base_width) {
+                        base_width = width;
+                        base_height = height;
+                        base_format = pix_format;
+                        base_format_str = pix_format_str;
                 }
+                if (!smaller_size(&w, &h)) {
+                        if (!mjpg_usable()) {
+                                policy_renegotiated(0);
+                                return;
+                        }
+                        fourcc = V4L2_PIX_FMT_MJPEG;
+                        fourcc_str = "MJPG";
+                }
+        } else {
+                w = base_width;
+                h = base_height;
+                fourcc = base_format;
+                fourcc_str = base_format_str;
+                base_width = 0;
         }
 
-        buffers = calloc(4, sizeof(*buffers));
-
-        if (!buffers) {
-                fprintf(stderr, "Out of memory\\n");
-                exit(EXIT_FAILURE);
-        }
-
-        for (n_buffers = 0; n_buffers < 4; ++n_buffers) {
-                buffers[n_buffers].length = buffer_size;
-                buffers[n_buffers].start = malloc(buffer_size);
-
-                if (!buffers[n_buffers].start) {
-                        fprintf(stderr, "Out of memory\\n");
-                        exit(EXIT_FAILURE);
-                }
+        capture_reconfigure(w, h, fourcc, fourcc_str);
+        if (encode_codec != ENCODE_NONE && encoder_set_format(width, height, pix_format, bytesperline, sizeimage) != 0) {
+                fprintf(stderr, "policy: the encoder cannot take %ux%u %s, staying at %ux%u %s\n", width, height,
+                        pix_format_str, old_width, old_height, old_format_str);
+                capture_reconfigure(old_width, old_height, old_format, old_format_str);
+                policy_renegotiated(0);
+                return;
         }
+        fprintf(stderr, "policy: renegotiated %ux%u %s -> %ux%u %s in %.1f ms\n", old_width, old_height,
+                old_format_str, width, height, pix_format_str, (metric_now_ns() - t0) / 1e6);
+        policy_renegotiated(1);
 }
 
-void init_device(void)
+static unsigned int still_width, still_height;
+
+/*
+ * Serves a snapshot request with this frame, or returns 1 when a still at a larger size was asked for; that
+ * one is taken once the frame is back with the driver. A pipe still holds buffers, so it gets this frame
+ */
+static int capture_snapshot(const struct v4l2cap_frame *frame)
 {
-        struct v4l2_capability cap;
-        struct v4l2_format fmt;
+        unsigned int kind = snapshot_take();
 
-        if (-1 == ioctl(fd, VIDIOC_QUERYCAP, &cap)) {
-                if (EINVAL == errno) {
-                        fprintf(stderr, "%s is no V4L2 device\\n",
-                                 dev_path);
-                        exit(EXIT_FAILURE);
-                } else {
-                        errno_exit("VIDIOC_QUERYCAP");
-                }
+        if (kind & SNAPSHOT_STILL) {
+                if (!pipe_sink && largest_size(&still_width, &still_height))
+                        return 1;
+                if (pipe_sink)
+                        kind = SNAPSHOT_FRAME;
         }
+        snapshot_frame(frame->data, frame->bytesused, width, height, bytesperline, pix_format, frame->sequence,
+                kind);
 
-        if (!(cap.capabilities & V4L2_CAP_VIDEO_CAPTURE)) {
-                fprintf(stderr, "%s is no video capture device\\n",
-                         dev_path);
-                exit(EXIT_FAILURE);
-        }
+        return 0;
+}
 
-        switch (io) {
-        case IO_METHOD_READ:
-                if (!(cap.capabilities & V4L2_CAP_READWRITE)) {
-                        fprintf(stderr, "%s does not support read i/o\\n",
-                                 dev_path);
-                        exit(EXIT_FAILURE);
-                }
-                break;
-
-        case IO_METHOD_MMAP:
-        case IO_METHOD_USERPTR:
-                if (!(cap.capabilities & V4L2_CAP_STREAMING)) {
-                        fprintf(stderr, "%s does not support streaming i/o\\n",
-                                 dev_path);
-                        exit(EXIT_FAILURE);
-                }
-                break;
-        }
-        
-        struct v4l2_fmtdesc fmtdesc;
-        
-        fmtdesc.index = 0;
-		fmtdesc.type = type;
-        
-        while (ioctl(fd, VIDIOC_ENUM_FMT, &fmtdesc) >= 0)
-        {
-        	if(pix_format != fmtdesc.pixelformat)
-        		fmtdesc.index++;
-        	else
-        		break;
-        }
-        
-        if(ioctl(fd, VIDIOC_ENUM_FMT, &fmtdesc) != 0)
-        {
-        	printf("Format not supported\n");
-        	errno_exit("VIDIOC_ENUM_FMT");
+/*
+ * A still between two preview frames: switch to the largest size, keep the first frame after the settle
+ * frames and go back to the preview format before the sink sees another frame
+ */
+static void capture_still(void)
+{
+        unsigned int preview_width = width, preview_height = height, tries, n = 0;
+        unsigned long long t0 = metric_now_ns();
+        struct v4l2cap_frame frame;
+        int ret = 0;
+
+        capture_reconfigure(still_width, still_height, pix_format, pix_format_str);
+        for (tries = 0; tries < snapshot_config.settle + 8 && n <= snapshot_config.settle; ++tries) {
+                if ((ret = v4l2cap_dequeue(capture_ctx, &frame)) == -EAGAIN)
+                        continue;
+                if (ret < 0)
+                        break;
+                if (n++ >= snapshot_config.settle)
+                        /* init_device() took bytesperline from the still size's format */
+                        snapshot_frame(frame.data, frame.bytesused, width, height, bytesperline, pix_format,
+                                frame.sequence, SNAPSHOT_STILL);
+                if ((ret = v4l2cap_release(capture_ctx, &frame)) < 0)
+                        break;
         }
-        
-        CLEAR(fmt);
-
-        fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-        fmt.fmt.pix.width       = width;
-        fmt.fmt.pix.height      = height;
-        fmt.fmt.pix.pixelformat = fmtdesc.pixelformat;
-        
-        if (-1 == ioctl(fd, VIDIOC_S_FMT, &fmt))
-                        errno_exit("VIDIOC_S_FMT");
-             
-        width = fmt.fmt.pix.width;
-        height = fmt.fmt.pix.height;	       
-        
-        switch (io) {
-        case IO_METHOD_READ:
-                init_read(fmt.fmt.pix.sizeimage);
-                break;
-
-        case IO_METHOD_MMAP:
-                init_mmap();
-                break;
-
-        case IO_METHOD_USERPTR:
-                init_userp(fmt.fmt.pix.sizeimage);
-                break;
+        if (n <= snapshot_config.settle) {
+                fprintf(stderr, "\nsnapshot: no frame at %ux%u (%s)\n", width, height,
+                        strerror(ret < 0 ? -ret : EAGAIN));
+                snapshot_stats.dropped++;
         }
-                                      
-}    
-        
+        /* a device lost mid-still comes back at the still size and is switched back below */
+        if (ret < 0 && hotplug_lost(ret) && capture_recover(ret) < 0)
+                return;
+        capture_reconfigure(preview_width, preview_height, pix_format, pix_format_str);
+        snapshot_switched(metric_now_ns() - t0);
+}
+
+/**
+Function Name : capture_policy_init
+Function Description : Arms the load-shedding policy with the steps that apply to this run: display frames are
+                       only skipped when streaming, recording is only decimated when capturing, and the format
+                       only changes where the sink copes with a new frame size
+Parameter : void
+Return : void
+**/
+void capture_policy_init(void)
+{
+        unsigned int levels;
+
+        if (!policy_enabled)
+                return;
+        if (streaming == 1)
+                levels = 1u << POLICY_SKIP_DISPLAY | 1u << POLICY_RENEGOTIATE;
+        else
+                levels = 1u << POLICY_DECIMATE | (encode_codec != ENCODE_NONE ? 1u << POLICY_RENEGOTIATE : 0);
+        base_width = 0;
+        policy_init(levels);
+}
+
 void openDevice(char* dev_path)
 {
-	if((fd = open(dev_path, O_RDWR)) < 0){
-        perror("open");
+	int ret = v4l2cap_open(&capture_ctx, dev_path, O_RDWR);
+
+	if(ret < 0){
+        /* the library prints nothing; for a synth: path -EINVAL is an option it does not know */
+        fprintf(stderr, "open %s: %s\n", dev_path, strerror(-ret));
         exit(1);
     }
+	fd = v4l2cap_fd(capture_ctx);
 }
 
 void close_device(void)
 {
-        if (-1 == close(fd))
-                errno_exit("close");
-
+        v4l2cap_close(capture_ctx);
+        capture_ctx = NULL;
         fd = -1;
 }
@@ -1,23 +1,36 @@
+#pragma once
+#include "v4l2capture.h"
+
 extern int fd;
 extern char *dev_path, *outfile, *pix_format_str;
 extern enum io_method io;
-extern struct buffer *buffers;
-extern unsigned int n_buffers;
 extern unsigned int width , height, capture, frame_count, type, pix_format, streaming;
+extern unsigned int bytesperline, sizeimage;      /* of the format init_device() negotiated */
 extern struct timeval start_time, end_time;
 extern double elapsed_time;
-int file;
+extern int file;
+
+extern struct v4l2cap *capture_ctx;     /* libv4l2capture context the CLI drives */
+
+/* Where streaming frames are drawn: the SDL texture ring, or plain memory in the benchmarks */
+struct render_target {
+        void *(*lock)(int *pitch);      /* memory for a width x height frame in the current format, NULL to skip it */
+        void (*present)(int written);   /* unlock, and show it unless written < 0 */
+};
+
+extern const struct render_target *render_target;
+extern int capture_specialized;         /* 0 runs the generic read_frame() that decides per frame */
 
+int xioctl(int fd, unsigned long request, void *arg);
 void errno_exit(const char *s);
 void process_image(const void *buffer_start, int size);
 int read_frame();
+void capture_specialize(void);
 void mainloop(void);
 void stop_capturing(void);
 void start_capturing(void);
 void uninit_device(void);
-void init_read(unsigned int buffer_size);
-void init_mmap(void);
-void init_userp(unsigned int buffer_size);
 void init_device(void);
+void capture_policy_init(void);
 void openDevice(char* dev_path);
 void close_device(void);
@@ -0,0 +1,172 @@
+#include <string.h>
+#include "crc32c.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <nmmintrin.h>
+#define CRC32C_X86
+#elif defined(__aarch64__)
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#include <arm_acle.h>
+#define CRC32C_ARM
+#endif
+
+/* Castagnoli polynomial, reflected */
+#define CRC32C_POLY 0x82f63b78u
+
+static uint32_t crc32c_table[8][256];
+static uint32_t (*crc32c_fn)(uint32_t crc, const void *buf, size_t len);
+static const char *crc32c_name;
+
+static void crc32c_table_init(void)
+{
+	uint32_t crc;
+	unsigned int i, j;
+
+	for (i = 0; i < 256; ++i) {
+		crc = i;
+		for (j = 0; j < 8; ++j)
+			crc = crc & 1 ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+		crc32c_table[0][i] = crc;
+	}
+	for (i = 0; i < 256; ++i)
+		for (j = 1; j < 8; ++j)
+			crc32c_table[j][i] = (crc32c_table[j - 1][i] >> 8) ^ crc32c_table[0][crc32c_table[j - 1][i] & 0xff];
+}
+
+/**
+Function Name : crc32c_sw
+Function Description : Table driven CRC32C, eight bytes per step (slicing-by-8), for CPUs without the instruction
+Parameter : running crc (0 to start), data and length
+Return : updated crc
+**/
+uint32_t crc32c_sw(uint32_t crc, const void *buf, size_t len)
+{
+	const unsigned char *p = buf;
+	uint64_t v;
+
+	if (!crc32c_table[0][1])
+		crc32c_table_init();
+
+	crc = ~crc;
+	for (; len >= 8; len -= 8, p += 8) {
+		memcpy(&v, p, 8);
+		v ^= crc;
+		crc = crc32c_table[7][v & 0xff] ^ crc32c_table[6][(v >> 8) & 0xff] ^
+			crc32c_table[5][(v >> 16) & 0xff] ^ crc32c_table[4][(v >> 24) & 0xff] ^
+			crc32c_table[3][(v >> 32) & 0xff] ^ crc32c_table[2][(v >> 40) & 0xff] ^
+			crc32c_table[1][(v >> 48) & 0xff] ^ crc32c_table[0][v >> 56];
+	}
+	while (len--)
+		crc = (crc >> 8) ^ crc32c_table[0][(crc ^ *p++) & 0xff];
+
+	return ~crc;
+}
+
+#if defined(CRC32C_X86)
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw(uint32_t crc, const void *buf, size_t len)
+{
+	const unsigned char *p = buf;
+	uint64_t v, c = ~crc;
+
+	for (; len >= 8; len -= 8, p += 8) {
+		memcpy(&v, p, 8);
+		c = _mm_crc32_u64(c, v);
+	}
+	crc = c;
+	while (len--)
+		crc = _mm_crc32_u8(crc, *p++);
+
+	return ~crc;
+}
+
+static int crc32c_hw_present(void)
+{
+	return __builtin_cpu_supports("sse4.2");
+}
+#define CRC32C_HW_NAME "sse4.2"
+#elif defined(CRC32C_ARM)
+__attribute__((target("+crc")))
+static uint32_t crc32c_hw(uint32_t crc, const void *buf, size_t len)
+{
+	const unsigned char *p = buf;
+	uint64_t v;
+
+	crc = ~crc;
+	for (; len >= 8; len -= 8, p += 8) {
+		memcpy(&v, p, 8);
+		crc = __crc32cd(crc, v);
+	}
+	while (len--)
+		crc = __crc32cb(crc, *p++);
+
+	return ~crc;
+}
+
+static int crc32c_hw_present(void)
+{
+	return (getauxval(AT_HWCAP) & HWCAP_CRC32) != 0;
+}
+#define CRC32C_HW_NAME "armv8-crc"
+#endif
+
+static void crc32c_select(void)
+{
+#ifdef CRC32C_HW_NAME
+	if (crc32c_hw_present()) {
+		crc32c_name = CRC32C_HW_NAME;
+		crc32c_fn = crc32c_hw;
+		return;
+	}
+#endif
+	crc32c_name = "table";
+	crc32c_fn = crc32c_sw;
+}
+
+/**
+Function Name : crc32c
+Function Description : CRC32C with the CPU's crc32 instruction when it has one (picked on first use), else
+                       the table
+Parameter : running crc (0 to start), data and length
+Return : updated crc
+**/
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len)
+{
+	if (!crc32c_fn)
+		crc32c_select();
+
+	return crc32c_fn(crc, buf, len);
+}
+
+/**
+Function Name : crc32c_sparse
+Function Description : Cheap fingerprint of a large frame: CRC32C of a CRC32C_SPARSE_CHUNK-byte sample every
+                       step bytes, of the last chunk and of the length. Any sensor noise shows up in the
+                       samples, so identical fingerprints on consecutive frames mean a repeated image
+Parameter : data, length and distance between samples (at least CRC32C_SPARSE_CHUNK)
+Return : fingerprint
+**/
+uint32_t crc32c_sparse(const void *buf, size_t len, size_t step)
+{
+	const unsigned char *p = buf;
+	uint32_t crc;
+	size_t off;
+
+	if (step < CRC32C_SPARSE_CHUNK || len <= 2 * step)
+		return crc32c(0, buf, len);
+
+	crc = crc32c(0, &len, sizeof(len));
+	for (off = 0; off + CRC32C_SPARSE_CHUNK <= len; off += step)
+		crc = crc32c(crc, p + off, CRC32C_SPARSE_CHUNK);
+
+	return crc32c(crc, p + len - CRC32C_SPARSE_CHUNK, CRC32C_SPARSE_CHUNK);
+}
+
+const char *crc32c_impl(void)
+{
+	if (!crc32c_fn)
+		crc32c_select();
+
+	return crc32c_name;
+}
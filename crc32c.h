@@ -0,0 +1,10 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+#define CRC32C_SPARSE_CHUNK 64          /* bytes checksummed at each sparse sample */
+
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len);
+uint32_t crc32c_sw(uint32_t crc, const void *buf, size_t len);
+uint32_t crc32c_sparse(const void *buf, size_t len, size_t step);
+const char *crc32c_impl(void);
@@ -0,0 +1,355 @@
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define DENOISE_X86
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#include "header.h"
+#include "capture.h"
+#include "denoise.h"
+#include "tilepool.h"
+#include "metrics.h"
+#include "trace.h"
+
+/*
+ * Temporal noise reduction: a recursive filter blending each frame into a running reference, which is also the
+ * frame handed on. Every sample is blended on its own, with the share of the reference falling linearly with
+ * the difference from it, from the strength at no difference to nothing at the threshold, so noise averages
+ * out where the scene is still and moving edges pass through without a trail. Works on the bytes of the
+ * frame as they lie, luma and chroma alike, in chunks on the tile pool.
+ *
+ * In 8.8 fixed point: alpha = s - ((min(|c - r|, t) * k) >> 8), saturating at 0, k = ceil(256 s / t), and
+ * r' = (c (256 - alpha) + r alpha + 128) >> 8. Every kernel computes exactly this, in 16-bit lanes.
+ */
+
+#define DENOISE_CHUNK (64 * 1024)       /* bytes per tile pool item */
+
+struct denoise_weights {
+	unsigned int s, t, k;
+};
+
+typedef unsigned int (*denoise_fn)(unsigned char *ref, const unsigned char *cur, unsigned int n,
+	const struct denoise_weights *w);
+
+struct denoise_job {
+	unsigned char *ref;
+	const unsigned char *cur;
+	unsigned int size;
+	struct denoise_weights w;
+	unsigned long long moving[TILE_MAX_WORKERS];
+};
+
+struct denoise_config denoise_config = { 75, 32 };
+struct denoise_stats denoise_stats;
+int denoise_enabled;
+
+static denoise_fn denoise_span;
+static const char *kernel_name;
+static unsigned char *reference;
+static unsigned int cur_width, cur_height, cur_fourcc, frame_size;
+static unsigned int cur_pitch;         /* the reference keeps the input's stride */
+static struct denoise_job job;
+static struct tile_future filtered;
+static int unsupported_reported;
+
+/**
+Function Name : denoise_parse
+Function Description : Parses the -N argument: "on", or comma separated strength=<percent> and
+                       threshold=<levels>
+Parameter : option string
+Return : 0 for success -1 for a bad option
+**/
+int denoise_parse(const char *spec)
+{
+	char *opts = strdup(spec), *item, *save;
+	int ret = 0;
+
+	denoise_enabled = 1;
+	for (item = strtok_r(opts, ",", &save); item; item = strtok_r(NULL, ",", &save)) {
+		if (strcmp(item, "on") == 0)
+			continue;
+		else if (strncmp(item, "strength=", 9) == 0)
+			denoise_config.strength = strtol(item + 9, NULL, 10);
+		else if (strncmp(item, "threshold=", 10) == 0)
+			denoise_config.threshold = strtol(item + 10, NULL, 10);
+		else {
+			fprintf(stderr, "Unknown denoise option %s\n", item);
+			ret = -1;
+		}
+	}
+	free(opts);
+	if (denoise_config.strength > 99) {
+		fprintf(stderr, "Denoise strength must be 0 to 99 percent\n");
+		ret = -1;
+	}
+	if (denoise_config.threshold < 1 || denoise_config.threshold > 255) {
+		fprintf(stderr, "Denoise threshold must be 1 to 255 levels\n");
+		ret = -1;
+	}
+
+	return ret;
+}
+
+static unsigned int denoise_span_c(unsigned char *ref, const unsigned char *cur, unsigned int n,
+	const struct denoise_weights *w)
+{
+	unsigned int i, d, a, moving = 0;
+
+	for (i = 0; i < n; ++i) {
+		d = cur[i] > ref[i] ? cur[i] - ref[i] : ref[i] - cur[i];
+		if (d >= w->t) {
+			d = w->t;
+			moving++;
+		}
+		a = d * w->k >> 8;
+		a = a < w->s ? w->s - a : 0;
+		ref[i] = (cur[i] * (256 - a) + ref[i] * a + 128) >> 8;
+	}
+
+	return moving;
+}
+
+#if defined(__SSE2__)
+static unsigned int denoise_span_sse2(unsigned char *ref, const unsigned char *cur, unsigned int n,
+	const struct denoise_weights *w)
+{
+	const __m128i z = _mm_setzero_si128(), vt = _mm_set1_epi8((char)w->t), vs = _mm_set1_epi16(w->s);
+	const __m128i vk = _mm_set1_epi16(w->k), v256 = _mm_set1_epi16(256), v128 = _mm_set1_epi16(128);
+	unsigned int i, moving = 0;
+
+	for (i = 0; i + 16 <= n; i += 16) {
+		__m128i c = _mm_loadu_si128((const __m128i *)(cur + i)), r = _mm_loadu_si128((const __m128i *)(ref + i));
+		__m128i d = _mm_min_epu8(_mm_or_si128(_mm_subs_epu8(c, r), _mm_subs_epu8(r, c)), vt);
+		__m128i al = _mm_subs_epu16(vs, _mm_srli_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(d, z), vk), 8));
+		__m128i ah = _mm_subs_epu16(vs, _mm_srli_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(d, z), vk), 8));
+		__m128i lo = _mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(c, z), _mm_sub_epi16(v256, al)),
+			_mm_mullo_epi16(_mm_unpacklo_epi8(r, z), al));
+		__m128i hi = _mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(c, z), _mm_sub_epi16(v256, ah)),
+			_mm_mullo_epi16(_mm_unpackhi_epi8(r, z), ah));
+
+		/* the sums stay below 65409, so the 16-bit lanes hold them without wrapping */
+		lo = _mm_srli_epi16(_mm_add_epi16(lo, v128), 8);
+		hi = _mm_srli_epi16(_mm_add_epi16(hi, v128), 8);
+		_mm_storeu_si128((__m128i *)(ref + i), _mm_packus_epi16(lo, hi));
+		moving += __builtin_popcount(_mm_movemask_epi8(_mm_cmpeq_epi8(d, vt)));
+	}
+
+	return moving + denoise_span_c(ref + i, cur + i, n - i, w);
+}
+#elif defined(__ARM_NEON)
+static unsigned int denoise_span_neon(unsigned char *ref, const unsigned char *cur, unsigned int n,
+	const struct denoise_weights *w)
+{
+	const uint8x16_t vt = vdupq_n_u8(w->t);
+	const uint16x8_t vs = vdupq_n_u16(w->s), vk = vdupq_n_u16(w->k), v256 = vdupq_n_u16(256);
+	const uint16x8_t v128 = vdupq_n_u16(128);
+	uint16x8_t count = vdupq_n_u16(0);
+	uint64x2_t total;
+	unsigned int i;
+
+	/* a chunk is at most 4096 vectors, two counts a lane each, so the 16-bit counters do not wrap */
+	for (i = 0; i + 16 <= n; i += 16) {
+		uint8x16_t c = vld1q_u8(cur + i), r = vld1q_u8(ref + i);
+		uint8x16_t d = vminq_u8(vabdq_u8(c, r), vt);
+		uint16x8_t al = vqsubq_u16(vs, vshrq_n_u16(vmulq_u16(vmovl_u8(vget_low_u8(d)), vk), 8));
+		uint16x8_t ah = vqsubq_u16(vs, vshrq_n_u16(vmulq_u16(vmovl_u8(vget_high_u8(d)), vk), 8));
+		uint16x8_t lo = vaddq_u16(vmulq_u16(vmovl_u8(vget_low_u8(c)), vsubq_u16(v256, al)),
+			vmulq_u16(vmovl_u8(vget_low_u8(r)), al));
+		uint16x8_t hi = vaddq_u16(vmulq_u16(vmovl_u8(vget_high_u8(c)), vsubq_u16(v256, ah)),
+			vmulq_u16(vmovl_u8(vget_high_u8(r)), ah));
+
+		vst1q_u8(ref + i, vcombine_u8(vshrn_n_u16(vaddq_u16(lo, v128), 8), vshrn_n_u16(vaddq_u16(hi, v128), 8)));
+		count = vpadalq_u8(count, vshrq_n_u8(vceqq_u8(d, vt), 7));
+	}
+	total = vpaddlq_u32(vpaddlq_u16(count));
+
+	return (unsigned int)(vgetq_lane_u64(total, 0) + vgetq_lane_u64(total, 1)) +
+		denoise_span_c(ref + i, cur + i, n - i, w);
+}
+#endif
+
+#if defined(DENOISE_X86)
+__attribute__((target("avx2")))
+static unsigned int denoise_span_avx2(unsigned char *ref, const unsigned char *cur, unsigned int n,
+	const struct denoise_weights *w)
+{
+	const __m256i z = _mm256_setzero_si256(), vt = _mm256_set1_epi8((char)w->t), vs = _mm256_set1_epi16(w->s);
+	const __m256i vk = _mm256_set1_epi16(w->k), v256 = _mm256_set1_epi16(256), v128 = _mm256_set1_epi16(128);
+	unsigned int i, moving = 0;
+
+	/* unpack and pack both work within 128-bit lanes, so the bytes come back in their order */
+	for (i = 0; i + 32 <= n; i += 32) {
+		__m256i c = _mm256_loadu_si256((const __m256i *)(cur + i));
+		__m256i r = _mm256_loadu_si256((const __m256i *)(ref + i));
+		__m256i d = _mm256_min_epu8(_mm256_or_si256(_mm256_subs_epu8(c, r), _mm256_subs_epu8(r, c)), vt);
+		__m256i al = _mm256_subs_epu16(vs,
+			_mm256_srli_epi16(_mm256_mullo_epi16(_mm256_unpacklo_epi8(d, z), vk), 8));
+		__m256i ah = _mm256_subs_epu16(vs,
+			_mm256_srli_epi16(_mm256_mullo_epi16(_mm256_unpackhi_epi8(d, z), vk), 8));
+		__m256i lo = _mm256_add_epi16(_mm256_mullo_epi16(_mm256_unpacklo_epi8(c, z), _mm256_sub_epi16(v256, al)),
+			_mm256_mullo_epi16(_mm256_unpacklo_epi8(r, z), al));
+		__m256i hi = _mm256_add_epi16(_mm256_mullo_epi16(_mm256_unpackhi_epi8(c, z), _mm256_sub_epi16(v256, ah)),
+			_mm256_mullo_epi16(_mm256_unpackhi_epi8(r, z), ah));
+
+		lo = _mm256_srli_epi16(_mm256_add_epi16(lo, v128), 8);
+		hi = _mm256_srli_epi16(_mm256_add_epi16(hi, v128), 8);
+		_mm256_storeu_si256((__m256i *)(ref + i), _mm256_packus_epi16(lo, hi));
+		moving += __builtin_popcount(_mm256_movemask_epi8(_mm256_cmpeq_epi8(d, vt)));
+	}
+
+	return moving + denoise_span_c(ref + i, cur + i, n - i, w);
+}
+
+static int denoise_avx2_present(void)
+{
+	return __builtin_cpu_supports("avx2");
+}
+#endif
+
+static const struct {
+	const char *name;
+	denoise_fn fn;
+	int (*present)(void);
+} denoise_kernels[] = {
+#if defined(DENOISE_X86)
+	{ "avx2", denoise_span_avx2, denoise_avx2_present },
+#endif
+#if defined(__SSE2__)
+	{ "sse2", denoise_span_sse2, NULL },
+#elif defined(__ARM_NEON)
+	{ "neon", denoise_span_neon, NULL },
+#endif
+	{ "scalar", denoise_span_c, NULL },
+};
+
+/**
+Function Name : denoise_select
+Function Description : Picks the kernel by name, or the fastest the CPU runs for NULL; all of them give the
+                       same bytes
+Parameter : "avx2", "sse2", "neon", "scalar" or NULL
+Return : 0 for success -1 when the kernel is not built in or the CPU lacks it
+**/
+int denoise_select(const char *kernel)
+{
+	unsigned int i;
+
+	for (i = 0; i < sizeof(denoise_kernels) / sizeof(denoise_kernels[0]); ++i) {
+		if (kernel && strcmp(kernel, denoise_kernels[i].name) != 0)
+			continue;
+		if (denoise_kernels[i].present && !denoise_kernels[i].present())
+			continue;
+		denoise_span = denoise_kernels[i].fn;
+		kernel_name = denoise_kernels[i].name;
+		return 0;
+	}
+
+	return -1;
+}
+
+/**
+Function Name : denoise_reset
+Function Description : Drops the reference, the next frame starts a new one
+Parameter : void
+Return : void
+**/
+void denoise_reset(void)
+{
+	free(reference);
+	reference = NULL;
+	cur_width = cur_height = cur_fourcc = cur_pitch = frame_size = 0;
+}
+
+static void denoise_chunk(void *arg, unsigned int item, unsigned int worker)
+{
+	struct denoise_job *j = arg;
+	unsigned int at = item * DENOISE_CHUNK, n = j->size - at < DENOISE_CHUNK ? j->size - at : DENOISE_CHUNK;
+
+	j->moving[worker] += denoise_span(j->ref + at, j->cur + at, n, &j->w);
+}
+
+/**
+Function Name : denoise_frame
+Function Description : Blends the frame into the reference on the tile pool and waits for it; the first frame
+                       of a size and format becomes the reference as it is
+Parameter : the captured frame, where to describe the filtered one, valid until the next call
+Return : 1 when out holds the filtered frame, -1 for a frame that is passed through as is
+**/
+int denoise_frame(const struct frame_view *in, struct frame_view *out)
+{
+	struct denoise_stats *st = &denoise_stats;
+	unsigned int s = denoise_config.strength * 256 / 100, t = denoise_config.threshold, i;
+	unsigned long long ns;
+
+	if (in->fourcc != V4L2_PIX_FMT_YUYV && in->fourcc != V4L2_PIX_FMT_NV12 && in->fourcc != V4L2_PIX_FMT_GREY) {
+		if (!unsupported_reported++)
+			fprintf(stderr, "denoise: only YUYV, NV12 and GREY frames are filtered\n");
+		return -1;
+	}
+	if (!frame_view_complete(in)) {
+		st->passed++;
+		return -1;
+	}
+	if (!denoise_span)
+		denoise_select(NULL);
+	st->kernel = kernel_name;
+	if (in->width != cur_width || in->height != cur_height || in->fourcc != cur_fourcc || in->pitch[0] != cur_pitch) {
+		denoise_reset();
+		if (!(reference = malloc(in->size)))
+			return -1;
+		memcpy(reference, in->plane[0], in->size);
+		cur_width = in->width;
+		cur_height = in->height;
+		cur_fourcc = in->fourcc;
+		cur_pitch = in->pitch[0];
+		frame_size = in->size;
+		st->restarts++;
+	} else {
+		job.ref = reference;
+		job.cur = in->plane[0];
+		job.size = frame_size;
+		job.w.s = s;
+		job.w.t = t;
+		job.w.k = (s * 256 + t - 1) / t;
+		memset(job.moving, 0, sizeof(job.moving));
+		TRACE_BEGIN(td);
+		tile_for(&filtered, denoise_chunk, &job, (frame_size + DENOISE_CHUNK - 1) / DENOISE_CHUNK);
+		ns = tile_wait(&filtered);
+		TRACE_END(td, "denoise");
+		for (i = 0; i < TILE_MAX_WORKERS; ++i)
+			st->moving += job.moving[i];
+		st->samples += frame_size;
+		st->filter_ns += ns;
+		if (ns > st->filter_max_ns)
+			st->filter_max_ns = ns;
+	}
+	st->frames++;
+	frame_view_init(out, reference, frame_size, in->sequence, cur_width, cur_height, cur_fourcc, cur_pitch);
+
+	return 1;
+}
+
+/**
+Function Name : denoise_finish
+Function Description : Prints the frames filtered, the kernel and the time per frame, and the share of samples
+                       taken as motion, then drops the reference
+Parameter : void
+Return : void
+**/
+void denoise_finish(void)
+{
+	struct denoise_stats *st = &denoise_stats;
+	unsigned long long blended = st->frames - st->restarts;
+
+	if (st->frames) {
+		printf("Denoise: %llu frames filtered with %s on %u threads, %llu restarted the reference, %llu short "
+			"passed through\n", st->frames, st->kernel, tile_pool_threads(), st->restarts, st->passed);
+		if (blended)
+			printf("\tFilter : %.2f ms avg %.2f ms max per frame, %.1f%% of samples taken as motion "
+				"(strength %u%%, threshold %u)\n", st->filter_ns / 1e6 / blended, st->filter_max_ns / 1e6,
+				st->samples ? 100.0 * st->moving / st->samples : 0.0, denoise_config.strength,
+				denoise_config.threshold);
+	}
+	denoise_reset();
+	unsupported_reported = 0;
+}
@@ -0,0 +1,26 @@
+#pragma once
+#include "frameview.h"
+
+struct denoise_config {
+	unsigned int strength;          /* percent of the reference kept where the frame matches it */
+	unsigned int threshold;         /* difference in levels from which a sample is taken as motion and not blended */
+};
+
+struct denoise_stats {
+	unsigned long long frames;              /* filtered */
+	unsigned long long passed;              /* short frames sent on as they came */
+	unsigned long long restarts;            /* reference taken afresh from a frame, at the start or a new size */
+	unsigned long long samples, moving;     /* bytes filtered, and those at or over the threshold */
+	unsigned long long filter_ns, filter_max_ns;    /* submitted to done on the tile pool */
+	const char *kernel;
+};
+
+extern struct denoise_config denoise_config;
+extern struct denoise_stats denoise_stats;
+extern int denoise_enabled;
+
+int denoise_parse(const char *spec);
+int denoise_select(const char *kernel);
+int denoise_frame(const struct frame_view *in, struct frame_view *out);
+void denoise_reset(void);
+void denoise_finish(void);
@@ -0,0 +1,597 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <setjmp.h>
+#include <jpeglib.h>
+#include <linux/videodev2.h>
+
+#include "encode.h"
+#include "lossless.h"
+#include "metrics.h"
+#include "trace.h"
+#include "rt.h"
+#include "segment.h"
+#include "h264.h"
+#include "mp4.h"
+
+enum encode_codec encode_codec = ENCODE_NONE;
+unsigned int encode_quality = 85, encode_threads = 2;
+
+static struct encode_job *slots;
+static unsigned int n_slots;
+static struct encode_worker *workers;
+static pthread_t writer_thread;
+static pthread_mutex_t encode_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t work_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t done_cond = PTHREAD_COND_INITIALIZER;
+static unsigned int submit_seq, encode_seq, write_seq;
+static unsigned int frames_dropped, frames_written, frames_oversized, frames_failed;
+static unsigned long long queue_sum;    /* slots in use after each submit, for the average depth */
+static unsigned int queue_max;
+static unsigned int n_workers;          /* encode_threads, or one for H.264, which threads inside x264 */
+static unsigned long long bytes_in, bytes_out;
+static int stopping, writer_fd = -1;
+static unsigned int enc_width, enc_height, enc_fourcc, enc_stride;
+static unsigned int slot_size;          /* sizeimage the slots were sized for */
+static struct timespec enc_start, enc_cpu_start;
+static int (*encode_frame)(struct encode_worker *worker, struct encode_job *job);
+
+static double ts_diff(const struct timespec *a, const struct timespec *b)
+{
+	return (b->tv_sec - a->tv_sec) + (b->tv_nsec - a->tv_nsec) / 1e9;
+}
+
+/**
+Function Name : encode_worker_main
+Function Description : Takes pending slots in capture order, compresses them and hands them to the writer
+Parameter : the encode_worker owning this thread
+Return : NULL
+**/
+static void *encode_worker_main(void *arg)
+{
+	struct encode_worker *worker = arg;
+	struct encode_job *job;
+	struct timespec t0, t1;
+	int failed;
+
+	TRACE_THREAD("encode");
+	rt_apply(RT_ENCODE);
+	pthread_mutex_lock(&encode_lock);
+	for (;;) {
+		while (encode_seq == submit_seq && !stopping)
+			pthread_cond_wait(&work_cond, &encode_lock);
+		if (encode_seq == submit_seq)
+			break;
+
+		job = &slots[encode_seq % n_slots];
+		job->state = SLOT_BUSY;
+		encode_seq++;
+		pthread_mutex_unlock(&encode_lock);
+
+		clock_gettime(CLOCK_THREAD_CPUTIME_ID, &t0);
+		TRACE_BEGIN(ts);
+		failed = encode_frame(worker, job) < 0;
+		if (failed)
+			job->out_size = 0;      /* nothing for the writer, counted instead */
+		TRACE_END(ts, "encode");
+		clock_gettime(CLOCK_THREAD_CPUTIME_ID, &t1);
+		worker->cpu_time += ts_diff(&t0, &t1);
+		worker->frames++;
+
+		pthread_mutex_lock(&encode_lock);
+		frames_failed += failed;
+		job->state = SLOT_DONE;
+		pthread_cond_broadcast(&done_cond);
+	}
+	pthread_mutex_unlock(&encode_lock);
+
+	return NULL;
+}
+
+/**
+Function Name : encode_writer_main
+Function Description : Writes finished slots strictly in submit order and returns them to the pool
+Parameter : unused
+Return : NULL
+**/
+static void *encode_writer_main(void *arg)
+{
+	struct encode_job *job;
+
+	(void)arg;
+	TRACE_THREAD("writer");
+	rt_apply(RT_WRITER);
+	pthread_mutex_lock(&encode_lock);
+	for (;;) {
+		job = &slots[write_seq % n_slots];
+		while (job->state != SLOT_DONE && !(stopping && write_seq == submit_seq))
+			pthread_cond_wait(&done_cond, &encode_lock);
+		if (job->state != SLOT_DONE)
+			break;
+		pthread_mutex_unlock(&encode_lock);
+
+		TRACE_BEGIN(ts);
+		if (encode_codec == ENCODE_H264) {
+			if (h264_write(&workers[0], writer_fd, job) < 0)
+				fprintf(stderr, "h264: frame %u not written\n", job->seq);
+		} else if ((segment_enabled ? segment_write(job->out, job->out_size) :
+			    write(writer_fd, job->out, job->out_size)) != (ssize_t)job->out_size)
+			perror("write");
+		TRACE_END(ts, "write");
+
+		pthread_mutex_lock(&encode_lock);
+		bytes_in += job->raw_size;
+		bytes_out += job->out_size;
+		frames_written++;
+		job->state = SLOT_FREE;
+		write_seq++;
+		metric_add(MG_WRITER_BACKLOG, -1);
+	}
+	pthread_mutex_unlock(&encode_lock);
+
+	return NULL;
+}
+
+/**
+Function Name : encoder_init
+Function Description : Allocates the slot pool and starts the encode workers and the in-order writer
+Parameter : output fd, negotiated frame width, height, fourcc, bytesperline and sizeimage
+Return : 0 for success -1 for failure
+**/
+int encoder_init(int out_fd, unsigned int frame_width, unsigned int frame_height, unsigned int fourcc,
+	unsigned int bytesperline, unsigned int sizeimage)
+{
+	unsigned int i;
+
+	switch (encode_codec) {
+	case ENCODE_JPEG:
+		if (fourcc != V4L2_PIX_FMT_YUYV && fourcc != V4L2_PIX_FMT_NV12) {
+			fprintf(stderr, "JPEG encoding needs YUYV or NV12 input\n");
+			return -1;
+		}
+		encode_frame = jpeg_encode_frame;
+		break;
+	case ENCODE_LZ4:
+	case ENCODE_ZSTD:
+		encode_frame = lossless_encode_frame;
+		break;
+	case ENCODE_H264:
+		if (fourcc != V4L2_PIX_FMT_YUYV && fourcc != V4L2_PIX_FMT_NV12 && fourcc != V4L2_PIX_FMT_GREY) {
+			fprintf(stderr, "H.264 encoding needs YUYV, NV12 or GREY input\n");
+			return -1;
+		}
+		if (!h264_available()) {
+			fprintf(stderr, "Built without H.264, rebuild with make H264=1\n");
+			return -1;
+		}
+		encode_frame = h264_encode_frame;
+		memset(&h264_stats, 0, sizeof(h264_stats));
+		break;
+	default:
+		return -1;
+	}
+
+	if (encode_threads < 1)
+		encode_threads = 1;
+
+	writer_fd = out_fd;
+	enc_width = frame_width;
+	enc_height = frame_height;
+	enc_fourcc = fourcc;
+	enc_stride = bytesperline;
+	/* the driver's sizeimage covers any format and any padding, so a frame is never cut to fit */
+	slot_size = sizeimage;
+	submit_seq = encode_seq = write_seq = 0;
+	frames_dropped = frames_written = frames_oversized = frames_failed = 0;
+	bytes_in = bytes_out = 0;
+	queue_sum = queue_max = 0;
+	stopping = 0;
+
+	/* two frames in flight per worker keeps every core busy while the writer drains */
+	n_slots = encode_threads * 2 + 1;
+	/* x264 codes each frame against the ones before, so a single caller feeds its frame threads in order */
+	n_workers = encode_codec == ENCODE_H264 ? 1 : encode_threads;
+	slots = calloc(n_slots, sizeof(*slots));
+	workers = calloc(n_workers, sizeof(*workers));
+	if (!slots || !workers) {
+		fprintf(stderr, "Out of memory\n");
+		return -1;
+	}
+
+	for (i = 0; i < n_slots; ++i) {
+		slots[i].raw = malloc(slot_size);
+		slots[i].out_capacity = slot_size;
+		slots[i].out = malloc(slots[i].out_capacity);
+		if (!slots[i].raw || !slots[i].out) {
+			fprintf(stderr, "Out of memory\n");
+			return -1;
+		}
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &enc_start);
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &enc_cpu_start);
+	for (i = 0; i < n_workers; ++i) {
+		workers[i].index = i;
+		if (pthread_create(&workers[i].thread, NULL, encode_worker_main, &workers[i])) {
+			fprintf(stderr, "create encode thread failed\n");
+			return -1;
+		}
+	}
+	if (pthread_create(&writer_thread, NULL, encode_writer_main, NULL)) {
+		fprintf(stderr, "create writer thread failed\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+Function Name : encoder_set_format
+Function Description : Switches the frames submitted from now on to a new format after a renegotiation; frames
+                       already queued keep theirs. The slots are not reallocated, so the new frames must fit
+Parameter : new frame width, height, fourcc, bytesperline and sizeimage
+Return : 0 for success -1 when the slots or the codec cannot take the format
+**/
+int encoder_set_format(unsigned int frame_width, unsigned int frame_height, unsigned int fourcc,
+	unsigned int bytesperline, unsigned int sizeimage)
+{
+	if (sizeimage > slot_size)
+		return -1;
+	/* the stream's SPS is already in the MP4 header */
+	if (encode_codec == ENCODE_H264 && (frame_width != enc_width || frame_height != enc_height || fourcc != enc_fourcc))
+		return -1;
+	if (encode_codec == ENCODE_JPEG && fourcc != V4L2_PIX_FMT_YUYV && fourcc != V4L2_PIX_FMT_NV12)
+		return -1;
+	enc_width = frame_width;
+	enc_height = frame_height;
+	enc_fourcc = fourcc;
+	enc_stride = bytesperline;
+
+	return 0;
+}
+
+/**
+Function Name : encoder_submit
+Function Description : Copies a dequeued frame into the next free slot. Never waits on the workers: when the
+                       pool is full the frame is dropped and counted so the caller can requeue its buffer at once.
+                       A frame larger than the slots is refused whole, never cut short
+Parameter : frame start and bytesused
+Return : 0 when queued -1 when dropped
+**/
+int encoder_submit(const void *frame, unsigned int size)
+{
+	struct encode_job *job;
+
+	if (size > slot_size) {
+		if (!frames_oversized++)
+			fprintf(stderr, "encode: a %u byte frame does not fit the %u byte sizeimage, not recorded\n", size,
+				slot_size);
+		metric_inc(MC_ENCODE_DROPPED, 1);
+		return -1;
+	}
+	pthread_mutex_lock(&encode_lock);
+	job = &slots[submit_seq % n_slots];
+	if (job->state != SLOT_FREE) {
+		frames_dropped++;
+		metric_inc(MC_ENCODE_DROPPED, 1);
+		pthread_mutex_unlock(&encode_lock);
+		return -1;
+	}
+	pthread_mutex_unlock(&encode_lock);
+
+	memcpy(job->raw, frame, size);
+	job->raw_size = size;
+	job->seq = submit_seq;
+	job->width = enc_width;
+	job->height = enc_height;
+	job->fourcc = enc_fourcc;
+	job->stride = enc_stride;
+	job->ts_ns = metric_now_ns();
+
+	pthread_mutex_lock(&encode_lock);
+	job->state = SLOT_PENDING;
+	submit_seq++;
+	queue_sum += submit_seq - write_seq;
+	if (submit_seq - write_seq > queue_max)
+		queue_max = submit_seq - write_seq;
+	metric_add(MG_WRITER_BACKLOG, 1);
+	pthread_cond_signal(&work_cond);
+	pthread_mutex_unlock(&encode_lock);
+
+	return 0;
+}
+
+/**
+Function Name : encoder_finish
+Function Description : Drains every queued frame, stops the threads and reports throughput, compression ratio,
+                       queue depth and the storage an hour of recording takes
+Parameter : void
+Return : void
+**/
+void encoder_finish(void)
+{
+	struct timespec end, cpu_end;
+	unsigned int i;
+	double cpu_time = 0, wall;
+	unsigned long long submitted;
+
+	if (!slots)
+		return;
+
+	pthread_mutex_lock(&encode_lock);
+	stopping = 1;
+	pthread_cond_broadcast(&work_cond);
+	pthread_cond_broadcast(&done_cond);
+	pthread_mutex_unlock(&encode_lock);
+
+	for (i = 0; i < n_workers; ++i)
+		pthread_join(workers[i].thread, NULL);
+	pthread_join(writer_thread, NULL);
+	if (encode_codec == ENCODE_H264)
+		bytes_out = h264_finish(&workers[0], writer_fd);      /* the container, not just the NALs */
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	wall = ts_diff(&enc_start, &end);
+
+	for (i = 0; i < n_workers; ++i) {
+		cpu_time += workers[i].cpu_time;
+		encode_worker_release(&workers[i]);
+	}
+	/* x264 encodes on threads of its own: count the whole process, capture included, as an upper bound */
+	if (encode_codec == ENCODE_H264) {
+		clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpu_end);
+		cpu_time = ts_diff(&enc_cpu_start, &cpu_end);
+	}
+
+	printf("Encode: %u frames written, %u dropped (pool full)\n", frames_written, frames_dropped);
+	if (frames_oversized || frames_failed)
+		printf("\t%u frames over sizeimage refused, %u the codec failed on\n", frames_oversized, frames_failed);
+	if (bytes_out)
+		printf("\tCompression ratio : %.1f:1 (%llu -> %llu bytes)\n",
+			(double)bytes_in / bytes_out, bytes_in, bytes_out);
+	if (cpu_time > 0)
+		printf("\tThroughput : %.1f fps/core, %.1f MB/s/core (%u threads%s, %.1f fps wall)\n",
+			frames_written / cpu_time, bytes_in / cpu_time / 1e6, encode_threads,
+			encode_codec == ENCODE_H264 ? " in x264, process CPU" : "", wall > 0 ? frames_written / wall : 0);
+	submitted = frames_written + frames_dropped;
+	if (frames_written)
+		printf("\tQueue : %.1f avg, %u max of %u slots\n", (double)queue_sum / frames_written, queue_max, n_slots);
+	if (wall > 0 && frames_written)
+		printf("\tStorage : %.2f GB/hour written, %.2f GB/hour raw (%.1f fps offered)\n",
+			bytes_out * 3600 / wall / 1e9, (double)bytes_in / frames_written * submitted * 3600 / wall / 1e9,
+			submitted / wall);
+	if (encode_codec == ENCODE_H264 && h264_stats.frames)
+		printf("\tH.264 : %llu frames, %llu keyframes in %llu fragments, %.1f s at %.0f kbit/s (%s, %s %u, "
+			"%u threads, up to %u frames inside x264)\n", h264_stats.frames, h264_stats.keyframes,
+			h264_stats.fragments, (double)h264_stats.duration / MP4_TIMESCALE, h264_stats.duration ?
+			h264_stats.bytes * 8.0 * MP4_TIMESCALE / h264_stats.duration / 1000 : 0, h264_config.preset,
+			h264_config.kbps ? "kbps" : "crf", h264_config.kbps ? h264_config.kbps : h264_config.crf,
+			h264_stats.threads, h264_stats.delayed_max);
+
+	for (i = 0; i < n_slots; ++i) {
+		free(slots[i].raw);
+		free(slots[i].out);
+	}
+	free(slots);
+	free(workers);
+	slots = NULL;
+	workers = NULL;
+}
+
+/**
+Function Name : encode_worker_release
+Function Description : Frees the codec scratch a worker accumulated
+Parameter : the worker
+Return : void
+**/
+void encode_worker_release(struct encode_worker *worker)
+{
+	if (worker->priv && worker->priv_free)
+		worker->priv_free(worker->priv);
+	else
+		free(worker->priv);
+	worker->priv = NULL;
+}
+
+/* libjpeg's default error_exit() calls exit(); here an error ends the frame, not the recording */
+struct jpeg_encode_error {
+	struct jpeg_error_mgr mgr;
+	jmp_buf jump;
+};
+
+struct jpeg_scratch {
+	struct jpeg_compress_struct cinfo;
+	struct jpeg_encode_error jerr;
+	unsigned char *planes[3];
+	JSAMPROW rows[3][16];
+	unsigned int luma_width;
+	unsigned char *out;             /* jpeg_mem_dest() state, kept here so it survives the longjmp */
+	unsigned long out_size;
+};
+
+static void jpeg_encode_error_exit(j_common_ptr cinfo)
+{
+	(*cinfo->err->output_message)(cinfo);
+	longjmp(((struct jpeg_encode_error *)cinfo->err)->jump, 1);
+}
+
+static void jpeg_scratch_free(void *priv)
+{
+	struct jpeg_scratch *js = priv;
+	unsigned int c;
+
+	jpeg_destroy_compress(&js->cinfo);
+	for (c = 0; c < 3; ++c)
+		free(js->planes[c]);
+	free(js);
+}
+
+static struct jpeg_scratch *jpeg_scratch_get(struct encode_worker *worker, unsigned int frame_width)
+{
+	struct jpeg_scratch *js = worker->priv;
+	unsigned int c, r, chroma_width;
+
+	if (js && js->luma_width == ((frame_width + 15) & ~15u))
+		return js;
+	encode_worker_release(worker);
+
+	if (!(js = calloc(1, sizeof(*js))))
+		return NULL;
+	js->cinfo.err = jpeg_std_error(&js->jerr.mgr);
+	js->jerr.mgr.error_exit = jpeg_encode_error_exit;
+	if (setjmp(js->jerr.jump)) {
+		jpeg_scratch_free(js);
+		return NULL;
+	}
+	jpeg_create_compress(&js->cinfo);
+
+	/* rows are padded to a whole MCU so libjpeg never reads past the buffers */
+	js->luma_width = (frame_width + 15) & ~15u;
+	chroma_width = js->luma_width / 2;
+	for (c = 0; c < 3; ++c) {
+		unsigned int w = c ? chroma_width : js->luma_width;
+
+		if (!(js->planes[c] = malloc(w * 16))) {
+			jpeg_scratch_free(js);
+			return NULL;
+		}
+		for (r = 0; r < 16; ++r)
+			js->rows[c][r] = js->planes[c] + r * w;
+	}
+	worker->priv = js;
+	worker->priv_free = jpeg_scratch_free;
+
+	return js;
+}
+
+static void pad_row(unsigned char *row, unsigned int used, unsigned int total)
+{
+	unsigned int x;
+
+	for (x = used; x < total; ++x)
+		row[x] = row[used - 1];
+}
+
+/* YUYV -> planar 4:2:2 rows, replicating the last row below the image */
+static void jpeg_rows_yuyv(struct jpeg_scratch *js, const struct encode_job *job, unsigned int y0)
+{
+	const unsigned char *frame = job->raw;
+	unsigned int w = job->width, h = job->height, stride = job->stride ? job->stride : w * 2;
+	unsigned int r, x, src_y;
+	const unsigned char *s;
+	unsigned char *py, *pu, *pv;
+
+	for (r = 0; r < 8; ++r) {
+		src_y = y0 + r < h ? y0 + r : h - 1;
+		s = frame + src_y * stride;
+		py = js->rows[0][r];
+		pu = js->rows[1][r];
+		pv = js->rows[2][r];
+		for (x = 0; x < w / 2; ++x) {
+			py[2 * x]     = s[4 * x];
+			pu[x]         = s[4 * x + 1];
+			py[2 * x + 1] = s[4 * x + 2];
+			pv[x]         = s[4 * x + 3];
+		}
+		pad_row(py, w, js->luma_width);
+		pad_row(pu, w / 2, js->luma_width / 2);
+		pad_row(pv, w / 2, js->luma_width / 2);
+	}
+}
+
+/* NV12 -> planar 4:2:0 rows (16 luma, 8 chroma per MCU row) */
+static void jpeg_rows_nv12(struct jpeg_scratch *js, const struct encode_job *job, unsigned int y0)
+{
+	const unsigned char *frame = job->raw;
+	unsigned int w = job->width, h = job->height, stride = job->stride ? job->stride : w;
+	const unsigned char *uv = frame + stride * h, *s;
+	unsigned int r, x, src_y;
+	unsigned char *pu, *pv;
+
+	for (r = 0; r < 16; ++r) {
+		src_y = y0 + r < h ? y0 + r : h - 1;
+		memcpy(js->rows[0][r], frame + src_y * stride, w);
+		pad_row(js->rows[0][r], w, js->luma_width);
+	}
+	for (r = 0; r < 8; ++r) {
+		src_y = y0 / 2 + r < h / 2 ? y0 / 2 + r : h / 2 - 1;
+		s = uv + src_y * stride;
+		pu = js->rows[1][r];
+		pv = js->rows[2][r];
+		for (x = 0; x < w / 2; ++x) {
+			pu[x] = s[2 * x];
+			pv[x] = s[2 * x + 1];
+		}
+		pad_row(pu, w / 2, js->luma_width / 2);
+		pad_row(pv, w / 2, js->luma_width / 2);
+	}
+}
+
+/**
+Function Name : jpeg_encode_frame
+Function Description : Compresses one YUYV or NV12 frame with libjpeg raw (planar) input, so chroma is never
+                       upsampled and downsampled again
+Parameter : worker owning the scratch buffers and the job to encode
+Return : 0 for success -1 when the scratch buffers cannot be allocated or libjpeg failed on the frame
+**/
+int jpeg_encode_frame(struct encode_worker *worker, struct encode_job *job)
+{
+	struct jpeg_scratch *js = jpeg_scratch_get(worker, job->width);
+	struct jpeg_compress_struct *cinfo;
+	int nv12 = job->fourcc == V4L2_PIX_FMT_NV12;
+	unsigned int lines = nv12 ? 16 : 8, y;
+	JSAMPARRAY planes[3];
+
+	job->out_size = 0;
+	if (!js)
+		return -1;
+	cinfo = &js->cinfo;
+	planes[0] = js->rows[0];
+	planes[1] = js->rows[1];
+	planes[2] = js->rows[2];
+	js->out = job->out;
+	js->out_size = job->out_capacity;
+	if (setjmp(js->jerr.jump)) {
+		jpeg_abort_compress(cinfo);
+		if (js->out != job->out)
+			free(js->out);  /* a buffer libjpeg grew into */
+		return -1;
+	}
+
+	jpeg_mem_dest(cinfo, &js->out, &js->out_size);
+
+	cinfo->image_width = job->width;
+	cinfo->image_height = job->height;
+	cinfo->input_components = 3;
+	cinfo->in_color_space = JCS_YCbCr;
+	jpeg_set_defaults(cinfo);
+	jpeg_set_colorspace(cinfo, JCS_YCbCr);
+	jpeg_set_quality(cinfo, encode_quality, TRUE);
+	cinfo->raw_data_in = TRUE;
+	cinfo->dct_method = JDCT_IFAST;
+	cinfo->comp_info[0].h_samp_factor = 2;
+	cinfo->comp_info[0].v_samp_factor = nv12 ? 2 : 1;
+	cinfo->comp_info[1].h_samp_factor = cinfo->comp_info[1].v_samp_factor = 1;
+	cinfo->comp_info[2].h_samp_factor = cinfo->comp_info[2].v_samp_factor = 1;
+
+	jpeg_start_compress(cinfo, TRUE);
+	for (y = 0; y < job->height; y += lines) {
+		if (nv12)
+			jpeg_rows_nv12(js, job, y);
+		else
+			jpeg_rows_yuyv(js, job, y);
+		jpeg_write_raw_data(cinfo, planes, lines);
+	}
+	jpeg_finish_compress(cinfo);
+
+	/* libjpeg allocates a larger buffer itself when ours was too small */
+	if (js->out != job->out) {
+		free(job->out);
+		job->out = js->out;
+		job->out_capacity = js->out_size;
+	}
+	job->out_size = js->out_size;
+
+	return 0;
+}
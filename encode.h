@@ -0,0 +1,53 @@
+#pragma once
+#include <pthread.h>
+
+enum encode_codec {
+	ENCODE_NONE,
+	ENCODE_JPEG,
+	ENCODE_LZ4,
+	ENCODE_ZSTD,
+	ENCODE_H264,
+};
+
+enum encode_slot_state {
+	SLOT_FREE,
+	SLOT_PENDING,
+	SLOT_BUSY,
+	SLOT_DONE,
+};
+
+struct encode_job {
+	unsigned char *raw;             /* private copy of the dequeued frame */
+	unsigned int raw_size;
+	unsigned char *out;             /* compressed frame, written in capture order */
+	unsigned long out_size;
+	unsigned long out_capacity;
+	unsigned int seq;
+	unsigned int width, height, fourcc;
+	unsigned int stride;            /* bytesperline of the first plane, 0 for the packed width */
+	unsigned long long ts_ns;       /* when it was submitted, the clock of the H.264 timestamps */
+	long long pts, dts;             /* of the coded frame in out, which for H.264 may be an earlier one */
+	int keyframe;
+	enum encode_slot_state state;
+};
+
+struct encode_worker {
+	pthread_t thread;
+	unsigned int index;
+	unsigned int frames;
+	double cpu_time;                /* seconds of thread CPU time spent encoding */
+	void *priv;                     /* codec scratch (row buffers, contexts) */
+	void (*priv_free)(void *priv);
+};
+
+extern enum encode_codec encode_codec;
+extern unsigned int encode_quality, encode_threads;
+
+int encoder_init(int out_fd, unsigned int frame_width, unsigned int frame_height, unsigned int fourcc,
+	unsigned int bytesperline, unsigned int sizeimage);
+int encoder_set_format(unsigned int frame_width, unsigned int frame_height, unsigned int fourcc,
+	unsigned int bytesperline, unsigned int sizeimage);
+int encoder_submit(const void *frame, unsigned int size);
+void encoder_finish(void);
+void encode_worker_release(struct encode_worker *worker);
+int jpeg_encode_frame(struct encode_worker *worker, struct encode_job *job);
@@ -0,0 +1,175 @@
+#include "header.h"
+#include "framecheck.h"
+#include "crc32c.h"
+#include "metrics.h"
+
+/*
+ * Catches what the driver does not flag: a camera that freezes and keeps delivering the same image, and
+ * frames cut short without V4L2_BUF_FLAG_ERROR. With -k every dequeued frame is fingerprinted with CRC32C
+ * (sparse is cheap enough for 1080p60) and the result goes to a per-frame sidecar next to the recording.
+ */
+
+enum crc_mode crc_mode = CRC_OFF;
+struct framecheck_stats framecheck_stats;
+
+static unsigned int expected_size, frame_fourcc;
+static uint32_t last_crc;
+static int have_last;
+static unsigned int repeat_run;
+static FILE *sidecar;
+
+/**
+Function Name : framecheck_parse
+Function Description : Parses the -k argument
+Parameter : off, sparse or full
+Return : 0 for success -1 for an unknown mode
+**/
+int framecheck_parse(const char *arg)
+{
+	if (strcmp(arg, "off") == 0)
+		crc_mode = CRC_OFF;
+	else if (strcmp(arg, "sparse") == 0)
+		crc_mode = CRC_SPARSE;
+	else if (strcmp(arg, "full") == 0)
+		crc_mode = CRC_FULL;
+	else {
+		fprintf(stderr, "Unknown checksum mode %s, use off, sparse or full\n", arg);
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+Function Name : framecheck_init
+Function Description : Starts a new stream of checks for the negotiated format
+Parameter : sizeimage every uncompressed frame must fill, and the fourcc
+Return : void
+**/
+void framecheck_init(unsigned int sizeimage, unsigned int fourcc)
+{
+	expected_size = sizeimage;
+	frame_fourcc = fourcc;
+	have_last = 0;
+	repeat_run = 0;
+	memset(&framecheck_stats, 0, sizeof(framecheck_stats));
+}
+
+/**
+Function Name : framecheck_open_sidecar
+Function Description : Creates <recording>.crc, one line per frame: sequence, timestamp, bytesused, CRC32C
+                       and status
+Parameter : recording file name
+Return : 0 for success -1 for failure
+**/
+int framecheck_open_sidecar(const char *recording)
+{
+	char path[256];
+
+	if (crc_mode == CRC_OFF)
+		return 0;
+	snprintf(path, sizeof(path), "%s.crc", recording);
+	if (!(sidecar = fopen(path, "w"))) {
+		perror(path);
+		return -1;
+	}
+	fprintf(sidecar, "# sequence timestamp bytesused crc32c(%s) status\n", crc_mode == CRC_FULL ? "full" : "sparse");
+
+	return 0;
+}
+
+/* A complete JPEG starts with SOI and ends with EOI; some cameras pad a few zero bytes after EOI */
+static int jpeg_complete(const unsigned char *p, unsigned int len)
+{
+	unsigned int i;
+
+	if (len < 4 || p[0] != 0xff || p[1] != 0xd8)
+		return 0;
+	for (i = len; i >= 2 && i + 16 > len; --i)
+		if (p[i - 2] == 0xff && p[i - 1] == 0xd9)
+			return 1;
+
+	return 0;
+}
+
+/**
+Function Name : framecheck_frame
+Function Description : Fingerprints one frame, flags repeats and truncation, updates the counters and appends
+                       the sidecar line. Reports once when the stream gets stuck and when it recovers
+Parameter : dequeued frame and where to store its checksum (may be NULL)
+Return : FRAME_* status bits
+**/
+unsigned int framecheck_frame(const struct v4l2cap_frame *frame, uint32_t *crc_out)
+{
+	unsigned int status = FRAME_OK;
+	uint32_t crc;
+
+	if (crc_mode == CRC_OFF)
+		return FRAME_OK;
+
+	crc = crc_mode == CRC_FULL ? crc32c(0, frame->data, frame->bytesused)
+		: crc32c_sparse(frame->data, frame->bytesused, FRAMECHECK_SPARSE_STEP);
+	framecheck_stats.frames++;
+
+	if (frame_fourcc == V4L2_PIX_FMT_MJPEG || frame_fourcc == V4L2_PIX_FMT_JPEG) {
+		if (!jpeg_complete(frame->data, frame->bytesused))
+			status |= FRAME_TRUNCATED;
+	} else if (frame->bytesused < expected_size)
+		status |= FRAME_TRUNCATED;
+
+	/* the length is part of the sparse fingerprint, so a repeat also means the same size */
+	if (have_last && crc == last_crc) {
+		status |= FRAME_REPEATED;
+		if (++repeat_run > framecheck_stats.longest_repeat_run)
+			framecheck_stats.longest_repeat_run = repeat_run;
+		if (repeat_run == FRAMECHECK_STUCK_RUN) {
+			framecheck_stats.stuck_events++;
+			fprintf(stderr, "frame %u: image unchanged for %u frames, camera looks stuck\n", frame->sequence,
+				repeat_run + 1);
+		}
+	} else {
+		if (repeat_run >= FRAMECHECK_STUCK_RUN)
+			fprintf(stderr, "frame %u: image changing again after %u repeats\n", frame->sequence, repeat_run);
+		repeat_run = 0;
+	}
+	last_crc = crc;
+	have_last = 1;
+
+	if (status & FRAME_REPEATED) {
+		framecheck_stats.repeated++;
+		metric_inc(MC_FRAMES_REPEATED, 1);
+	}
+	if (status & FRAME_TRUNCATED) {
+		framecheck_stats.truncated++;
+		metric_inc(MC_FRAMES_TRUNCATED, 1);
+	}
+	if (sidecar)
+		fprintf(sidecar, "%u %ld.%06ld %u %08x %s\n", frame->sequence, (long)frame->timestamp.tv_sec,
+			(long)frame->timestamp.tv_usec, frame->bytesused, crc,
+			status == FRAME_OK ? "ok" : status == FRAME_REPEATED ? "repeat"
+			: status == FRAME_TRUNCATED ? "truncated" : "repeat+truncated");
+	if (crc_out)
+		*crc_out = crc;
+
+	return status;
+}
+
+/**
+Function Name : framecheck_finish
+Function Description : Prints the summary and closes the sidecar
+Parameter : void
+Return : void
+**/
+void framecheck_finish(void)
+{
+	if (crc_mode == CRC_OFF)
+		return;
+	printf("crc32c (%s, %s): %llu frames checked, %llu repeated (longest run %u, stuck %u times), %llu truncated\n",
+		crc_mode == CRC_FULL ? "full" : "sparse", crc32c_impl(), framecheck_stats.frames,
+		framecheck_stats.repeated, framecheck_stats.longest_repeat_run, framecheck_stats.stuck_events,
+		framecheck_stats.truncated);
+	if (sidecar) {
+		fclose(sidecar);
+		sidecar = NULL;
+	}
+}
@@ -0,0 +1,36 @@
+#pragma once
+#include <stdint.h>
+#include "v4l2capture.h"
+
+#define FRAMECHECK_STUCK_RUN 3          /* repeats in a row before the stream is reported stuck */
+#define FRAMECHECK_SPARSE_STEP 4096     /* bytes between sparse samples */
+
+enum crc_mode {
+	CRC_OFF,
+	CRC_SPARSE,                     /* sample every FRAMECHECK_SPARSE_STEP bytes */
+	CRC_FULL,
+};
+
+/* Per-frame status bits, also written to the sidecar */
+enum frame_status {
+	FRAME_OK = 0,
+	FRAME_REPEATED = 1 << 0,        /* same checksum and size as the previous frame */
+	FRAME_TRUNCATED = 1 << 1,       /* bytesused short of sizeimage, or a JPEG without its EOI marker */
+};
+
+struct framecheck_stats {
+	unsigned long long frames;
+	unsigned long long repeated;
+	unsigned long long truncated;
+	unsigned int stuck_events;
+	unsigned int longest_repeat_run;
+};
+
+extern enum crc_mode crc_mode;
+extern struct framecheck_stats framecheck_stats;
+
+int framecheck_parse(const char *arg);
+void framecheck_init(unsigned int sizeimage, unsigned int fourcc);
+int framecheck_open_sidecar(const char *recording);
+unsigned int framecheck_frame(const struct v4l2cap_frame *frame, uint32_t *crc);
+void framecheck_finish(void);
@@ -0,0 +1,72 @@
+#pragma once
+#include <linux/videodev2.h>
+
+#define FRAME_MAX_PLANES 2
+
+/*
+ * A dequeued frame with the layout of its planes, so sinks index rows by pitch instead of recomputing offsets
+ * from a pointer and a length. Compressed and unknown formats are one plane holding bytesused bytes.
+ */
+struct frame_view {
+	const unsigned char *plane[FRAME_MAX_PLANES];
+	unsigned int pitch[FRAME_MAX_PLANES];   /* bytes per row */
+	unsigned int rows[FRAME_MAX_PLANES];
+	unsigned int n_planes;
+	unsigned int width, height, fourcc;
+	unsigned int bytesused;
+	unsigned int size;                      /* bytes the layout needs, 0 when only the payload knows */
+	unsigned int sequence;
+};
+
+/*
+ * Inlined with a constant fourcc, the switch folds away and only the plane arithmetic is left. bytesperline is
+ * the negotiated stride of the first plane, which NV12's chroma plane shares; 0 or less than a row means packed.
+ */
+static inline void frame_view_init(struct frame_view *v, const void *data, unsigned int bytesused,
+	unsigned int sequence, unsigned int width, unsigned int height, unsigned int fourcc, unsigned int bytesperline)
+{
+	unsigned int row = fourcc == V4L2_PIX_FMT_YUYV ? width * 2 : width;
+	unsigned int pitch = bytesperline > row ? bytesperline : row;
+
+	v->plane[0] = data;
+	v->plane[1] = 0;
+	v->pitch[1] = v->rows[1] = 0;
+	v->width = width;
+	v->height = height;
+	v->fourcc = fourcc;
+	v->bytesused = bytesused;
+	v->sequence = sequence;
+	switch (fourcc) {
+	case V4L2_PIX_FMT_YUYV:
+		v->n_planes = 1;
+		v->pitch[0] = pitch;
+		v->rows[0] = height;
+		v->size = pitch * height;
+		break;
+	case V4L2_PIX_FMT_NV12:
+		v->n_planes = 2;
+		v->pitch[0] = v->pitch[1] = pitch;
+		v->rows[0] = height;
+		v->rows[1] = height / 2;
+		v->plane[1] = v->plane[0] + pitch * height;
+		v->size = pitch * height * 3 / 2;
+		break;
+	case V4L2_PIX_FMT_GREY:
+		v->n_planes = 1;
+		v->pitch[0] = pitch;
+		v->rows[0] = height;
+		v->size = pitch * height;
+		break;
+	default:
+		v->n_planes = 1;
+		v->pitch[0] = bytesused;
+		v->rows[0] = 1;
+		v->size = 0;
+	}
+}
+
+/* A short frame keeps its planes, but they reach past bytesused */
+static inline int frame_view_complete(const struct frame_view *v)
+{
+	return v->bytesused >= v->size;
+}
@@ -0,0 +1,384 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <linux/videodev2.h>
+#ifdef V4L2_H264
+#include <x264.h>
+#endif
+
+#include "h264.h"
+#include "mp4.h"
+
+/*
+ * H.264 recording for long captures: x264 in the encode worker, one worker only, since every frame is coded
+ * against the ones before it, with x264's own frame threads (i_threads = -t) doing the parallel work. The
+ * slot ring in front of it stays the bounded queue: a frame that finds it full is dropped, never waited for.
+ * The writer thread muxes the coded frames into a fragmented MP4 (mp4.c) in the order x264 hands them out,
+ * which with lookahead and B-frames is some frames behind the input; the slots of frames still inside x264
+ * are written empty. Built only with make H264=1, which links libx264.
+ */
+
+struct h264_config h264_config = { "veryfast", "", 23, 0, 10, 0 };
+struct h264_stats h264_stats;
+
+#ifdef V4L2_H264
+/* Everything one recording keeps; the worker owns it, the writer thread only touches mp4 */
+struct h264_scratch {
+	x264_t *enc;
+	x264_picture_t pic;
+	unsigned int width, height, fourcc;
+	unsigned char sps[256], pps[256];       /* for the MP4 header, without their lengths */
+	unsigned int sps_size, pps_size;
+	unsigned long long first_ns;            /* submit time of the first frame, pts 0 */
+	long long last_pts;
+	int have_first;
+	struct mp4_writer *mp4;                 /* opened by the writer at the first coded frame */
+};
+#endif
+
+/**
+Function Name : h264_parse
+Function Description : Parses the -x argument: comma separated preset=, tune=, crf=, kbps= (average
+                       bitrate instead of constant quality) and keyint=<seconds>, or "on" for the defaults
+Parameter : option string
+Return : 0 for success -1 for a bad option or a build without libx264
+**/
+int h264_parse(const char *spec)
+{
+	char *opts = strdup(spec), *item, *save;
+	int ret = 0;
+
+	encode_codec = ENCODE_H264;
+	for (item = strtok_r(opts, ",", &save); item; item = strtok_r(NULL, ",", &save)) {
+		if (strcmp(item, "on") == 0)
+			continue;
+		else if (strncmp(item, "preset=", 7) == 0)
+			snprintf(h264_config.preset, sizeof(h264_config.preset), "%s", item + 7);
+		else if (strncmp(item, "tune=", 5) == 0)
+			snprintf(h264_config.tune, sizeof(h264_config.tune), "%s", item + 5);
+		else if (strncmp(item, "crf=", 4) == 0)
+			h264_config.crf = strtol(item + 4, NULL, 10);
+		else if (strncmp(item, "kbps=", 5) == 0)
+			h264_config.kbps = strtol(item + 5, NULL, 10);
+		else if (strncmp(item, "keyint=", 7) == 0)
+			h264_config.keyint = strtol(item + 7, NULL, 10);
+		else {
+			fprintf(stderr, "Unknown h264 option %s\n", item);
+			ret = -1;
+		}
+	}
+	free(opts);
+	if (h264_config.crf > 51) {
+		fprintf(stderr, "H.264 crf must be 0 to 51\n");
+		ret = -1;
+	}
+	if (h264_config.keyint < 1) {
+		fprintf(stderr, "H.264 keyint must be at least 1 second\n");
+		ret = -1;
+	}
+	if (!h264_available()) {
+		fprintf(stderr, "Built without H.264, rebuild with make H264=1\n");
+		ret = -1;
+	}
+
+	return ret;
+}
+
+/**
+Function Name : h264_available
+Function Description : Tells whether this build links libx264
+Parameter : void
+Return : 1 when it does 0 otherwise
+**/
+int h264_available(void)
+{
+#ifdef V4L2_H264
+	return 1;
+#else
+	return 0;
+#endif
+}
+
+#ifdef V4L2_H264
+static void h264_scratch_free(void *priv)
+{
+	struct h264_scratch *hs = priv;
+
+	if (hs->mp4)
+		mp4_close(hs->mp4, NULL);
+	if (hs->enc)
+		x264_encoder_close(hs->enc);
+	x264_picture_clean(&hs->pic);
+	free(hs);
+}
+
+/* Drops a scratch x264 would not open for, so the next frame tries again; only the first failure is told */
+static struct h264_scratch *h264_scratch_fail(struct encode_worker *worker, const char *why)
+{
+	if (!h264_stats.open_failures++)
+		fprintf(stderr, "h264: %s, retrying with the next frame\n", why);
+	encode_worker_release(worker);
+
+	return NULL;
+}
+
+/* Opens x264 for the job's size and keeps its SPS and PPS for the MP4 header */
+static struct h264_scratch *h264_scratch_get(struct encode_worker *worker, const struct encode_job *job)
+{
+	struct h264_scratch *hs = worker->priv;
+	unsigned int fps = h264_config.fps ? h264_config.fps : 30;
+	x264_param_t param;
+	x264_nal_t *nal;
+	int i, n;
+
+	if (hs)
+		return hs;
+	if (!(hs = calloc(1, sizeof(*hs))))
+		return h264_scratch_fail(worker, "out of memory");
+	worker->priv = hs;
+	worker->priv_free = h264_scratch_free;
+	hs->width = job->width;
+	hs->height = job->height;
+	hs->fourcc = job->fourcc;
+
+	if (x264_param_default_preset(&param, h264_config.preset, h264_config.tune[0] ? h264_config.tune : NULL) < 0)
+		return h264_scratch_fail(worker, "unknown preset or tune");
+	param.i_threads = encode_threads;
+	param.i_width = job->width;
+	param.i_height = job->height;
+	param.i_csp = job->fourcc == V4L2_PIX_FMT_NV12 ? X264_CSP_NV12 : X264_CSP_I420;
+	/* capture timestamps, in the MP4 timescale, so dropped frames leave gaps in time and not a faster clip */
+	param.b_vfr_input = 1;
+	param.i_timebase_num = 1;
+	param.i_timebase_den = MP4_TIMESCALE;
+	param.i_fps_num = fps;
+	param.i_fps_den = 1;
+	param.i_keyint_max = fps * h264_config.keyint;
+	param.b_annexb = 0;             /* 4-byte lengths, as avcC has them */
+	param.b_repeat_headers = 0;     /* SPS and PPS go in the MP4 header */
+	param.i_log_level = X264_LOG_WARNING;
+	if (h264_config.kbps) {
+		param.rc.i_rc_method = X264_RC_ABR;
+		param.rc.i_bitrate = h264_config.kbps;
+		param.rc.i_vbv_max_bitrate = h264_config.kbps;
+		param.rc.i_vbv_buffer_size = h264_config.kbps;
+	} else {
+		param.rc.i_rc_method = X264_RC_CRF;
+		param.rc.f_rf_constant = h264_config.crf;
+	}
+	if (x264_param_apply_profile(&param, "high") < 0 ||
+	    x264_picture_alloc(&hs->pic, param.i_csp, job->width, job->height) < 0 ||
+	    !(hs->enc = x264_encoder_open(&param)))
+		return h264_scratch_fail(worker, "cannot open the encoder");
+	x264_encoder_parameters(hs->enc, &param);
+	h264_stats.threads = param.i_threads;
+
+	/* each NAL carries its 4-byte length, which avcC has no use for */
+	if (x264_encoder_headers(hs->enc, &nal, &n) < 0)
+		return h264_scratch_fail(worker, "no SPS and PPS from the encoder");
+	for (i = 0; i < n; ++i) {
+		if (nal[i].i_type == NAL_SPS && nal[i].i_payload - 4 <= (int)sizeof(hs->sps)) {
+			hs->sps_size = nal[i].i_payload - 4;
+			memcpy(hs->sps, nal[i].p_payload + 4, hs->sps_size);
+		} else if (nal[i].i_type == NAL_PPS && nal[i].i_payload - 4 <= (int)sizeof(hs->pps)) {
+			hs->pps_size = nal[i].i_payload - 4;
+			memcpy(hs->pps, nal[i].p_payload + 4, hs->pps_size);
+		}
+	}
+
+	return hs;
+}
+
+/* YUYV -> I420, chroma averaged over each pair of rows; GREY -> I420 with neutral chroma. Rows are
+   job->stride apart, NV12's chroma plane follows the luma at the same stride */
+static void h264_fill_picture(x264_picture_t *pic, const struct encode_job *job)
+{
+	const unsigned char *frame = job->raw, *s0, *s1;
+	unsigned int w = job->width, h = job->height, x, y;
+	unsigned int stride = job->stride ? job->stride : job->fourcc == V4L2_PIX_FMT_YUYV ? w * 2 : w;
+	unsigned char *py, *pu, *pv;
+
+	if (job->fourcc == V4L2_PIX_FMT_NV12) {
+		for (y = 0; y < h; ++y)
+			memcpy(pic->img.plane[0] + y * pic->img.i_stride[0], frame + y * stride, w);
+		for (y = 0; y < h / 2; ++y)
+			memcpy(pic->img.plane[1] + y * pic->img.i_stride[1], frame + stride * h + y * stride, w);
+		return;
+	}
+	if (job->fourcc == V4L2_PIX_FMT_GREY) {
+		for (y = 0; y < h; ++y)
+			memcpy(pic->img.plane[0] + y * pic->img.i_stride[0], frame + y * stride, w);
+		for (y = 0; y < h / 2; ++y) {
+			memset(pic->img.plane[1] + y * pic->img.i_stride[1], 128, w / 2);
+			memset(pic->img.plane[2] + y * pic->img.i_stride[2], 128, w / 2);
+		}
+		return;
+	}
+	for (y = 0; y < h; y += 2) {
+		s0 = frame + y * stride;
+		s1 = y + 1 < h ? s0 + stride : s0;
+		py = pic->img.plane[0] + y * pic->img.i_stride[0];
+		pu = pic->img.plane[1] + y / 2 * pic->img.i_stride[1];
+		pv = pic->img.plane[2] + y / 2 * pic->img.i_stride[2];
+		for (x = 0; x < w / 2; ++x) {
+			py[2 * x] = s0[4 * x];
+			py[2 * x + 1] = s0[4 * x + 2];
+			pu[x] = (s0[4 * x + 1] + s1[4 * x + 1] + 1) >> 1;
+			pv[x] = (s0[4 * x + 3] + s1[4 * x + 3] + 1) >> 1;
+		}
+		if (y + 1 < h) {
+			py += pic->img.i_stride[0];
+			for (x = 0; x < w; ++x)
+				py[x] = s1[2 * x];
+		}
+	}
+}
+
+/* Copies a coded frame's NALs, which x264 lays out back to back, into the job */
+static int h264_take(struct encode_job *job, const x264_nal_t *nal, int size, const x264_picture_t *out)
+{
+	unsigned char *p;
+
+	job->out_size = 0;
+	if (size <= 0)
+		return 0;
+	if ((unsigned long)size > job->out_capacity) {
+		if (!(p = realloc(job->out, size)))
+			return -1;
+		job->out = p;
+		job->out_capacity = size;
+	}
+	memcpy(job->out, nal[0].p_payload, size);
+	job->out_size = size;
+	job->pts = out->i_pts;
+	job->dts = out->i_dts;
+	job->keyframe = out->b_keyframe;
+
+	return 0;
+}
+#endif
+
+/**
+Function Name : h264_encode_frame
+Function Description : Feeds one frame to x264, opening it on the first; the job gets whatever frame x264
+                       hands out in return, which is an earlier one or none while the lookahead fills
+Parameter : worker owning the x264 context and the job to encode
+Return : 0 for success -1 for failure
+**/
+int h264_encode_frame(struct encode_worker *worker, struct encode_job *job)
+{
+#ifdef V4L2_H264
+	struct h264_scratch *hs = h264_scratch_get(worker, job);
+	x264_picture_t out;
+	x264_nal_t *nal;
+	long long pts;
+	int n, size;
+
+	job->out_size = 0;
+	if (!hs)
+		return -1;
+	if (job->width != hs->width || job->height != hs->height || job->fourcc != hs->fourcc)
+		return -1;      /* encoder_set_format() refuses this, a recovery may not */
+	if (!hs->have_first) {
+		hs->first_ns = job->ts_ns;
+		hs->last_pts = -1;
+		hs->have_first = 1;
+	}
+	pts = (long long)(job->ts_ns - hs->first_ns) * 9 / 100000;
+	if (pts <= hs->last_pts)
+		pts = hs->last_pts + 1; /* x264 wants them strictly increasing */
+	hs->last_pts = pts;
+
+	h264_fill_picture(&hs->pic, job);
+	hs->pic.i_pts = pts;
+	hs->pic.i_type = X264_TYPE_AUTO;
+	if ((size = x264_encoder_encode(hs->enc, &nal, &n, &hs->pic, &out)) < 0)
+		return -1;
+	n = x264_encoder_delayed_frames(hs->enc);
+	if ((unsigned int)n > h264_stats.delayed_max)
+		h264_stats.delayed_max = n;
+
+	return h264_take(job, nal, size, &out);
+#else
+	(void)worker;
+	job->out_size = 0;
+	return -1;
+#endif
+}
+
+/**
+Function Name : h264_write
+Function Description : Muxes a coded frame from the writer thread, starting the MP4 at the first one
+Parameter : the encode worker that coded it, output fd and the job; an empty one is a frame still inside x264
+Return : 0 for success -1 for a failed write
+**/
+int h264_write(struct encode_worker *worker, int fd, const struct encode_job *job)
+{
+#ifdef V4L2_H264
+	struct h264_scratch *hs;
+
+	if (!job->out_size)
+		return 0;
+	/* a coded frame was handed over under the encode lock after the scratch that coded it was set up */
+	hs = worker->priv;
+	if (!hs->mp4 && !(hs->mp4 = mp4_open(fd, job->width, job->height, hs->sps, hs->sps_size, hs->pps,
+			hs->pps_size, job->pts, job->dts)))
+		return -1;
+
+	return mp4_sample(hs->mp4, job->out, job->out_size, job->pts, job->dts, job->keyframe);
+#else
+	(void)worker;
+	(void)fd;
+	(void)job;
+	return -1;
+#endif
+}
+
+/**
+Function Name : h264_finish
+Function Description : Drains the frames x264 still holds into the MP4, closes it and fills h264_stats; called
+                       once the workers and the writer have stopped
+Parameter : the encode worker owning the x264 context and the output fd
+Return : bytes in the MP4 file
+**/
+unsigned long long h264_finish(struct encode_worker *worker, int fd)
+{
+#ifdef V4L2_H264
+	struct h264_scratch *hs = worker->priv;
+	struct encode_job job = { 0 };
+	struct mp4_stats st = { 0 };
+	x264_picture_t out;
+	x264_nal_t *nal;
+	int n, size;
+
+	if (hs && hs->enc) {
+		job.width = hs->width;
+		job.height = hs->height;
+		while (x264_encoder_delayed_frames(hs->enc) > 0) {
+			if ((size = x264_encoder_encode(hs->enc, &nal, &n, NULL, &out)) < 0 ||
+			    h264_take(&job, nal, size, &out) < 0 || h264_write(worker, fd, &job) < 0)
+				break;
+		}
+		free(job.out);
+	}
+	if (hs) {
+		if (hs->mp4)
+			mp4_close(hs->mp4, &st);
+		hs->mp4 = NULL;
+		hs->have_first = 0;
+	}
+
+	h264_stats.frames = st.samples;
+	h264_stats.keyframes = st.keyframes;
+	h264_stats.bytes = st.bytes;
+	h264_stats.fragments = st.fragments;
+	h264_stats.duration = st.duration;
+
+	return st.bytes;
+#else
+	(void)worker;
+	(void)fd;
+	return 0;
+#endif
+}
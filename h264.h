@@ -0,0 +1,31 @@
+#pragma once
+#include "encode.h"
+
+struct h264_config {
+	char preset[16];                /* x264 preset, ultrafast to placebo */
+	char tune[16];                  /* x264 tune, empty for none */
+	unsigned int crf;               /* constant quality, used when kbps is 0 */
+	unsigned int kbps;              /* average bitrate with a VBV of one second */
+	unsigned int keyint;            /* seconds between keyframes, each starts an MP4 fragment */
+	unsigned int fps;               /* nominal frame rate for rate control and the level, 0 for 30 */
+};
+
+struct h264_stats {
+	unsigned long long frames;              /* coded and written */
+	unsigned long long keyframes;
+	unsigned long long bytes;               /* MP4 file, boxes included */
+	unsigned long long fragments;
+	unsigned long long duration;            /* in MP4_TIMESCALE ticks */
+	unsigned int delayed_max;               /* frames x264 held at once, lookahead and B-frames */
+	unsigned int threads;
+	unsigned int open_failures;             /* frames x264 would not open for */
+};
+
+extern struct h264_config h264_config;
+extern struct h264_stats h264_stats;
+
+int h264_parse(const char *spec);
+int h264_available(void);
+int h264_encode_frame(struct encode_worker *worker, struct encode_job *job);
+int h264_write(struct encode_worker *worker, int fd, const struct encode_job *job);
+unsigned long long h264_finish(struct encode_worker *worker, int fd);
@@ -0,0 +1,581 @@
+#include <math.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+#include "header.h"
+#include "capture.h"
+#include "hdr.h"
+#include "tilepool.h"
+#include "metrics.h"
+#include "trace.h"
+
+/*
+ * HDR from exposure brackets taken on consecutive frames. The exposure (or gain) control is set on every frame
+ * for the frame latency frames ahead, cycling through the brackets, so frame sequence s is bracket s % n. Each
+ * frame is tagged with the value that applied to it, the last one set for a sequence at or before its own, and
+ * kept until its group of n sequences is complete. The group is merged on the tile pool by exposure fusion:
+ * every pixel is the mean of its brackets weighted by how well exposed each is, with chroma weighted by its
+ * luma. The merge runs while the next group is captured; one frame comes out per group.
+ */
+
+#define HDR_BAND 16             /* rows per tile pool item, even so NV12 chroma rows stay whole */
+#define HDR_RING 16             /* control values set and the sequence they apply from */
+#define HDR_SAMPLE 8            /* every 8th pixel of every 8th row makes the brightness of a bracket */
+
+enum hdr_state { HDR_START, HDR_RUN, HDR_OFF };
+
+struct hdr_slot {
+	unsigned char *data;
+	unsigned int sequence;
+	unsigned int mean;
+};
+
+struct hdr_job {
+	const unsigned char *src[HDR_MAX_BRACKETS];
+	unsigned char *dst;
+	unsigned int n, width, height, fourcc;
+	unsigned int pitch;             /* of the brackets and the merged frame alike */
+};
+
+struct hdr_config hdr_config = { 3, 2.0, 0, 2 };
+struct hdr_stats hdr_stats;
+int hdr_enabled;
+
+static enum hdr_state state;
+static unsigned int ctrl_id;
+static int base_value;
+static struct {
+	unsigned int sequence;
+	int value;
+} issued[HDR_RING];
+static unsigned int n_issued;
+static int last_issued;
+static struct hdr_slot slots[2][HDR_MAX_BRACKETS];     /* per group parity */
+static unsigned int have[2];                            /* brackets of the group in each set */
+static unsigned int cur_group, cur_set, group_started, group_merged;
+static unsigned char *fused[2];
+static unsigned int fused_next, merge_set, merge_sequence;
+static int merge_pending;
+static struct hdr_job job;
+static struct tile_future merge_done;
+static unsigned int cur_width, cur_height, cur_fourcc, cur_pitch, frame_size;
+static int unsupported_reported;
+
+/**
+Function Name : hdr_parse
+Function Description : Parses the -H argument: "on", or comma separated brackets=<n>, stops=<EV>,
+                       latency=<frames> and gain
+Parameter : option string
+Return : 0 for success -1 for a bad option
+**/
+int hdr_parse(const char *spec)
+{
+	char *opts = strdup(spec), *item, *save;
+	int ret = 0;
+
+	hdr_enabled = 1;
+	for (item = strtok_r(opts, ",", &save); item; item = strtok_r(NULL, ",", &save)) {
+		if (strcmp(item, "on") == 0)
+			continue;
+		else if (strncmp(item, "brackets=", 9) == 0)
+			hdr_config.brackets = strtol(item + 9, NULL, 10);
+		else if (strncmp(item, "stops=", 6) == 0)
+			hdr_config.stops = strtod(item + 6, NULL);
+		else if (strncmp(item, "latency=", 8) == 0)
+			hdr_config.latency = strtol(item + 8, NULL, 10);
+		else if (strcmp(item, "gain") == 0)
+			hdr_config.gain = 1;
+		else {
+			fprintf(stderr, "Unknown hdr option %s\n", item);
+			ret = -1;
+		}
+	}
+	free(opts);
+	if (hdr_config.brackets < 2 || hdr_config.brackets > HDR_MAX_BRACKETS) {
+		fprintf(stderr, "HDR brackets must be 2 to %u\n", HDR_MAX_BRACKETS);
+		ret = -1;
+	}
+	if (hdr_config.stops <= 0 || hdr_config.stops > 4) {
+		fprintf(stderr, "HDR stops must be above 0 and at most 4\n");
+		ret = -1;
+	}
+	if (hdr_config.latency > HDR_RING / 2) {
+		fprintf(stderr, "HDR latency must be 0 to %u frames\n", HDR_RING / 2);
+		ret = -1;
+	}
+
+	return ret;
+}
+
+/**
+Function Name : hdr_reset
+Function Description : Drops the brackets held, waits for a merge in flight and frees the buffers; the
+                       controls are found again on the next frame
+Parameter : void
+Return : void
+**/
+void hdr_reset(void)
+{
+	unsigned int s, i;
+
+	if (merge_pending)
+		tile_wait(&merge_done);
+	merge_pending = 0;
+	for (s = 0; s < 2; ++s) {
+		for (i = 0; i < HDR_MAX_BRACKETS; ++i) {
+			free(slots[s][i].data);
+			slots[s][i].data = NULL;
+		}
+		free(fused[s]);
+		fused[s] = NULL;
+		have[s] = 0;
+	}
+	cur_width = cur_height = cur_fourcc = cur_pitch = frame_size = 0;
+	group_started = group_merged = 0;
+	n_issued = 0;
+	state = HDR_START;
+}
+
+/* Well-exposedness of a level: ((y (255 - y)) >> 7)^2 >> 6, plus 1 so a group clipped everywhere still averages */
+static inline unsigned int hdr_weight(unsigned int y)
+{
+	unsigned int q = y * (255 - y) >> 7;
+
+	return (q * q >> 6) + 1;
+}
+
+/*
+ * dst[k] = sum w_i src_i[k] / sum w_i over n brackets, w_i the weight of wsrc_i[k], or of wsrc_i[k & ~1] when
+ * pairs share a weight (YUYV Y0 U and Y1 V, NV12 UV from the luma above). Rounded the same in every path.
+ */
+static void fuse_row(unsigned char *dst, const unsigned char *const *src, const unsigned char *const *wsrc,
+	unsigned int n, unsigned int count, int pairs)
+{
+	unsigned int k = 0, i, num, den, w;
+
+#if defined(__SSE2__)
+	const __m128i zero = _mm_setzero_si128(), c255 = _mm_set1_epi16(255), one = _mm_set1_epi16(1);
+	const __m128i even = _mm_set1_epi32(0xffff);
+	__m128i v, y, q, wt, den16, num_lo, num_hi, prod, half;
+	__m128 lo, hi;
+
+	/* weights and products fit 16 bits (253 * 255), the sums over brackets are taken in 32 */
+#define LOAD8(p) _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(p)), zero)
+	for (; k + 8 <= count; k += 8) {
+		den16 = num_lo = num_hi = zero;
+		for (i = 0; i < n; ++i) {
+			v = LOAD8(src[i] + k);
+			y = LOAD8(wsrc[i] + k);
+			if (pairs) {
+				y = _mm_and_si128(y, even);
+				y = _mm_or_si128(y, _mm_slli_epi32(y, 16));
+			}
+			q = _mm_srli_epi16(_mm_mullo_epi16(y, _mm_sub_epi16(c255, y)), 7);
+			wt = _mm_add_epi16(_mm_srli_epi16(_mm_mullo_epi16(q, q), 6), one);
+			den16 = _mm_add_epi16(den16, wt);
+			prod = _mm_mullo_epi16(v, wt);
+			num_lo = _mm_add_epi32(num_lo, _mm_unpacklo_epi16(prod, zero));
+			num_hi = _mm_add_epi32(num_hi, _mm_unpackhi_epi16(prod, zero));
+		}
+		/* (num + den / 2) / den in float is exact to the integer below for these magnitudes */
+		half = _mm_srli_epi16(den16, 1);
+		lo = _mm_div_ps(_mm_cvtepi32_ps(_mm_add_epi32(num_lo, _mm_unpacklo_epi16(half, zero))),
+			_mm_cvtepi32_ps(_mm_unpacklo_epi16(den16, zero)));
+		hi = _mm_div_ps(_mm_cvtepi32_ps(_mm_add_epi32(num_hi, _mm_unpackhi_epi16(half, zero))),
+			_mm_cvtepi32_ps(_mm_unpackhi_epi16(den16, zero)));
+		v = _mm_packs_epi32(_mm_cvttps_epi32(lo), _mm_cvttps_epi32(hi));
+		_mm_storel_epi64((__m128i *)(dst + k), _mm_packus_epi16(v, v));
+	}
+#undef LOAD8
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+	/* vdivq_f32 is AArch64 only, 32-bit ARM takes the scalar loop */
+	const uint16x8_t c255 = vdupq_n_u16(255), one = vdupq_n_u16(1);
+	uint16x8_t v, y, q, wt, den16, prod, half;
+	uint32x4_t num_lo, num_hi;
+	float32x4_t lo, hi;
+
+	for (; k + 8 <= count; k += 8) {
+		den16 = vdupq_n_u16(0);
+		num_lo = num_hi = vdupq_n_u32(0);
+		for (i = 0; i < n; ++i) {
+			v = vmovl_u8(vld1_u8(src[i] + k));
+			y = vmovl_u8(vld1_u8(wsrc[i] + k));
+			if (pairs)
+				y = vtrnq_u16(y, y).val[0];
+			q = vshrq_n_u16(vmulq_u16(y, vsubq_u16(c255, y)), 7);
+			wt = vaddq_u16(vshrq_n_u16(vmulq_u16(q, q), 6), one);
+			den16 = vaddq_u16(den16, wt);
+			prod = vmulq_u16(v, wt);
+			num_lo = vaddw_u16(num_lo, vget_low_u16(prod));
+			num_hi = vaddw_u16(num_hi, vget_high_u16(prod));
+		}
+		half = vshrq_n_u16(den16, 1);
+		lo = vdivq_f32(vcvtq_f32_u32(vaddw_u16(num_lo, vget_low_u16(half))),
+			vcvtq_f32_u32(vmovl_u16(vget_low_u16(den16))));
+		hi = vdivq_f32(vcvtq_f32_u32(vaddw_u16(num_hi, vget_high_u16(half))),
+			vcvtq_f32_u32(vmovl_u16(vget_high_u16(den16))));
+		vst1_u8(dst + k, vqmovn_u16(vcombine_u16(vmovn_u32(vcvtq_u32_f32(lo)), vmovn_u32(vcvtq_u32_f32(hi)))));
+	}
+#endif
+	for (; k < count; ++k) {
+		for (i = num = den = 0; i < n; ++i) {
+			w = hdr_weight(wsrc[i][pairs ? k & ~1u : k]);
+			num += w * src[i][k];
+			den += w;
+		}
+		dst[k] = (num + den / 2) / den;
+	}
+}
+
+static void merge_band(void *arg, unsigned int item, unsigned int worker)
+{
+	const struct hdr_job *j = arg;
+	const unsigned char *s[HDR_MAX_BRACKETS], *ws[HDR_MAX_BRACKETS];
+	unsigned int y0 = item * HDR_BAND, y1 = y0 + HDR_BAND < j->height ? y0 + HDR_BAND : j->height, y, i;
+	unsigned int pitch = j->pitch, row = j->fourcc == V4L2_PIX_FMT_YUYV ? j->width * 2 : j->width;
+	size_t chroma = (size_t)pitch * j->height;
+
+	(void)worker;
+	for (y = y0; y < y1; ++y) {
+		for (i = 0; i < j->n; ++i)
+			s[i] = j->src[i] + (size_t)y * pitch;
+		fuse_row(j->dst + (size_t)y * pitch, s, s, j->n, row, j->fourcc == V4L2_PIX_FMT_YUYV);
+		if (j->fourcc != V4L2_PIX_FMT_NV12 || (y & 1))
+			continue;
+		/* the UV row under luma rows y and y + 1, weighted by the luma of row y */
+		for (i = 0; i < j->n; ++i) {
+			s[i] = j->src[i] + chroma + (size_t)y / 2 * pitch;
+			ws[i] = j->src[i] + (size_t)y * pitch;
+		}
+		fuse_row(j->dst + chroma + (size_t)y / 2 * pitch, s, ws, j->n, row, 1);
+	}
+}
+
+static void merge_submit(const unsigned char *const *src, unsigned int n, unsigned char *dst, unsigned int width,
+	unsigned int height, unsigned int fourcc, unsigned int pitch)
+{
+	unsigned int i;
+
+	for (i = 0; i < n; ++i)
+		job.src[i] = src[i];
+	job.dst = dst;
+	job.n = n;
+	job.width = width;
+	job.height = height;
+	job.fourcc = fourcc;
+	job.pitch = pitch;
+	tile_for(&merge_done, merge_band, &job, (height + HDR_BAND - 1) / HDR_BAND);
+}
+
+/**
+Function Name : hdr_merge
+Function Description : Fuses n brackets of one size and format into dst on the tile pool and waits for it
+Parameter : the brackets, how many, destination of the brackets' size
+Return : nanoseconds from submission to completion
+**/
+unsigned long long hdr_merge(const struct frame_view *brackets, unsigned int n, unsigned char *dst)
+{
+	const unsigned char *src[HDR_MAX_BRACKETS];
+	unsigned int i;
+
+	if (merge_pending) {
+		tile_wait(&merge_done);
+		merge_pending = 0;
+	}
+	for (i = 0; i < n && i < HDR_MAX_BRACKETS; ++i)
+		src[i] = brackets[i].plane[0];
+	merge_submit(src, i, dst, brackets[0].width, brackets[0].height, brackets[0].fourcc, brackets[0].pitch[0]);
+
+	return tile_wait(&merge_done);
+}
+
+/* Takes the exposure (or gain) off the camera's automatic control and works out the bracket values around it */
+static int hdr_open(void)
+{
+	struct v4l2_queryctrl qc;
+	struct v4l2_control ctrl;
+	unsigned int n = hdr_config.brackets, i;
+	int step, v;
+
+	ctrl_id = hdr_config.gain ? V4L2_CID_GAIN : V4L2_CID_EXPOSURE_ABSOLUTE;
+	CLEAR(qc);
+	qc.id = ctrl_id;
+	if (-1 == xioctl(fd, VIDIOC_QUERYCTRL, &qc) || (qc.flags & V4L2_CTRL_FLAG_DISABLED) || qc.maximum <= qc.minimum) {
+		fprintf(stderr, "hdr: %s has no %s control\n", dev_path, hdr_config.gain ? "gain" : "absolute exposure");
+		return -1;
+	}
+	step = qc.step > 0 ? qc.step : 1;
+	CLEAR(ctrl);
+	if (!hdr_config.gain) {
+		ctrl.id = V4L2_CID_EXPOSURE_AUTO;
+		ctrl.value = V4L2_EXPOSURE_MANUAL;
+		if (-1 == xioctl(fd, VIDIOC_S_CTRL, &ctrl) && errno != EINVAL)
+			perror("hdr: switching V4L2_CID_EXPOSURE_AUTO to manual");
+	}
+	ctrl.id = ctrl_id;
+	base_value = -1 == xioctl(fd, VIDIOC_G_CTRL, &ctrl) ? qc.default_value : ctrl.value;
+
+	/* exposure is linear in the control, the middle bracket is where the camera had it */
+	for (i = 0; i < n; ++i) {
+		v = (int)(base_value * exp2(hdr_config.stops * (i - (n - 1) / 2.0)) + 0.5);
+		v = qc.minimum + (v - qc.minimum) / step * step;
+		v = v < qc.minimum ? qc.minimum : v > qc.maximum ? qc.maximum : v;
+		if (i && v <= hdr_stats.values[i - 1])
+			v = hdr_stats.values[i - 1] + step;
+		if (v > qc.maximum) {
+			fprintf(stderr, "hdr: %u brackets %.1f EV apart do not fit the range %d to %d around %d\n", n,
+				hdr_config.stops, qc.minimum, qc.maximum, base_value);
+			return -1;
+		}
+		hdr_stats.values[i] = v;
+	}
+	last_issued = base_value;
+
+	return 0;
+}
+
+/* Sets the control for the frame latency frames from this one, and remembers from which sequence it applies */
+static void hdr_schedule(unsigned int sequence)
+{
+	struct v4l2_control ctrl;
+	unsigned int target = sequence + hdr_config.latency;
+	unsigned long long t0;
+
+	CLEAR(ctrl);
+	ctrl.id = ctrl_id;
+	ctrl.value = hdr_stats.values[target % hdr_config.brackets];
+	if (ctrl.value == last_issued)
+		return;
+	t0 = metric_now_ns();
+	if (-1 == xioctl(fd, VIDIOC_S_CTRL, &ctrl)) {
+		perror("hdr: VIDIOC_S_CTRL");
+		state = HDR_OFF;
+		return;
+	}
+	hdr_stats.control_ns += metric_now_ns() - t0;
+	hdr_stats.controls++;
+	issued[n_issued % HDR_RING].sequence = target;
+	issued[n_issued % HDR_RING].value = ctrl.value;
+	n_issued++;
+	last_issued = ctrl.value;
+}
+
+/* The bracket a frame was taken with: the last value set for its sequence or one before, -1 for none */
+static int hdr_tag(unsigned int sequence)
+{
+	unsigned int i, n = n_issued < HDR_RING ? n_issued : HDR_RING;
+	int value = base_value;
+
+	for (i = 1; i <= n; ++i)
+		if (issued[(n_issued - i) % HDR_RING].sequence <= sequence) {
+			value = issued[(n_issued - i) % HDR_RING].value;
+			break;
+		}
+	for (i = 0; i < hdr_config.brackets; ++i)
+		if (hdr_stats.values[i] == value)
+			return i;
+
+	return -1;
+}
+
+static unsigned int hdr_mean(const struct frame_view *v)
+{
+	unsigned int step = v->fourcc == V4L2_PIX_FMT_YUYV ? 2 : 1, x, y, n = 0;
+	unsigned long long sum = 0;
+
+	for (y = 0; y < v->height; y += HDR_SAMPLE)
+		for (x = 0; x < v->width; x += HDR_SAMPLE, ++n)
+			sum += v->plane[0][y * v->pitch[0] + x * step];
+
+	return n ? sum / n : 0;
+}
+
+static int hdr_setup(const struct frame_view *v)
+{
+	unsigned int s, i;
+
+	hdr_reset();
+	cur_width = v->width;
+	cur_height = v->height;
+	cur_fourcc = v->fourcc;
+	cur_pitch = v->pitch[0];
+	frame_size = v->size;
+	for (s = 0; s < 2; ++s) {
+		for (i = 0; i < hdr_config.brackets; ++i)
+			if (!(slots[s][i].data = malloc(frame_size)))
+				return -1;
+		if (!(fused[s] = malloc(frame_size)))
+			return -1;
+	}
+
+	return 0;
+}
+
+/* The merge in flight is finished: describe its frame, which stays valid until the merge after next */
+static void hdr_deliver(struct frame_view *out)
+{
+	unsigned long long ns = tile_wait(&merge_done);
+
+	hdr_stats.merge_ns += ns;
+	if (ns > hdr_stats.merge_max_ns)
+		hdr_stats.merge_max_ns = ns;
+	hdr_stats.merged++;
+	merge_pending = 0;
+	frame_view_init(out, fused[fused_next ^ 1], frame_size, merge_sequence, cur_width, cur_height, cur_fourcc,
+		cur_pitch);
+}
+
+/* Waits for a merge still reading the set a new group is about to fill */
+static void hdr_claim(unsigned int set)
+{
+	unsigned long long t0;
+
+	if (merge_pending && merge_set == set && !tile_done(&merge_done)) {
+		t0 = metric_now_ns();
+		tile_wait(&merge_done);
+		hdr_stats.wait_ns += metric_now_ns() - t0;
+	}
+}
+
+/**
+Function Name : hdr_frame
+Function Description : Cycles the exposure for the frame latency frames ahead, keeps this frame as the bracket
+                       it was taken with, starts the merge when its group is complete and hands back a merge
+                       that has finished
+Parameter : the captured frame, where to describe a merged one
+Return : 1 when out holds a merged frame, 0 when nothing is due yet, -1 for a format that is passed through as is
+**/
+int hdr_frame(const struct frame_view *in, struct frame_view *out)
+{
+	unsigned int n = hdr_config.brackets, group = in->sequence / n, set, b, i;
+	const unsigned char *src[HDR_MAX_BRACKETS];
+	unsigned long long t0;
+	int tag, ret = 0;
+
+	if (in->fourcc != V4L2_PIX_FMT_YUYV && in->fourcc != V4L2_PIX_FMT_NV12 && in->fourcc != V4L2_PIX_FMT_GREY) {
+		if (!unsupported_reported++)
+			fprintf(stderr, "hdr: only YUYV, NV12 and GREY frames are merged\n");
+		return -1;
+	}
+	if (state == HDR_OFF)
+		return -1;
+	if (in->width != cur_width || in->height != cur_height || in->fourcc != cur_fourcc || in->pitch[0] != cur_pitch) {
+		if (hdr_setup(in) != 0) {
+			hdr_reset();
+			state = HDR_OFF;
+			return -1;
+		}
+	}
+	if (state == HDR_START) {
+		if (hdr_open() != 0) {
+			state = HDR_OFF;
+			return -1;
+		}
+		state = HDR_RUN;
+	}
+	hdr_schedule(in->sequence);
+	hdr_stats.frames++;
+	if (!frame_view_complete(in))
+		return 0;
+
+	/* a new group: the one before was merged, or lost a bracket on the way */
+	set = group & 1;
+	if (!group_started || group != cur_group) {
+		if (group_started && !group_merged && have[cur_set])
+			hdr_stats.incomplete++;
+		hdr_claim(set);
+		cur_group = group;
+		cur_set = set;
+		have[set] = 0;
+		group_started = 1;
+		group_merged = 0;
+	}
+	if ((tag = hdr_tag(in->sequence)) < 0) {
+		hdr_stats.untagged++;
+		return 0;
+	}
+	t0 = metric_now_ns();
+	TRACE_BEGIN(th);
+	memcpy(slots[set][tag].data, in->plane[0], frame_size);
+	slots[set][tag].sequence = in->sequence;
+	slots[set][tag].mean = hdr_mean(in);
+	have[set] |= 1u << tag;
+	hdr_stats.copy_ns += metric_now_ns() - t0;
+	TRACE_END(th, "hdr copy");
+
+	if (have[set] == (1u << n) - 1 && !group_merged) {
+		if (merge_pending) {
+			t0 = metric_now_ns();
+			hdr_deliver(out);
+			hdr_stats.wait_ns += metric_now_ns() - t0;
+			ret = 1;
+		}
+		/* a latency set too short tags frames with the bracket before theirs, seen as a darker longer one */
+		for (b = 1; b < n && slots[set][b].mean + 2 >= slots[set][b - 1].mean; ++b)
+			;
+		if (b < n)
+			hdr_stats.misordered++;
+		for (i = 0; i < n; ++i)
+			src[i] = slots[set][i].data;
+		merge_submit(src, n, fused[fused_next], cur_width, cur_height, cur_fourcc, cur_pitch);
+		fused_next ^= 1;
+		merge_pending = 1;
+		merge_set = set;
+		merge_sequence = in->sequence;
+		group_merged = 1;
+	} else if (merge_pending && tile_done(&merge_done)) {
+		hdr_deliver(out);
+		ret = 1;
+	}
+
+	return ret;
+}
+
+/**
+Function Name : hdr_flush
+Function Description : Hands back the merge still in flight at the end of a recording
+Parameter : where to describe the merged frame
+Return : 1 when out holds a frame, 0 when none is left
+**/
+int hdr_flush(struct frame_view *out)
+{
+	if (!merge_pending)
+		return 0;
+	hdr_deliver(out);
+
+	return 1;
+}
+
+/**
+Function Name : hdr_finish
+Function Description : Prints the brackets, the frames merged and lost, and the merge time per merged frame,
+                       then frees the buffers
+Parameter : void
+Return : void
+**/
+void hdr_finish(void)
+{
+	struct hdr_stats *st = &hdr_stats;
+	unsigned int i;
+
+	if (st->frames) {
+		printf("HDR: %llu frames in %llu merged (1 in %u), %llu groups incomplete, %llu frames untagged, %llu groups "
+			"misordered\n", st->frames, st->merged, hdr_config.brackets, st->incomplete, st->untagged,
+			st->misordered);
+		printf("\tBrackets :");
+		for (i = 0; i < hdr_config.brackets; ++i)
+			printf(" %d", st->values[i]);
+		printf(" %s, %llu controls set at %.3f ms each, latency %u frames\n",
+			hdr_config.gain ? "gain" : "exposure", st->controls,
+			st->controls ? st->control_ns / 1e6 / st->controls : 0.0, hdr_config.latency);
+		if (st->merged)
+			printf("\tMerge : %.2f ms avg %.2f ms max per merged frame on %u threads, %.2f ms copy per frame, "
+				"%.2f ms waited per merged frame\n", st->merge_ns / 1e6 / st->merged, st->merge_max_ns / 1e6,
+				tile_pool_threads(), st->copy_ns / 1e6 / st->frames, st->wait_ns / 1e6 / st->merged);
+	}
+	hdr_reset();
+	unsupported_reported = 0;
+}
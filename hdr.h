@@ -0,0 +1,35 @@
+#pragma once
+#include "frameview.h"
+
+#define HDR_MAX_BRACKETS 5
+
+struct hdr_config {
+	unsigned int brackets;          /* exposures per merged frame */
+	double stops;                   /* EV between neighbouring brackets, centred on the exposure found at start */
+	int gain;                       /* bracket V4L2_CID_GAIN instead of V4L2_CID_EXPOSURE_ABSOLUTE */
+	unsigned int latency;           /* frames from setting the control to the first frame it applies to */
+};
+
+struct hdr_stats {
+	unsigned long long frames;              /* taken in */
+	unsigned long long merged;              /* frames handed back */
+	unsigned long long incomplete;          /* groups that lost a bracket to a dropped frame, not merged */
+	unsigned long long untagged;            /* frames whose exposure was not one of the brackets */
+	unsigned long long misordered;          /* merged groups not brighter with each longer bracket */
+	unsigned long long controls, control_ns;        /* VIDIOC_S_CTRL cycling the brackets */
+	unsigned long long copy_ns;                     /* brackets kept until their group is complete */
+	unsigned long long merge_ns, merge_max_ns;      /* submitted to done on the tile pool */
+	unsigned long long wait_ns;                     /* of that, the capture thread waited for */
+	int values[HDR_MAX_BRACKETS];           /* the control value of each bracket */
+};
+
+extern struct hdr_config hdr_config;
+extern struct hdr_stats hdr_stats;
+extern int hdr_enabled;
+
+int hdr_parse(const char *spec);
+int hdr_frame(const struct frame_view *in, struct frame_view *out);
+int hdr_flush(struct frame_view *out);
+unsigned long long hdr_merge(const struct frame_view *brackets, unsigned int n, unsigned char *dst);
+void hdr_reset(void);
+void hdr_finish(void);
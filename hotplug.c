@@ -0,0 +1,148 @@
+#include "header.h"
+#include <libgen.h>
+#include <poll.h>
+#include <sys/inotify.h>
+#include "hotplug.h"
+#include "metrics.h"
+
+/*
+ * Keeps a capture alive across a USB glitch or a replug. When the device goes away the context is detached
+ * and reopened in place with its last format, instead of the process exiting and a supervisor restarting it.
+ * While the node is missing, inotify on its directory wakes the retry as soon as udev recreates it; paths
+ * outside a watchable directory (and the synthetic device) are polled.
+ */
+
+unsigned int hotplug_timeout = 10;      /* seconds to wait for the device, 0 exits on loss as before */
+struct hotplug_stats hotplug_stats;
+
+static unsigned long long lost_ns;      /* set from a loss until the first frame after it */
+static const char *lost_path;
+
+/**
+Function Name : hotplug_lost
+Function Description : Tells a vanished device from other failures
+Parameter : -errno from the capture library
+Return : 1 if the device went away and recovery is enabled, 0 otherwise
+**/
+int hotplug_lost(int err)
+{
+	return hotplug_timeout && (err == -ENODEV || err == -EIO || err == -ENXIO);
+}
+
+/* inotify on the node's directory, -1 when there is nothing to watch */
+static int watch_open(const char *path)
+{
+	char *dir = strdup(path);
+	int wfd = -1;
+
+	if (dir && path[0] == '/' && (wfd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) >= 0 &&
+	    inotify_add_watch(wfd, dirname(dir), IN_CREATE | IN_ATTRIB | IN_MOVED_TO) < 0) {
+		close(wfd);
+		wfd = -1;
+	}
+	free(dir);
+
+	return wfd;
+}
+
+static void watch_wait(int wfd)
+{
+	struct pollfd pfd = { .fd = wfd, .events = POLLIN };
+	struct timespec pause = { 0, HOTPLUG_POLL_MS * 1000000L };
+	char events[4096];
+
+	if (wfd < 0) {
+		nanosleep(&pause, NULL);
+		return;
+	}
+	/* any change in the directory is worth a retry, the open tells whether it was our node */
+	if (poll(&pfd, 1, HOTPLUG_WATCH_MS) > 0)
+		while (read(wfd, events, sizeof(events)) > 0)
+			;
+}
+
+/**
+Function Name : hotplug_recover
+Function Description : Reopens a device that went away, waiting for its node to come back for up to
+                       hotplug_timeout seconds; the stream restarts with the previous format and buffers
+Parameter : capture context, device path and the error that reported the loss
+Return : 0 when capturing again, -errno when the device did not come back in time
+**/
+int hotplug_recover(struct v4l2cap *ctx, const char *path, int err)
+{
+	unsigned long long t0 = metric_now_ns();
+	unsigned int attempts = 0;
+	double ms;
+	int wfd, ret;
+
+	lost_ns = t0;
+	lost_path = path;
+	hotplug_stats.losses++;
+	metric_inc(MC_DEVICE_LOST, 1);
+	fprintf(stderr, "%s: device lost (%s), waiting up to %u s for it to come back\n", path, strerror(-err),
+		hotplug_timeout);
+
+	/* watch before the first reopen, so a node created in between is not missed */
+	wfd = watch_open(path);
+	while ((ret = v4l2cap_reopen(ctx)) < 0) {
+		attempts++;
+		if (metric_now_ns() - t0 >= hotplug_timeout * 1000000000ull) {
+			fprintf(stderr, "%s: not back after %u s (%s), giving up\n", path, hotplug_timeout, strerror(-ret));
+			lost_ns = 0;
+			if (wfd >= 0)
+				close(wfd);
+			return ret;
+		}
+		watch_wait(wfd);
+	}
+	if (wfd >= 0)
+		close(wfd);
+
+	attempts++;
+	hotplug_stats.attempts += attempts;
+	ms = (metric_now_ns() - t0) / 1e6;
+	if (ms > hotplug_stats.reopen_ms_max)
+		hotplug_stats.reopen_ms_max = ms;
+	fprintf(stderr, "%s: reopened after %.1f ms (%u attempts)%s\n", path, ms, attempts,
+		wfd >= 0 ? ", watched with inotify" : "");
+
+	return 0;
+}
+
+/**
+Function Name : hotplug_frame
+Function Description : Called for every delivered frame; the first one after a loss completes the recovery
+                       and its time is recorded
+Parameter : void
+Return : void
+**/
+void hotplug_frame(void)
+{
+	double ms;
+
+	if (!lost_ns)
+		return;
+	ms = (metric_now_ns() - lost_ns) / 1e6;
+	lost_ns = 0;
+	hotplug_stats.recoveries++;
+	hotplug_stats.recover_ms_total += ms;
+	if (ms > hotplug_stats.recover_ms_max)
+		hotplug_stats.recover_ms_max = ms;
+	fprintf(stderr, "%s: recovered, first frame %.1f ms after the loss\n", lost_path, ms);
+}
+
+/**
+Function Name : hotplug_finish
+Function Description : Prints the time-to-recover summary when the device went away during the run
+Parameter : void
+Return : void
+**/
+void hotplug_finish(void)
+{
+	if (!hotplug_stats.losses)
+		return;
+	printf("device lost %u times, recovered %u (%u reopen attempts), time to first frame avg %.1f ms max %.1f ms\n",
+		hotplug_stats.losses, hotplug_stats.recoveries, hotplug_stats.attempts,
+		hotplug_stats.recoveries ? hotplug_stats.recover_ms_total / hotplug_stats.recoveries : 0,
+		hotplug_stats.recover_ms_max);
+}
@@ -0,0 +1,22 @@
+#pragma once
+#include "v4l2capture.h"
+
+#define HOTPLUG_POLL_MS 10              /* retry interval without inotify (the synthetic device, no /dev watch) */
+#define HOTPLUG_WATCH_MS 250            /* retry interval with inotify, in case the node changes without an event */
+
+struct hotplug_stats {
+	unsigned int losses;
+	unsigned int recoveries;
+	unsigned int attempts;          /* reopen calls, across all losses */
+	double reopen_ms_max;           /* loss to streaming again */
+	double recover_ms_total;        /* loss to the first frame after it */
+	double recover_ms_max;
+};
+
+extern unsigned int hotplug_timeout;
+extern struct hotplug_stats hotplug_stats;
+
+int hotplug_lost(int err);
+int hotplug_recover(struct v4l2cap *ctx, const char *path, int err);
+void hotplug_frame(void);
+void hotplug_finish(void);
@@ -0,0 +1,731 @@
+#include "header.h"
+#include <math.h>
+#include <stdint.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#include "isp.h"
+#include "metrics.h"
+#include "tilepool.h"
+#include "trace.h"
+
+/*
+ * Software ISP for raw Bayer sensors, producing RGB24. A frame is cut into horizontal bands run on the tile pool.
+ * Each band first linearizes its rows, plus a halo of mirrored neighbours, into a 12-bit mosaic. It then
+ * demosaics, colour corrects and gamma maps a strip of rows at a time, so the RGB intermediate stays in cache.
+ */
+
+#define WORK_BITS 12
+#define WORK_MAX ((1 << WORK_BITS) - 1)
+#define HALO 4                          /* mosaic rows and columns kept around a band, the edge demosaic reads 3 */
+#define STRIP_ROWS 8
+
+struct isp_config isp_config = { -1, { 1, 1, 1 }, 0, ISP_BILINEAR, { 1, 0, 0, 0, 1, 0, 0, 0, 1 }, 2.2, 0 };
+struct isp_stats isp_stats;
+
+struct isp_band {
+	unsigned int y0, y1;
+	uint16_t *mosaic;               /* (rows + 2 HALO) x mstride, starting HALO rows and columns before the band */
+	uint16_t *green;                /* the same layout, green everywhere for the edge demosaic */
+	uint16_t *strip;                /* R, G and B planes of STRIP_ROWS x width */
+	unsigned long long stage_ns[ISP_STAGES];
+	unsigned long long sums[4];     /* raw sums per CFA position, for the grey world */
+};
+
+static const struct {
+	unsigned int fourcc;
+	unsigned char red_x, red_y, bits;
+} bayer_formats[] = {
+	{ V4L2_PIX_FMT_SRGGB8, 0, 0, 8 }, { V4L2_PIX_FMT_SGRBG8, 1, 0, 8 },
+	{ V4L2_PIX_FMT_SGBRG8, 0, 1, 8 }, { V4L2_PIX_FMT_SBGGR8, 1, 1, 8 },
+	{ V4L2_PIX_FMT_SRGGB10, 0, 0, 10 }, { V4L2_PIX_FMT_SGRBG10, 1, 0, 10 },
+	{ V4L2_PIX_FMT_SGBRG10, 0, 1, 10 }, { V4L2_PIX_FMT_SBGGR10, 1, 1, 10 },
+	{ V4L2_PIX_FMT_SRGGB12, 0, 0, 12 }, { V4L2_PIX_FMT_SGRBG12, 1, 0, 12 },
+	{ V4L2_PIX_FMT_SGBRG12, 0, 1, 12 }, { V4L2_PIX_FMT_SBGGR12, 1, 1, 12 },
+	{ V4L2_PIX_FMT_SRGGB16, 0, 0, 16 }, { V4L2_PIX_FMT_SGRBG16, 1, 0, 16 },
+	{ V4L2_PIX_FMT_SGBRG16, 0, 1, 16 }, { V4L2_PIX_FMT_SBGGR16, 1, 1, 16 },
+};
+
+static const char *demosaic_names[] = { "bilinear", "edge" };
+static const char *stage_names[ISP_STAGES] = { "linearize", "demosaic", "ccm", "gamma" };
+
+static struct isp_band bands[ISP_MAX_BANDS];
+static unsigned int n_bands, mstride;
+static int ready;
+
+static unsigned int cur_width, cur_height, cur_fourcc, depth, red_x, red_y, lut_shift, lut_mask, black_idx;
+static unsigned char *job_dst;
+static int job_pitch;
+static const void *job_src;
+
+static uint16_t lin_lut[4][1 << WORK_BITS];     /* indexed by (y & 1) * 2 + (x & 1) */
+static unsigned char gamma_lut[1 << WORK_BITS];
+static int16_t ccm_q13[9];
+static int ccm_identity;
+static double awb_gain[3];
+
+static struct tile_future frame_done;
+
+static int bayer_lookup(unsigned int fourcc)
+{
+	unsigned int i;
+
+	for (i = 0; i < sizeof(bayer_formats) / sizeof(bayer_formats[0]); ++i)
+		if (bayer_formats[i].fourcc == fourcc)
+			return i;
+
+	return -1;
+}
+
+/**
+Function Name : isp_is_bayer
+Function Description : Tells whether a pixel format is raw Bayer the ISP can develop
+Parameter : V4L2 fourcc
+Return : 1 for raw Bayer 0 otherwise
+**/
+int isp_is_bayer(unsigned int fourcc)
+{
+	return bayer_lookup(fourcc) >= 0;
+}
+
+static int parse_list(const char *arg, double *values, unsigned int n)
+{
+	char *end;
+	unsigned int i;
+
+	for (i = 0; i < n; ++i) {
+		values[i] = strtod(arg, &end);
+		if (end == arg || (i + 1 < n && *end != ':'))
+			return -1;
+		arg = end + 1;
+	}
+
+	return *end ? -1 : 0;
+}
+
+/**
+Function Name : isp_parse
+Function Description : Parses the -I argument, comma separated black=,wb=r:g:b,awb,bilinear or edge,
+                       ccm=nine values separated by colons,gamma= and bands=
+Parameter : option string
+Return : 0 for success -1 for a bad option
+**/
+int isp_parse(const char *spec)
+{
+	char *opts = strdup(spec), *item, *save;
+	double sum;
+	int ret = 0, r;
+
+	for (item = strtok_r(opts, ",", &save); item; item = strtok_r(NULL, ",", &save)) {
+		if (strncmp(item, "black=", 6) == 0)
+			isp_config.black = strtol(item + 6, NULL, 10);
+		else if (strncmp(item, "wb=", 3) == 0) {
+			if (parse_list(item + 3, isp_config.wb, 3) != 0) {
+				fprintf(stderr, "ISP white balance needs three gains, r:g:b\n");
+				ret = -1;
+			}
+			isp_config.awb = 0;
+		} else if (strcmp(item, "awb") == 0)
+			isp_config.awb = 1;
+		else if (strcmp(item, "bilinear") == 0)
+			isp_config.demosaic = ISP_BILINEAR;
+		else if (strcmp(item, "edge") == 0)
+			isp_config.demosaic = ISP_EDGE;
+		else if (strncmp(item, "ccm=", 4) == 0) {
+			if (parse_list(item + 4, isp_config.ccm, 9) != 0) {
+				fprintf(stderr, "ISP colour matrix needs nine values separated by colons\n");
+				ret = -1;
+			}
+		} else if (strncmp(item, "gamma=", 6) == 0)
+			isp_config.gamma = strtod(item + 6, NULL);
+		else if (strncmp(item, "bands=", 6) == 0)
+			isp_config.bands = strtol(item + 6, NULL, 10);
+		else {
+			fprintf(stderr, "Unknown ISP option %s\n", item);
+			ret = -1;
+		}
+	}
+	free(opts);
+
+	/* the fixed point matrix must not overflow 16 bits, see ccm_strip() */
+	for (r = 0; r < 3; ++r) {
+		sum = fabs(isp_config.ccm[r * 3]) + fabs(isp_config.ccm[r * 3 + 1]) + fabs(isp_config.ccm[r * 3 + 2]);
+		if (sum >= 7.99 || fabs(isp_config.ccm[r * 3]) >= 3.99 || fabs(isp_config.ccm[r * 3 + 1]) >= 3.99 ||
+		    fabs(isp_config.ccm[r * 3 + 2]) >= 3.99) {
+			fprintf(stderr, "ISP colour matrix row %d is too large, keep each value under 4 and a row under 8\n", r);
+			ret = -1;
+		}
+	}
+	if (isp_config.gamma <= 0)
+		isp_config.gamma = 1;
+	if (isp_config.bands > ISP_MAX_BANDS)
+		isp_config.bands = ISP_MAX_BANDS;
+
+	return ret;
+}
+
+static unsigned int cfa_colour(unsigned int x, unsigned int y)
+{
+	if ((x & 1) == red_x && (y & 1) == red_y)
+		return 0;
+	if ((x & 1) != red_x && (y & 1) != red_y)
+		return 2;
+
+	return 1;
+}
+
+/* black level and white balance folded into one LUT per CFA position, scaled to the 12-bit working range */
+static void build_lin_luts(void)
+{
+	const double *gain = isp_config.awb ? awb_gain : isp_config.wb;
+	double scale = (double)WORK_MAX / (lut_mask - black_idx), v;
+	unsigned int p, i;
+
+	for (p = 0; p < 4; ++p)
+		for (i = 0; i <= lut_mask; ++i) {
+			v = ((double)i - black_idx) * gain[cfa_colour(p & 1, p >> 1)] * scale;
+			lin_lut[p][i] = v <= 0 ? 0 : v >= WORK_MAX ? WORK_MAX : (uint16_t)(v + 0.5);
+		}
+}
+
+static void build_luts(void)
+{
+	unsigned int i;
+
+	build_lin_luts();
+	for (i = 0; i <= WORK_MAX; ++i)
+		gamma_lut[i] = (unsigned char)(255 * pow((double)i / WORK_MAX, 1 / isp_config.gamma) + 0.5);
+
+	/* Q13, so a 12-bit sample shifted up by 3 and multiplied keeps the result in the high 16 bits */
+	ccm_identity = 1;
+	for (i = 0; i < 9; ++i) {
+		ccm_q13[i] = (int16_t)lround(isp_config.ccm[i] * 8192);
+		if (ccm_q13[i] != (i % 4 == 0 ? 8192 : 0))
+			ccm_identity = 0;
+	}
+}
+
+static void linearize(struct isp_band *band)
+{
+	int y, sy, x, k, width = cur_width, height = cur_height;
+	const uint16_t *lut0, *lut1;
+	const unsigned char *in8;
+	const uint16_t *in16;
+	unsigned long long s0, s1;
+	uint16_t *out;
+
+	for (y = (int)band->y0 - HALO; y < (int)band->y1 + HALO; ++y) {
+		/* mirror about the edge rows, which keeps every sample on its CFA colour */
+		sy = y < 0 ? -y : y >= height ? 2 * (height - 1) - y : y;
+		out = band->mosaic + (size_t)(y - (int)band->y0 + HALO) * mstride + HALO;
+		lut0 = lin_lut[(sy & 1) * 2];
+		lut1 = lin_lut[(sy & 1) * 2 + 1];
+		s0 = s1 = 0;
+		if (depth == 8) {
+			in8 = (const unsigned char *)job_src + (size_t)sy * width;
+			for (x = 0; x < width; x += 2) {
+				out[x] = lut0[in8[x]];
+				out[x + 1] = lut1[in8[x + 1]];
+			}
+			if (isp_config.awb && y >= (int)band->y0 && y < (int)band->y1)
+				for (x = 0; x < width; x += 2) {
+					s0 += in8[x];
+					s1 += in8[x + 1];
+				}
+		} else {
+			in16 = (const uint16_t *)job_src + (size_t)sy * width;
+			for (x = 0; x < width; x += 2) {
+				out[x] = lut0[in16[x] >> lut_shift & lut_mask];
+				out[x + 1] = lut1[in16[x + 1] >> lut_shift & lut_mask];
+			}
+			if (isp_config.awb && y >= (int)band->y0 && y < (int)band->y1)
+				for (x = 0; x < width; x += 2) {
+					s0 += in16[x] >> lut_shift & lut_mask;
+					s1 += in16[x + 1] >> lut_shift & lut_mask;
+				}
+		}
+		band->sums[(sy & 1) * 2] += s0;
+		band->sums[(sy & 1) * 2 + 1] += s1;
+		for (k = 1; k <= HALO; ++k) {
+			out[-k] = out[k];
+			out[width - 1 + k] = out[width - 1 - k];
+		}
+	}
+}
+
+static inline unsigned int avg2(unsigned int a, unsigned int b)
+{
+	return (a + b + 1) >> 1;
+}
+
+static inline uint16_t clamp_work(int v)
+{
+	return v < 0 ? 0 : v > WORK_MAX ? WORK_MAX : v;
+}
+
+/*
+ * Every output takes one of five estimates: the sample itself, the horizontal, vertical, four-neighbour
+ * or diagonal average. Which one depends only on the row colour and the column parity, so the SIMD
+ * version computes all five for eight columns and selects per lane. Both round the same way.
+ */
+static void bilinear_row(const uint16_t *m, unsigned int y, uint16_t *r, uint16_t *g, uint16_t *b)
+{
+	const uint16_t *u = m - mstride, *d = m + mstride;
+	int red_row = (y & 1) == red_y, x = 0, width = cur_width;
+	unsigned int c, h, v, c4, dg;
+
+#if defined(__SSE2__)
+	__m128i red_col = _mm_set_epi16(0, -1, 0, -1, 0, -1, 0, -1), vc, vh, vv, v4, vd;
+
+	if (red_x)
+		red_col = _mm_xor_si128(red_col, _mm_set1_epi16(-1));
+#define LD(p) _mm_loadu_si128((const __m128i *)(p))
+#define SEL(a, b) _mm_or_si128(_mm_and_si128(red_col, a), _mm_andnot_si128(red_col, b))
+	for (; x + 8 <= width; x += 8) {
+		vc = LD(m + x);
+		vh = _mm_avg_epu16(LD(m + x - 1), LD(m + x + 1));
+		vv = _mm_avg_epu16(LD(u + x), LD(d + x));
+		v4 = _mm_avg_epu16(vh, vv);
+		vd = _mm_avg_epu16(_mm_avg_epu16(LD(u + x - 1), LD(u + x + 1)),
+			_mm_avg_epu16(LD(d + x - 1), LD(d + x + 1)));
+		if (red_row) {
+			_mm_storeu_si128((__m128i *)(r + x), SEL(vc, vh));
+			_mm_storeu_si128((__m128i *)(g + x), SEL(v4, vc));
+			_mm_storeu_si128((__m128i *)(b + x), SEL(vd, vv));
+		} else {
+			_mm_storeu_si128((__m128i *)(r + x), SEL(vv, vd));
+			_mm_storeu_si128((__m128i *)(g + x), SEL(vc, v4));
+			_mm_storeu_si128((__m128i *)(b + x), SEL(vh, vc));
+		}
+	}
+#undef LD
+#undef SEL
+#elif defined(__ARM_NEON)
+	static const uint16_t even_lanes[8] = { 0xffff, 0, 0xffff, 0, 0xffff, 0, 0xffff, 0 };
+	uint16x8_t red_col = vld1q_u16(even_lanes), vc, vh, vv, v4, vd;
+
+	if (red_x)
+		red_col = vmvnq_u16(red_col);
+	for (; x + 8 <= width; x += 8) {
+		vc = vld1q_u16(m + x);
+		vh = vrhaddq_u16(vld1q_u16(m + x - 1), vld1q_u16(m + x + 1));
+		vv = vrhaddq_u16(vld1q_u16(u + x), vld1q_u16(d + x));
+		v4 = vrhaddq_u16(vh, vv);
+		vd = vrhaddq_u16(vrhaddq_u16(vld1q_u16(u + x - 1), vld1q_u16(u + x + 1)),
+			vrhaddq_u16(vld1q_u16(d + x - 1), vld1q_u16(d + x + 1)));
+		if (red_row) {
+			vst1q_u16(r + x, vbslq_u16(red_col, vc, vh));
+			vst1q_u16(g + x, vbslq_u16(red_col, v4, vc));
+			vst1q_u16(b + x, vbslq_u16(red_col, vd, vv));
+		} else {
+			vst1q_u16(r + x, vbslq_u16(red_col, vv, vd));
+			vst1q_u16(g + x, vbslq_u16(red_col, vc, v4));
+			vst1q_u16(b + x, vbslq_u16(red_col, vh, vc));
+		}
+	}
+#endif
+	for (; x < width; ++x) {
+		c = m[x];
+		h = avg2(m[x - 1], m[x + 1]);
+		v = avg2(u[x], d[x]);
+		c4 = avg2(h, v);
+		dg = avg2(avg2(u[x - 1], u[x + 1]), avg2(d[x - 1], d[x + 1]));
+		if ((x & 1) == red_x) {
+			r[x] = red_row ? c : v;
+			g[x] = red_row ? c4 : c;
+			b[x] = red_row ? dg : h;
+		} else {
+			r[x] = red_row ? h : dg;
+			g[x] = red_row ? c : c4;
+			b[x] = red_row ? v : c;
+		}
+	}
+}
+
+static inline int min_int(int a, int b)
+{
+	return a < b ? a : b;
+}
+
+static inline int max_int(int a, int b)
+{
+	return a > b ? a : b;
+}
+
+static inline int clamp_between(int v, int a, int b)
+{
+	return a < b ? (v < a ? a : v > b ? b : v) : (v < b ? b : v > a ? a : v);
+}
+
+/*
+ * Green everywhere, interpolated along the direction with the smaller gradient (Hamilton-Adams). The
+ * second derivative of the sampled colour sharpens the estimate, but is kept within the greens it came
+ * from, so a colour edge that green does not share cannot ring.
+ */
+static void edge_green(struct isp_band *band)
+{
+	int y, x, c, gh, gv, lh, lv, dh, dv, g, width = cur_width;
+	const uint16_t *m, *u, *d, *uu, *dd;
+	uint16_t *out;
+
+	for (y = (int)band->y0 - 1; y < (int)band->y1 + 1; ++y) {
+		m = band->mosaic + (size_t)(y - (int)band->y0 + HALO) * mstride + HALO;
+		out = band->green + (m - band->mosaic);
+		u = m - mstride;
+		d = m + mstride;
+		uu = u - mstride;
+		dd = d + mstride;
+		for (x = -1; x <= width; ++x) {
+			c = m[x];
+			if ((x ^ y ^ red_x ^ red_y) & 1) {
+				out[x] = c;
+				continue;
+			}
+			gh = m[x - 1] + m[x + 1];
+			gv = u[x] + d[x];
+			lh = 2 * c - m[x - 2] - m[x + 2];
+			lv = 2 * c - uu[x] - dd[x];
+			dh = abs(m[x - 1] - m[x + 1]) + abs(lh);
+			dv = abs(u[x] - d[x]) + abs(lv);
+			if (dh < dv)
+				g = clamp_between((2 * gh + lh) >> 2, m[x - 1], m[x + 1]);
+			else if (dv < dh)
+				g = clamp_between((2 * gv + lv) >> 2, u[x], d[x]);
+			else
+				g = clamp_between((2 * (gh + gv) + lh + lv) >> 3, min_int(min_int(m[x - 1], m[x + 1]),
+					min_int(u[x], d[x])), max_int(max_int(m[x - 1], m[x + 1]), max_int(u[x], d[x])));
+			out[x] = g;
+		}
+	}
+}
+
+/* red and blue as green plus the averaged colour difference of the neighbours that have them */
+static void edge_row(const uint16_t *m, const uint16_t *gp, unsigned int y, uint16_t *r, uint16_t *g, uint16_t *b)
+{
+	const uint16_t *u = m - mstride, *d = m + mstride, *gu = gp - mstride, *gd = gp + mstride;
+	int red_row = (y & 1) == red_y, gc, dh, dv, dd, x, width = cur_width;
+
+	for (x = 0; x < width; ++x) {
+		gc = gp[x];
+		g[x] = gc;
+		if (((x & 1) == red_x) == red_row) {
+			/* a red or blue sample, the other colour sits on the diagonals */
+			dd = (u[x - 1] - gu[x - 1] + u[x + 1] - gu[x + 1] + d[x - 1] - gd[x - 1] + d[x + 1] - gd[x + 1]) >> 2;
+			r[x] = red_row ? m[x] : clamp_work(gc + dd);
+			b[x] = red_row ? clamp_work(gc + dd) : m[x];
+			continue;
+		}
+		dh = (m[x - 1] - gp[x - 1] + m[x + 1] - gp[x + 1]) >> 1;
+		dv = (u[x] - gu[x] + d[x] - gd[x]) >> 1;
+		r[x] = clamp_work(gc + (red_row ? dh : dv));
+		b[x] = clamp_work(gc + (red_row ? dv : dh));
+	}
+}
+
+static inline int ccm_term(unsigned int v, int m)
+{
+	return ((int)(v << 3) * m) >> 16;
+}
+
+/*
+ * Each output is the sum of three high halves of 16x16 products. isp_parse() keeps the magnitudes of a
+ * row under 8, so the sum fits in 16 bits and the SIMD and scalar paths agree exactly.
+ */
+static void ccm_strip(uint16_t *r, uint16_t *g, uint16_t *b, unsigned int n)
+{
+	unsigned int i = 0, k;
+	int out[3];
+
+#if defined(__SSE2__)
+	__m128i mq[9], vr, vg, vb, o[3], zero = _mm_setzero_si128(), top = _mm_set1_epi16(WORK_MAX);
+
+	for (k = 0; k < 9; ++k)
+		mq[k] = _mm_set1_epi16(ccm_q13[k]);
+	for (; i + 8 <= n; i += 8) {
+		vr = _mm_slli_epi16(_mm_loadu_si128((const __m128i *)(r + i)), 3);
+		vg = _mm_slli_epi16(_mm_loadu_si128((const __m128i *)(g + i)), 3);
+		vb = _mm_slli_epi16(_mm_loadu_si128((const __m128i *)(b + i)), 3);
+		for (k = 0; k < 3; ++k) {
+			o[k] = _mm_add_epi16(_mm_add_epi16(_mm_mulhi_epi16(vr, mq[k * 3]), _mm_mulhi_epi16(vg, mq[k * 3 + 1])),
+				_mm_mulhi_epi16(vb, mq[k * 3 + 2]));
+			o[k] = _mm_min_epi16(_mm_max_epi16(o[k], zero), top);
+		}
+		_mm_storeu_si128((__m128i *)(r + i), o[0]);
+		_mm_storeu_si128((__m128i *)(g + i), o[1]);
+		_mm_storeu_si128((__m128i *)(b + i), o[2]);
+	}
+#elif defined(__ARM_NEON)
+	int16x8_t vr, vg, vb, o[3], zero = vdupq_n_s16(0), top = vdupq_n_s16(WORK_MAX);
+	int16x4_t mq[9];
+
+	for (k = 0; k < 9; ++k)
+		mq[k] = vdup_n_s16(ccm_q13[k]);
+#define MULHI(a, m) vcombine_s16(vshrn_n_s32(vmull_s16(vget_low_s16(a), m), 16), \
+	vshrn_n_s32(vmull_s16(vget_high_s16(a), m), 16))
+	for (; i + 8 <= n; i += 8) {
+		vr = vshlq_n_s16(vreinterpretq_s16_u16(vld1q_u16(r + i)), 3);
+		vg = vshlq_n_s16(vreinterpretq_s16_u16(vld1q_u16(g + i)), 3);
+		vb = vshlq_n_s16(vreinterpretq_s16_u16(vld1q_u16(b + i)), 3);
+		for (k = 0; k < 3; ++k) {
+			o[k] = vaddq_s16(vaddq_s16(MULHI(vr, mq[k * 3]), MULHI(vg, mq[k * 3 + 1])), MULHI(vb, mq[k * 3 + 2]));
+			o[k] = vminq_s16(vmaxq_s16(o[k], zero), top);
+		}
+		vst1q_u16(r + i, vreinterpretq_u16_s16(o[0]));
+		vst1q_u16(g + i, vreinterpretq_u16_s16(o[1]));
+		vst1q_u16(b + i, vreinterpretq_u16_s16(o[2]));
+	}
+#undef MULHI
+#endif
+	for (; i < n; ++i) {
+		for (k = 0; k < 3; ++k)
+			out[k] = ccm_term(r[i], ccm_q13[k * 3]) + ccm_term(g[i], ccm_q13[k * 3 + 1]) +
+				ccm_term(b[i], ccm_q13[k * 3 + 2]);
+		r[i] = clamp_work(out[0]);
+		g[i] = clamp_work(out[1]);
+		b[i] = clamp_work(out[2]);
+	}
+}
+
+static void gamma_rows(const uint16_t *r, const uint16_t *g, const uint16_t *b, unsigned int y, unsigned int rows)
+{
+	unsigned char *out;
+	unsigned int x, i;
+
+	for (i = 0; i < rows; ++i, r += cur_width, g += cur_width, b += cur_width) {
+		out = job_dst + (size_t)(y + i) * job_pitch;
+		for (x = 0; x < cur_width; ++x, out += 3) {
+			out[0] = gamma_lut[r[x]];
+			out[1] = gamma_lut[g[x]];
+			out[2] = gamma_lut[b[x]];
+		}
+	}
+}
+
+static void run_band(struct isp_band *band)
+{
+	uint16_t *r = band->strip, *g = r + STRIP_ROWS * cur_width, *b = g + STRIP_ROWS * cur_width;
+	const uint16_t *m;
+	unsigned long long t0, t1;
+	unsigned int s, y, rows;
+
+	t0 = metric_now_ns();
+	linearize(band);
+	t1 = metric_now_ns();
+	band->stage_ns[ISP_LINEARIZE] += t1 - t0;
+	if (isp_config.demosaic == ISP_EDGE) {
+		edge_green(band);
+		t0 = metric_now_ns();
+		band->stage_ns[ISP_DEMOSAIC] += t0 - t1;
+		t1 = t0;
+	}
+
+	for (s = band->y0; s < band->y1; s += STRIP_ROWS) {
+		rows = band->y1 - s < STRIP_ROWS ? band->y1 - s : STRIP_ROWS;
+		for (y = s; y < s + rows; ++y) {
+			m = band->mosaic + (size_t)(y - band->y0 + HALO) * mstride + HALO;
+			if (isp_config.demosaic == ISP_EDGE)
+				edge_row(m, band->green + (m - band->mosaic), y, r + (y - s) * cur_width,
+					g + (y - s) * cur_width, b + (y - s) * cur_width);
+			else
+				bilinear_row(m, y, r + (y - s) * cur_width, g + (y - s) * cur_width, b + (y - s) * cur_width);
+		}
+		t0 = metric_now_ns();
+		band->stage_ns[ISP_DEMOSAIC] += t0 - t1;
+
+		if (!ccm_identity)
+			ccm_strip(r, g, b, rows * cur_width);
+		t1 = metric_now_ns();
+		band->stage_ns[ISP_CCM] += t1 - t0;
+
+		gamma_rows(r, g, b, s, rows);
+		t0 = metric_now_ns();
+		band->stage_ns[ISP_GAMMA] += t0 - t1;
+		t1 = t0;
+	}
+}
+
+static void isp_band_item(void *arg, unsigned int item, unsigned int worker)
+{
+	(void)arg;
+	(void)worker;
+	TRACE_BEGIN(ts);
+	run_band(&bands[item]);
+	TRACE_END(ts, "isp band");
+}
+
+static int isp_setup(unsigned int width, unsigned int height, unsigned int fourcc)
+{
+	int f = bayer_lookup(fourcc);
+	unsigned int n, band_rows, black;
+
+	if (width < 2 * HALO || height < 2 * HALO || (width | height) & 1) {
+		fprintf(stderr, "ISP: %ux%u is not a Bayer frame size\n", width, height);
+		return -1;
+	}
+	cur_width = width;
+	cur_height = height;
+	cur_fourcc = fourcc;
+	depth = bayer_formats[f].bits;
+	red_x = bayer_formats[f].red_x;
+	red_y = bayer_formats[f].red_y;
+	lut_shift = depth > WORK_BITS ? depth - WORK_BITS : 0;
+	lut_mask = (1u << (depth - lut_shift)) - 1;
+	black = isp_config.black >= 0 ? (unsigned int)isp_config.black : 16u << (depth - 8);
+	black_idx = black >> lut_shift;
+	if (black_idx >= lut_mask / 2) {
+		fprintf(stderr, "ISP: black level %u is out of range for %u-bit samples, using 0\n", black, depth);
+		black_idx = 0;
+	}
+	memcpy(awb_gain, isp_config.wb, sizeof(awb_gain));
+	build_luts();
+
+	n = isp_config.bands ? isp_config.bands : tile_pool_threads();
+	if (n > ISP_MAX_BANDS)
+		n = ISP_MAX_BANDS;
+	if (n > height / 16)
+		n = height / 16 ? height / 16 : 1;
+	band_rows = ((height + n - 1) / n + 1) & ~1u;
+	mstride = width + 2 * HALO;
+
+	memset(bands, 0, sizeof(bands));
+	for (n_bands = 0; n_bands < n && n_bands * band_rows < height; ++n_bands) {
+		struct isp_band *band = &bands[n_bands];
+
+		band->y0 = n_bands * band_rows;
+		band->y1 = band->y0 + band_rows < height ? band->y0 + band_rows : height;
+		band->mosaic = malloc((size_t)(band->y1 - band->y0 + 2 * HALO) * mstride * sizeof(uint16_t));
+		band->strip = malloc((size_t)3 * STRIP_ROWS * width * sizeof(uint16_t));
+		if (isp_config.demosaic == ISP_EDGE)
+			band->green = malloc((size_t)(band->y1 - band->y0 + 2 * HALO) * mstride * sizeof(uint16_t));
+		if (!band->mosaic || !band->strip || (isp_config.demosaic == ISP_EDGE && !band->green)) {
+			n_bands++;
+			isp_release();
+			fprintf(stderr, "ISP: out of memory\n");
+			return -1;
+		}
+	}
+
+	isp_stats.bands = n_bands;
+	ready = 1;
+
+	return 0;
+}
+
+/* grey world: the next frames are balanced so the red and blue averages meet green, eased in over a few frames */
+static void awb_update(void)
+{
+	unsigned long long sums[4] = { 0 };
+	double mean[3], pixels = (double)cur_width * cur_height / 4, target;
+	unsigned int i, p;
+
+	for (i = 0; i < n_bands; ++i)
+		for (p = 0; p < 4; ++p) {
+			sums[p] += bands[i].sums[p];
+			bands[i].sums[p] = 0;
+		}
+	memset(mean, 0, sizeof(mean));
+	for (p = 0; p < 4; ++p)
+		mean[cfa_colour(p & 1, p >> 1)] += sums[p] / pixels - black_idx;
+	mean[1] /= 2;
+	if (mean[0] < 1 || mean[1] < 1 || mean[2] < 1)
+		return;
+	for (i = 0; i < 3; i += 2) {
+		target = mean[1] / mean[i];
+		target = target < 0.25 ? 0.25 : target > 8 ? 8 : target;
+		awb_gain[i] = 0.9 * awb_gain[i] + 0.1 * target;
+	}
+	awb_gain[1] = 1;
+	build_lin_luts();
+}
+
+/**
+Function Name : isp_process
+Function Description : Develops one raw Bayer frame into RGB24 rows at dst, all bands in parallel. The
+                       bands and LUTs are set up on the first frame and again when the format changes
+Parameter : destination and its pitch, frame and bytesused, width, height and Bayer fourcc
+Return : bytes written, -1 for a format or size the ISP cannot handle or a short frame
+**/
+int isp_process(unsigned char *dst, int pitch, const void *frame, unsigned int bytesused, unsigned int width,
+	unsigned int height, unsigned int fourcc)
+{
+	unsigned long long t0 = metric_now_ns(), wall;
+	unsigned int i, s;
+
+	if (bayer_lookup(fourcc) < 0)
+		return -1;
+	if (!ready || width != cur_width || height != cur_height || fourcc != cur_fourcc) {
+		isp_release();
+		if (isp_setup(width, height, fourcc) != 0)
+			return -1;
+	}
+	if (bytesused < width * height * (depth > 8 ? 2 : 1))
+		return -1;
+
+	job_dst = dst;
+	job_pitch = pitch;
+	job_src = frame;
+	tile_for(&frame_done, isp_band_item, NULL, n_bands);
+	tile_wait(&frame_done);
+
+	for (i = 0; i < n_bands; ++i)
+		for (s = 0; s < ISP_STAGES; ++s) {
+			isp_stats.stage_ns[s] += bands[i].stage_ns[s];
+			bands[i].stage_ns[s] = 0;
+		}
+	if (isp_config.awb)
+		awb_update();
+	wall = metric_now_ns() - t0;
+	isp_stats.frames++;
+	isp_stats.wall_ns += wall;
+	if (wall > isp_stats.max_wall_ns)
+		isp_stats.max_wall_ns = wall;
+
+	return width * 3 * height;
+}
+
+/**
+Function Name : isp_release
+Function Description : Frees the band buffers; the next frame sets them up again
+Parameter : void
+Return : void
+**/
+void isp_release(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < n_bands; ++i) {
+		free(bands[i].mosaic);
+		free(bands[i].green);
+		free(bands[i].strip);
+	}
+	memset(bands, 0, sizeof(bands));
+	n_bands = 0;
+	ready = 0;
+}
+
+/**
+Function Name : isp_finish
+Function Description : Prints the time per frame of each stage and in total, then releases the ISP
+Parameter : void
+Return : void
+**/
+void isp_finish(void)
+{
+	unsigned int s;
+
+	if (isp_stats.frames) {
+		printf("isp: %llu frames %ux%u %u-bit, %s demosaic in %u bands, per frame", isp_stats.frames,
+			cur_width, cur_height, depth, demosaic_names[isp_config.demosaic], isp_stats.bands);
+		for (s = 0; s < ISP_STAGES; ++s)
+			printf(" %s %.0f us", stage_names[s], isp_stats.stage_ns[s] / 1e3 / isp_stats.frames);
+		printf(" (summed over bands), wall %.2f ms avg %.2f ms max, %.0f fps\n",
+			isp_stats.wall_ns / 1e6 / isp_stats.frames, isp_stats.max_wall_ns / 1e6,
+			isp_stats.frames * 1e9 / isp_stats.wall_ns);
+		if (isp_config.awb)
+			printf("isp: grey world gains r %.2f b %.2f\n", awb_gain[0], awb_gain[2]);
+	}
+	isp_release();
+}
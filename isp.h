@@ -0,0 +1,45 @@
+#pragma once
+
+#define ISP_MAX_BANDS 64
+
+enum isp_demosaic {
+	ISP_BILINEAR,                   /* average of the nearest samples of each colour */
+	ISP_EDGE,                       /* green along the smoother gradient, red and blue from colour differences */
+};
+
+/* Stages in the order each band runs them, timed separately */
+enum isp_stage {
+	ISP_LINEARIZE,                  /* black level and white balance through one LUT per CFA position */
+	ISP_DEMOSAIC,
+	ISP_CCM,                        /* colour matrix, skipped while it is the identity */
+	ISP_GAMMA,                      /* gamma LUT and RGB24 packing into the destination */
+	ISP_STAGES,
+};
+
+struct isp_config {
+	int black;                      /* black level in sensor units, -1 for 16 at 8 bits scaled to the depth */
+	double wb[3];                   /* red, green and blue gains */
+	int awb;                        /* grey-world gains from the previous frames instead of wb */
+	enum isp_demosaic demosaic;
+	double ccm[9];                  /* camera RGB to output RGB, row major, values under 4 and row sums under 8 */
+	double gamma;
+	unsigned int bands;             /* bands per frame run on the tile pool, 0 for one per pool worker */
+};
+
+struct isp_stats {
+	unsigned long long frames;
+	unsigned long long stage_ns[ISP_STAGES];        /* summed over the bands of each frame */
+	unsigned long long wall_ns;
+	unsigned long long max_wall_ns;
+	unsigned int bands;
+};
+
+extern struct isp_config isp_config;
+extern struct isp_stats isp_stats;
+
+int isp_parse(const char *spec);
+int isp_is_bayer(unsigned int fourcc);
+int isp_process(unsigned char *dst, int pitch, const void *frame, unsigned int bytesused, unsigned int width,
+	unsigned int height, unsigned int fourcc);
+void isp_release(void);
+void isp_finish(void);
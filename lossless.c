@@ -0,0 +1,299 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <lz4.h>
+#include <zstd.h>
+#include <linux/videodev2.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#include "lossless.h"
+
+enum delta_filter lossless_filter = DELTA_NONE;
+int lossless_level = 1;
+
+struct lossless_scratch {
+	ZSTD_CCtx *cctx;
+	unsigned char *filtered;
+	unsigned int filtered_size;
+};
+
+/**
+Function Name : lossless_parse
+Function Description : Parses "lz4" or "zstd[:level]" from the command line
+Parameter : option argument
+Return : 0 for success -1 for unknown codec
+**/
+int lossless_parse(const char *arg)
+{
+	if (strcmp(arg, "lz4") == 0) {
+		encode_codec = ENCODE_LZ4;
+		return 0;
+	}
+	if (strncmp(arg, "zstd", 4) == 0) {
+		encode_codec = ENCODE_ZSTD;
+		if (arg[4] == ':')
+			lossless_level = strtol(arg + 5, NULL, 10);
+		return 0;
+	}
+
+	fprintf(stderr, "Unknown lossless codec %s\n", arg);
+	return -1;
+}
+
+/**
+Function Name : lossless_stride
+Function Description : Bytes per line of the first plane, used as the row delta distance: the driver's
+                       bytesperline when it gave one, else the packed width of the format
+Parameter : fourcc, width, height, bytesperline (0 when unknown) and bytesused of the frame
+Return : stride in bytes
+**/
+unsigned int lossless_stride(unsigned int fourcc, unsigned int width, unsigned int height, unsigned int bytesperline,
+	unsigned int raw_size)
+{
+	if (bytesperline)
+		return bytesperline;
+	switch (fourcc) {
+	case V4L2_PIX_FMT_NV12:
+	case V4L2_PIX_FMT_NV21:
+	case V4L2_PIX_FMT_YUV420:
+	case V4L2_PIX_FMT_GREY:
+	case V4L2_PIX_FMT_SBGGR8:
+	case V4L2_PIX_FMT_SGBRG8:
+	case V4L2_PIX_FMT_SGRBG8:
+	case V4L2_PIX_FMT_SRGGB8:
+		return width;
+	case V4L2_PIX_FMT_RGB24:
+	case V4L2_PIX_FMT_BGR24:
+		return width * 3;
+	case V4L2_PIX_FMT_YUYV:
+	case V4L2_PIX_FMT_UYVY:
+	case V4L2_PIX_FMT_RGB565:
+		return width * 2;
+	case V4L2_PIX_FMT_RGB32:
+	case V4L2_PIX_FMT_BGR32:
+	case V4L2_PIX_FMT_XRGB32:
+	case V4L2_PIX_FMT_XBGR32:
+	case V4L2_PIX_FMT_ARGB32:
+	case V4L2_PIX_FMT_ABGR32:
+		return width * 4;
+	}
+
+	return height && raw_size / height ? raw_size / height : raw_size;
+}
+
+static void sub_bytes(unsigned char *dst, const unsigned char *a, const unsigned char *b, unsigned int n)
+{
+	unsigned int i = 0;
+
+#if defined(__SSE2__)
+	for (; i + 16 <= n; i += 16)
+		_mm_storeu_si128((__m128i *)(dst + i), _mm_sub_epi8(_mm_loadu_si128((const __m128i *)(a + i)),
+			_mm_loadu_si128((const __m128i *)(b + i))));
+#elif defined(__ARM_NEON)
+	for (; i + 16 <= n; i += 16)
+		vst1q_u8(dst + i, vsubq_u8(vld1q_u8(a + i), vld1q_u8(b + i)));
+#endif
+	for (; i < n; ++i)
+		dst[i] = a[i] - b[i];
+}
+
+static void add_bytes(unsigned char *dst, const unsigned char *b, unsigned int n)
+{
+	unsigned int i = 0;
+
+#if defined(__SSE2__)
+	for (; i + 16 <= n; i += 16)
+		_mm_storeu_si128((__m128i *)(dst + i), _mm_add_epi8(_mm_loadu_si128((const __m128i *)(dst + i)),
+			_mm_loadu_si128((const __m128i *)(b + i))));
+#elif defined(__ARM_NEON)
+	for (; i + 16 <= n; i += 16)
+		vst1q_u8(dst + i, vaddq_u8(vld1q_u8(dst + i), vld1q_u8(b + i)));
+#endif
+	for (; i < n; ++i)
+		dst[i] += b[i];
+}
+
+/**
+Function Name : delta_rows_encode
+Function Description : Replaces every row but the first with its difference to the row above. Only rows of
+                       the same frame are referenced, so each frame stays decodable on its own
+Parameter : destination, source, stride and number of rows
+Return : void
+**/
+void delta_rows_encode(unsigned char *dst, const unsigned char *src, unsigned int stride, unsigned int rows)
+{
+	unsigned int r;
+
+	if (!rows)
+		return;
+	memcpy(dst, src, stride);
+	for (r = 1; r < rows; ++r)
+		sub_bytes(dst + r * stride, src + r * stride, src + (r - 1) * stride, stride);
+}
+
+/**
+Function Name : delta_rows_decode
+Function Description : In-place inverse of delta_rows_encode
+Parameter : buffer, stride and number of rows
+Return : void
+**/
+void delta_rows_decode(unsigned char *buf, unsigned int stride, unsigned int rows)
+{
+	unsigned int r;
+
+	for (r = 1; r < rows; ++r)
+		add_bytes(buf + r * stride, buf + (r - 1) * stride, stride);
+}
+
+static void lossless_scratch_free(void *priv)
+{
+	struct lossless_scratch *ls = priv;
+
+	ZSTD_freeCCtx(ls->cctx);
+	free(ls->filtered);
+	free(ls);
+}
+
+static struct lossless_scratch *lossless_scratch_get(struct encode_worker *worker, unsigned int raw_size)
+{
+	struct lossless_scratch *ls = worker->priv;
+
+	if (!ls) {
+		if (!(ls = calloc(1, sizeof(*ls))))
+			return NULL;
+		if (!(ls->cctx = ZSTD_createCCtx())) {
+			free(ls);
+			return NULL;
+		}
+		worker->priv = ls;
+		worker->priv_free = lossless_scratch_free;
+	}
+	if (lossless_filter != DELTA_NONE && ls->filtered_size < raw_size) {
+		free(ls->filtered);
+		ls->filtered_size = 0;
+		if (!(ls->filtered = malloc(raw_size)))
+			return NULL;
+		ls->filtered_size = raw_size;
+	}
+
+	return ls;
+}
+
+/**
+Function Name : lossless_encode_frame
+Function Description : Optionally row-delta filters a frame, compresses it with LZ4 or zstd and prefixes it
+                       with a lossless_frame_header. Frames that fail to compress are stored verbatim
+Parameter : worker owning the scratch buffers and the job to encode
+Return : 0 for success -1 when a buffer cannot be allocated
+**/
+int lossless_encode_frame(struct encode_worker *worker, struct encode_job *job)
+{
+	struct lossless_scratch *ls = lossless_scratch_get(worker, job->raw_size);
+	struct lossless_frame_header hdr;
+	const unsigned char *src = job->raw;
+	unsigned long bound;
+	size_t comp = 0;
+	int ret;
+
+	if (!ls)
+		return -1;
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic = LOSSLESS_MAGIC;
+	hdr.header_size = sizeof(hdr);
+	hdr.seq = job->seq;
+	hdr.fourcc = job->fourcc;
+	hdr.width = job->width;
+	hdr.height = job->height;
+	hdr.stride = lossless_stride(job->fourcc, job->width, job->height, job->stride, job->raw_size);
+	hdr.raw_size = job->raw_size;
+	hdr.codec = encode_codec;
+	hdr.filter = lossless_filter;
+
+	if (lossless_filter == DELTA_ROW) {
+		unsigned int rows = job->raw_size / hdr.stride;
+
+		delta_rows_encode(ls->filtered, job->raw, hdr.stride, rows);
+		memcpy(ls->filtered + rows * hdr.stride, job->raw + rows * hdr.stride, job->raw_size - rows * hdr.stride);
+		src = ls->filtered;
+	}
+
+	bound = ZSTD_compressBound(job->raw_size);
+	if ((unsigned long)LZ4_compressBound(job->raw_size) > bound)
+		bound = LZ4_compressBound(job->raw_size);
+	if (job->out_capacity < sizeof(hdr) + bound) {
+		free(job->out);
+		job->out_capacity = 0;
+		if (!(job->out = malloc(sizeof(hdr) + bound)))
+			return -1;
+		job->out_capacity = sizeof(hdr) + bound;
+	}
+
+	if (encode_codec == ENCODE_LZ4) {
+		ret = LZ4_compress_default((const char *)src, (char *)job->out + sizeof(hdr), job->raw_size, bound);
+		comp = ret > 0 ? (size_t)ret : 0;
+	} else {
+		comp = ZSTD_compressCCtx(ls->cctx, job->out + sizeof(hdr), bound, src, job->raw_size, lossless_level);
+		if (ZSTD_isError(comp))
+			comp = 0;
+	}
+
+	if (!comp) {
+		hdr.codec = ENCODE_NONE;
+		memcpy(job->out + sizeof(hdr), src, job->raw_size);
+		comp = job->raw_size;
+	}
+
+	hdr.comp_size = comp;
+	memcpy(job->out, &hdr, sizeof(hdr));
+	job->out_size = sizeof(hdr) + comp;
+
+	return 0;
+}
+
+/**
+Function Name : lossless_decode_frame
+Function Description : Restores the original frame from one record written by lossless_encode_frame
+Parameter : record start and length, destination buffer and its size
+Return : raw frame size for success -1 for a damaged record
+**/
+long lossless_decode_frame(const unsigned char *record, unsigned long record_size, unsigned char *dst, unsigned long dst_size)
+{
+	struct lossless_frame_header hdr;
+	const unsigned char *payload;
+	size_t got;
+
+	if (record_size < sizeof(hdr))
+		return -1;
+	memcpy(&hdr, record, sizeof(hdr));
+	if (hdr.magic != LOSSLESS_MAGIC || hdr.header_size + hdr.comp_size > record_size || hdr.raw_size > dst_size)
+		return -1;
+	payload = record + hdr.header_size;
+
+	switch (hdr.codec) {
+	case ENCODE_NONE:
+		memcpy(dst, payload, hdr.raw_size);
+		got = hdr.raw_size;
+		break;
+	case ENCODE_LZ4:
+		got = LZ4_decompress_safe((const char *)payload, (char *)dst, hdr.comp_size, dst_size);
+		break;
+	case ENCODE_ZSTD:
+		got = ZSTD_decompress(dst, dst_size, payload, hdr.comp_size);
+		if (ZSTD_isError(got))
+			return -1;
+		break;
+	default:
+		return -1;
+	}
+	if (got != hdr.raw_size)
+		return -1;
+
+	if (hdr.filter == DELTA_ROW && hdr.stride)
+		delta_rows_decode(dst, hdr.stride, hdr.raw_size / hdr.stride);
+
+	return hdr.raw_size;
+}
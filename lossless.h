@@ -0,0 +1,37 @@
+#pragma once
+#include <stdint.h>
+#include "encode.h"
+
+#define LOSSLESS_MAGIC 0x5a4c3456      /* "V4LZ" */
+
+enum delta_filter {
+	DELTA_NONE,
+	DELTA_ROW,
+};
+
+/* Precedes every compressed frame, so a recording can be seeked by hopping comp_size */
+struct lossless_frame_header {
+	uint32_t magic;
+	uint32_t header_size;
+	uint32_t seq;
+	uint32_t fourcc;
+	uint32_t width;
+	uint32_t height;
+	uint32_t stride;
+	uint32_t raw_size;
+	uint32_t comp_size;
+	uint8_t codec;
+	uint8_t filter;
+	uint8_t reserved[2];
+};
+
+extern enum delta_filter lossless_filter;
+extern int lossless_level;
+
+int lossless_parse(const char *arg);
+unsigned int lossless_stride(unsigned int fourcc, unsigned int width, unsigned int height, unsigned int bytesperline,
+	unsigned int raw_size);
+void delta_rows_encode(unsigned char *dst, const unsigned char *src, unsigned int stride, unsigned int rows);
+void delta_rows_decode(unsigned char *buf, unsigned int stride, unsigned int rows);
+int lossless_encode_frame(struct encode_worker *worker, struct encode_job *job);
+long lossless_decode_frame(const unsigned char *record, unsigned long record_size, unsigned char *dst, unsigned long dst_size);
@@ -2,6 +2,26 @@
 #include "main.h"
 #include "v4l2_ctrl.h"
 #include "capture.h"
+#include "encode.h"
+#include "lossless.h"
+#include "h264.h"
+#include "bench.h"
+#include "metrics.h"
+#include "trace.h"
+#include "rt.h"
+#include "pipeout.h"
+#include "framecheck.h"
+#include "policy.h"
+#include "hotplug.h"
+#include "isp.h"
+#include "tilepool.h"
+#include "snapshot.h"
+#include "pyramid.h"
+#include "segment.h"
+#include "stabilize.h"
+#include "autofocus.h"
+#include "hdr.h"
+#include "denoise.h"
 
 extern void mainstreamloop();
 
@@ -16,6 +36,10 @@ int main(int argc, char **argv)
 	printf("main\n");
 	char c;
     int optidx = 0;
+	int device_info = 0, list_formats = 0, list_ctrls = 0;
+
+	if(argc > 1 && (strcmp(argv[1], "-B") == 0 || strcmp(argv[1], "--bench") == 0))
+		return run_benchmarks(argc - 1, argv + 1);
 
 	 struct option longopt[] = {
 		    {"device-path",1,NULL,'d'},
@@ -32,22 +56,42 @@ int main(int argc, char **argv)
 		    {"height",1,NULL,'v'},
 			{"outfile",1,NULL,'o'},
 			{"stream",0,NULL,'s'},
+			{"jpeg",1,NULL,'j'},
+			{"h264",1,NULL,'x'},
+			{"threads",1,NULL,'t'},
+			{"lossless",1,NULL,'z'},
+			{"row-delta",0,NULL,'R'},
+			{"metrics",1,NULL,'M'},
+			{"trace",1,NULL,'T'},
+			{"pin",1,NULL,'P'},
+			{"sched-fifo",1,NULL,'S'},
+			{"mlock",0,NULL,'l'},
+			{"y4m",0,NULL,'Y'},
+			{"crc",1,NULL,'k'},
+			{"adaptive",1,NULL,'A'},
+			{"recover",1,NULL,'e'},
+			{"isp",1,NULL,'I'},
+			{"workers",1,NULL,'W'},
+			{"snapshot",1,NULL,'n'},
+			{"outputs",1,NULL,'O'},
+			{"segment",1,NULL,'g'},
+			{"stabilize",1,NULL,'V'},
+			{"autofocus",1,NULL,'a'},
+			{"hdr",1,NULL,'H'},
+			{"denoise",1,NULL,'N'},
 		    {0,0,0,0}
 	};
 	
-	openDevice(dev_path);
-	init_device();
-	while ((c=getopt_long(argc,argv,"d:C:w:v:F:o:fhDcmurs",longopt,&optidx)) != -1)
+	/* every option is read before the device is opened, so -d decides which one that is */
+	while ((c=getopt_long(argc,argv,"d:C:w:v:F:o:j:x:t:z:M:T:P:S:k:A:e:I:W:n:O:g:V:a:H:N:fhDcmursRlY",longopt,&optidx)) != -1)
     {
         switch ( c )
         {
             case 'd':
                 dev_path = strdup( optarg );
-                close_device();
-                openDevice(dev_path);
                 break;
             case 'D':
-                deviceInfo();
+                device_info = 1;
                 break;
             case 'w':
                 width = strtol( optarg, NULL, 10 );
@@ -62,6 +106,8 @@ int main(int argc, char **argv)
                 break;
             case 'o':
                 outfile = strdup( optarg );
+                if(strcmp(outfile, "-") == 0)
+                	pipeout_claim_stdout();
                 break;
             case 'F':
 				pix_format_str = strdup( optarg );
@@ -69,10 +115,10 @@ int main(int argc, char **argv)
 					goto CLOSE_AND_EXIT;
                 break;
 			case 'f':
-				listFormats();
+				list_formats = 1;
 				break;
 			case 'c':
-				listControls();
+				list_ctrls = 1;
 				break;
 			case 'h':
 				usage(stdout, argv[0]);
@@ -91,6 +137,91 @@ int main(int argc, char **argv)
 				streaming = 1;
 				capture = 0;
 				break;
+			case 'j':
+				encode_codec = ENCODE_JPEG;
+				encode_quality = strtol( optarg, NULL, 10 );
+				break;
+			case 'x':
+				if(h264_parse(optarg) != 0)
+					goto CLOSE_AND_EXIT;
+				break;
+			case 't':
+				encode_threads = strtol( optarg, NULL, 10 );
+				break;
+			case 'z':
+				if(lossless_parse(optarg) != 0)
+					goto CLOSE_AND_EXIT;
+				break;
+			case 'R':
+				lossless_filter = DELTA_ROW;
+				break;
+			case 'M':
+				if(metrics_start(optarg) != 0)
+					goto CLOSE_AND_EXIT;
+				break;
+			case 'T':
+				trace_path = strdup( optarg );
+				trace_install_signal();
+				break;
+			case 'P':
+				if(rt_parse_pin(optarg) != 0)
+					goto CLOSE_AND_EXIT;
+				break;
+			case 'S':
+				rt_fifo_priority = strtol( optarg, NULL, 10 );
+				break;
+			case 'l':
+				rt_mlock = 1;
+				break;
+			case 'Y':
+				pipe_framing = PIPE_Y4M;
+				break;
+			case 'k':
+				if(framecheck_parse(optarg) != 0)
+					goto CLOSE_AND_EXIT;
+				break;
+			case 'A':
+				if(policy_parse(optarg) != 0)
+					goto CLOSE_AND_EXIT;
+				break;
+			case 'e':
+				hotplug_timeout = strtol( optarg, NULL, 10 );
+				break;
+			case 'I':
+				if(isp_parse(optarg) != 0)
+					goto CLOSE_AND_EXIT;
+				break;
+			case 'W':
+				tile_threads = strtol( optarg, NULL, 10 );
+				break;
+			case 'n':
+				if(snapshot_parse(optarg) != 0)
+					goto CLOSE_AND_EXIT;
+				break;
+			case 'O':
+				if(pyramid_parse(optarg) != 0)
+					goto CLOSE_AND_EXIT;
+				break;
+			case 'g':
+				if(segment_parse(optarg) != 0)
+					goto CLOSE_AND_EXIT;
+				break;
+			case 'V':
+				if(stabilize_parse(optarg) != 0)
+					goto CLOSE_AND_EXIT;
+				break;
+			case 'a':
+				if(autofocus_parse(optarg) != 0)
+					goto CLOSE_AND_EXIT;
+				break;
+			case 'H':
+				if(hdr_parse(optarg) != 0)
+					goto CLOSE_AND_EXIT;
+				break;
+			case 'N':
+				if(denoise_parse(optarg) != 0)
+					goto CLOSE_AND_EXIT;
+				break;
             default:
                 printf("bad arg\n");
 				usage(stderr, argv[0]);
@@ -99,6 +230,17 @@ int main(int argc, char **argv)
         }
 	}
 	
+	openDevice(dev_path);
+	if(device_info)
+		deviceInfo();
+	if(list_formats)
+		listFormats();
+	if(list_ctrls)
+		listControls();
+
+	rt_lock_memory();
+	snapshot_install_signal();
+
 	if(capture)
 	{
 		init_device();
@@ -118,6 +260,10 @@ int main(int argc, char **argv)
 	}
 	
 CLOSE_AND_EXIT:
+	tile_pool_finish();
+	if(trace_path)
+		trace_dump(trace_path);
+	metrics_stop();
 	close_device();
 	printf("End of main\n");
 	return 0;
@@ -144,9 +290,40 @@ void usage( FILE *fp, char * name )
                  "-r | --read          Use read() calls\n"
                  "-u | --user-ptr      Use application allocated buffers\n"
                  "-F | --pix-format    Pixel format to select format[default=YUYV]\n"
-                 "-o | --outfile       Output file name\n"
+                 "-o | --outfile       Output file name, - for stdout or an existing FIFO to stream raw frames with vmsplice\n"
                  "-w | --width         Width of output image[Default=640]\n"
                  "-v | --heigth        Height of output image[Default=480]\n"
+                 "-j | --jpeg          Encode YUYV/NV12 captures to JPEG with quality [1-100] before writing\n"
+                 "-x | --h264          Record YUYV/NV12/GREY to H.264 in a fragmented MP4 (make H264=1): on, or preset=,tune=,\n"
+                 "                     crf=[23], kbps= for a bitrate instead, keyint=<seconds between keyframes>[10]\n"
+                 "-t | --threads       Number of encode threads, x264 frame threads with -x[Default=2]\n"
+                 "-z | --lossless      Compress raw frames losslessly, lz4 or zstd[:level]\n"
+                 "-R | --row-delta     Delta filter each row against the previous one before lossless compression\n"
+                 "-M | --metrics       Export Prometheus metrics on unix:<path> or a loopback <port>\n"
+                 "-T | --trace         Write a Chrome trace (make TRACE=1) at exit and on SIGUSR1\n"
+                 "-P | --pin           Pin threads, e.g. capture=2,writer=4,encode=5-7; capture also renders\n"
+                 "-S | --sched-fifo    Run the capture thread at SCHED_FIFO with this priority\n"
+                 "-l | --mlock         Lock all memory with mlockall\n"
+                 "-Y | --y4m           Frame raw output to stdout or a FIFO as YUV4MPEG2\n"
+                 "-k | --crc           CRC32C every frame to catch stuck and truncated frames, off, sparse or full[default=off]\n"
+                 "-A | --adaptive      Shed load when the sink falls behind: on, or high=,low=,window=,hold=,mjpg\n"
+                 "-e | --recover       Seconds to wait for a device that went away to come back, 0 to exit[default=10]\n"
+                 "-I | --isp           Develop raw Bayer for display: black=,wb=r:g:b or awb,bilinear or edge,ccm=9 values r:g:b rows,gamma=,bands=\n"
+                 "-W | --workers       Threads in the tile pool that frame processing (the ISP) runs on[default=online CPUs]\n"
+                 "-n | --snapshot      Snapshot files (SPACE, s for a still at the largest size, SIGUSR2 or GET /snapshot[?still]\n"
+                 "                     on the metrics endpoint): <prefix>, or prefix=,settle=<frames after a still switch>,raw\n"
+                 "-O | --outputs       Smaller copies of every YUYV/NV12/GREY frame as Y4M, <w>x<h>=<file or FIFO>[,...]\n"
+                 "-g | --segment       Split the recording into preallocated files: seconds=,size=<MB>,budget=<MB> deleting the\n"
+                 "                     oldest past it,prealloc=<MB> for the first of a seconds= recording[default=64]\n"
+                 "-V | --stabilize     Stabilize YUYV/NV12/GREY preview and recording: on, or crop=<percent>[default=10],\n"
+                 "                     lookahead=<frames held back>[default=8],norotate\n"
+                 "-a | --autofocus     Focus the lens from the sharpness of a YUYV/NV12/GREY frame: on, or roi=<percent>[default=40],\n"
+                 "                     settle=<frames a move takes>[default=2],step=<first step>,refocus=<percent drop>[default=0]\n"
+                 "-H | --hdr           Merge YUYV/NV12/GREY exposure brackets into one frame each: on, or brackets=<n>[default=3],\n"
+                 "                     stops=<EV apart>[default=2],latency=<frames a control takes>[default=2],gain\n"
+                 "-N | --denoise       Blend YUYV/NV12/GREY frames into a running reference where they match it: on, or\n"
+                 "                     strength=<percent kept>[default=75],threshold=<levels taken as motion>[default=32]\n"
+                 "-B | --bench         Run a benchmark without a device, must be the first option [list]\n"
                  "",
                  name, dev_path, frame_count);
 }
@@ -0,0 +1,220 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "metrics.h"
+#include "snapshot.h"
+
+atomic_ullong metric_counters[MC_COUNTERS];
+atomic_llong metric_gauges[MG_GAUGES];
+struct metric_hist metric_hists[MH_HISTS];
+
+static const char *counter_names[MC_COUNTERS][2] = {
+	{ "v4l2_frames_dequeued_total", "Frames dequeued from the driver" },
+	{ "v4l2_frames_dropped_total", "Frames the driver dropped, from sequence number gaps" },
+	{ "v4l2_frames_error_total", "Buffers returned with V4L2_BUF_FLAG_ERROR" },
+	{ "v4l2_encode_dropped_total", "Frames refused because the encode pool was full" },
+	{ "v4l2_frames_repeated_total", "Frames identical to the previous one by CRC32C" },
+	{ "v4l2_frames_truncated_total", "Frames with bytesused short of the image size or an incomplete JPEG" },
+	{ "v4l2_device_lost_total", "Times the capture device went away and was reopened" },
+};
+
+static const char *gauge_names[MG_GAUGES][2] = {
+	{ "v4l2_buffers_queued", "Capture buffers currently owned by the driver" },
+	{ "v4l2_writer_backlog_frames", "Frames submitted for encoding but not yet written" },
+	{ "v4l2_policy_level", "Load-shedding step taken by the adaptive policy, 0 for none" },
+};
+
+static const char *hist_names[MH_HISTS][2] = {
+	{ "v4l2_dqbuf_wait_seconds", "Time blocked in VIDIOC_DQBUF" },
+	{ "v4l2_render_seconds", "Time to upload and present one frame" },
+	{ "v4l2_write_seconds", "Time to write or submit one frame" },
+};
+
+static pthread_t metrics_thread;
+static int metrics_fd = -1;
+static atomic_int metrics_exit;                 /* set by metrics_stop(), read by the exporter thread */
+static char metrics_path[108];
+
+/**
+Function Name : metrics_format
+Function Description : Renders every counter, gauge and histogram in Prometheus text exposition format
+Parameter : destination buffer and its size
+Return : number of bytes written (truncated to size - 1)
+**/
+size_t metrics_format(char *buf, size_t size)
+{
+	size_t len = 0;
+	unsigned long long cumulative;
+	unsigned int i, b;
+
+#define EMIT(...) do { \
+		int n = snprintf(buf + len, size - len, __VA_ARGS__); \
+		if (n > 0) \
+			len = len + n < size ? len + n : size - 1; \
+	} while (0)
+
+	for (i = 0; i < MC_COUNTERS; ++i) {
+		EMIT("# HELP %s %s\n# TYPE %s counter\n", counter_names[i][0], counter_names[i][1], counter_names[i][0]);
+		EMIT("%s %llu\n", counter_names[i][0],
+			(unsigned long long)atomic_load_explicit(&metric_counters[i], memory_order_relaxed));
+	}
+	for (i = 0; i < MG_GAUGES; ++i) {
+		EMIT("# HELP %s %s\n# TYPE %s gauge\n", gauge_names[i][0], gauge_names[i][1], gauge_names[i][0]);
+		EMIT("%s %lld\n", gauge_names[i][0],
+			(long long)atomic_load_explicit(&metric_gauges[i], memory_order_relaxed));
+	}
+	for (i = 0; i < MH_HISTS; ++i) {
+		EMIT("# HELP %s %s\n# TYPE %s histogram\n", hist_names[i][0], hist_names[i][1], hist_names[i][0]);
+		cumulative = 0;
+		for (b = 0; b < METRIC_HIST_BUCKETS; ++b) {
+			cumulative += atomic_load_explicit(&metric_hists[i].buckets[b], memory_order_relaxed);
+			EMIT("%s_bucket{le=\"%g\"} %llu\n", hist_names[i][0], (16 << b) / 1e6, cumulative);
+		}
+		cumulative += atomic_load_explicit(&metric_hists[i].buckets[b], memory_order_relaxed);
+		EMIT("%s_bucket{le=\"+Inf\"} %llu\n", hist_names[i][0], cumulative);
+		EMIT("%s_sum %.9f\n", hist_names[i][0],
+			atomic_load_explicit(&metric_hists[i].sum_ns, memory_order_relaxed) / 1e9);
+		EMIT("%s_count %llu\n", hist_names[i][0], cumulative);
+	}
+#undef EMIT
+
+	return len;
+}
+
+static void metrics_serve(int client)
+{
+	static char body[16384];
+	char request[1024], header[128];
+	struct timeval timeout = { 1, 0 };
+	size_t len;
+	int n;
+
+	/* a client that connects and then says nothing, or stops reading, must not hold up the next scrape */
+	setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+	setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+	/* /snapshot[?still] asks for a snapshot, every other path gets the full exposition */
+	n = read(client, request, sizeof(request) - 1);
+	if (n < 0)
+		return;
+	request[n] = '\0';
+
+	if (strncmp(request, "GET /snapshot", 13) == 0 || strncmp(request, "POST /snapshot", 14) == 0) {
+		snapshot_request(strstr(request, "/snapshot?still") ? SNAPSHOT_STILL : SNAPSHOT_FRAME);
+		len = snprintf(body, sizeof(body), "snapshot requested\n");
+		n = snprintf(header, sizeof(header), "HTTP/1.0 202 Accepted\r\n"
+			"Content-Type: text/plain\r\nContent-Length: %zu\r\n\r\n", len);
+	} else {
+		len = metrics_format(body, sizeof(body));
+		n = snprintf(header, sizeof(header), "HTTP/1.0 200 OK\r\n"
+			"Content-Type: text/plain; version=0.0.4\r\nContent-Length: %zu\r\n\r\n", len);
+	}
+	if (write(client, header, n) == n)
+		if (write(client, body, len) < 0)
+			perror("metrics write");
+}
+
+static void *metrics_main(void *arg)
+{
+	struct pollfd pfd;
+	int client;
+
+	(void)arg;
+	pfd.fd = metrics_fd;
+	pfd.events = POLLIN;
+	while (!atomic_load(&metrics_exit)) {
+		if (poll(&pfd, 1, 200) <= 0)
+			continue;
+		client = accept(metrics_fd, NULL, NULL);
+		if (client < 0)
+			continue;
+		metrics_serve(client);
+		close(client);
+	}
+
+	return NULL;
+}
+
+/**
+Function Name : metrics_start
+Function Description : Starts the exporter thread on "unix:<path>", "<port>" or "127.0.0.1:<port>". TCP is
+                       always bound to loopback
+Parameter : endpoint string
+Return : 0 for success -1 for failure
+**/
+int metrics_start(const char *endpoint)
+{
+	struct sockaddr_un sun;
+	struct sockaddr_in sin;
+	const char *port;
+	int one = 1;
+
+	if (strncmp(endpoint, "unix:", 5) == 0) {
+		memset(&sun, 0, sizeof(sun));
+		sun.sun_family = AF_UNIX;
+		strncpy(sun.sun_path, endpoint + 5, sizeof(sun.sun_path) - 1);
+		strcpy(metrics_path, sun.sun_path);
+		unlink(metrics_path);
+		metrics_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		if (metrics_fd < 0 || bind(metrics_fd, (struct sockaddr *)&sun, sizeof(sun)) < 0)
+			goto FAIL;
+	} else {
+		port = strrchr(endpoint, ':');
+		port = port ? port + 1 : endpoint;
+		memset(&sin, 0, sizeof(sin));
+		sin.sin_family = AF_INET;
+		sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		sin.sin_port = htons(strtol(port, NULL, 10));
+		metrics_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		if (metrics_fd < 0)
+			goto FAIL;
+		setsockopt(metrics_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+		if (bind(metrics_fd, (struct sockaddr *)&sin, sizeof(sin)) < 0)
+			goto FAIL;
+	}
+
+	if (listen(metrics_fd, 4) < 0)
+		goto FAIL;
+	atomic_store(&metrics_exit, 0);
+	if (pthread_create(&metrics_thread, NULL, metrics_main, NULL)) {
+		fprintf(stderr, "create metrics thread failed\n");
+		goto FAIL;
+	}
+
+	return 0;
+
+FAIL:
+	perror("metrics");
+	if (metrics_fd >= 0)
+		close(metrics_fd);
+	metrics_fd = -1;
+	return -1;
+}
+
+/**
+Function Name : metrics_stop
+Function Description : Stops the exporter thread and removes its socket
+Parameter : void
+Return : void
+**/
+void metrics_stop(void)
+{
+	if (metrics_fd < 0)
+		return;
+
+	atomic_store(&metrics_exit, 1);
+	pthread_join(metrics_thread, NULL);
+	close(metrics_fd);
+	metrics_fd = -1;
+	if (metrics_path[0])
+		unlink(metrics_path);
+}
@@ -0,0 +1,78 @@
+#pragma once
+#include <stdatomic.h>
+#include <stddef.h>
+#include <time.h>
+
+#define METRIC_HIST_BUCKETS 16          /* upper bounds 16us << i, plus +Inf */
+
+enum metric_counter_id {
+	MC_FRAMES_DEQUEUED,
+	MC_FRAMES_DROPPED,                  /* gaps in the driver sequence number */
+	MC_FRAMES_ERROR,                    /* buffers returned with V4L2_BUF_FLAG_ERROR */
+	MC_ENCODE_DROPPED,                  /* frames refused by a full encode pool */
+	MC_FRAMES_REPEATED,                 /* frames with the same CRC32C as the one before */
+	MC_FRAMES_TRUNCATED,                /* frames short of sizeimage or missing the JPEG EOI */
+	MC_DEVICE_LOST,                     /* times the device went away mid-capture */
+	MC_COUNTERS,
+};
+
+enum metric_gauge_id {
+	MG_BUFFERS_QUEUED,                  /* buffers owned by the driver */
+	MG_WRITER_BACKLOG,                  /* frames submitted to the encode pool but not yet written */
+	MG_POLICY_LEVEL,                    /* load-shedding step, 0 when nothing is shed */
+	MG_GAUGES,
+};
+
+enum metric_hist_id {
+	MH_DQBUF_WAIT,
+	MH_RENDER,
+	MH_WRITE,
+	MH_HISTS,
+};
+
+struct metric_hist {
+	atomic_ullong buckets[METRIC_HIST_BUCKETS + 1];
+	atomic_ullong sum_ns;
+};
+
+extern atomic_ullong metric_counters[MC_COUNTERS];
+extern atomic_llong metric_gauges[MG_GAUGES];
+extern struct metric_hist metric_hists[MH_HISTS];
+
+static inline unsigned long long metric_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static inline void metric_inc(enum metric_counter_id id, unsigned long long n)
+{
+	atomic_fetch_add_explicit(&metric_counters[id], n, memory_order_relaxed);
+}
+
+static inline void metric_set(enum metric_gauge_id id, long long v)
+{
+	atomic_store_explicit(&metric_gauges[id], v, memory_order_relaxed);
+}
+
+static inline void metric_add(enum metric_gauge_id id, long long v)
+{
+	atomic_fetch_add_explicit(&metric_gauges[id], v, memory_order_relaxed);
+}
+
+/* Bucket i holds what is at or below 16us << i, decided on the nanoseconds so nothing is rounded under a bound */
+static inline void metric_observe(enum metric_hist_id id, unsigned long long ns)
+{
+	unsigned int i = ns <= 16000 ? 0 : 64 - __builtin_clzll((ns - 1) / 16000);
+
+	if (i > METRIC_HIST_BUCKETS)
+		i = METRIC_HIST_BUCKETS;
+	atomic_fetch_add_explicit(&metric_hists[id].buckets[i], 1, memory_order_relaxed);
+	atomic_fetch_add_explicit(&metric_hists[id].sum_ns, ns, memory_order_relaxed);
+}
+
+size_t metrics_format(char *buf, size_t size);
+int metrics_start(const char *endpoint);
+void metrics_stop(void);
@@ -0,0 +1,527 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "mp4.h"
+
+/*
+ * Fragmented MP4 with one H.264 track. The moov at the start describes the track and holds no samples; they
+ * follow in moof + mdat fragments, one per GOP, so everything up to the last fragment plays after a crash
+ * and nothing is seeked back to: a pipe takes the same bytes as a file. An mfra at the end lists the
+ * keyframe of every fragment for seeking. Samples are length prefixed NAL units (avcC, 4-byte lengths).
+ */
+
+#define MP4_MAX_FRAGMENT 1024           /* samples, for an encoder whose keyframes are further apart */
+#define MP4_DEFAULT_DURATION 3000       /* 30 fps, for a last sample with no successor to measure */
+
+struct mp4_sample {
+	unsigned int size;
+	long long pts, dts;
+	int keyframe;
+};
+
+struct mp4_buf {
+	unsigned char *p;
+	size_t len, cap;
+	int error;                      /* a realloc failed, what was put after it is missing */
+};
+
+struct mp4_writer {
+	int fd;
+	int error;
+	unsigned long long offset;              /* where the next box starts */
+	long long first_dts;
+	unsigned int last_duration;
+	struct mp4_buf data;                    /* mdat payload of the fragment being gathered */
+	struct mp4_sample *samples;
+	unsigned int n_samples;
+	struct {
+		unsigned long long time, offset;
+	} *points;                              /* presentation time and moof of each fragment opening on a keyframe */
+	unsigned int n_points, points_cap;
+	struct mp4_stats stats;
+};
+
+static void put_bytes(struct mp4_buf *b, const void *data, size_t n)
+{
+	size_t cap = b->cap ? b->cap : 4096;
+	unsigned char *p;
+
+	if (b->error)
+		return;
+	while (b->len + n > cap)
+		cap *= 2;
+	if (cap != b->cap) {
+		if (!(p = realloc(b->p, cap))) {
+			b->error = 1;
+			return;
+		}
+		b->p = p;
+		b->cap = cap;
+	}
+	memcpy(b->p + b->len, data, n);
+	b->len += n;
+}
+
+static void put8(struct mp4_buf *b, unsigned int v)
+{
+	unsigned char c = v;
+
+	put_bytes(b, &c, 1);
+}
+
+static void put16(struct mp4_buf *b, unsigned int v)
+{
+	unsigned char c[2] = { v >> 8, v };
+
+	put_bytes(b, c, 2);
+}
+
+static void put32(struct mp4_buf *b, unsigned int v)
+{
+	unsigned char c[4] = { v >> 24, v >> 16, v >> 8, v };
+
+	put_bytes(b, c, 4);
+}
+
+static void put64(struct mp4_buf *b, unsigned long long v)
+{
+	put32(b, v >> 32);
+	put32(b, v);
+}
+
+static void put_zero(struct mp4_buf *b, size_t n)
+{
+	while (n--)
+		put8(b, 0);
+}
+
+/* Opens a box, full box when version is 0 or more; returns where its size goes for box_end() */
+static size_t box_begin(struct mp4_buf *b, const char *type, int version, unsigned int flags)
+{
+	size_t at = b->len;
+
+	put32(b, 0);
+	put_bytes(b, type, 4);
+	if (version >= 0)
+		put32(b, (unsigned int)version << 24 | flags);
+
+	return at;
+}
+
+static void box_end(struct mp4_buf *b, size_t at)
+{
+	unsigned int size = b->len - at;
+
+	if (b->len < at + 4)
+		return;
+	b->p[at] = size >> 24;
+	b->p[at + 1] = size >> 16;
+	b->p[at + 2] = size >> 8;
+	b->p[at + 3] = size;
+}
+
+static void put_matrix(struct mp4_buf *b)
+{
+	static const unsigned int unity[9] = { 0x00010000, 0, 0, 0, 0x00010000, 0, 0, 0, 0x40000000 };
+	unsigned int i;
+
+	for (i = 0; i < 9; ++i)
+		put32(b, unity[i]);
+}
+
+/* A box that could not be built whole fails the writer rather than go out truncated */
+static int mp4_buf_ok(struct mp4_writer *w, const struct mp4_buf *b)
+{
+	if (b->error && !w->error) {
+		fprintf(stderr, "mp4: out of memory\n");
+		w->error = 1;
+	}
+
+	return !b->error;
+}
+
+static void mp4_emit(struct mp4_writer *w, const unsigned char *p, size_t n)
+{
+	ssize_t ret;
+
+	while (n && !w->error) {
+		if ((ret = write(w->fd, p, n)) < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("mp4: write");
+			w->error = 1;
+			return;
+		}
+		p += ret;
+		n -= ret;
+		w->offset += ret;
+		w->stats.bytes += ret;
+	}
+}
+
+static void put_avc1(struct mp4_buf *b, unsigned int width, unsigned int height, const unsigned char *sps,
+	unsigned int sps_size, const unsigned char *pps, unsigned int pps_size)
+{
+	size_t avc1, avcc;
+
+	avc1 = box_begin(b, "avc1", -1, 0);
+	put_zero(b, 6);
+	put16(b, 1);                    /* data reference index */
+	put_zero(b, 16);
+	put16(b, width);
+	put16(b, height);
+	put32(b, 0x00480000);           /* 72 dpi */
+	put32(b, 0x00480000);
+	put32(b, 0);
+	put16(b, 1);                    /* frames per sample */
+	put_zero(b, 32);                /* compressor name */
+	put16(b, 0x18);
+	put16(b, 0xffff);
+	avcc = box_begin(b, "avcC", -1, 0);
+	put8(b, 1);
+	put8(b, sps[1]);                /* profile, compatibility and level as the SPS has them */
+	put8(b, sps[2]);
+	put8(b, sps[3]);
+	put8(b, 0xff);                  /* 4-byte NAL lengths */
+	put8(b, 0xe1);                  /* one SPS */
+	put16(b, sps_size);
+	put_bytes(b, sps, sps_size);
+	put8(b, 1);
+	put16(b, pps_size);
+	put_bytes(b, pps, pps_size);
+	if (sps[1] == 100 || sps[1] == 110 || sps[1] == 122 || sps[1] == 144) {
+		put8(b, 0xfc | 1);      /* 4:2:0 */
+		put8(b, 0xf8);          /* 8-bit luma and chroma */
+		put8(b, 0xf8);
+		put8(b, 0);
+	}
+	box_end(b, avcc);
+	box_end(b, avc1);
+}
+
+/* ftyp and a moov with the track and no samples, mvex saying they come in fragments */
+static void mp4_header(struct mp4_writer *w, unsigned int width, unsigned int height, const unsigned char *sps,
+	unsigned int sps_size, const unsigned char *pps, unsigned int pps_size, long long delay)
+{
+	struct mp4_buf b = { 0 };
+	size_t box, moov, trak, mdia, minf, dinf, stbl, mvex;
+
+	box = box_begin(&b, "ftyp", -1, 0);
+	put_bytes(&b, "isom", 4);
+	put32(&b, 0x200);
+	put_bytes(&b, "isomiso5iso6avc1mp41", 20);     /* iso5 for offsets from the moof */
+	box_end(&b, box);
+
+	moov = box_begin(&b, "moov", -1, 0);
+	box = box_begin(&b, "mvhd", 0, 0);
+	put32(&b, 0);                   /* creation and modification time */
+	put32(&b, 0);
+	put32(&b, MP4_TIMESCALE);
+	put32(&b, 0);                   /* duration: in the fragments */
+	put32(&b, 0x00010000);          /* rate 1.0 */
+	put16(&b, 0x0100);              /* volume 1.0 */
+	put_zero(&b, 10);
+	put_matrix(&b);
+	put_zero(&b, 24);
+	put32(&b, 2);                   /* next track */
+	box_end(&b, box);
+
+	trak = box_begin(&b, "trak", -1, 0);
+	box = box_begin(&b, "tkhd", 0, 3);      /* enabled, in the movie */
+	put32(&b, 0);
+	put32(&b, 0);
+	put32(&b, 1);                   /* track id */
+	put32(&b, 0);
+	put32(&b, 0);
+	put_zero(&b, 8);
+	put16(&b, 0);                   /* layer */
+	put16(&b, 0);                   /* alternate group */
+	put16(&b, 0);                   /* volume */
+	put16(&b, 0);
+	put_matrix(&b);
+	put32(&b, width << 16);
+	put32(&b, height << 16);
+	box_end(&b, box);
+	if (delay > 0) {
+		/* B-frames decode ahead of their presentation: start showing at the first frame, not the first decode */
+		size_t edts = box_begin(&b, "edts", -1, 0);
+
+		box = box_begin(&b, "elst", 0, 0);
+		put32(&b, 1);
+		put32(&b, 0);           /* the whole track */
+		put32(&b, (unsigned int)delay);
+		put32(&b, 0x00010000);
+		box_end(&b, box);
+		box_end(&b, edts);
+	}
+
+	mdia = box_begin(&b, "mdia", -1, 0);
+	box = box_begin(&b, "mdhd", 0, 0);
+	put32(&b, 0);
+	put32(&b, 0);
+	put32(&b, MP4_TIMESCALE);
+	put32(&b, 0);
+	put16(&b, 0x55c4);              /* "und" */
+	put16(&b, 0);
+	box_end(&b, box);
+	box = box_begin(&b, "hdlr", 0, 0);
+	put32(&b, 0);
+	put_bytes(&b, "vide", 4);
+	put_zero(&b, 12);
+	put_bytes(&b, "VideoHandler", 13);
+	box_end(&b, box);
+
+	minf = box_begin(&b, "minf", -1, 0);
+	box = box_begin(&b, "vmhd", 0, 1);
+	put_zero(&b, 8);
+	box_end(&b, box);
+	dinf = box_begin(&b, "dinf", -1, 0);
+	box = box_begin(&b, "dref", 0, 0);
+	put32(&b, 1);
+	box_end(&b, box_begin(&b, "url ", 0, 1));      /* the data is in this file */
+	box_end(&b, box);
+	box_end(&b, dinf);
+
+	stbl = box_begin(&b, "stbl", -1, 0);
+	box = box_begin(&b, "stsd", 0, 0);
+	put32(&b, 1);
+	put_avc1(&b, width, height, sps, sps_size, pps, pps_size);
+	box_end(&b, box);
+	box = box_begin(&b, "stts", 0, 0);
+	put32(&b, 0);
+	box_end(&b, box);
+	box = box_begin(&b, "stsc", 0, 0);
+	put32(&b, 0);
+	box_end(&b, box);
+	box = box_begin(&b, "stsz", 0, 0);
+	put32(&b, 0);
+	put32(&b, 0);
+	box_end(&b, box);
+	box = box_begin(&b, "stco", 0, 0);
+	put32(&b, 0);
+	box_end(&b, box);
+	box_end(&b, stbl);
+	box_end(&b, minf);
+	box_end(&b, mdia);
+	box_end(&b, trak);
+
+	mvex = box_begin(&b, "mvex", -1, 0);
+	box = box_begin(&b, "trex", 0, 0);
+	put32(&b, 1);                   /* track id */
+	put32(&b, 1);                   /* sample description */
+	put32(&b, 0);
+	put32(&b, 0);
+	put32(&b, 0);
+	box_end(&b, box);
+	box_end(&b, mvex);
+	box_end(&b, moov);
+
+	if (mp4_buf_ok(w, &b))
+		mp4_emit(w, b.p, b.len);
+	free(b.p);
+}
+
+/**
+Function Name : mp4_open
+Function Description : Starts a fragmented MP4 on fd with the track header of an H.264 stream; the first
+                       sample's times place the edit that hides the decode delay of B-frames
+Parameter : output fd, frame width and height, SPS and PPS without start codes or lengths, pts and dts of the
+            first sample in MP4_TIMESCALE ticks
+Return : the writer, NULL for failure
+**/
+struct mp4_writer *mp4_open(int fd, unsigned int width, unsigned int height, const unsigned char *sps,
+	unsigned int sps_size, const unsigned char *pps, unsigned int pps_size, long long first_pts, long long first_dts)
+{
+	struct mp4_writer *w;
+	off_t at;
+
+	if (sps_size < 4 || !pps_size) {
+		fprintf(stderr, "mp4: no SPS and PPS to describe the stream\n");
+		return NULL;
+	}
+	if (!(w = calloc(1, sizeof(*w))) || !(w->samples = calloc(MP4_MAX_FRAGMENT, sizeof(*w->samples)))) {
+		free(w);
+		fprintf(stderr, "Out of memory\n");
+		return NULL;
+	}
+	w->fd = fd;
+	/* the random access offsets count from the start of the file, a pipe starts where it is */
+	at = lseek(fd, 0, SEEK_CUR);
+	w->offset = at > 0 ? (unsigned long long)at : 0;
+	w->first_dts = first_dts;
+	w->last_duration = MP4_DEFAULT_DURATION;
+	mp4_header(w, width, height, sps, sps_size, pps, pps_size, first_pts - first_dts);
+	if (w->error) {
+		free(w->samples);
+		free(w);
+		return NULL;
+	}
+
+	return w;
+}
+
+/* Writes the samples gathered as one moof + mdat; the last one lasts until next_dts, or as long as the one before */
+static void mp4_fragment(struct mp4_writer *w, long long next_dts, int have_next)
+{
+	struct mp4_buf b = { 0 };
+	struct mp4_sample *s;
+	size_t moof, traf, box, data_offset;
+	unsigned long long moof_at = w->offset;
+	unsigned int i, duration;
+	unsigned char mdat[8];
+
+	if (!w->n_samples)
+		return;
+	moof = box_begin(&b, "moof", -1, 0);
+	box = box_begin(&b, "mfhd", 0, 0);
+	put32(&b, ++w->stats.fragments);
+	box_end(&b, box);
+	traf = box_begin(&b, "traf", -1, 0);
+	box = box_begin(&b, "tfhd", 0, 0x020000);      /* offsets from the moof */
+	put32(&b, 1);
+	box_end(&b, box);
+	box = box_begin(&b, "tfdt", 1, 0);
+	put64(&b, w->samples[0].dts - w->first_dts);
+	box_end(&b, box);
+	/* data offset, and duration, size, flags and signed composition offset per sample */
+	box = box_begin(&b, "trun", 1, 0x000f01);
+	put32(&b, w->n_samples);
+	data_offset = b.len;
+	put32(&b, 0);
+	for (i = 0; i < w->n_samples; ++i) {
+		s = &w->samples[i];
+		if (i + 1 < w->n_samples)
+			duration = s[1].dts - s->dts;
+		else
+			duration = have_next && next_dts > s->dts ? next_dts - s->dts : w->last_duration;
+		if (duration)
+			w->last_duration = duration;
+		put32(&b, duration);
+		put32(&b, s->size);
+		/* a keyframe depends on nothing, anything else on other samples and is no sync point */
+		put32(&b, s->keyframe ? 0x02000000 : 0x01010000);
+		put32(&b, (unsigned int)(s->pts - s->dts));
+		w->stats.duration = s->dts - w->first_dts + duration;
+	}
+	box_end(&b, box);
+	box_end(&b, traf);
+	box_end(&b, moof);
+	if (!mp4_buf_ok(w, &b) || !mp4_buf_ok(w, &w->data)) {
+		free(b.p);
+		w->data.len = 0;
+		w->n_samples = 0;
+		return;
+	}
+	i = b.len + 8;
+	b.p[data_offset] = i >> 24;
+	b.p[data_offset + 1] = i >> 16;
+	b.p[data_offset + 2] = i >> 8;
+	b.p[data_offset + 3] = i;
+
+	if (w->samples[0].keyframe) {
+		if (w->n_points == w->points_cap) {
+			void *p = realloc(w->points, (w->points_cap ? w->points_cap * 2 : 256) * sizeof(*w->points));
+
+			if (p) {
+				w->points = p;
+				w->points_cap = w->points_cap ? w->points_cap * 2 : 256;
+			}
+		}
+		if (w->n_points < w->points_cap) {
+			w->points[w->n_points].time = w->samples[0].pts - w->first_dts;
+			w->points[w->n_points].offset = moof_at;
+			w->n_points++;
+		}
+	}
+	i = w->data.len + 8;
+	mdat[0] = i >> 24;
+	mdat[1] = i >> 16;
+	mdat[2] = i >> 8;
+	mdat[3] = i;
+	memcpy(mdat + 4, "mdat", 4);
+	mp4_emit(w, b.p, b.len);
+	mp4_emit(w, mdat, 8);
+	mp4_emit(w, w->data.p, w->data.len);
+	free(b.p);
+	w->data.len = 0;
+	w->n_samples = 0;
+}
+
+/**
+Function Name : mp4_sample
+Function Description : Adds one coded frame in decode order; a keyframe closes the fragment before it
+Parameter : the writer, the frame as length prefixed NAL units, its pts and dts, whether it is a keyframe
+Return : 0 for success -1 once a write has failed
+**/
+int mp4_sample(struct mp4_writer *w, const unsigned char *data, unsigned int size, long long pts, long long dts,
+	int keyframe)
+{
+	struct mp4_sample *s;
+
+	if (w->error)
+		return -1;
+	if (w->n_samples && (keyframe || w->n_samples == MP4_MAX_FRAGMENT))
+		mp4_fragment(w, dts, 1);
+	s = &w->samples[w->n_samples++];
+	s->size = size;
+	s->pts = pts;
+	s->dts = dts;
+	s->keyframe = keyframe;
+	put_bytes(&w->data, data, size);
+	if (!mp4_buf_ok(w, &w->data))
+		return -1;
+	w->stats.samples++;
+	w->stats.keyframes += keyframe != 0;
+
+	return w->error ? -1 : 0;
+}
+
+/**
+Function Name : mp4_close
+Function Description : Writes the last fragment and the mfra listing every fragment's keyframe, then frees
+                       the writer; the descriptor stays open
+Parameter : the writer, where to put what was written (may be NULL)
+Return : 0 for success -1 when a write failed
+**/
+int mp4_close(struct mp4_writer *w, struct mp4_stats *stats)
+{
+	struct mp4_buf b = { 0 };
+	size_t mfra, box;
+	unsigned int i;
+	int ret;
+
+	mp4_fragment(w, 0, 0);
+	mfra = box_begin(&b, "mfra", -1, 0);
+	box = box_begin(&b, "tfra", 1, 0);
+	put32(&b, 1);                   /* track id */
+	put32(&b, 0);                   /* traf, trun and sample numbers in one byte each */
+	put32(&b, w->n_points);
+	for (i = 0; i < w->n_points; ++i) {
+		put64(&b, w->points[i].time);
+		put64(&b, w->points[i].offset);
+		put8(&b, 1);
+		put8(&b, 1);
+		put8(&b, 1);
+	}
+	box_end(&b, box);
+	box = box_begin(&b, "mfro", 0, 0);
+	put32(&b, b.len - mfra + 4);
+	box_end(&b, box);
+	box_end(&b, mfra);
+	if (mp4_buf_ok(w, &b))
+		mp4_emit(w, b.p, b.len);
+	free(b.p);
+
+	ret = w->error ? -1 : 0;
+	if (stats)
+		*stats = w->stats;
+	free(w->data.p);
+	free(w->samples);
+	free(w->points);
+	free(w);
+
+	return ret;
+}
@@ -0,0 +1,18 @@
+#pragma once
+
+#define MP4_TIMESCALE 90000             /* ticks per second of every time the writer takes */
+
+struct mp4_writer;
+
+struct mp4_stats {
+	unsigned long long samples, keyframes;
+	unsigned long long fragments;
+	unsigned long long bytes;               /* the whole file, boxes and all */
+	unsigned long long duration;            /* ticks from the first sample to the end of the last */
+};
+
+struct mp4_writer *mp4_open(int fd, unsigned int width, unsigned int height, const unsigned char *sps,
+	unsigned int sps_size, const unsigned char *pps, unsigned int pps_size, long long first_pts, long long first_dts);
+int mp4_sample(struct mp4_writer *w, const unsigned char *data, unsigned int size, long long pts, long long dts,
+	int keyframe);
+int mp4_close(struct mp4_writer *w, struct mp4_stats *stats);
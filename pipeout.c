@@ -0,0 +1,384 @@
+#define _GNU_SOURCE
+#include "header.h"
+#include <sys/uio.h>
+#include "pipeout.h"
+#include "trace.h"
+
+/*
+ * Raw or Y4M frames to stdout or a FIFO. vmsplice() hands the pipe references to the capture buffer's pages
+ * instead of copying them, so a spliced buffer stays out of the driver's queue until the reader has consumed
+ * it: everything ever pushed minus FIONREAD is what the reader has taken, and a frame whose last spliced
+ * byte is below that is released. Outputs that can't take vmsplice (a regular file behind stdout, a
+ * buffer the kernel can't pin) fall back to write() for good.
+ */
+
+struct pipe_hold {
+	struct v4l2cap_frame frame;
+	unsigned long long end;         /* stream offset just past the frame's spliced bytes */
+};
+
+enum pipe_framing pipe_framing = PIPE_RAW;
+int pipe_vmsplice = 1;
+struct pipeout_stats pipeout_stats;
+
+static int out_fd = -1, stdout_fd = -1;
+static unsigned int width, height, fourcc, limit;
+static unsigned long long pushed;
+static struct pipe_hold holds[PIPE_MAX_HELD];
+static unsigned int hold_head, hold_count;
+static pipeout_release_fn release_fn;
+static void *release_user;
+static unsigned char *planar;           /* Y4M repack of packed or semi-planar frames, always written */
+
+static const char y4m_frame[] = "FRAME\n";
+
+/**
+Function Name : pipeout_claim_stdout
+Function Description : Keeps the original stdout for frames and points fd 1 at stderr, so nothing else the
+                       program prints (including output still sitting in the stdio buffer) lands in the stream
+Parameter : void
+Return : descriptor of the original stdout
+**/
+int pipeout_claim_stdout(void)
+{
+	if (stdout_fd < 0) {
+		stdout_fd = dup(STDOUT_FILENO);
+		dup2(STDERR_FILENO, STDOUT_FILENO);
+	}
+
+	return stdout_fd;
+}
+
+/**
+Function Name : pipeout_target
+Function Description : Opens the output when it is "-" or names an existing FIFO
+Parameter : output file name
+Return : descriptor to stream to, -1 when outfile is an ordinary file name
+**/
+int pipeout_target(const char *outfile)
+{
+	struct stat st;
+	int target;
+
+	if (strcmp(outfile, "-") == 0)
+		return pipeout_claim_stdout();
+	if (stat(outfile, &st) != 0 || !S_ISFIFO(st.st_mode))
+		return -1;
+	if ((target = open(outfile, O_WRONLY)) < 0) {
+		perror("open");
+		exit(1);
+	}
+
+	return target;
+}
+
+static const char *y4m_colorspace(unsigned int pixelformat)
+{
+	switch (pixelformat) {
+	case V4L2_PIX_FMT_YUYV:
+		return "422";
+	case V4L2_PIX_FMT_NV12:
+	case V4L2_PIX_FMT_YUV420:
+		return "420jpeg";
+	case V4L2_PIX_FMT_GREY:
+		return "mono";
+	}
+
+	return NULL;
+}
+
+static int write_all(const void *buf, size_t len)
+{
+	const unsigned char *p = buf;
+	ssize_t r;
+
+	while (len) {
+		r = write(out_fd, p, len);
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		p += r;
+		len -= r;
+		pushed += r;
+		pipeout_stats.copied_bytes += r;
+	}
+
+	return 0;
+}
+
+/* Writes what is left of the iovec, used for repacked data and after vmsplice gave up */
+static int write_iov(struct iovec *iov, int n)
+{
+	for (; n > 0; iov++, n--)
+		if (iov->iov_len && write_all(iov->iov_base, iov->iov_len) != 0)
+			return -1;
+
+	return 0;
+}
+
+/* Splices the iovec by reference, copying whatever is left if the output turns out not to take vmsplice */
+static int splice_iov(struct iovec *iov, int n)
+{
+	ssize_t r;
+
+	while (n > 0 && pipe_vmsplice) {
+		r = vmsplice(out_fd, iov, n, 0);
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno != EBADF && errno != EINVAL && errno != EFAULT)
+				return -1;
+			fprintf(stderr, "vmsplice: %s, writing frames with write()\n", strerror(errno));
+			pipe_vmsplice = 0;
+			break;
+		}
+		pushed += r;
+		pipeout_stats.spliced_bytes += r;
+		while (n > 0 && (size_t)r >= iov->iov_len) {
+			r -= iov->iov_len;
+			iov++;
+			n--;
+		}
+		if (n > 0) {
+			iov->iov_base = (unsigned char *)iov->iov_base + r;
+			iov->iov_len -= r;
+		}
+	}
+	if (n > 0)
+		return write_iov(iov, n) != 0 ? -1 : 1;
+
+	return 0;
+}
+
+static unsigned long long pipe_consumed(void)
+{
+	int pending = 0;
+
+	if (ioctl(out_fd, FIONREAD, &pending) != 0)
+		return pushed;
+
+	return pushed - pending;
+}
+
+/* Releases every held frame the reader is past, then waits until fewer than max are held */
+static void release_consumed(unsigned int max)
+{
+	struct timespec pause = { 0, 100000 };
+	unsigned long long consumed;
+
+	for (;;) {
+		consumed = pipe_consumed();
+		while (hold_count && holds[hold_head].end <= consumed) {
+			release_fn(&holds[hold_head].frame, release_user);
+			hold_head = (hold_head + 1) % PIPE_MAX_HELD;
+			hold_count--;
+		}
+		if (hold_count < max || hold_count == 0)
+			return;
+		pipeout_stats.waits++;
+		nanosleep(&pause, NULL);
+	}
+}
+
+/**
+Function Name : pipeout_init
+Function Description : Prepares streaming to a pipe, grows the pipe so a whole frame fits, and writes the Y4M
+                       stream header when Y4M framing is selected
+Parameter : output descriptor, negotiated frame size and fourcc, frame rate for the Y4M header, how many
+            frames may be held by the pipe at once (0 disables vmsplice), and the callback that gives a
+            drained frame back
+Return : 0 for success -1 for failure
+**/
+int pipeout_init(int fd, unsigned int frame_width, unsigned int frame_height, unsigned int pixelformat,
+	unsigned int fps, unsigned int max_held, pipeout_release_fn release, void *user)
+{
+	char header[128];
+	struct stat st;
+	int size, len;
+
+	out_fd = fd;
+	width = frame_width;
+	height = frame_height;
+	fourcc = pixelformat;
+	limit = max_held > PIPE_MAX_HELD ? PIPE_MAX_HELD : max_held;
+	release_fn = release;
+	release_user = user;
+	pushed = 0;
+	hold_head = hold_count = 0;
+	memset(&pipeout_stats, 0, sizeof(pipeout_stats));
+
+	if (limit == 0 || fstat(fd, &st) != 0 || !S_ISFIFO(st.st_mode))
+		pipe_vmsplice = 0;
+	if (pipe_vmsplice)
+		for (size = 2 * width * height * 2; size >= 65536; size /= 2)
+			if (fcntl(fd, F_SETPIPE_SZ, size) >= 0)
+				break;
+
+	if (pipe_framing == PIPE_Y4M) {
+		if (!y4m_colorspace(fourcc)) {
+			fprintf(stderr, "Y4M output needs YUYV, NV12, YU12 or GREY frames\n");
+			return -1;
+		}
+		if (fourcc == V4L2_PIX_FMT_YUYV || fourcc == V4L2_PIX_FMT_NV12) {
+			free(planar);
+			planar = malloc(width * height * 2);
+			if (!planar) {
+				fprintf(stderr, "Out of memory\n");
+				return -1;
+			}
+		}
+		len = snprintf(header, sizeof(header), "YUV4MPEG2 W%u H%u F%u:1 Ip A1:1 C%s\n", width, height,
+			fps ? fps : 30, y4m_colorspace(fourcc));
+		if (write_all(header, len) != 0) {
+			perror("write");
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/* YUYV to planar 4:2:2, or the interleaved chroma of NV12 to separate U and V planes */
+static unsigned int y4m_repack(const unsigned char *src)
+{
+	unsigned int x, y, n = width * height;
+	unsigned char *u = planar + (fourcc == V4L2_PIX_FMT_YUYV ? n : 0), *v;
+
+	if (fourcc == V4L2_PIX_FMT_YUYV) {
+		v = u + n / 2;
+		for (y = 0; y < n; y += 2, src += 4) {
+			planar[y] = src[0];
+			planar[y + 1] = src[2];
+			*u++ = src[1];
+			*v++ = src[3];
+		}
+		return n * 2;
+	}
+
+	v = u + n / 4;
+	src += n;
+	for (y = 0; y < height / 2; ++y)
+		for (x = 0; x < width / 2; ++x, src += 2) {
+			*u++ = src[0];
+			*v++ = src[1];
+		}
+	return n / 2;
+}
+
+/**
+Function Name : pipeout_frame
+Function Description : Pushes one frame into the pipe. Data that is already in output layout is spliced by
+                       reference and the frame is held until the reader drains it; repacked Y4M chroma and
+                       everything on the write() fallback is copied
+Parameter : dequeued frame
+Return : 1 when the frame is held (it comes back through the release callback), 0 when the caller can
+         release it now, -1 for failure
+**/
+int pipeout_frame(const struct v4l2cap_frame *frame)
+{
+	struct iovec iov[2];
+	unsigned int n = 0, luma = width * height;
+	unsigned long long before = pipeout_stats.spliced_bytes;
+	int ret;
+
+	TRACE_BEGIN(ts);
+	if (pipe_vmsplice)
+		release_consumed(limit);
+
+	if (pipe_framing == PIPE_Y4M) {
+		iov[n].iov_base = (void *)y4m_frame;
+		iov[n++].iov_len = sizeof(y4m_frame) - 1;
+	}
+
+	if (pipe_framing == PIPE_Y4M && fourcc == V4L2_PIX_FMT_YUYV) {
+		/* packed 4:2:2 has nothing in Y4M layout, the whole picture is repacked */
+		if (write_iov(iov, n) != 0 || write_all(planar, y4m_repack(frame->data)) != 0)
+			return -1;
+		n = 0;
+	} else if (pipe_framing == PIPE_Y4M && fourcc == V4L2_PIX_FMT_NV12) {
+		/* the luma plane is already planar and goes by reference, only the chroma is repacked */
+		iov[n].iov_base = frame->data;
+		iov[n++].iov_len = luma;
+		ret = pipe_vmsplice ? splice_iov(iov, n) : write_iov(iov, n);
+		if (ret < 0 || write_all(planar, y4m_repack(frame->data)) != 0)
+			return -1;
+		n = 0;
+	} else {
+		iov[n].iov_base = frame->data;
+		iov[n++].iov_len = frame->bytesused;
+	}
+
+	if (n) {
+		ret = pipe_vmsplice ? splice_iov(iov, n) : write_iov(iov, n);
+		if (ret < 0)
+			return -1;
+	}
+	pipeout_stats.frames++;
+	TRACE_END(ts, pipe_vmsplice ? "vmsplice" : "write");
+
+	/* held only if some of the buffer itself went by reference; the FRAME marker is static */
+	if (pipeout_stats.spliced_bytes - before <= (pipe_framing == PIPE_Y4M ? sizeof(y4m_frame) - 1 : 0))
+		return 0;
+
+	holds[(hold_head + hold_count) % PIPE_MAX_HELD].frame = *frame;
+	holds[(hold_head + hold_count) % PIPE_MAX_HELD].end = pushed;
+	if (++hold_count > pipeout_stats.max_held)
+		pipeout_stats.max_held = hold_count;
+
+	return 1;
+}
+
+/* Waits up to two seconds for the reader to get past every held frame, then lets go of them all */
+static void drain_held(int release)
+{
+	struct timespec pause = { 0, 1000000 };
+	unsigned int tries;
+
+	for (tries = 0; tries < 2000 && hold_count; ++tries) {
+		if (pipe_consumed() >= holds[(hold_head + hold_count - 1) % PIPE_MAX_HELD].end)
+			break;
+		nanosleep(&pause, NULL);
+	}
+	while (hold_count) {
+		if (release)
+			release_fn(&holds[hold_head].frame, release_user);
+		hold_head = (hold_head + 1) % PIPE_MAX_HELD;
+		hold_count--;
+	}
+}
+
+/**
+Function Name : pipeout_forget
+Function Description : Drops the held frames of a device that went away without handing them back; waits for
+                       the reader first, since the memory behind them may be reused once the device returns
+Parameter : void
+Return : void
+**/
+void pipeout_forget(void)
+{
+	if (out_fd >= 0)
+		drain_held(0);
+}
+
+/**
+Function Name : pipeout_finish
+Function Description : Waits up to two seconds for the reader to drain the held frames, releases them and
+                       prints how much of the stream went by reference
+Parameter : void
+Return : void
+**/
+void pipeout_finish(void)
+{
+	if (out_fd < 0)
+		return;
+	drain_held(1);
+
+	printf("pipe: %llu frames, %.1f MB by vmsplice, %.1f MB copied, %llu waits for the reader, up to %u frames held\n",
+		pipeout_stats.frames, pipeout_stats.spliced_bytes / 1e6, pipeout_stats.copied_bytes / 1e6,
+		pipeout_stats.waits, pipeout_stats.max_held);
+	free(planar);
+	planar = NULL;
+	out_fd = -1;
+}
@@ -0,0 +1,32 @@
+#pragma once
+#include "v4l2capture.h"
+
+#define PIPE_MAX_HELD 32
+
+enum pipe_framing {
+	PIPE_RAW,                       /* frames back to back, exactly as dequeued */
+	PIPE_Y4M,                       /* YUV4MPEG2 stream header, then "FRAME\n" + planar picture per frame */
+};
+
+/* Hands a frame whose pages the pipe no longer references back to its owner */
+typedef void (*pipeout_release_fn)(const struct v4l2cap_frame *frame, void *user);
+
+struct pipeout_stats {
+	unsigned long long frames;
+	unsigned long long spliced_bytes;       /* handed to the pipe by reference with vmsplice */
+	unsigned long long copied_bytes;        /* copied with write() */
+	unsigned long long waits;               /* times a frame had to wait for the reader to drain a held buffer */
+	unsigned int max_held;
+};
+
+extern enum pipe_framing pipe_framing;
+extern int pipe_vmsplice;
+extern struct pipeout_stats pipeout_stats;
+
+int pipeout_claim_stdout(void);
+int pipeout_target(const char *outfile);
+int pipeout_init(int out_fd, unsigned int frame_width, unsigned int frame_height, unsigned int fourcc,
+	unsigned int fps, unsigned int max_held, pipeout_release_fn release, void *user);
+int pipeout_frame(const struct v4l2cap_frame *frame);
+void pipeout_forget(void);
+void pipeout_finish(void);
@@ -0,0 +1,312 @@
+#include "header.h"
+#include "policy.h"
+#include "metrics.h"
+
+/*
+ * Watches how busy the sink (render, write, encode submit, pipe) keeps the capture thread, how many buffers
+ * the driver still owns after each dequeue, and the driver and encoder drop counters. A window of frames
+ * over the high mark steps one level down the shedding ladder; only a run of windows under the low mark
+ * steps back up, and a step up that is soon followed by overload doubles the run needed next time, until a
+ * step up holds.
+ */
+
+int policy_enabled;
+struct policy_config policy_config = { 0.85, 0.5, 30, 5, 0 };
+struct policy_stats policy_stats;
+
+static const char *level_names[POLICY_LEVELS] = { "normal", "skip-display", "decimate", "renegotiate" };
+
+static unsigned int usable;
+static enum policy_level level;
+static int pending;                     /* +1 renegotiate down, -1 back to the original format */
+static int settle;                      /* the window straddling a change is not evaluated */
+static unsigned int depth;              /* format steps taken below the original */
+static unsigned int skip_counter;
+
+static unsigned int win_frames, win_min_queued, win_buffers;
+static unsigned long long win_start_ns, win_sink_ns, win_drops, frames_seen;
+static unsigned int clear_windows, bounces;
+static unsigned long long windows, last_step_up;
+
+static unsigned long long level_since_ns, level_ns[POLICY_LEVELS];
+
+/* clear windows needed before a step up, doubled per recent bounce up to eight times */
+static unsigned int hold_windows(void)
+{
+	return policy_config.hold << (bounces < 3 ? bounces : 3);
+}
+
+static unsigned long long policy_drops(void)
+{
+	return atomic_load_explicit(&metric_counters[MC_FRAMES_DROPPED], memory_order_relaxed) +
+		atomic_load_explicit(&metric_counters[MC_ENCODE_DROPPED], memory_order_relaxed);
+}
+
+static void window_reset(void)
+{
+	win_frames = 0;
+	win_sink_ns = 0;
+	win_min_queued = ~0u;
+	win_start_ns = metric_now_ns();
+	win_drops = policy_drops();
+}
+
+/**
+Function Name : policy_parse
+Function Description : Parses the -A argument: "on", or comma separated high=,low=,window=,hold= and mjpg
+Parameter : option string
+Return : 0 for success -1 for a bad option
+**/
+int policy_parse(const char *spec)
+{
+	char *opts = strdup(spec), *item, *save;
+	int ret = 0;
+
+	policy_enabled = 1;
+	for (item = strtok_r(opts, ",", &save); item; item = strtok_r(NULL, ",", &save)) {
+		if (strcmp(item, "on") == 0)
+			continue;
+		else if (strncmp(item, "high=", 5) == 0)
+			policy_config.high = strtod(item + 5, NULL);
+		else if (strncmp(item, "low=", 4) == 0)
+			policy_config.low = strtod(item + 4, NULL);
+		else if (strncmp(item, "window=", 7) == 0)
+			policy_config.window = strtol(item + 7, NULL, 10);
+		else if (strncmp(item, "hold=", 5) == 0)
+			policy_config.hold = strtol(item + 5, NULL, 10);
+		else if (strcmp(item, "mjpg") == 0)
+			policy_config.allow_mjpg = 1;
+		else {
+			fprintf(stderr, "Unknown policy option %s\n", item);
+			ret = -1;
+		}
+	}
+	free(opts);
+	if (policy_config.window < 2)
+		policy_config.window = 2;
+	if (policy_config.low >= policy_config.high) {
+		fprintf(stderr, "Policy low mark must be below the high mark\n");
+		ret = -1;
+	}
+
+	return ret;
+}
+
+/**
+Function Name : policy_init
+Function Description : Starts at the normal level with the steps that make sense for this run
+Parameter : bitmask of usable levels (1 << POLICY_SKIP_DISPLAY etc.)
+Return : void
+**/
+void policy_init(unsigned int usable_levels)
+{
+	usable = usable_levels | 1u << POLICY_NORMAL;
+	level = POLICY_NORMAL;
+	pending = 0;
+	settle = 0;
+	depth = 0;
+	clear_windows = bounces = 0;
+	memset(&policy_stats, 0, sizeof(policy_stats));
+	windows = last_step_up = frames_seen = 0;
+	memset(level_ns, 0, sizeof(level_ns));
+	level_since_ns = metric_now_ns();
+	metric_set(MG_POLICY_LEVEL, POLICY_NORMAL);
+	window_reset();
+}
+
+static void set_level(enum policy_level next, double load, unsigned long long drops)
+{
+	unsigned long long now = metric_now_ns();
+
+	fprintf(stderr, "policy: frame %llu %s -> %s: sink load %.2f (high %.2f low %.2f), %llu drops, "
+		"min %u/%u buffers queued, hold %u windows\n", frames_seen, level_names[level], level_names[next],
+		load, policy_config.high, policy_config.low, drops, win_min_queued == ~0u ? 0 : win_min_queued,
+		win_buffers, hold_windows());
+
+	if (next == POLICY_RENEGOTIATE && level < POLICY_RENEGOTIATE)
+		pending = 1;
+	else if (level == POLICY_RENEGOTIATE && next < POLICY_RENEGOTIATE)
+		pending = -1;
+
+	level_ns[level] += now - level_since_ns;
+	level_since_ns = now;
+	level = next;
+	policy_stats.steps++;
+	settle = 1;
+	metric_set(MG_POLICY_LEVEL, level);
+}
+
+static int level_above(enum policy_level from)
+{
+	int l;
+
+	for (l = from + 1; l < POLICY_LEVELS; ++l)
+		if (usable & 1u << l)
+			return l;
+
+	return -1;
+}
+
+static int level_below(enum policy_level from)
+{
+	int l;
+
+	for (l = (int)from - 1; l > POLICY_NORMAL; --l)
+		if (usable & 1u << l)
+			return l;
+
+	return POLICY_NORMAL;
+}
+
+/**
+Function Name : policy_skip
+Function Description : Decides whether this frame's sink is skipped; every other frame is once any step is taken
+Parameter : void
+Return : 1 to skip the frame (its buffer is still requeued) 0 to hand it to the sink
+**/
+int policy_skip(void)
+{
+	if (!policy_enabled || level == POLICY_NORMAL)
+		return 0;
+
+	if (!(skip_counter++ & 1))
+		return 0;
+	policy_stats.shed++;
+
+	return 1;
+}
+
+/**
+Function Name : policy_observe
+Function Description : Accounts one frame and, at the end of each window, steps down on overload or back up
+                       after enough clear windows
+Parameter : time spent in the sink for this frame, buffers the driver owns after the dequeue, and the total
+Return : void
+**/
+void policy_observe(unsigned long long sink_ns, unsigned int queued, unsigned int n_buffers)
+{
+	unsigned long long now, drops;
+	unsigned int hold = hold_windows();
+	double load;
+	int next;
+
+	if (!policy_enabled || pending)
+		return;
+
+	frames_seen++;
+	win_frames++;
+	win_sink_ns += sink_ns;
+	win_buffers = n_buffers;
+	if (queued < win_min_queued)
+		win_min_queued = queued;
+	if (win_frames < policy_config.window)
+		return;
+
+	now = metric_now_ns();
+	load = (double)win_sink_ns / (now - win_start_ns);
+	drops = policy_drops() - win_drops;
+	windows++;
+	if (settle) {
+		settle = 0;
+		window_reset();
+		return;
+	}
+
+	/* a driver left with no buffer after a dequeue is dropping frames, even if it does not say so */
+	if (load > policy_config.high || drops || (n_buffers > 1 && win_min_queued == 0)) {
+		clear_windows = 0;
+		if (last_step_up && windows - last_step_up <= 2ull * hold)
+			bounces++;
+		last_step_up = 0;
+		next = level_above(level);
+		if (next >= 0)
+			set_level(next, load, drops);
+		else if (level == POLICY_RENEGOTIATE) {
+			fprintf(stderr, "policy: frame %llu still overloaded at %s, load %.2f, %llu drops, stepping the format down again\n",
+				frames_seen, level_names[level], load, drops);
+			pending = 1;
+			settle = 1;
+		}
+	} else if (load < policy_config.low && level != POLICY_NORMAL) {
+		/* a step up that held earns back one doubling of the hold */
+		if (last_step_up && windows - last_step_up > 2ull * hold) {
+			bounces -= bounces > 0;
+			last_step_up = 0;
+			hold = hold_windows();
+		}
+		if (++clear_windows >= hold) {
+			set_level(level_below(level), load, drops);
+			clear_windows = 0;
+			last_step_up = windows;
+		}
+	} else
+		clear_windows = 0;
+
+	window_reset();
+}
+
+/**
+Function Name : policy_poll
+Function Description : Tells the capture loop whether to renegotiate the format, between frames
+Parameter : void
+Return : 1 to step the format down, -1 to go back to the original format, 0 for nothing to do
+**/
+int policy_poll(void)
+{
+	return policy_enabled ? pending : 0;
+}
+
+/**
+Function Name : policy_renegotiated
+Function Description : Reports the outcome of a renegotiation. When the first step down finds nothing smaller
+                       the renegotiate level is dropped for the rest of the run; later steps stay where they are
+Parameter : 1 if the format changed, 0 if it could not
+Return : void
+**/
+void policy_renegotiated(int ok)
+{
+	if (ok) {
+		policy_stats.renegotiations++;
+		depth = pending > 0 ? depth + 1 : 0;
+	} else if (pending > 0 && !depth) {
+		fprintf(stderr, "policy: no smaller format to renegotiate to, dropping the %s step\n",
+			level_names[POLICY_RENEGOTIATE]);
+		usable &= ~(1u << POLICY_RENEGOTIATE);
+		pending = 0;
+		set_level(level_below(POLICY_RENEGOTIATE), 0, 0);
+	} else if (pending > 0)
+		fprintf(stderr, "policy: no smaller format than the current one\n");
+	pending = 0;
+	settle = 1;
+	window_reset();
+}
+
+enum policy_level policy_level(void)
+{
+	return level;
+}
+
+/**
+Function Name : policy_finish
+Function Description : Prints how long the run spent at each level
+Parameter : void
+Return : void
+**/
+void policy_finish(void)
+{
+	unsigned int l;
+	double total = 0;
+
+	if (!policy_enabled)
+		return;
+	level_ns[level] += metric_now_ns() - level_since_ns;
+	level_since_ns = metric_now_ns();
+	for (l = 0; l < POLICY_LEVELS; ++l)
+		total += level_ns[l];
+	printf("policy: %u steps, %u renegotiations, %llu frames shed,", policy_stats.steps,
+		policy_stats.renegotiations, policy_stats.shed);
+	for (l = 0; l < POLICY_LEVELS; ++l)
+		if (usable & 1u << l || level_ns[l])
+			printf(" %s %.1f%%", level_names[l], total ? level_ns[l] * 100 / total : 0);
+	printf(" of the time\n");
+}
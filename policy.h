@@ -0,0 +1,37 @@
+#pragma once
+
+/* Load-shedding steps, each one keeps the effects of the ones before it */
+enum policy_level {
+	POLICY_NORMAL,
+	POLICY_SKIP_DISPLAY,            /* present every other frame */
+	POLICY_DECIMATE,                /* record every other frame */
+	POLICY_RENEGOTIATE,             /* smaller frames (or MJPG) through init_device() */
+	POLICY_LEVELS,
+};
+
+struct policy_config {
+	double high;                    /* sink busy fraction of the window that counts as overload */
+	double low;                     /* below this (and no drops) the window is clear */
+	unsigned int window;            /* frames per evaluation */
+	unsigned int hold;              /* clear windows before stepping back up, doubled after each bounce */
+	int allow_mjpg;                 /* renegotiate to MJPG when there is no smaller size */
+};
+
+struct policy_stats {
+	unsigned int steps;             /* level changes, both ways */
+	unsigned int renegotiations;    /* format changes carried out */
+	unsigned long long shed;        /* frames whose sink was skipped */
+};
+
+extern int policy_enabled;
+extern struct policy_config policy_config;
+extern struct policy_stats policy_stats;
+
+int policy_parse(const char *spec);
+void policy_init(unsigned int usable_levels);
+int policy_skip(void);
+void policy_observe(unsigned long long sink_ns, unsigned int queued, unsigned int n_buffers);
+int policy_poll(void);
+void policy_renegotiated(int ok);
+enum policy_level policy_level(void);
+void policy_finish(void);
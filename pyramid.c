@@ -0,0 +1,643 @@
+#include <pthread.h>
+#include <stdatomic.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#include "header.h"
+#include "pyramid.h"
+#include "metrics.h"
+#include "trace.h"
+
+/*
+ * Several smaller outputs from each captured frame. Level i of the pyramid is the frame halved i times with a
+ * 2x2 box, each level computed from the one above it, as planar I420. The levels are built in strips: the
+ * rows a strip adds to one level are read back for the next level while they are still in cache, so the
+ * frame is read once however many outputs there are. An output that is exactly a level gets its planes as
+ * they are; any other size is resampled bilinearly from the smallest level that still covers it.
+ */
+
+struct pyramid_stats pyramid_stats;
+unsigned int pyramid_outputs;
+
+struct pyramid_level {
+	unsigned char *plane[3];        /* Y, U and V, U and V NULL for GREY */
+	unsigned int pitch[3];
+	unsigned int width, height;     /* luma, even; chroma is half of both */
+};
+
+/* A Y4M stream to a file or FIFO, written by its own thread from a one-picture mailbox */
+struct y4m_sink {
+	const char *path;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	unsigned char *mail, *writing;  /* packed I420, swapped when the writer takes a picture */
+	unsigned int size, width, height;
+	int full, stop;
+	atomic_int opened;
+	unsigned long long written;
+};
+
+struct pyramid_output {
+	unsigned int width, height;
+	pyramid_fn fn;
+	void *user;
+	unsigned int level;             /* the level it is taken or resampled from, 0 when it does not fit */
+	int exact;
+	unsigned char *scaled;          /* I420 bilinear result when not exact */
+	unsigned int *xmap[2];          /* luma and chroma source column << 8 | fraction per output column */
+	unsigned long long frames, dropped;
+	struct y4m_sink *y4m;
+};
+
+static struct pyramid_output outputs[PYRAMID_MAX_OUTPUTS];
+static struct pyramid_level levels[PYRAMID_MAX_LEVELS + 1];
+static unsigned int n_levels, cur_width, cur_height, cur_fourcc;
+static int unsupported_reported;
+
+/**
+Function Name : pyramid_add_output
+Function Description : Adds an output of the given size delivered to fn on the capture thread
+Parameter : output width and height, callback and its argument
+Return : 0 for success -1 when there is no room or the size is odd
+**/
+int pyramid_add_output(unsigned int width, unsigned int height, pyramid_fn fn, void *user)
+{
+	struct pyramid_output *o;
+
+	if (pyramid_outputs == PYRAMID_MAX_OUTPUTS || !width || !height || (width | height) & 1) {
+		fprintf(stderr, "pyramid: cannot add a %ux%u output (at most %u, even sizes)\n", width, height,
+			PYRAMID_MAX_OUTPUTS);
+		return -1;
+	}
+	o = &outputs[pyramid_outputs++];
+	memset(o, 0, sizeof(*o));
+	o->width = width;
+	o->height = height;
+	o->fn = fn;
+	o->user = user;
+	cur_width = 0;          /* levels are planned again on the next frame */
+
+	return 0;
+}
+
+static void *y4m_main(void *arg)
+{
+	struct y4m_sink *s = arg;
+	unsigned char *tmp;
+	char header[96];
+	int fd, n;
+
+	TRACE_THREAD("pyramid y4m");
+	/* a FIFO blocks here until its reader opens it, the capture thread never waits for that */
+	if ((fd = open(s->path, O_WRONLY | O_CREAT | O_TRUNC, 0660)) < 0) {
+		perror(s->path);
+		return NULL;
+	}
+	atomic_store(&s->opened, 1);
+	n = snprintf(header, sizeof(header), "YUV4MPEG2 W%u H%u F30:1 Ip A1:1 C420jpeg\n", s->width, s->height);
+	if (write(fd, header, n) != n)
+		goto DONE;
+
+	pthread_mutex_lock(&s->lock);
+	for (;;) {
+		while (!s->full && !s->stop)
+			pthread_cond_wait(&s->cond, &s->lock);
+		if (!s->full)
+			break;
+		tmp = s->writing;
+		s->writing = s->mail;
+		s->mail = tmp;
+		s->full = 0;
+		pthread_mutex_unlock(&s->lock);
+
+		if (write(fd, "FRAME\n", 6) != 6 || write(fd, s->writing, s->size) != (ssize_t)s->size) {
+			perror(s->path);
+			pthread_mutex_lock(&s->lock);
+			break;
+		}
+		pthread_mutex_lock(&s->lock);
+		s->written++;
+	}
+	pthread_mutex_unlock(&s->lock);
+DONE:
+	close(fd);
+
+	return NULL;
+}
+
+/* Packs the picture into the mailbox; a picture the writer has not taken yet is replaced */
+static void y4m_post(const struct pyramid_image *img, void *user)
+{
+	struct pyramid_output *o = user;
+	struct y4m_sink *s = o->y4m;
+	unsigned int cw = img->width / 2, ch = img->height / 2, y, c;
+	unsigned char *dst;
+
+	pthread_mutex_lock(&s->lock);
+	if (s->full)
+		o->dropped++;
+	dst = s->mail;
+	for (y = 0; y < img->height; ++y, dst += img->width)
+		memcpy(dst, img->plane[0] + (size_t)y * img->pitch[0], img->width);
+	for (c = 1; c < 3; ++c)
+		for (y = 0; y < ch; ++y, dst += cw)
+			if (img->plane[c])
+				memcpy(dst, img->plane[c] + (size_t)y * img->pitch[c], cw);
+			else
+				memset(dst, 128, cw);
+	s->full = 1;
+	pthread_cond_signal(&s->cond);
+	pthread_mutex_unlock(&s->lock);
+}
+
+/**
+Function Name : pyramid_parse
+Function Description : Parses the -O argument, comma separated <w>x<h>=<path> outputs, each written as a Y4M
+                       stream to a file or an existing FIFO by its own thread
+Parameter : option string
+Return : 0 for success -1 for a bad output
+**/
+int pyramid_parse(const char *spec)
+{
+	char *opts = strdup(spec), *item, *save, *path;
+	unsigned int w, h;
+	struct y4m_sink *s;
+	int ret = 0;
+
+	for (item = strtok_r(opts, ",", &save); item; item = strtok_r(NULL, ",", &save)) {
+		path = strchr(item, '=');
+		if (!path || sscanf(item, "%ux%u", &w, &h) != 2 || pyramid_add_output(w, h, y4m_post, NULL) != 0) {
+			fprintf(stderr, "Bad output %s, expected <width>x<height>=<path>\n", item);
+			ret = -1;
+			continue;
+		}
+		s = calloc(1, sizeof(*s));
+		s->path = strdup(path + 1);
+		s->width = w;
+		s->height = h;
+		s->size = w * h * 3 / 2;
+		s->mail = malloc(s->size);
+		s->writing = malloc(s->size);
+		pthread_mutex_init(&s->lock, NULL);
+		pthread_cond_init(&s->cond, NULL);
+		outputs[pyramid_outputs - 1].y4m = s;
+		outputs[pyramid_outputs - 1].user = &outputs[pyramid_outputs - 1];
+		if (pthread_create(&s->thread, NULL, y4m_main, s)) {
+			fprintf(stderr, "create output thread failed\n");
+			ret = -1;
+		}
+	}
+	free(opts);
+
+	return ret;
+}
+
+static unsigned int level_width(unsigned int i)
+{
+	return (cur_width >> i) & ~1u;
+}
+
+static unsigned int level_height(unsigned int i)
+{
+	return (cur_height >> i) & ~1u;
+}
+
+/* Source position of each destination pixel centre in 1/256ths, clamped to the first pixel */
+static int source_pos(unsigned int d, unsigned int dst_size, unsigned int src_size)
+{
+	int s = (int)(((2 * d + 1) * src_size * 128) / dst_size) - 128;
+
+	return s < 0 ? 0 : s;
+}
+
+static unsigned int *column_map(unsigned int dw, unsigned int sw)
+{
+	unsigned int *map = malloc(dw * sizeof(*map)), x;
+
+	for (x = 0; x < dw && map; ++x)
+		map[x] = source_pos(x, dw, sw);
+
+	return map;
+}
+
+/* Picks each output's level and allocates the levels the deepest one needs, for a new capture format */
+static int pyramid_plan(unsigned int width, unsigned int height, unsigned int fourcc)
+{
+	struct pyramid_output *o;
+	struct pyramid_level *l;
+	unsigned int i, c, deepest = 0;
+
+	for (i = 1; i <= n_levels; ++i)
+		for (c = 0; c < 3; ++c) {
+			free(levels[i].plane[c]);
+			levels[i].plane[c] = NULL;
+		}
+	cur_width = width;
+	cur_height = height;
+	cur_fourcc = fourcc;
+
+	for (o = outputs; o < outputs + pyramid_outputs; ++o) {
+		o->level = 0;
+		for (i = 1; i <= PYRAMID_MAX_LEVELS && level_width(i) >= o->width && level_height(i) >= o->height; ++i)
+			o->level = i;
+		if (!o->level) {
+			fprintf(stderr, "pyramid: %ux%u does not fit half of %ux%u, not delivered\n", o->width, o->height,
+				width, height);
+			continue;
+		}
+		o->exact = level_width(o->level) == o->width && level_height(o->level) == o->height;
+		free(o->scaled);
+		free(o->xmap[0]);
+		free(o->xmap[1]);
+		o->scaled = NULL;
+		o->xmap[0] = o->xmap[1] = NULL;
+		if (!o->exact) {
+			o->scaled = malloc(o->width * o->height * 3 / 2);
+			o->xmap[0] = column_map(o->width, level_width(o->level));
+			o->xmap[1] = column_map(o->width / 2, level_width(o->level) / 2);
+			if (!o->scaled || !o->xmap[0] || !o->xmap[1]) {
+				fprintf(stderr, "Out of memory\n");
+				return -1;
+			}
+		}
+		if (o->level > deepest)
+			deepest = o->level;
+	}
+
+	n_levels = deepest;
+	for (i = 1; i <= n_levels; ++i) {
+		l = &levels[i];
+		l->width = level_width(i);
+		l->height = level_height(i);
+		l->pitch[0] = l->width;
+		l->pitch[1] = l->pitch[2] = l->width / 2;
+		l->plane[0] = malloc((size_t)l->width * l->height);
+		for (c = 1; c < 3 && fourcc != V4L2_PIX_FMT_GREY; ++c)
+			l->plane[c] = malloc((size_t)l->pitch[c] * (l->height / 2));
+		if (!l->plane[0] || (fourcc != V4L2_PIX_FMT_GREY && (!l->plane[1] || !l->plane[2]))) {
+			fprintf(stderr, "Out of memory\n");
+			return -1;
+		}
+	}
+	pyramid_stats.levels = n_levels;
+
+	return 0;
+}
+
+/**
+Function Name : pyramid_box_row
+Function Description : dst[x] = rounded mean of the 2x2 block at column 2x of rows s0 and s1
+Parameter : destination row, the two source rows, destination width
+Return : void
+**/
+void pyramid_box_row(unsigned char *dst, const unsigned char *s0, const unsigned char *s1, unsigned int width)
+{
+	unsigned int x = 0;
+
+#if defined(__SSE2__)
+	const __m128i lo = _mm_set1_epi16(0xff), two = _mm_set1_epi16(2);
+	__m128i a, b, c, d;
+
+	/* the even and odd bytes of each 16-bit lane are horizontal neighbours */
+	for (; x + 16 <= width; x += 16) {
+		a = _mm_loadu_si128((const __m128i *)(s0 + 2 * x));
+		b = _mm_loadu_si128((const __m128i *)(s1 + 2 * x));
+		c = _mm_add_epi16(_mm_add_epi16(_mm_and_si128(a, lo), _mm_srli_epi16(a, 8)),
+			_mm_add_epi16(_mm_and_si128(b, lo), _mm_srli_epi16(b, 8)));
+		a = _mm_loadu_si128((const __m128i *)(s0 + 2 * x + 16));
+		b = _mm_loadu_si128((const __m128i *)(s1 + 2 * x + 16));
+		d = _mm_add_epi16(_mm_add_epi16(_mm_and_si128(a, lo), _mm_srli_epi16(a, 8)),
+			_mm_add_epi16(_mm_and_si128(b, lo), _mm_srli_epi16(b, 8)));
+		c = _mm_srli_epi16(_mm_add_epi16(c, two), 2);
+		d = _mm_srli_epi16(_mm_add_epi16(d, two), 2);
+		_mm_storeu_si128((__m128i *)(dst + x), _mm_packus_epi16(c, d));
+	}
+#elif defined(__ARM_NEON)
+	uint16x8_t sum;
+
+	for (; x + 8 <= width; x += 8) {
+		sum = vpaddlq_u8(vld1q_u8(s0 + 2 * x));
+		sum = vpadalq_u8(sum, vld1q_u8(s1 + 2 * x));
+		vst1_u8(dst + x, vrshrn_n_u16(sum, 2));
+	}
+#endif
+	for (; x < width; ++x)
+		dst[x] = (s0[2 * x] + s0[2 * x + 1] + s1[2 * x] + s1[2 * x + 1] + 2) >> 2;
+}
+
+/**
+Function Name : pyramid_box_row_yuyv
+Function Description : pyramid_box_row() on the luma of two YUYV rows
+Parameter : destination row, the two source rows, destination width
+Return : void
+**/
+void pyramid_box_row_yuyv(unsigned char *dst, const unsigned char *s0, const unsigned char *s1, unsigned int width)
+{
+	unsigned int x = 0;
+
+#if defined(__SSE2__)
+	const __m128i lo = _mm_set1_epi16(0xff), two = _mm_set1_epi16(2);
+	__m128i y0, y1, c, d;
+
+	/* 32 pixels: pack the 32 Y bytes of each row, then the planar kernel */
+#define LUMA(p) _mm_packus_epi16(_mm_and_si128(_mm_loadu_si128((const __m128i *)(p)), lo), \
+		_mm_and_si128(_mm_loadu_si128((const __m128i *)((p) + 16)), lo))
+#define PAIRS(v) _mm_add_epi16(_mm_and_si128(v, lo), _mm_srli_epi16(v, 8))
+	for (; x + 16 <= width; x += 16) {
+		y0 = LUMA(s0 + 4 * x);
+		y1 = LUMA(s1 + 4 * x);
+		c = _mm_add_epi16(PAIRS(y0), PAIRS(y1));
+		y0 = LUMA(s0 + 4 * x + 32);
+		y1 = LUMA(s1 + 4 * x + 32);
+		d = _mm_add_epi16(PAIRS(y0), PAIRS(y1));
+		c = _mm_srli_epi16(_mm_add_epi16(c, two), 2);
+		d = _mm_srli_epi16(_mm_add_epi16(d, two), 2);
+		_mm_storeu_si128((__m128i *)(dst + x), _mm_packus_epi16(c, d));
+	}
+#undef LUMA
+#undef PAIRS
+#elif defined(__ARM_NEON)
+	uint16x8_t sum;
+
+	for (; x + 8 <= width; x += 8) {
+		sum = vpaddlq_u8(vld2q_u8(s0 + 4 * x).val[0]);
+		sum = vpadalq_u8(sum, vld2q_u8(s1 + 4 * x).val[0]);
+		vst1_u8(dst + x, vrshrn_n_u16(sum, 2));
+	}
+#endif
+	for (; x < width; ++x)
+		dst[x] = (s0[4 * x] + s0[4 * x + 2] + s1[4 * x] + s1[4 * x + 2] + 2) >> 2;
+}
+
+/* U and V of level 1 from two NV12 chroma rows: a 2x2 box over each of the interleaved planes */
+static void box_row_nv12_uv(unsigned char *u, unsigned char *v, const unsigned char *s0, const unsigned char *s1,
+	unsigned int width)
+{
+	unsigned int x;
+
+	for (x = 0; x < width; ++x) {
+		u[x] = (s0[4 * x] + s0[4 * x + 2] + s1[4 * x] + s1[4 * x + 2] + 2) >> 2;
+		v[x] = (s0[4 * x + 1] + s0[4 * x + 3] + s1[4 * x + 1] + s1[4 * x + 3] + 2) >> 2;
+	}
+}
+
+/* U and V of level 1 from four YUYV rows: 4:2:2 chroma is halved across and quartered down */
+static void box_row_yuyv_uv(unsigned char *u, unsigned char *v, const unsigned char *s, unsigned int pitch,
+	unsigned int width)
+{
+	const unsigned char *r;
+	unsigned int x, su, sv, k;
+
+	for (x = 0; x < width; ++x) {
+		su = sv = 4;
+		for (k = 0, r = s + 8 * x; k < 4; ++k, r += pitch) {
+			su += r[1] + r[5];
+			sv += r[3] + r[7];
+		}
+		u[x] = su >> 3;
+		v[x] = sv >> 3;
+	}
+}
+
+/* Level 1 rows [y0, y1) and chroma rows [c0, c1) straight from the captured frame */
+static void build_first(const struct frame_view *view, unsigned int y0, unsigned int y1, unsigned int c0,
+	unsigned int c1)
+{
+	struct pyramid_level *l = &levels[1];
+	const unsigned char *src = view->plane[0];
+	unsigned int p = view->pitch[0], y;
+
+	for (y = y0; y < y1; ++y) {
+		if (view->fourcc == V4L2_PIX_FMT_YUYV)
+			pyramid_box_row_yuyv(l->plane[0] + y * l->pitch[0], src + 2 * y * p, src + (2 * y + 1) * p, l->width);
+		else
+			pyramid_box_row(l->plane[0] + y * l->pitch[0], src + 2 * y * p, src + (2 * y + 1) * p, l->width);
+	}
+	for (y = c0; y < c1; ++y) {
+		if (view->fourcc == V4L2_PIX_FMT_YUYV)
+			box_row_yuyv_uv(l->plane[1] + y * l->pitch[1], l->plane[2] + y * l->pitch[2], src + 4 * y * p, p,
+				l->width / 2);
+		else if (view->fourcc == V4L2_PIX_FMT_NV12)
+			box_row_nv12_uv(l->plane[1] + y * l->pitch[1], l->plane[2] + y * l->pitch[2],
+				view->plane[1] + 2 * y * view->pitch[1], view->plane[1] + (2 * y + 1) * view->pitch[1],
+				l->width / 2);
+	}
+}
+
+static void build_next(unsigned int i, unsigned int y0, unsigned int y1, unsigned int c0, unsigned int c1)
+{
+	struct pyramid_level *l = &levels[i], *up = &levels[i - 1];
+	unsigned int y, c;
+
+	for (y = y0; y < y1; ++y)
+		pyramid_box_row(l->plane[0] + y * l->pitch[0], up->plane[0] + 2 * y * up->pitch[0],
+			up->plane[0] + (2 * y + 1) * up->pitch[0], l->width);
+	for (c = 1; c < 3 && l->plane[c]; ++c)
+		for (y = c0; y < c1; ++y)
+			pyramid_box_row(l->plane[c] + y * l->pitch[c], up->plane[c] + 2 * y * up->pitch[c],
+				up->plane[c] + (2 * y + 1) * up->pitch[c], l->width / 2);
+}
+
+static unsigned int min_u(unsigned int a, unsigned int b)
+{
+	return a < b ? a : b;
+}
+
+/*
+ * A strip is the source rows that make two luma rows of the deepest level; each level's share of the strip
+ * is built right after the level above produced the rows it reads
+ */
+static void pyramid_build(const struct frame_view *view)
+{
+	unsigned int strip, i, rows, crows, y0, c0;
+
+	for (strip = 0; strip * (2u << (n_levels - 1)) < levels[1].height; ++strip)
+		for (i = 1; i <= n_levels; ++i) {
+			rows = 2u << (n_levels - i);
+			crows = rows / 2;
+			y0 = strip * rows;
+			c0 = strip * crows;
+			if (y0 >= levels[i].height)
+				break;
+			if (i == 1)
+				build_first(view, y0, min_u(y0 + rows, levels[i].height), c0,
+					min_u(c0 + crows, levels[i].height / 2));
+			else
+				build_next(i, y0, min_u(y0 + rows, levels[i].height), c0,
+					min_u(c0 + crows, levels[i].height / 2));
+		}
+}
+
+/* Bilinear with pixel centres aligned, 8-bit fractions; the source is at most twice the size */
+static void resample_plane(unsigned char *dst, unsigned int dw, unsigned int dh, const unsigned char *src,
+	unsigned int pitch, unsigned int sw, unsigned int sh, const unsigned int *xmap)
+{
+	unsigned int x, y, fx, fy, x0, x1, sy;
+	const unsigned char *r0, *r1;
+
+	for (y = 0; y < dh; ++y, dst += dw) {
+		sy = source_pos(y, dh, sh);
+		fy = sy & 255;
+		r0 = src + (size_t)(sy >> 8) * pitch;
+		r1 = (sy >> 8) + 1 < sh ? r0 + pitch : r0;
+		for (x = 0; x < dw; ++x) {
+			fx = xmap[x] & 255;
+			x0 = xmap[x] >> 8;
+			x1 = x0 + 1 < sw ? x0 + 1 : x0;
+			dst[x] = ((r0[x0] * (256 - fx) + r0[x1] * fx) * (256 - fy) +
+				(r1[x0] * (256 - fx) + r1[x1] * fx) * fy + 32768) >> 16;
+		}
+	}
+}
+
+static void pyramid_deliver(struct pyramid_output *o, unsigned int sequence)
+{
+	struct pyramid_level *l = &levels[o->level];
+	struct pyramid_image img;
+	unsigned long long t0;
+	unsigned int c, cw = o->width / 2, ch = o->height / 2;
+
+	img.width = o->width;
+	img.height = o->height;
+	img.sequence = sequence;
+	if (o->exact) {
+		for (c = 0; c < 3; ++c) {
+			img.plane[c] = l->plane[c];
+			img.pitch[c] = l->pitch[c];
+		}
+	} else {
+		t0 = metric_now_ns();
+		img.plane[0] = o->scaled;
+		img.pitch[0] = o->width;
+		resample_plane(o->scaled, o->width, o->height, l->plane[0], l->pitch[0], l->width, l->height,
+			o->xmap[0]);
+		for (c = 1; c < 3; ++c) {
+			img.plane[c] = l->plane[c] ? o->scaled + o->width * o->height + (c - 1) * cw * ch : NULL;
+			img.pitch[c] = cw;
+			if (l->plane[c])
+				resample_plane((unsigned char *)img.plane[c], cw, ch, l->plane[c], l->pitch[c], l->width / 2,
+					l->height / 2, o->xmap[1]);
+		}
+		pyramid_stats.resample_ns += metric_now_ns() - t0;
+	}
+	t0 = metric_now_ns();
+	o->fn(&img, o->user);
+	pyramid_stats.deliver_ns += metric_now_ns() - t0;
+	o->frames++;
+}
+
+/**
+Function Name : pyramid_frame
+Function Description : Builds the pyramid levels of one captured YUYV, NV12 or GREY frame in a single strip
+                       pass and hands every output its picture
+Parameter : the frame's view
+Return : 0 for success -1 for a format or frame that cannot be scaled
+**/
+int pyramid_frame(const struct frame_view *view)
+{
+	struct pyramid_output *o;
+	unsigned long long t0;
+
+	if (view->fourcc != V4L2_PIX_FMT_YUYV && view->fourcc != V4L2_PIX_FMT_NV12 &&
+	    view->fourcc != V4L2_PIX_FMT_GREY) {
+		if (!unsupported_reported++)
+			fprintf(stderr, "pyramid: only YUYV, NV12 and GREY frames are scaled\n");
+		return -1;
+	}
+	if (!frame_view_complete(view))
+		return -1;
+	if (view->width != cur_width || view->height != cur_height || view->fourcc != cur_fourcc)
+		if (pyramid_plan(view->width, view->height, view->fourcc) != 0)
+			return -1;
+	if (!n_levels)
+		return -1;
+
+	TRACE_BEGIN(tp);
+	t0 = metric_now_ns();
+	pyramid_build(view);
+	pyramid_stats.build_ns += metric_now_ns() - t0;
+	pyramid_stats.frames++;
+	for (o = outputs; o < outputs + pyramid_outputs; ++o)
+		if (o->level)
+			pyramid_deliver(o, view->sequence);
+	TRACE_END(tp, "pyramid");
+
+	return 0;
+}
+
+/**
+Function Name : pyramid_reset
+Function Description : Stops the output threads and removes every output and level
+Parameter : void
+Return : void
+**/
+void pyramid_reset(void)
+{
+	struct pyramid_output *o;
+	struct y4m_sink *s;
+	unsigned int i, c;
+	int fd;
+
+	for (o = outputs; o < outputs + pyramid_outputs; ++o) {
+		if ((s = o->y4m)) {
+			pthread_mutex_lock(&s->lock);
+			s->stop = 1;
+			fd = -1;
+			if (!atomic_load(&s->opened)) {
+				/* a FIFO nobody opened keeps the writer in open(), be its reader while it gives up */
+				s->full = 0;
+				fd = open(s->path, O_RDONLY | O_NONBLOCK);
+			}
+			pthread_cond_signal(&s->cond);
+			pthread_mutex_unlock(&s->lock);
+			pthread_join(s->thread, NULL);
+			if (fd >= 0)
+				close(fd);
+			pthread_mutex_destroy(&s->lock);
+			pthread_cond_destroy(&s->cond);
+			free(s->mail);
+			free(s->writing);
+			free((char *)s->path);
+			free(s);
+		}
+		free(o->scaled);
+		free(o->xmap[0]);
+		free(o->xmap[1]);
+	}
+	for (i = 1; i <= n_levels; ++i)
+		for (c = 0; c < 3; ++c) {
+			free(levels[i].plane[c]);
+			levels[i].plane[c] = NULL;
+		}
+	memset(outputs, 0, sizeof(outputs));
+	pyramid_outputs = n_levels = 0;
+	cur_width = cur_height = cur_fourcc = 0;
+	unsupported_reported = 0;
+}
+
+/**
+Function Name : pyramid_finish
+Function Description : Prints the cost of the levels and the outputs and what each output got, then stops them
+Parameter : void
+Return : void
+**/
+void pyramid_finish(void)
+{
+	struct pyramid_stats *st = &pyramid_stats;
+	struct pyramid_output *o;
+
+	if (st->frames) {
+		printf("Pyramid: %llu frames, %u levels, %.2f ms build %.2f ms resample %.2f ms delivery per frame\n",
+			st->frames, st->levels, st->build_ns / 1e6 / st->frames, st->resample_ns / 1e6 / st->frames,
+			st->deliver_ns / 1e6 / st->frames);
+		for (o = outputs; o < outputs + pyramid_outputs; ++o)
+			printf("\t%4ux%-4u level %u%s : %llu frames, %llu replaced before written%s%s\n", o->width,
+				o->height, o->level, o->exact ? " as is" : " resampled", o->frames, o->dropped,
+				o->y4m ? " -> " : "", o->y4m ? o->y4m->path : "");
+	}
+	pyramid_reset();
+}
@@ -0,0 +1,37 @@
+#pragma once
+#include "frameview.h"
+
+#define PYRAMID_MAX_LEVELS 6
+#define PYRAMID_MAX_OUTPUTS 8
+
+/* One I420 picture handed to an output; u and v are NULL for a GREY capture */
+struct pyramid_image {
+	const unsigned char *plane[3];
+	unsigned int pitch[3];
+	unsigned int width, height;
+	unsigned int sequence;
+};
+
+/* Runs on the capture thread; an output that may block hands the picture to its own thread */
+typedef void (*pyramid_fn)(const struct pyramid_image *image, void *user);
+
+struct pyramid_stats {
+	unsigned long long frames;
+	unsigned long long build_ns;            /* 2x2 box levels, all of them in one pass over the frame */
+	unsigned long long resample_ns;         /* bilinear outputs between two levels */
+	unsigned long long deliver_ns;          /* output callbacks */
+	unsigned int levels;
+};
+
+extern struct pyramid_stats pyramid_stats;
+extern unsigned int pyramid_outputs;
+
+int pyramid_parse(const char *spec);
+int pyramid_add_output(unsigned int width, unsigned int height, pyramid_fn fn, void *user);
+int pyramid_frame(const struct frame_view *view);
+void pyramid_reset(void);
+void pyramid_finish(void);
+
+/* The 2x2 box halving the levels are built with, for other stages that want a small luma */
+void pyramid_box_row(unsigned char *dst, const unsigned char *s0, const unsigned char *s1, unsigned int width);
+void pyramid_box_row_yuyv(unsigned char *dst, const unsigned char *s0, const unsigned char *s1, unsigned int width);
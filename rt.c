@@ -0,0 +1,126 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+
+#include "rt.h"
+
+int rt_fifo_priority;                   /* 0 keeps SCHED_OTHER */
+int rt_mlock;
+
+static const char *rt_role_names[RT_ROLES] = { "capture", "writer", "encode" };
+static cpu_set_t rt_cpus[RT_ROLES];
+static int rt_pinned[RT_ROLES];
+
+/**
+Function Name : rt_parse_pin
+Function Description : Parses "role=cpu[-cpu],..." where role is capture, writer or encode; frames are
+                       rendered on the capture thread, so its settings cover rendering
+Parameter : option argument
+Return : 0 for success -1 for a malformed list
+**/
+int rt_parse_pin(const char *arg)
+{
+	char *list = strdup(arg), *item, *save, *eq;
+	int role, first, last, cpu, ret = 0;
+
+	for (item = strtok_r(list, ",", &save); item; item = strtok_r(NULL, ",", &save)) {
+		eq = strchr(item, '=');
+		if (!eq) {
+			ret = -1;
+			break;
+		}
+		*eq = '\0';
+		for (role = 0; role < RT_ROLES; ++role)
+			if (strcmp(item, rt_role_names[role]) == 0)
+				break;
+		if (role == RT_ROLES) {
+			ret = -1;
+			break;
+		}
+
+		first = last = strtol(eq + 1, &eq, 10);
+		if (*eq == '-')
+			last = strtol(eq + 1, NULL, 10);
+		if (first < 0 || last < first || last >= CPU_SETSIZE) {
+			ret = -1;
+			break;
+		}
+		CPU_ZERO(&rt_cpus[role]);
+		for (cpu = first; cpu <= last; ++cpu)
+			CPU_SET(cpu, &rt_cpus[role]);
+		rt_pinned[role] = 1;
+	}
+	free(list);
+
+	if (ret)
+		fprintf(stderr, "Bad pin list %s, expected role=cpu[-cpu],...\n", arg);
+	return ret;
+}
+
+/**
+Function Name : rt_apply
+Function Description : Pins the calling thread to the CPUs chosen for its role and, for the capture thread,
+                       switches it to SCHED_FIFO. Failures are reported but not fatal
+Parameter : role of the calling thread
+Return : 0 when everything requested was applied -1 otherwise
+**/
+int rt_apply(enum rt_role role)
+{
+	struct sched_param param;
+	int err, ret = 0;
+
+	if (rt_pinned[role]) {
+		err = pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &rt_cpus[role]);
+		if (err) {
+			fprintf(stderr, "pin %s thread: %s\n", rt_role_names[role], strerror(err));
+			ret = -1;
+		}
+	}
+
+	if (role == RT_CAPTURE && rt_fifo_priority > 0) {
+		memset(&param, 0, sizeof(param));
+		param.sched_priority = rt_fifo_priority;
+		err = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+		if (err) {
+			fprintf(stderr, "SCHED_FIFO %d for capture thread: %s\n", rt_fifo_priority, strerror(err));
+			ret = -1;
+		}
+	}
+
+	return ret;
+}
+
+/**
+Function Name : rt_lock_memory
+Function Description : Locks current and future pages so the capture path never takes a major fault
+Parameter : void
+Return : 0 for success -1 for failure
+**/
+int rt_lock_memory(void)
+{
+	if (!rt_mlock)
+		return 0;
+	if (mlockall(MCL_CURRENT | MCL_FUTURE) == -1) {
+		perror("mlockall");
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+Function Name : rt_unlock_memory
+Function Description : Undoes rt_lock_memory(), for a run that locked memory for a while only
+Parameter : void
+Return : void
+**/
+void rt_unlock_memory(void)
+{
+	if (rt_mlock)
+		munlockall();
+}
@@ -0,0 +1,16 @@
+#pragma once
+
+enum rt_role {
+	RT_CAPTURE,             /* with SDL streaming, the same thread converts and presents each frame */
+	RT_WRITER,
+	RT_ENCODE,
+	RT_ROLES,
+};
+
+extern int rt_fifo_priority;
+extern int rt_mlock;
+
+int rt_parse_pin(const char *arg);
+int rt_apply(enum rt_role role);
+int rt_lock_memory(void);
+void rt_unlock_memory(void);
@@ -0,0 +1,388 @@
+#define _GNU_SOURCE
+#include <pthread.h>
+
+#include "header.h"
+#include "segment.h"
+#include "metrics.h"
+#include "trace.h"
+#include "rt.h"
+
+/*
+ * A recording split into files by duration or size. A background thread creates each next file and fallocates
+ * it before the writer needs it, so the writer only swaps descriptors: no open(), no extent allocation and no
+ * close() on the thread that writes frames. The same thread trims the unwritten tail of a finished file,
+ * grows an allocation a segment is outgrowing and deletes the oldest files when the recording passes its
+ * byte budget. When the next file is late the writer keeps appending to the current one.
+ */
+
+struct segment_config segment_config = { 0, 0, 0, 64ull << 20 };
+struct segment_stats segment_stats;
+int segment_enabled;
+
+struct segment {
+	char *path;
+	int fd;
+	unsigned long long allocated;   /* bytes fallocated past EOF, grown by extensions */
+	unsigned long long written;
+	unsigned long long start_ns;    /* first write */
+};
+
+/* A finished file retention may delete, oldest first */
+struct segment_kept {
+	char *path;
+	unsigned long long bytes;
+};
+
+static pthread_t prep_thread;
+static pthread_mutex_t segment_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t segment_cond = PTHREAD_COND_INITIALIZER;
+static int started, stopping;
+
+/* the writer's file and its next extension point, only touched by the writing thread */
+static struct segment cur;
+static unsigned long long extend_at;
+static int cur_late;
+
+/* handed between the writer and the thread under segment_lock */
+static struct segment next, retired;
+static int next_ready, retire_pending, extend_fd = -1;
+static unsigned long long extend_from, extend_len, estimate;
+
+/* the thread's own bookkeeping */
+static char *seg_stem, *seg_suffix;
+static unsigned int next_index;
+static struct segment_kept *kept;
+static unsigned int n_kept, kept_cap;
+static unsigned long long kept_bytes, writing_alloc, ready_alloc;
+static int over_budget_reported;
+
+/**
+Function Name : segment_parse
+Function Description : Parses the -g argument: comma separated seconds=, size=<MB>, budget=<MB> and
+                       prealloc=<MB>
+Parameter : option string
+Return : 0 for success -1 for a bad option
+**/
+int segment_parse(const char *spec)
+{
+	char *opts = strdup(spec), *item, *save;
+	int ret = 0;
+
+	segment_enabled = 1;
+	for (item = strtok_r(opts, ",", &save); item; item = strtok_r(NULL, ",", &save)) {
+		if (strncmp(item, "seconds=", 8) == 0)
+			segment_config.seconds = strtol(item + 8, NULL, 10);
+		else if (strncmp(item, "size=", 5) == 0)
+			segment_config.max_bytes = strtoull(item + 5, NULL, 10) << 20;
+		else if (strncmp(item, "budget=", 7) == 0)
+			segment_config.budget = strtoull(item + 7, NULL, 10) << 20;
+		else if (strncmp(item, "prealloc=", 9) == 0)
+			segment_config.prealloc = strtoull(item + 9, NULL, 10) << 20;
+		else {
+			fprintf(stderr, "Unknown segment option %s\n", item);
+			ret = -1;
+		}
+	}
+	free(opts);
+	if (!segment_config.seconds && !segment_config.max_bytes) {
+		fprintf(stderr, "Segments need seconds= or size=\n");
+		ret = -1;
+	}
+	if (segment_config.budget && segment_config.max_bytes && segment_config.budget < 2 * segment_config.max_bytes) {
+		fprintf(stderr, "Segment budget must hold at least two segments\n");
+		ret = -1;
+	}
+
+	return ret;
+}
+
+/* Opens segment index with bytes allocated ahead; a filesystem without fallocate just grows the file */
+static int segment_create(struct segment *s, unsigned int index, unsigned long long bytes)
+{
+	size_t len = strlen(seg_stem) + strlen(seg_suffix) + 16;
+
+	memset(s, 0, sizeof(*s));
+	s->path = malloc(len);
+	snprintf(s->path, len, "%s_%05u%s", seg_stem, index, seg_suffix);
+	if ((s->fd = open(s->path, O_WRONLY | O_CREAT | O_TRUNC, 0660)) < 0) {
+		perror(s->path);
+		free(s->path);
+		return -1;
+	}
+	if (bytes && !segment_stats.no_fallocate) {
+		TRACE_BEGIN(ta);
+		if (fallocate(s->fd, FALLOC_FL_KEEP_SIZE, 0, bytes) == 0) {
+			s->allocated = bytes;
+			segment_stats.allocated += bytes;
+		} else if (errno == EOPNOTSUPP || errno == ENOSYS) {
+			fprintf(stderr, "%s: no fallocate on this filesystem, segments grow as written\n", s->path);
+			segment_stats.no_fallocate = 1;
+		} else
+			perror("fallocate");    /* e.g. ENOSPC: still written, retention may make room */
+		TRACE_END(ta, "fallocate");
+	}
+	segment_stats.segments++;
+
+	return 0;
+}
+
+/* Deletes the oldest finished files until the recording plus need bytes fits the budget */
+static void segment_retain(unsigned long long need)
+{
+	if (!segment_config.budget)
+		return;
+	while (n_kept && kept_bytes + writing_alloc + ready_alloc + need > segment_config.budget) {
+		if (unlink(kept[0].path) != 0)
+			perror(kept[0].path);
+		segment_stats.deleted++;
+		segment_stats.deleted_bytes += kept[0].bytes;
+		kept_bytes -= kept[0].bytes;
+		free(kept[0].path);
+		memmove(kept, kept + 1, --n_kept * sizeof(*kept));
+	}
+	if (kept_bytes + writing_alloc + ready_alloc + need > segment_config.budget && !over_budget_reported++)
+		fprintf(stderr, "\nsegment: the current files alone are over the %llu MB budget\n",
+			segment_config.budget >> 20);
+}
+
+/* Releases what was allocated but not written, closes the file and keeps it for retention */
+static void segment_close(struct segment *s)
+{
+	if (s->allocated > s->written && ftruncate(s->fd, s->written) == 0)
+		segment_stats.trimmed += s->allocated - s->written;
+	close(s->fd);
+	if (n_kept == kept_cap) {
+		kept_cap = kept_cap ? 2 * kept_cap : 16;
+		kept = realloc(kept, kept_cap * sizeof(*kept));
+	}
+	kept[n_kept].path = s->path;
+	kept[n_kept++].bytes = s->written;
+	kept_bytes += s->written;
+}
+
+static void *segment_main(void *arg)
+{
+	struct segment s;
+	unsigned long long bytes, from, len;
+	int fd, ret;
+
+	(void)arg;
+	TRACE_THREAD("segment");
+	rt_apply(RT_WRITER);    /* file housekeeping shares the CPUs given to writing, never the capture one */
+	pthread_mutex_lock(&segment_lock);
+	for (;;) {
+		while (!stopping && !retire_pending && extend_fd < 0 && next_ready)
+			pthread_cond_wait(&segment_cond, &segment_lock);
+		if (extend_fd >= 0) {
+			/* before a retire, so the descriptor is still open */
+			fd = extend_fd;
+			from = extend_from;
+			len = extend_len;
+			extend_fd = -1;
+			pthread_mutex_unlock(&segment_lock);
+			if (fallocate(fd, FALLOC_FL_KEEP_SIZE, from, len) == 0) {
+				segment_stats.extended++;
+				segment_stats.allocated += len;
+				writing_alloc += len;
+			}
+			pthread_mutex_lock(&segment_lock);
+			continue;
+		}
+		if (retire_pending) {
+			s = retired;
+			retire_pending = 0;
+			pthread_mutex_unlock(&segment_lock);
+			writing_alloc = ready_alloc;    /* the file prepared last is the one being written now */
+			ready_alloc = 0;
+			segment_close(&s);
+			segment_retain(0);
+			pthread_mutex_lock(&segment_lock);
+			continue;
+		}
+		if (stopping)
+			break;
+
+		bytes = segment_config.max_bytes ? segment_config.max_bytes : estimate;
+		pthread_mutex_unlock(&segment_lock);
+		segment_retain(bytes);
+		if ((ret = segment_create(&s, next_index, bytes)) != 0)
+			usleep(200000); /* the writer stays on its file meanwhile */
+		pthread_mutex_lock(&segment_lock);
+		if (ret == 0) {
+			next_index++;
+			next = s;
+			next_ready = 1;
+			ready_alloc = s.allocated;
+		}
+	}
+	pthread_mutex_unlock(&segment_lock);
+
+	return NULL;
+}
+
+/**
+Function Name : segment_open
+Function Description : Creates the first segment <stem>_00000<suffix> and starts the thread that prepares the
+                       next ones
+Parameter : file name without the extension, and the extension
+Return : descriptor of the first segment, -1 for failure
+**/
+int segment_open(const char *stem, const char *suffix)
+{
+	seg_stem = strdup(stem);
+	seg_suffix = strdup(suffix);
+	estimate = segment_config.max_bytes ? segment_config.max_bytes : segment_config.prealloc;
+	if (segment_create(&cur, 0, estimate) != 0)
+		return -1;
+	next_index = 1;
+	writing_alloc = cur.allocated;
+	extend_at = cur.allocated - cur.allocated / 8;
+	cur_late = 0;
+	stopping = 0;
+	next_ready = retire_pending = 0;
+	if (pthread_create(&prep_thread, NULL, segment_main, NULL)) {
+		fprintf(stderr, "create segment thread failed\n");
+		return -1;
+	}
+	started = 1;
+
+	return cur.fd;
+}
+
+/* Swaps to the prepared file, the old one goes to the thread; no syscall while the lock is held */
+static void segment_rotate(unsigned long long now)
+{
+	unsigned long long elapsed = now - cur.start_ns, seconds_ns = segment_config.seconds * 1000000000ull;
+	int ready;
+
+	pthread_mutex_lock(&segment_lock);
+	if ((ready = next_ready)) {
+		retired = cur;
+		retire_pending = 1;
+		cur = next;
+		next_ready = 0;
+		/* a duration bound segment is sized after the rate of the one just finished, with a quarter spare */
+		if (!segment_config.max_bytes && elapsed)
+			estimate = (unsigned long long)((double)retired.written * seconds_ns / elapsed) / 4 * 5;
+		pthread_cond_signal(&segment_cond);
+	}
+	pthread_mutex_unlock(&segment_lock);
+	if (!ready) {
+		if (!cur_late++)
+			segment_stats.late++;
+		return;
+	}
+	cur.start_ns = now;
+	cur_late = 0;
+	extend_at = cur.allocated - cur.allocated / 8;
+	segment_stats.rotations++;
+}
+
+/* A segment seven eighths into its allocation gets half of it again, ahead of the writer */
+static void segment_extend(void)
+{
+	unsigned long long len = cur.allocated / 2;
+
+	pthread_mutex_lock(&segment_lock);
+	if (extend_fd < 0) {
+		extend_fd = cur.fd;
+		extend_from = cur.allocated;
+		extend_len = len;
+		pthread_cond_signal(&segment_cond);
+	}
+	pthread_mutex_unlock(&segment_lock);
+	cur.allocated += len;
+	extend_at = cur.allocated - cur.allocated / 8;
+}
+
+/**
+Function Name : segment_write
+Function Description : Appends one frame to the current segment, first switching to the next one when the
+                       duration or size is reached and the next file is ready. Called from one thread at a time
+Parameter : data and its size
+Return : what write() returned
+**/
+ssize_t segment_write(const void *data, size_t size)
+{
+	unsigned long long t0 = metric_now_ns(), t1, ns;
+	ssize_t ret;
+
+	if (!cur.start_ns)
+		cur.start_ns = t0;
+	if (cur.written && ((segment_config.max_bytes && cur.written + size > segment_config.max_bytes) ||
+	    (segment_config.seconds && t0 - cur.start_ns >= segment_config.seconds * 1000000000ull))) {
+		segment_rotate(t0);
+		t1 = metric_now_ns() - t0;
+		if (t1 > segment_stats.rotate_max_ns)
+			segment_stats.rotate_max_ns = t1;
+	}
+	if ((ret = write(cur.fd, data, size)) > 0)
+		cur.written += ret;
+	if (cur.allocated && !segment_config.max_bytes && cur.written >= extend_at)
+		segment_extend();
+
+	ns = metric_now_ns() - t0;
+	segment_stats.writes++;
+	segment_stats.write_ns += ns;
+	if (ns > segment_stats.write_max_ns)
+		segment_stats.write_max_ns = ns;
+
+	return ret;
+}
+
+/**
+Function Name : segment_finish
+Function Description : Stops the thread, closes the current segment, removes a prepared one nothing was
+                       written to and prints the segment report
+Parameter : void
+Return : void
+**/
+void segment_finish(void)
+{
+	struct segment_stats *st = &segment_stats;
+	unsigned int i;
+
+	if (!started)
+		return;
+	pthread_mutex_lock(&segment_lock);
+	stopping = 1;
+	pthread_cond_signal(&segment_cond);
+	pthread_mutex_unlock(&segment_lock);
+	pthread_join(prep_thread, NULL);
+	started = 0;
+
+	writing_alloc = ready_alloc = 0;
+	segment_close(&cur);
+	segment_retain(0);
+	if (next_ready) {
+		close(next.fd);
+		unlink(next.path);
+		free(next.path);
+		st->segments--;
+		st->allocated -= next.allocated;
+		next_ready = 0;
+	}
+
+	printf("Segments: %llu files, %llu rotations (%llu late), %.1f MB kept in %u files\n", st->segments,
+		st->rotations, st->late, kept_bytes / 1048576.0, n_kept);
+	printf("\tAllocated ahead : %.1f MB (%llu extensions), %.1f MB unwritten released at close%s\n",
+		st->allocated / 1048576.0, st->extended, st->trimmed / 1048576.0,
+		st->no_fallocate ? ", fallocate unsupported" : "");
+	if (segment_config.budget)
+		printf("\tRetention : %llu files %.1f MB deleted to stay within %llu MB\n", st->deleted,
+			st->deleted_bytes / 1048576.0, segment_config.budget >> 20);
+	if (st->writes)
+		printf("\tWrite : %.1f us avg %.1f us max, rotation %.1f us max\n", st->write_ns / 1e3 / st->writes,
+			st->write_max_ns / 1e3, st->rotate_max_ns / 1e3);
+
+	for (i = 0; i < n_kept; ++i)
+		free(kept[i].path);
+	free(kept);
+	kept = NULL;
+	n_kept = kept_cap = 0;
+	kept_bytes = 0;
+	free(seg_stem);
+	free(seg_suffix);
+	memset(&cur, 0, sizeof(cur));
+	over_budget_reported = 0;
+}
@@ -0,0 +1,32 @@
+#pragma once
+#include <sys/types.h>
+
+struct segment_config {
+	unsigned int seconds;           /* start a new segment after this long, 0 for no limit */
+	unsigned long long max_bytes;   /* or once the next write would pass this size, 0 for no limit */
+	unsigned long long budget;      /* all segments of the recording together, oldest deleted past it, 0 for none */
+	unsigned long long prealloc;    /* first allocation when only seconds bounds a segment */
+};
+
+struct segment_stats {
+	unsigned long long segments;            /* files opened */
+	unsigned long long rotations;
+	unsigned long long late;                /* rotations due while the next file was not ready, kept writing */
+	unsigned long long allocated;           /* bytes fallocated ahead of the writer */
+	unsigned long long extended;            /* allocations grown while a segment outlasted its estimate */
+	unsigned long long trimmed;             /* bytes allocated but not written, released at close */
+	unsigned long long deleted, deleted_bytes;
+	unsigned long long write_ns, write_max_ns;      /* segment_write() on the writing thread */
+	unsigned long long rotate_max_ns;               /* of which switching to the next file */
+	unsigned long long writes;
+	int no_fallocate;                       /* the filesystem refused, files grow as they are written */
+};
+
+extern struct segment_config segment_config;
+extern struct segment_stats segment_stats;
+extern int segment_enabled;
+
+int segment_parse(const char *spec);
+int segment_open(const char *stem, const char *suffix);
+ssize_t segment_write(const void *data, size_t size);
+void segment_finish(void);
@@ -0,0 +1,410 @@
+#include <pthread.h>
+#include <signal.h>
+
+#include "header.h"
+#include "snapshot.h"
+#include "encode.h"
+#include "metrics.h"
+#include "trace.h"
+
+/*
+ * Stills taken while the preview (or a recording) keeps running. A request from a hotkey, the metrics endpoint
+ * or SIGUSR2 only sets a flag; the capture thread copies the next frame into one of a few pooled buffers and
+ * goes on, and a background thread encodes and writes it. Requests made before the frame arrives coalesce.
+ */
+
+struct snapshot_config snapshot_config = { "snapshot", 2, 0 };
+struct snapshot_stats snapshot_stats;
+atomic_uint snapshot_pending;
+
+enum snapshot_slot_state {
+	SNAP_FREE,
+	SNAP_QUEUED,
+	SNAP_WRITING,
+};
+
+struct snapshot_slot {
+	unsigned char *data;            /* the copied frame, kept between snapshots */
+	unsigned int capacity, size;
+	unsigned char *out;             /* JPEG, grown by libjpeg as needed */
+	unsigned long out_capacity;
+	unsigned int width, height, fourcc, sequence, index;
+	unsigned int stride;            /* bytesperline the frame was captured with */
+	unsigned long long request_ns;
+	enum snapshot_slot_state state;
+};
+
+static struct snapshot_slot slots[SNAPSHOT_BUFFERS];
+static unsigned int queue[SNAPSHOT_BUFFERS], q_head, q_count;
+static pthread_mutex_t snapshot_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t snapshot_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t writer_thread;
+static int writer_started, stopping;
+static struct encode_worker writer;
+
+static atomic_ullong request_ns, requests, coalesced;
+static unsigned long long taken_ns, last_tick_ns;       /* capture thread only */
+static unsigned int next_index;
+static int gap_watch;                   /* 1 after a frame was copied, 2 after a still switch */
+
+/**
+Function Name : snapshot_parse
+Function Description : Parses the -n argument: a file prefix, or comma separated prefix=,settle= and raw
+Parameter : option string
+Return : 0 for success -1 for a bad option
+**/
+int snapshot_parse(const char *spec)
+{
+	char *opts = strdup(spec), *item, *save;
+	int ret = 0;
+
+	for (item = strtok_r(opts, ",", &save); item; item = strtok_r(NULL, ",", &save)) {
+		if (strncmp(item, "prefix=", 7) == 0)
+			snapshot_config.prefix = strdup(item + 7);
+		else if (strncmp(item, "settle=", 7) == 0)
+			snapshot_config.settle = strtol(item + 7, NULL, 10);
+		else if (strcmp(item, "raw") == 0)
+			snapshot_config.raw = 1;
+		else if (!strchr(item, '='))
+			snapshot_config.prefix = strdup(item);
+		else {
+			fprintf(stderr, "Unknown snapshot option %s\n", item);
+			ret = -1;
+		}
+	}
+	free(opts);
+
+	return ret;
+}
+
+/**
+Function Name : snapshot_request
+Function Description : Asks the capture thread for a snapshot. Only touches atomics, so it is safe from any
+                       thread and from a signal handler
+Parameter : SNAPSHOT_FRAME or SNAPSHOT_STILL
+Return : void
+**/
+void snapshot_request(enum snapshot_kind kind)
+{
+	unsigned long long none = 0;
+
+	atomic_fetch_add(&requests, 1);
+	if (!atomic_compare_exchange_strong(&request_ns, &none, metric_now_ns()))
+		atomic_fetch_add(&coalesced, 1);
+	atomic_fetch_or(&snapshot_pending, kind);
+}
+
+static void snapshot_signal(int sig)
+{
+	(void)sig;
+	snapshot_request(SNAPSHOT_FRAME);
+}
+
+/**
+Function Name : snapshot_install_signal
+Function Description : SIGUSR2 requests a snapshot of the next frame
+Parameter : void
+Return : void
+**/
+void snapshot_install_signal(void)
+{
+	signal(SIGUSR2, snapshot_signal);
+}
+
+/**
+Function Name : snapshot_take
+Function Description : Claims the pending request on the capture thread; a request racing the claim is served
+                       with the next frame at worst
+Parameter : void
+Return : the requested kinds, 0 for none
+**/
+unsigned int snapshot_take(void)
+{
+	taken_ns = atomic_exchange(&request_ns, 0);
+	if (!taken_ns)
+		taken_ns = metric_now_ns();
+
+	return atomic_exchange(&snapshot_pending, 0);
+}
+
+/**
+Function Name : snapshot_tick
+Function Description : Times the interval since the previous frame on the capture thread, so the interval
+                       that spans a snapshot can be compared with the others
+Parameter : void
+Return : void
+**/
+void snapshot_tick(void)
+{
+	unsigned long long now = metric_now_ns(), d = now - last_tick_ns;
+
+	if (last_tick_ns && gap_watch) {
+		snapshot_stats.gaps[gap_watch - 1]++;
+		snapshot_stats.gap_ns[gap_watch - 1] += d;
+		if (d > snapshot_stats.gap_max_ns[gap_watch - 1])
+			snapshot_stats.gap_max_ns[gap_watch - 1] = d;
+	} else if (last_tick_ns) {
+		snapshot_stats.intervals++;
+		snapshot_stats.interval_ns += d;
+	}
+	gap_watch = 0;
+	last_tick_ns = now;
+}
+
+static void snapshot_path(char *buf, size_t size, const struct snapshot_slot *s, int jpeg)
+{
+	char fourcc[5];
+
+	if (jpeg) {
+		snprintf(buf, size, "%s_%u_%ux%u.jpg", snapshot_config.prefix, s->index, s->width, s->height);
+		return;
+	}
+	memcpy(fourcc, &s->fourcc, 4);
+	fourcc[4] = '\0';
+	if (fourcc[3] == ' ')
+		fourcc[3] = '\0';
+	snprintf(buf, size, "%s_%u_%ux%u.%s", snapshot_config.prefix, s->index, s->width, s->height, fourcc);
+}
+
+/* YUYV and NV12 are encoded, MJPG is already a JPEG, anything else (Bayer, grey) is written as captured */
+static int snapshot_write(struct snapshot_slot *s)
+{
+	int encode = !snapshot_config.raw && (s->fourcc == V4L2_PIX_FMT_YUYV || s->fourcc == V4L2_PIX_FMT_NV12);
+	struct encode_job job;
+	const unsigned char *data = s->data;
+	size_t len = s->size;
+	char path[256];
+	ssize_t n;
+	int out;
+
+	if (encode) {
+		memset(&job, 0, sizeof(job));
+		job.raw = s->data;
+		job.raw_size = s->size;
+		job.out = s->out;
+		job.out_capacity = s->out_capacity;
+		job.width = s->width;
+		job.height = s->height;
+		job.fourcc = s->fourcc;
+		job.stride = s->stride;
+		TRACE_BEGIN(te);
+		n = jpeg_encode_frame(&writer, &job);
+		TRACE_END(te, "snapshot encode");
+		s->out = job.out;
+		s->out_capacity = job.out_capacity;
+		if (n < 0) {
+			fprintf(stderr, "\nsnapshot: frame %u could not be encoded\n", s->sequence);
+			return -1;
+		}
+		data = job.out;
+		len = job.out_size;
+	}
+
+	snapshot_path(path, sizeof(path), s, encode || s->fourcc == V4L2_PIX_FMT_MJPEG);
+	if ((out = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0660)) < 0) {
+		perror(path);
+		return -1;
+	}
+	TRACE_BEGIN(tw);
+	while (len && (n = write(out, data, len)) > 0) {
+		data += n;
+		len -= n;
+	}
+	TRACE_END(tw, "snapshot write");
+	close(out);
+	if (len) {
+		fprintf(stderr, "%s: short write\n", path);
+		return -1;
+	}
+	fprintf(stderr, "\nsnapshot: %s (frame %u) in %.1f ms\n", path, s->sequence,
+		(metric_now_ns() - s->request_ns) / 1e6);
+
+	return 0;
+}
+
+static void *snapshot_writer_main(void *arg)
+{
+	struct snapshot_slot *s;
+	unsigned long long ns;
+	int ret;
+
+	(void)arg;
+	TRACE_THREAD("snapshot");
+	pthread_mutex_lock(&snapshot_lock);
+	for (;;) {
+		while (!q_count && !stopping)
+			pthread_cond_wait(&snapshot_cond, &snapshot_lock);
+		if (!q_count)
+			break;
+		s = &slots[queue[q_head]];
+		q_head = (q_head + 1) % SNAPSHOT_BUFFERS;
+		q_count--;
+		s->state = SNAP_WRITING;
+		pthread_mutex_unlock(&snapshot_lock);
+
+		ret = snapshot_write(s);
+		ns = metric_now_ns() - s->request_ns;
+
+		pthread_mutex_lock(&snapshot_lock);
+		if (ret == 0) {
+			snapshot_stats.written++;
+			snapshot_stats.done_ns += ns;
+			if (ns > snapshot_stats.done_max_ns)
+				snapshot_stats.done_max_ns = ns;
+		} else
+			snapshot_stats.failed++;
+		s->state = SNAP_FREE;
+	}
+	pthread_mutex_unlock(&snapshot_lock);
+	encode_worker_release(&writer);
+
+	return NULL;
+}
+
+/**
+Function Name : snapshot_frame
+Function Description : Copies a frame for the claimed request into a free pooled buffer and queues it for the
+                       writer thread; the caller may requeue the capture buffer right after
+Parameter : frame data, bytes used, its size, the bytesperline negotiated for that size, fourcc and sequence,
+            and the kind of snapshot it serves
+Return : 0 for success -1 when every buffer is still being written
+**/
+int snapshot_frame(const void *frame, unsigned int bytesused, unsigned int width, unsigned int height,
+	unsigned int bytesperline, unsigned int fourcc, unsigned int sequence, enum snapshot_kind kind)
+{
+	struct snapshot_slot *s = NULL;
+	unsigned long long ns;
+	unsigned int i;
+
+	pthread_mutex_lock(&snapshot_lock);
+	if (!writer_started) {
+		stopping = 0;
+		if (pthread_create(&writer_thread, NULL, snapshot_writer_main, NULL)) {
+			pthread_mutex_unlock(&snapshot_lock);
+			fprintf(stderr, "create snapshot thread failed\n");
+			snapshot_stats.dropped++;
+			return -1;
+		}
+		writer_started = 1;
+	}
+	for (i = 0; i < SNAPSHOT_BUFFERS && !s; ++i)
+		if (slots[i].state == SNAP_FREE)
+			s = &slots[i];
+	if (s)
+		s->state = SNAP_WRITING;        /* ours until queued */
+	pthread_mutex_unlock(&snapshot_lock);
+	if (!s) {
+		fprintf(stderr, "\nsnapshot: all %u buffers busy, dropped\n", SNAPSHOT_BUFFERS);
+		snapshot_stats.dropped++;
+		return -1;
+	}
+
+	TRACE_BEGIN(tc);
+	if (s->capacity < bytesused) {
+		free(s->data);
+		s->data = malloc(bytesused);
+		s->capacity = s->data ? bytesused : 0;
+	}
+	if (!s->data) {
+		fprintf(stderr, "Out of memory\n");
+		s->state = SNAP_FREE;
+		snapshot_stats.dropped++;
+		return -1;
+	}
+	memcpy(s->data, frame, bytesused);
+	TRACE_END(tc, "snapshot copy");
+	s->size = bytesused;
+	s->width = width;
+	s->height = height;
+	s->stride = bytesperline;
+	s->fourcc = fourcc;
+	s->sequence = sequence;
+	s->index = next_index++;
+	s->request_ns = taken_ns;
+
+	ns = metric_now_ns() - taken_ns;
+	snapshot_stats.copied++;
+	snapshot_stats.grab_ns += ns;
+	if (ns > snapshot_stats.grab_max_ns)
+		snapshot_stats.grab_max_ns = ns;
+	if (kind & SNAPSHOT_STILL)
+		snapshot_stats.stills++;
+	gap_watch = 1;
+
+	pthread_mutex_lock(&snapshot_lock);
+	s->state = SNAP_QUEUED;
+	queue[(q_head + q_count++) % SNAPSHOT_BUFFERS] = s - slots;
+	pthread_cond_signal(&snapshot_cond);
+	pthread_mutex_unlock(&snapshot_lock);
+
+	return 0;
+}
+
+/**
+Function Name : snapshot_switched
+Function Description : Records how long the preview format was stopped to take a still
+Parameter : nanoseconds from stopping the preview stream to restarting it
+Return : void
+**/
+void snapshot_switched(unsigned long long ns)
+{
+	snapshot_stats.switches++;
+	snapshot_stats.switch_ns += ns;
+	if (ns > snapshot_stats.switch_max_ns)
+		snapshot_stats.switch_max_ns = ns;
+	gap_watch = 2;
+}
+
+/**
+Function Name : snapshot_finish
+Function Description : Writes the snapshots still queued, prints the latency and preview gap report and
+                       frees the buffer pool
+Parameter : void
+Return : void
+**/
+void snapshot_finish(void)
+{
+	struct snapshot_stats *st = &snapshot_stats;
+	unsigned int i;
+
+	if (writer_started) {
+		pthread_mutex_lock(&snapshot_lock);
+		stopping = 1;
+		pthread_cond_signal(&snapshot_cond);
+		pthread_mutex_unlock(&snapshot_lock);
+		pthread_join(writer_thread, NULL);
+		writer_started = 0;
+	}
+	st->requested = atomic_exchange(&requests, 0);
+	st->coalesced = atomic_exchange(&coalesced, 0);
+	atomic_store(&request_ns, 0);
+	atomic_store(&snapshot_pending, 0);
+
+	if (st->requested) {
+		printf("Snapshot: %llu requested (%llu coalesced), %llu written, %llu dropped, %llu failed, %llu at the "
+			"still size\n", st->requested, st->coalesced, st->written, st->dropped, st->failed, st->stills);
+		if (st->copied)
+			printf("\tRequest to frame copied : %.1f ms avg %.1f max\n", st->grab_ns / 1e6 / st->copied,
+				st->grab_max_ns / 1e6);
+		if (st->written)
+			printf("\tRequest to file written : %.1f ms avg %.1f max\n", st->done_ns / 1e6 / st->written,
+				st->done_max_ns / 1e6);
+		if (st->intervals)
+			printf("\tPreview gap : %.1f ms avg between frames, %.1f ms avg %.1f max across a snapshot, "
+				"%.1f ms avg %.1f max across a still\n", st->interval_ns / 1e6 / st->intervals,
+				st->gaps[0] ? st->gap_ns[0] / 1e6 / st->gaps[0] : 0, st->gap_max_ns[0] / 1e6,
+				st->gaps[1] ? st->gap_ns[1] / 1e6 / st->gaps[1] : 0, st->gap_max_ns[1] / 1e6);
+		if (st->switches)
+			printf("\tStill switch : %.1f ms avg %.1f max with the preview format stopped\n",
+				st->switch_ns / 1e6 / st->switches, st->switch_max_ns / 1e6);
+	}
+
+	for (i = 0; i < SNAPSHOT_BUFFERS; ++i) {
+		free(slots[i].data);
+		free(slots[i].out);
+	}
+	memset(slots, 0, sizeof(slots));
+	q_head = q_count = 0;
+	last_tick_ns = 0;
+	gap_watch = 0;
+}
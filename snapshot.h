@@ -0,0 +1,45 @@
+#pragma once
+#include <stdatomic.h>
+
+#define SNAPSHOT_BUFFERS 3              /* frames copied but not yet written; a request finding none free is dropped */
+
+/* What a pending request asks for, ORed together while requests coalesce */
+enum snapshot_kind {
+	SNAPSHOT_FRAME = 1,             /* the next frame at the preview format */
+	SNAPSHOT_STILL = 2,             /* one frame at the largest size, then back to the preview format */
+};
+
+struct snapshot_config {
+	const char *prefix;             /* files are <prefix>_<n>_<w>x<h>.<jpg or fourcc> */
+	unsigned int settle;            /* frames discarded after switching to the still size */
+	int raw;                        /* write YUYV/NV12 as captured instead of encoding JPEG */
+};
+
+struct snapshot_stats {
+	unsigned long long requested;
+	unsigned long long coalesced;   /* requests made while an earlier one was still pending */
+	unsigned long long copied;
+	unsigned long long written;
+	unsigned long long dropped;     /* no free buffer, or the still could not be taken */
+	unsigned long long failed;      /* copied but not written */
+	unsigned long long grab_ns, grab_max_ns;        /* request to the frame copied */
+	unsigned long long done_ns, done_max_ns;        /* request to the file written */
+	unsigned long long stills;
+	unsigned long long switches, switch_ns, switch_max_ns;  /* preview format stopped to restarted for a still */
+	unsigned long long gaps[2], gap_ns[2], gap_max_ns[2];  /* preview interval spanning a snapshot, a still */
+	unsigned long long intervals, interval_ns;      /* every other preview interval */
+};
+
+extern struct snapshot_config snapshot_config;
+extern struct snapshot_stats snapshot_stats;
+extern atomic_uint snapshot_pending;
+
+int snapshot_parse(const char *spec);
+void snapshot_request(enum snapshot_kind kind);
+void snapshot_install_signal(void);
+unsigned int snapshot_take(void);
+void snapshot_tick(void);
+int snapshot_frame(const void *frame, unsigned int bytesused, unsigned int width, unsigned int height,
+	unsigned int bytesperline, unsigned int fourcc, unsigned int sequence, enum snapshot_kind kind);
+void snapshot_switched(unsigned long long ns);
+void snapshot_finish(void);
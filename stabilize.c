@@ -0,0 +1,643 @@
+#include <math.h>
+#include <limits.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#include "header.h"
+#include "stabilize.h"
+#include "pyramid.h"
+#include "tilepool.h"
+#include "metrics.h"
+#include "trace.h"
+
+/*
+ * Video stabilization for a shaking mount. The global motion between consecutive frames is found by block
+ * matching on a small luma pyramid: 16x16 blocks searched at 1/8 of the frame, refined at 1/4 with a sub-pixel
+ * fit, and the median and a least squares roll over the blocks that agree. The summed motion is the camera
+ * path; frames are held back lookahead frames so the path around each one can be smoothed with the future in
+ * view, and the frame is warped by the difference, zoomed in by the crop so no border shows. The warp runs on
+ * the tile pool in bands of rows.
+ */
+
+#define STAB_LEVELS 3           /* searched at level 3 (1/8), refined at level 2 (1/4) */
+#define STAB_BLOCK 16
+#define STAB_GRID_X 8
+#define STAB_GRID_Y 6
+#define STAB_COARSE 4           /* search range at 1/8, +-32 pixels of the frame */
+#define STAB_FINE 2             /* refinement around the coarse match at 1/4 */
+#define STAB_BAND 16            /* output rows per tile pool item */
+
+struct stabilize_config stabilize_config = { 10, 8, 1 };
+struct stabilize_stats stabilize_stats;
+int stabilize_enabled;
+
+struct stab_motion {
+	double x, y, a;                 /* pixels of the frame and radians */
+};
+
+/* A block's motion at level 2 and its centre relative to the middle of the level */
+struct stab_vector {
+	double x, y, vx, vy;
+};
+
+struct stab_slot {
+	unsigned char *data;
+	unsigned int sequence;
+	unsigned long long taken_ns;
+};
+
+/* q = (a x + b y + e, c x + d y + f) maps an output sample to the source for one plane */
+struct stab_plane {
+	const unsigned char *src;
+	unsigned char *dst;
+	unsigned int pitch, step;       /* bytes per row, bytes between samples */
+	unsigned int width, height;     /* samples */
+	unsigned int row_shift;         /* plane rows are luma rows >> row_shift */
+	double a, b, c, d, e, f;
+};
+
+struct stab_warp {
+	struct stab_plane planes[3];
+	unsigned int n_planes, height;
+};
+
+static struct stab_slot slots[STABILIZE_MAX_LOOKAHEAD + 1];
+static struct stab_motion path[2 * STABILIZE_MAX_LOOKAHEAD + 1];
+static unsigned char *luma[2][STAB_LEVELS + 1];         /* per frame parity, level 0 unused */
+static unsigned int level_w[STAB_LEVELS + 1], level_h[STAB_LEVELS + 1];
+static unsigned char *out_frame;
+static unsigned int cur_width, cur_height, cur_fourcc, cur_pitch, frame_size;
+static unsigned long long frames_in, frames_out;
+static struct tile_future warp_done;
+static int unsupported_reported;
+
+/**
+Function Name : stabilize_parse
+Function Description : Parses the -V argument: "on", or comma separated crop=<percent>, lookahead=<frames>
+                       and norotate
+Parameter : option string
+Return : 0 for success -1 for a bad option
+**/
+int stabilize_parse(const char *spec)
+{
+	char *opts = strdup(spec), *item, *save;
+	int ret = 0;
+
+	stabilize_enabled = 1;
+	for (item = strtok_r(opts, ",", &save); item; item = strtok_r(NULL, ",", &save)) {
+		if (strcmp(item, "on") == 0)
+			continue;
+		else if (strncmp(item, "crop=", 5) == 0)
+			stabilize_config.crop = strtol(item + 5, NULL, 10);
+		else if (strncmp(item, "lookahead=", 10) == 0)
+			stabilize_config.lookahead = strtol(item + 10, NULL, 10);
+		else if (strcmp(item, "norotate") == 0)
+			stabilize_config.rotation = 0;
+		else {
+			fprintf(stderr, "Unknown stabilize option %s\n", item);
+			ret = -1;
+		}
+	}
+	free(opts);
+	if (stabilize_config.crop < 1 || stabilize_config.crop > 25) {
+		fprintf(stderr, "Stabilize crop must be 1 to 25 percent\n");
+		ret = -1;
+	}
+	if (stabilize_config.lookahead < 1 || stabilize_config.lookahead > STABILIZE_MAX_LOOKAHEAD) {
+		fprintf(stderr, "Stabilize lookahead must be 1 to %u frames\n", STABILIZE_MAX_LOOKAHEAD);
+		ret = -1;
+	}
+
+	return ret;
+}
+
+/**
+Function Name : stabilize_reset
+Function Description : Drops the held frames and the path and frees the buffers
+Parameter : void
+Return : void
+**/
+void stabilize_reset(void)
+{
+	unsigned int i, l;
+
+	for (i = 0; i <= STABILIZE_MAX_LOOKAHEAD; ++i) {
+		free(slots[i].data);
+		slots[i].data = NULL;
+	}
+	for (i = 0; i < 2; ++i)
+		for (l = 1; l <= STAB_LEVELS; ++l) {
+			free(luma[i][l]);
+			luma[i][l] = NULL;
+		}
+	free(out_frame);
+	out_frame = NULL;
+	cur_width = cur_height = cur_fourcc = cur_pitch = 0;
+	frames_in = frames_out = 0;
+}
+
+static int stab_setup(const struct frame_view *v)
+{
+	unsigned int i, l;
+
+	stabilize_reset();
+	if (v->width < 256 || v->height < 192) {
+		fprintf(stderr, "stabilize: %ux%u is too small to track\n", v->width, v->height);
+		return -1;
+	}
+	cur_width = v->width;
+	cur_height = v->height;
+	cur_fourcc = v->fourcc;
+	cur_pitch = v->pitch[0];
+	frame_size = v->size;
+	for (i = 0; i <= stabilize_config.lookahead; ++i)
+		if (!(slots[i].data = malloc(frame_size)))
+			return -1;
+	for (l = 1; l <= STAB_LEVELS; ++l) {
+		level_w[l] = (cur_width >> l) & ~1u;
+		level_h[l] = (cur_height >> l) & ~1u;
+		for (i = 0; i < 2; ++i)
+			if (!(luma[i][l] = malloc(level_w[l] * level_h[l])))
+				return -1;
+	}
+	if (!(out_frame = malloc(frame_size)))
+		return -1;
+
+	return 0;
+}
+
+/* Levels 1 to 3 of the frame's luma, each half the one before */
+static void stab_luma(const struct frame_view *v, unsigned char **l)
+{
+	const unsigned char *s0;
+	unsigned int i, y;
+
+	for (y = 0; y < level_h[1]; ++y) {
+		s0 = v->plane[0] + 2 * y * v->pitch[0];
+		if (v->fourcc == V4L2_PIX_FMT_YUYV)
+			pyramid_box_row_yuyv(l[1] + y * level_w[1], s0, s0 + v->pitch[0], level_w[1]);
+		else
+			pyramid_box_row(l[1] + y * level_w[1], s0, s0 + v->pitch[0], level_w[1]);
+	}
+	for (i = 2; i <= STAB_LEVELS; ++i)
+		for (y = 0; y < level_h[i]; ++y)
+			pyramid_box_row(l[i] + y * level_w[i], l[i - 1] + 2 * y * level_w[i - 1],
+				l[i - 1] + (2 * y + 1) * level_w[i - 1], level_w[i]);
+}
+
+/* Sum of absolute differences of two 16x16 blocks */
+static unsigned int sad16(const unsigned char *a, const unsigned char *b, unsigned int pitch)
+{
+	unsigned int y, sum = 0;
+
+#if defined(__SSE2__)
+	__m128i acc = _mm_setzero_si128();
+
+	for (y = 0; y < STAB_BLOCK; ++y, a += pitch, b += pitch)
+		acc = _mm_add_epi64(acc, _mm_sad_epu8(_mm_loadu_si128((const __m128i *)a),
+			_mm_loadu_si128((const __m128i *)b)));
+	sum = _mm_cvtsi128_si32(acc) + _mm_cvtsi128_si32(_mm_srli_si128(acc, 8));
+#elif defined(__ARM_NEON)
+	uint16x8_t acc = vdupq_n_u16(0);
+	uint8x16_t va, vb;
+	uint64x2_t s;
+
+	for (y = 0; y < STAB_BLOCK; ++y, a += pitch, b += pitch) {
+		va = vld1q_u8(a);
+		vb = vld1q_u8(b);
+		acc = vabal_u8(acc, vget_low_u8(va), vget_low_u8(vb));
+		acc = vabal_u8(acc, vget_high_u8(va), vget_high_u8(vb));
+	}
+	s = vpaddlq_u32(vpaddlq_u16(acc));
+	sum = vgetq_lane_u64(s, 0) + vgetq_lane_u64(s, 1);
+#else
+	unsigned int x;
+
+	for (y = 0; y < STAB_BLOCK; ++y, a += pitch, b += pitch)
+		for (x = 0; x < STAB_BLOCK; ++x)
+			sum += a[x] > b[x] ? a[x] - b[x] : b[x] - a[x];
+#endif
+
+	return sum;
+}
+
+/*
+ * SADs of the block at (x, y) of cur against prev moved by every (cx + dx, cy + dy) within range, the motion
+ * being where the block's content was in prev subtracted from where it is now. Out of frame candidates are
+ * UINT_MAX. Returns the index of the best.
+ */
+static int block_search(const unsigned char *cur, const unsigned char *prev, unsigned int w, unsigned int h, int x,
+	int y, int cx, int cy, int range, unsigned int *sads)
+{
+	int dx, dy, px, py, n = 2 * range + 1, best = -1;
+	unsigned int s, min = UINT_MAX;
+
+	for (dy = -range; dy <= range; ++dy)
+		for (dx = -range; dx <= range; ++dx) {
+			px = x - (cx + dx);
+			py = y - (cy + dy);
+			s = UINT_MAX;
+			if (px >= 0 && py >= 0 && px + STAB_BLOCK <= (int)w && py + STAB_BLOCK <= (int)h)
+				s = sad16(cur + y * w + x, prev + py * w + px, w);
+			sads[(dy + range) * n + dx + range] = s;
+			if (s < min) {
+				min = s;
+				best = (dy + range) * n + dx + range;
+			}
+		}
+
+	return best;
+}
+
+/* Vertex of the parabola through three SADs, 0 when they do not bend up enough to trust */
+static int sub_pixel(unsigned int l, unsigned int m, unsigned int r, double *offset)
+{
+	double bend = (double)l + r - 2.0 * m;
+
+	if (l == UINT_MAX || r == UINT_MAX || bend < STAB_BLOCK * STAB_BLOCK)
+		return 0;
+	*offset = ((double)l - r) / (2 * bend);
+
+	return 1;
+}
+
+/* Motion of every block of the grid that matched clearly, at level 2 */
+static unsigned int stab_blocks(unsigned char **prev, unsigned char **cur, struct stab_vector *vec)
+{
+	unsigned int w2 = level_w[2], h2 = level_h[2], w3 = level_w[3], h3 = level_h[3], gx, gy, n = 0;
+	unsigned int coarse[(2 * STAB_COARSE + 1) * (2 * STAB_COARSE + 1)], fine[(2 * STAB_FINE + 1) * (2 * STAB_FINE + 1)];
+	int margin = 2 * STAB_COARSE + STAB_FINE, x2, y2, x3, y3, b, mx, my, nf = 2 * STAB_FINE + 1;
+	double ox, oy;
+
+	for (gy = 0; gy < STAB_GRID_Y; ++gy)
+		for (gx = 0; gx < STAB_GRID_X; ++gx) {
+			x2 = margin + gx * (w2 - STAB_BLOCK - 2 * margin) / (STAB_GRID_X - 1);
+			y2 = margin + gy * (h2 - STAB_BLOCK - 2 * margin) / (STAB_GRID_Y - 1);
+			x3 = (x2 + STAB_BLOCK / 2) / 2 - STAB_BLOCK / 2;
+			y3 = (y2 + STAB_BLOCK / 2) / 2 - STAB_BLOCK / 2;
+			x3 = x3 < 0 ? 0 : x3 + STAB_BLOCK > (int)w3 ? (int)w3 - STAB_BLOCK : x3;
+			y3 = y3 < 0 ? 0 : y3 + STAB_BLOCK > (int)h3 ? (int)h3 - STAB_BLOCK : y3;
+
+			stabilize_stats.blocks++;
+			b = block_search(cur[3], prev[3], w3, h3, x3, y3, 0, 0, STAB_COARSE, coarse);
+			if (b < 0)
+				continue;
+			mx = 2 * (b % (2 * STAB_COARSE + 1) - STAB_COARSE);
+			my = 2 * (b / (2 * STAB_COARSE + 1) - STAB_COARSE);
+			b = block_search(cur[2], prev[2], w2, h2, x2, y2, mx, my, STAB_FINE, fine);
+			/* a best match on the edge of the window may lie beyond it */
+			if (b < 0 || b % nf == 0 || b % nf == nf - 1 || b / nf == 0 || b / nf == nf - 1)
+				continue;
+			if (!sub_pixel(fine[b - 1], fine[b], fine[b + 1], &ox) ||
+			    !sub_pixel(fine[b - nf], fine[b], fine[b + nf], &oy))
+				continue;
+			vec[n].x = x2 + STAB_BLOCK / 2 - w2 / 2.0;
+			vec[n].y = y2 + STAB_BLOCK / 2 - h2 / 2.0;
+			vec[n].vx = mx + b % nf - STAB_FINE + ox;
+			vec[n].vy = my + b / nf - STAB_FINE + oy;
+			n++;
+		}
+
+	return n;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* Shift of the median block, roll fitted to the blocks within a pixel and a half of it, then their mean shift */
+static int stab_global(const struct stab_vector *vec, unsigned int n, struct stab_motion *m)
+{
+	double xs[STAB_GRID_X * STAB_GRID_Y], ys[STAB_GRID_X * STAB_GRID_Y], tx, ty, num = 0, den = 0, sx = 0, sy = 0;
+	unsigned int i, inliers = 0;
+
+	if (n < 4)
+		return -1;
+	for (i = 0; i < n; ++i) {
+		xs[i] = vec[i].vx;
+		ys[i] = vec[i].vy;
+	}
+	qsort(xs, n, sizeof(xs[0]), cmp_double);
+	qsort(ys, n, sizeof(ys[0]), cmp_double);
+	tx = xs[n / 2];
+	ty = ys[n / 2];
+
+	m->a = 0;
+	for (i = 0; i < n; ++i)
+		if (fabs(vec[i].vx - tx) + fabs(vec[i].vy - ty) <= 1.5) {
+			num += vec[i].x * (vec[i].vy - ty) - vec[i].y * (vec[i].vx - tx);
+			den += vec[i].x * vec[i].x + vec[i].y * vec[i].y;
+			inliers++;
+		}
+	if (inliers < 4)
+		return -1;
+	if (stabilize_config.rotation && den > 0)
+		m->a = num / den;
+	/* v = t + a * (-y, x) */
+	for (i = 0; i < n; ++i)
+		if (fabs(vec[i].vx - tx) + fabs(vec[i].vy - ty) <= 1.5) {
+			sx += vec[i].vx + m->a * vec[i].y;
+			sy += vec[i].vy - m->a * vec[i].x;
+		}
+	m->x = sx / inliers * cur_width / level_w[2];
+	m->y = sy / inliers * cur_height / level_h[2];
+	stabilize_stats.inliers += inliers;
+
+	return inliers;
+}
+
+/* The path around frame m smoothed with a Gaussian over the lookahead either side, as far as it is known */
+static struct stab_motion stab_smoothed(unsigned long long m, unsigned long long last)
+{
+	struct stab_motion s = { 0, 0, 0 }, *p;
+	int k, l = stabilize_config.lookahead;
+	double sigma = l / 2.0 > 1 ? l / 2.0 : 1, w, sum = 0;
+
+	for (k = -l; k <= l; ++k) {
+		if ((long long)m + k < 0 || m + k > last)
+			continue;
+		p = &path[(m + k) % (2 * l + 1)];
+		w = exp(-k * k / (2 * sigma * sigma));
+		s.x += w * p->x;
+		s.y += w * p->y;
+		s.a += w * p->a;
+		sum += w;
+	}
+	s.x /= sum;
+	s.y /= sum;
+	s.a /= sum;
+
+	return s;
+}
+
+static double clampd(double v, double limit, int *clamped)
+{
+	if (v > limit || v < -limit) {
+		*clamped = 1;
+		return v > 0 ? limit : -limit;
+	}
+
+	return v;
+}
+
+/* Bilinear resampling of rows [y0, y1) of one plane, without bounds checks on rows that stay inside */
+static void warp_rows(const struct stab_plane *p, unsigned int y0, unsigned int y1)
+{
+	long long qx, qy, dqx = llround(p->a * 65536), dqy = llround(p->c * 65536), ex, ey;
+	long long max_x = ((long long)p->width - 1) << 16, max_y = ((long long)p->height - 1) << 16;
+	const unsigned char *r0, *r1;
+	unsigned char *dst;
+	unsigned int x, y, ix, iy, fx, fy, top, bottom, step = p->step;
+
+	for (y = y0; y < y1; ++y) {
+		qx = llround((p->b * y + p->e) * 65536);
+		qy = llround((p->d * y + p->f) * 65536);
+		ex = qx + dqx * (p->width - 1);
+		ey = qy + dqy * (p->width - 1);
+		dst = p->dst + (size_t)y * p->pitch;
+		if (qx >= 0 && ex >= 0 && qx < max_x && ex < max_x && qy >= 0 && ey >= 0 && qy < max_y && ey < max_y) {
+			for (x = 0; x < p->width; ++x, qx += dqx, qy += dqy, dst += step) {
+				ix = qx >> 16;
+				iy = qy >> 16;
+				fx = (qx >> 8) & 255;
+				fy = (qy >> 8) & 255;
+				r0 = p->src + (size_t)iy * p->pitch + ix * step;
+				r1 = r0 + p->pitch;
+				top = r0[0] * (256 - fx) + r0[step] * fx;
+				bottom = r1[0] * (256 - fx) + r1[step] * fx;
+				*dst = (top * (256 - fy) + bottom * fy + 32768) >> 16;
+			}
+			continue;
+		}
+		for (x = 0; x < p->width; ++x, qx += dqx, qy += dqy, dst += step) {
+			ex = qx < 0 ? 0 : qx >= max_x ? max_x - 1 : qx;
+			ey = qy < 0 ? 0 : qy >= max_y ? max_y - 1 : qy;
+			ix = ex >> 16;
+			iy = ey >> 16;
+			fx = (ex >> 8) & 255;
+			fy = (ey >> 8) & 255;
+			r0 = p->src + (size_t)iy * p->pitch + ix * step;
+			r1 = r0 + p->pitch;
+			top = r0[0] * (256 - fx) + r0[step] * fx;
+			bottom = r1[0] * (256 - fx) + r1[step] * fx;
+			*dst = (top * (256 - fy) + bottom * fy + 32768) >> 16;
+		}
+	}
+}
+
+static void warp_band(void *arg, unsigned int item, unsigned int worker)
+{
+	struct stab_warp *w = arg;
+	const struct stab_plane *p;
+	unsigned int y0 = item * STAB_BAND, y1 = y0 + STAB_BAND < w->height ? y0 + STAB_BAND : w->height, i;
+
+	(void)worker;
+	for (i = 0; i < w->n_planes; ++i) {
+		p = &w->planes[i];
+		warp_rows(p, y0 >> p->row_shift, y1 >> p->row_shift);
+	}
+}
+
+/*
+ * One plane sampled at (sx, sy) luma pixels per sample: the luma transform q = A p + t seen from that grid is
+ * S^-1 A S, S^-1 t with S = diag(sx, sy)
+ */
+static void plane_setup(struct stab_plane *p, const unsigned char *src, unsigned char *dst, unsigned int pitch,
+	unsigned int step, unsigned int sx, unsigned int sy, const double *m)
+{
+	p->src = src;
+	p->dst = dst;
+	p->pitch = pitch;
+	p->step = step;
+	p->width = cur_width / sx;
+	p->height = cur_height / sy;
+	p->row_shift = sy == 2;
+	p->a = m[0];
+	p->b = m[1] * sy / sx;
+	p->c = m[2] * sx / sy;
+	p->d = m[3];
+	p->e = m[4] / sx;
+	p->f = m[5] / sy;
+}
+
+/* Warps held frame m by its correction into out_frame */
+static int stab_emit(unsigned long long last, struct frame_view *out)
+{
+	struct stab_slot *slot = &slots[frames_out % (stabilize_config.lookahead + 1)];
+	struct stab_motion s = stab_smoothed(frames_out, last), *t = &path[frames_out % (2 * stabilize_config.lookahead + 1)];
+	double zoom = 1 - 2 * stabilize_config.crop / 100.0, mx = cur_width * stabilize_config.crop / 100.0;
+	double my = cur_height * stabilize_config.crop / 100.0, cx = cur_width / 2.0, cy = cur_height / 2.0;
+	double ca, sa, m[6], x, y, a, a_max;
+	unsigned int y_step = cur_fourcc == V4L2_PIX_FMT_YUYV ? 2 : 1;
+	struct frame_view src;
+	struct stab_warp w;
+	unsigned long long t0 = metric_now_ns(), ns;
+	int clamped = 0;
+
+	/*
+	 * The frame shows the scene moved by its path t, it is shown as if moved by the smoothed path s. Roll uses
+	 * up the margin first, the shift gets what is left.
+	 */
+	a_max = 0.5 * fmin(mx / cy, my / cx);
+	a = clampd(s.a - t->a, a_max, &clamped);
+	x = clampd(s.x - t->x, mx - fabs(a) * cy * zoom, &clamped);
+	y = clampd(s.y - t->y, my - fabs(a) * cx * zoom, &clamped);
+	stabilize_stats.clamped += clamped;
+	stabilize_stats.last_x = x;
+	stabilize_stats.last_y = y;
+	stabilize_stats.last_a = a;
+
+	/* source = c + zoom R(-a) (p - c) - (x, y) */
+	ca = cos(a) * zoom;
+	sa = sin(a) * zoom;
+	m[0] = ca;
+	m[1] = sa;
+	m[2] = -sa;
+	m[3] = ca;
+	m[4] = cx - ca * cx - sa * cy - x;
+	m[5] = cy + sa * cx - ca * cy - y;
+
+	frame_view_init(&src, slot->data, frame_size, slot->sequence, cur_width, cur_height, cur_fourcc, cur_pitch);
+	frame_view_init(out, out_frame, frame_size, slot->sequence, cur_width, cur_height, cur_fourcc, cur_pitch);
+	memset(&w, 0, sizeof(w));
+	w.height = cur_height;
+	plane_setup(&w.planes[w.n_planes++], src.plane[0], out_frame, src.pitch[0], y_step, 1, 1, m);
+	if (cur_fourcc == V4L2_PIX_FMT_YUYV) {
+		plane_setup(&w.planes[w.n_planes++], src.plane[0] + 1, out_frame + 1, src.pitch[0], 4, 2, 1, m);
+		plane_setup(&w.planes[w.n_planes++], src.plane[0] + 3, out_frame + 3, src.pitch[0], 4, 2, 1, m);
+	} else if (cur_fourcc == V4L2_PIX_FMT_NV12) {
+		plane_setup(&w.planes[w.n_planes++], src.plane[1], (unsigned char *)out->plane[1], src.pitch[1], 2, 2, 2,
+			m);
+		plane_setup(&w.planes[w.n_planes++], src.plane[1] + 1, (unsigned char *)out->plane[1] + 1, src.pitch[1], 2,
+			2, 2, m);
+	}
+	TRACE_BEGIN(tw);
+	tile_for(&warp_done, warp_band, &w, (cur_height + STAB_BAND - 1) / STAB_BAND);
+	tile_wait(&warp_done);
+	TRACE_END(tw, "stabilize warp");
+
+	ns = metric_now_ns();
+	stabilize_stats.warp_ns += ns - t0;
+	ns -= slot->taken_ns;
+	stabilize_stats.latency_ns += ns;
+	if (ns > stabilize_stats.latency_max_ns)
+		stabilize_stats.latency_max_ns = ns;
+	stabilize_stats.shown++;
+	frames_out++;
+
+	return 1;
+}
+
+/**
+Function Name : stabilize_frame
+Function Description : Takes a YUYV, NV12 or GREY frame in, measures its motion against the one before and,
+                       once lookahead frames are held, hands back the oldest one stabilized
+Parameter : the captured frame, where to describe the stabilized one
+Return : 1 when out holds a frame, 0 when nothing is due yet, -1 for a format that is passed through as is
+**/
+int stabilize_frame(const struct frame_view *in, struct frame_view *out)
+{
+	unsigned int l = stabilize_config.lookahead, n;
+	struct stab_vector vec[STAB_GRID_X * STAB_GRID_Y];
+	struct stab_motion m = { 0, 0, 0 }, *prev, *t;
+	struct stab_slot *slot;
+	unsigned long long t0 = metric_now_ns(), t1;
+
+	if (in->fourcc != V4L2_PIX_FMT_YUYV && in->fourcc != V4L2_PIX_FMT_NV12 && in->fourcc != V4L2_PIX_FMT_GREY) {
+		if (!unsupported_reported++)
+			fprintf(stderr, "stabilize: only YUYV, NV12 and GREY frames are stabilized\n");
+		return -1;
+	}
+	if (in->width != cur_width || in->height != cur_height || in->fourcc != cur_fourcc || in->pitch[0] != cur_pitch)
+		if (stab_setup(in) != 0) {
+			stabilize_reset();
+			return -1;
+		}
+	if (!frame_view_complete(in))
+		return 0;
+
+	slot = &slots[frames_in % (l + 1)];
+	memcpy(slot->data, in->plane[0], frame_size);
+	slot->sequence = in->sequence;
+	slot->taken_ns = t0;
+	t1 = metric_now_ns();
+	stabilize_stats.copy_ns += t1 - t0;
+
+	TRACE_BEGIN(te);
+	stab_luma(in, luma[frames_in & 1]);
+	if (frames_in) {
+		n = stab_blocks(luma[(frames_in - 1) & 1], luma[frames_in & 1], vec);
+		if (stab_global(vec, n, &m) < 0) {
+			stabilize_stats.lost++;
+			m.x = m.y = m.a = 0;
+		}
+	}
+	t = &path[frames_in % (2 * l + 1)];
+	if (frames_in) {
+		prev = &path[(frames_in - 1) % (2 * l + 1)];
+		t->x = prev->x + m.x;
+		t->y = prev->y + m.y;
+		t->a = prev->a + m.a;
+	} else
+		t->x = t->y = t->a = 0;
+	stabilize_stats.motion_px += hypot(m.x, m.y);
+	stabilize_stats.motion_rad += fabs(m.a);
+	stabilize_stats.frames++;
+	frames_in++;
+	stabilize_stats.estimate_ns += metric_now_ns() - t1;
+	TRACE_END(te, "stabilize estimate");
+
+	if (frames_in <= l)
+		return 0;
+
+	return stab_emit(frames_in - 1, out);
+}
+
+/**
+Function Name : stabilize_flush
+Function Description : Hands back the next frame still held at the end of a recording, smoothed with the
+                       path as far as it goes
+Parameter : where to describe the stabilized frame
+Return : 1 when out holds a frame, 0 when none is left
+**/
+int stabilize_flush(struct frame_view *out)
+{
+	if (frames_out >= frames_in)
+		return 0;
+
+	return stab_emit(frames_in - 1, out);
+}
+
+/**
+Function Name : stabilize_finish
+Function Description : Prints the cost per frame, the latency added and how much motion there was, then frees
+                       the buffers
+Parameter : void
+Return : void
+**/
+void stabilize_finish(void)
+{
+	struct stabilize_stats *st = &stabilize_stats;
+
+	if (st->frames) {
+		printf("Stabilize: %llu frames in %llu out, lookahead %u, crop %u%%: %.2f ms copy %.2f ms estimate "
+			"per frame, %.2f ms warp per frame out on %u threads\n", st->frames, st->shown,
+			stabilize_config.lookahead, stabilize_config.crop, st->copy_ns / 1e6 / st->frames,
+			st->estimate_ns / 1e6 / st->frames, st->shown ? st->warp_ns / 1e6 / st->shown : 0.0,
+			tile_pool_threads());
+		if (st->shown)
+			printf("\tLatency : %.1f ms avg %.1f ms max from taken in to handed back\n",
+				st->latency_ns / 1e6 / st->shown, st->latency_max_ns / 1e6);
+		printf("\tMotion : %.2f px %.3f deg per frame, %.0f%% of blocks agreeing, %llu frames lost, %llu "
+			"corrections clamped\n", st->motion_px / st->frames, st->motion_rad * 180 / M_PI / st->frames,
+			st->blocks ? 100.0 * st->inliers / st->blocks : 0.0, st->lost, st->clamped);
+	}
+	stabilize_reset();
+	unsupported_reported = 0;
+}
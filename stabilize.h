@@ -0,0 +1,32 @@
+#pragma once
+#include "frameview.h"
+
+#define STABILIZE_MAX_LOOKAHEAD 30
+
+struct stabilize_config {
+	unsigned int crop;              /* percent of each edge given up to the correction */
+	unsigned int lookahead;         /* frames held back so the path is smoothed with the future in view */
+	int rotation;                   /* correct roll as well as shift */
+};
+
+struct stabilize_stats {
+	unsigned long long frames;              /* taken in */
+	unsigned long long shown;               /* handed back stabilized */
+	unsigned long long lost;                /* too few blocks agreed on a motion, taken as still */
+	unsigned long long clamped;             /* correction cut to what the crop allows */
+	unsigned long long blocks, inliers;
+	unsigned long long copy_ns, estimate_ns, warp_ns;
+	unsigned long long latency_ns, latency_max_ns;  /* frame taken in to handed back */
+	double motion_px, motion_rad;           /* sum of the estimated frame to frame motion */
+	double last_x, last_y, last_a;          /* correction applied to the last frame handed back */
+};
+
+extern struct stabilize_config stabilize_config;
+extern struct stabilize_stats stabilize_stats;
+extern int stabilize_enabled;
+
+int stabilize_parse(const char *spec);
+int stabilize_frame(const struct frame_view *in, struct frame_view *out);
+int stabilize_flush(struct frame_view *out);
+void stabilize_reset(void);
+void stabilize_finish(void);
@@ -1,4 +1,94 @@
 #include "stream.h"
+#include "capture.h"
+#include "trace.h"
+#include "rt.h"
+#include "framecheck.h"
+#include "policy.h"
+#include "hotplug.h"
+#include "texfill.h"
+#include "isp.h"
+#include "snapshot.h"
+#include "pyramid.h"
+#include "stabilize.h"
+#include "autofocus.h"
+#include "hdr.h"
+#include "denoise.h"
+
+#define STREAM_TEXTURES 3               /* locked in turn, so the one being written is not the one last drawn */
+
+static SDL_Texture *textures[STREAM_TEXTURES];
+static unsigned int tex_next, tex_fourcc;
+static unsigned int tex_width, tex_height;   /* the frame size may change under the policy, the window does not */
+
+static const Uint32 tex_formats[] = {
+	[TEXFILL_YUY2] = SDL_PIXELFORMAT_YUY2,
+	[TEXFILL_NV12] = SDL_PIXELFORMAT_NV12,
+	[TEXFILL_RGB24] = SDL_PIXELFORMAT_RGB24,
+};
+
+/* (Re)creates the texture ring for the negotiated size and format */
+static int create_textures(void)
+{
+	int layout = texfill_layout(pix_format);
+	unsigned int i;
+
+	for (i = 0; i < STREAM_TEXTURES; ++i) {
+		if (textures[i])
+			SDL_DestroyTexture(textures[i]);
+		textures[i] = NULL;
+	}
+	if (layout < 0) {
+		fprintf(stderr, "SDL: cannot display %s frames\n", pix_format_str);
+		return -1;
+	}
+	for (i = 0; i < STREAM_TEXTURES; ++i) {
+		textures[i] = SDL_CreateTexture(sdlRenderer, tex_formats[layout], SDL_TEXTUREACCESS_STREAMING, width, height);
+		if (!textures[i]) {
+			fprintf(stderr, "SDL_CreateTexture Error %s\n", SDL_GetError());
+			return -1;
+		}
+	}
+	tex_width = width;
+	tex_height = height;
+	tex_fourcc = pix_format;
+	tex_next = 0;
+
+	return 0;
+}
+
+/* The next texture of the ring, locked; the conversion or decode writes straight into it, nothing is staged */
+static void *texture_lock(int *pitch)
+{
+	void *pixels;
+
+	if(width != tex_width || height != tex_height || pix_format != tex_fourcc)
+		if(create_textures() != 0)
+			return NULL;
+	sdlTexture = textures[tex_next++ % STREAM_TEXTURES];
+	if(SDL_LockTexture(sdlTexture, NULL, &pixels, pitch) != 0)
+	{
+		fprintf(stderr, "SDL_LockTexture Error %s\n", SDL_GetError());
+		return NULL;
+	}
+
+	return pixels;
+}
+
+static void texture_present(int written)
+{
+	SDL_UnlockTexture(sdlTexture);
+	if(written < 0)
+		return;         /* keep showing the previous frame */
+	TRACE_BEGIN(t_copy);
+	SDL_RenderClear(sdlRenderer);
+	SDL_RenderCopy(sdlRenderer, sdlTexture, NULL, &sdlRect);
+	TRACE_END(t_copy, "SDL_RenderCopy");
+	TRACE_BEGIN(t_present);
+	SDL_RenderPresent(sdlRenderer);
+	TRACE_END(t_present, "SDL_RenderPresent");
+}
+
+static const struct render_target sdl_target = { texture_lock, texture_present };
 
 void *v4l2_streaming() {
 	// SDL2 begins
@@ -24,40 +114,39 @@ void *v4l2_streaming() {
 	fprintf(stderr, "SDL_CreateRenderer Error\n");
 	return NULL;
 	}
-	sdlTexture =
-	  SDL_CreateTexture(sdlRenderer, SDL_PIXELFORMAT_YUY2,
-		                SDL_TEXTUREACCESS_STREAMING, width, height);
+	if (create_textures() != 0)
+		return NULL;
 	sdlRect.w = width;
 	sdlRect.h = height;
+	render_target = &sdl_target;
 	
-	gettimeofday(&start_time, NULL);
-	while (!thread_exit_sig) 
-	{
-		read_frame();
-		
-		gettimeofday(&end_time, NULL);
+	TRACE_THREAD("capture+render");
+	rt_apply(RT_CAPTURE);
+	capture_policy_init();
 
-		elapsed_time = (end_time.tv_sec - start_time.tv_sec) * 1000.0;      // sec to ms
-		elapsed_time += (end_time.tv_usec - start_time.tv_usec) / 1000.0;   // us to ms
+	const struct v4l2cap_stats *stats = v4l2cap_get_stats(capture_ctx);
+	struct timespec loop_start, loop_end;
 
-		printf("\r%.2lf - %.1lf", elapsed_time, 1000/elapsed_time);
-		fflush(stdout);
-		start_time = end_time;
+	v4l2cap_reset_stats(capture_ctx);
+	/* as in mainloop, nothing is printed per frame; the rate is reported once the window closes */
+	clock_gettime(CLOCK_MONOTONIC, &loop_start);
+	while (!thread_exit_sig) 
+	{
+		if (read_frame() < 0)
+			break;
 	}
+	clock_gettime(CLOCK_MONOTONIC, &loop_end);
+
+	elapsed_time = (loop_end.tv_sec - loop_start.tv_sec) * 1000.0;      // sec to ms
+	elapsed_time += (loop_end.tv_nsec - loop_start.tv_nsec) / 1000000.0;   // ns to ms
+	printf("%llu frames shown in %.2lf ms - %.1lf fps, %llu corrupted frames requeued (longest run %u)\n",
+		stats->frames, elapsed_time, stats->frames * 1000 / elapsed_time,
+		stats->errors, stats->longest_error_run);
 	
 	return NULL;
 	
 }
 
-void frame_handler(void *pframe, int length) 
-{
-	SDL_UpdateTexture(sdlTexture, &sdlRect, pframe, width * 2);
-	//  SDL_UpdateYUVTexture
-	SDL_RenderClear(sdlRenderer);
-	SDL_RenderCopy(sdlRenderer, sdlTexture, NULL, &sdlRect);
-	SDL_RenderPresent(sdlRenderer);
-}
-
 
 void mainstreamloop()
 {
@@ -69,8 +158,10 @@ void mainstreamloop()
 
 	int quit = 0;
 	SDL_Event e;
+	TRACE_THREAD("events");
 	while (!quit) 
 	{
+		trace_poll();
 		while (SDL_PollEvent(&e)) 
 		{
 			if (e.type == SDL_QUIT) { // click close icon then quit
@@ -80,6 +171,10 @@ void mainstreamloop()
 		{
 			if (e.key.keysym.sym == SDLK_ESCAPE) // press ESC the quit
 				quit = 1;
+			else if (e.key.keysym.sym == SDLK_SPACE) // snapshot of the next frame
+				snapshot_request(SNAPSHOT_FRAME);
+			else if (e.key.keysym.sym == SDLK_s) // still at the largest size
+				snapshot_request(SNAPSHOT_STILL);
 		}
 	}
 	usleep(25);
@@ -87,5 +182,16 @@ void mainstreamloop()
 
 	thread_exit_sig = 1;               // exit thread_stream
 	pthread_join(thread_stream, NULL); // wait for thread_stream exiting
+	policy_finish();
+	hotplug_finish();
+	texfill_finish();
+	isp_finish();
+	framecheck_finish();
+	snapshot_finish();
+	pyramid_finish();
+	stabilize_finish();
+	autofocus_finish();
+	hdr_finish();
+	denoise_finish();
 	SDL_Quit();
 }
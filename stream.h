@@ -2,11 +2,11 @@
 #include <SDL2/SDL.h>
 #include <pthread.h>
 
-void frame_handler(void *pframe, int length);
 void *v4l2_streaming();
 void mainstreamloop();
 
 extern int read_frame();
+extern void capture_policy_init(void);
 extern int fd;
 extern char *dev_path, *outfile, *pix_format_str;
 extern enum io_method io;
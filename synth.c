@@ -0,0 +1,228 @@
+#include <stdlib.h>
+#include <string.h>
+#include <linux/videodev2.h>
+
+#include "synth.h"
+
+/* Cheap deterministic sensor-like noise so compressors and filters see realistic content */
+static unsigned int synth_noise(unsigned int *state)
+{
+	unsigned int x = *state;
+
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	*state = x;
+
+	return x;
+}
+
+/* Moving gradient plus a bright square that moves one pixel per frame, so frames have edges and motion */
+static void synth_columns(short *col, short *square, unsigned int width, unsigned int frame_no)
+{
+	unsigned int x, pos;
+
+	for (x = 0; x < width; ++x) {
+		pos = (x + frame_no) % width;
+		col[x] = 32 + ((x + 2 * frame_no) % width) * 160 / width;
+		square[x] = pos > width / 3 && pos < width / 2 ? 40 : 0;
+	}
+}
+
+static inline unsigned char synth_luma(const short *col, const short *square, unsigned int x, int row_base,
+	int in_square, unsigned int *seed, unsigned int noise)
+{
+	int v = col[x] + row_base + (in_square ? square[x] : 0) + (int)(synth_noise(seed) & noise) - (int)noise / 2;
+
+	return v < 0 ? 0 : v > 255 ? 255 : v;
+}
+
+/**
+Function Name : synth_frame_size
+Function Description : Size in bytes of one synthetic frame
+Parameter : width, height and fourcc
+Return : frame size, 0 for unsupported formats
+**/
+unsigned int synth_frame_size(unsigned int width, unsigned int height, unsigned int fourcc)
+{
+	switch (fourcc) {
+	case V4L2_PIX_FMT_YUYV:
+		return width * height * 2;
+	case V4L2_PIX_FMT_NV12:
+	case V4L2_PIX_FMT_YUV420:
+		return width * height * 3 / 2;
+	case V4L2_PIX_FMT_GREY:
+		return width * height;
+	}
+
+	return 0;
+}
+
+/* The pattern of frame_no with luma noise of noise + 1 levels, 7 or 0 */
+static void synth_render(unsigned char *buf, unsigned int width, unsigned int height, unsigned int fourcc,
+	unsigned int frame_no, unsigned int noise)
+{
+	unsigned int x, y, seed = 0x9e3779b9u ^ (frame_no * 2654435761u);
+	unsigned char *p = buf;
+	short *col = malloc(width * 2 * sizeof(short)), *square = col + width;
+	int row_base, in_square;
+
+	synth_columns(col, square, width, frame_no);
+
+	switch (fourcc) {
+	case V4L2_PIX_FMT_YUYV:
+		for (y = 0; y < height; ++y) {
+			row_base = y * 40 / height;
+			in_square = y > height / 3 && y < height * 2 / 3;
+			for (x = 0; x < width; x += 2) {
+				*p++ = synth_luma(col, square, x, row_base, in_square, &seed, noise);
+				*p++ = 128 + x * 32 / width;
+				*p++ = synth_luma(col, square, x + 1, row_base, in_square, &seed, noise);
+				*p++ = 112 + y * 32 / height;
+			}
+		}
+		break;
+	case V4L2_PIX_FMT_NV12:
+	case V4L2_PIX_FMT_YUV420:
+	case V4L2_PIX_FMT_GREY:
+		for (y = 0; y < height; ++y) {
+			row_base = y * 40 / height;
+			in_square = y > height / 3 && y < height * 2 / 3;
+			for (x = 0; x < width; ++x)
+				*p++ = synth_luma(col, square, x, row_base, in_square, &seed, noise);
+		}
+		if (fourcc == V4L2_PIX_FMT_GREY)
+			break;
+		for (y = 0; y < height / 2; ++y)
+			for (x = 0; x < width / 2; ++x) {
+				unsigned char u = 128 + x * 64 / width, v = 112 + y * 64 / height;
+
+				if (fourcc == V4L2_PIX_FMT_NV12) {
+					*p++ = u;
+					*p++ = v;
+				} else {
+					buf[width * height + y * (width / 2) + x] = u;
+					buf[width * height * 5 / 4 + y * (width / 2) + x] = v;
+				}
+			}
+		break;
+	default:
+		memset(buf, 0, synth_frame_size(width, height, fourcc));
+		break;
+	}
+	free(col);
+}
+
+/**
+Function Name : synth_fill_frame
+Function Description : Renders a moving gradient test pattern with noise in the requested format
+Parameter : destination, width, height, fourcc and frame number
+Return : void
+**/
+void synth_fill_frame(unsigned char *buf, unsigned int width, unsigned int height, unsigned int fourcc, unsigned int frame_no)
+{
+	synth_render(buf, width, height, fourcc, frame_no, 7);
+}
+
+/**
+Function Name : synth_fill_clean
+Function Description : Renders the test pattern of synth_fill_frame() without its noise, the truth a
+                       denoiser is measured against
+Parameter : destination, width, height, fourcc and frame number
+Return : void
+**/
+void synth_fill_clean(unsigned char *buf, unsigned int width, unsigned int height, unsigned int fourcc, unsigned int frame_no)
+{
+	synth_render(buf, width, height, fourcc, frame_no, 0);
+}
+
+/**
+Function Name : synth_grain
+Function Description : Adds the noise of a sensor in low light to every sample, luma and chroma: near
+                       gaussian, the sum of four uniform bytes scaled to sigma levels, new on every call
+Parameter : frame, width, height, fourcc, sigma in levels and a seed, e.g. the frame number
+Return : void
+**/
+void synth_grain(unsigned char *buf, unsigned int width, unsigned int height, unsigned int fourcc, unsigned int sigma,
+	unsigned int seed)
+{
+	unsigned int i, n = synth_frame_size(width, height, fourcc), r, state = 0x2545f491u ^ (seed * 2654435761u);
+	int v;
+
+	if (!state)
+		state = 1;
+	for (i = 0; i < n; ++i) {
+		r = synth_noise(&state);
+		/* four bytes sum to 510 +- 147.8, 443 / 65536 of that is sigma 1 */
+		v = (int)((r & 0xff) + (r >> 8 & 0xff) + (r >> 16 & 0xff) + (r >> 24)) - 510;
+		v = buf[i] + v * (int)sigma * 443 / 65536;
+		buf[i] = v < 0 ? 0 : v > 255 ? 255 : v;
+	}
+}
+
+/**
+Function Name : synth_expose
+Function Description : Turns the rendered luma into what a sensor sees of a scene with a wide dynamic range:
+                       each level is a radiance 2^((level - 128) / 20), about 12 stops over the pattern, and
+                       exposure 1 puts level 128 at 64, so highlights clip and shadows sink into the bottom codes
+Parameter : frame, width, height, fourcc and exposure relative to the default
+Return : void
+**/
+void synth_expose(unsigned char *buf, unsigned int width, unsigned int height, unsigned int fourcc, double exposure)
+{
+	static double lut_exposure;
+	static unsigned char lut[256];
+	unsigned int i, n = width * height, step = 1;
+	double v;
+
+	if (fourcc == V4L2_PIX_FMT_YUYV)
+		step = 2;
+	else if (fourcc != V4L2_PIX_FMT_NV12 && fourcc != V4L2_PIX_FMT_YUV420 && fourcc != V4L2_PIX_FMT_GREY)
+		return;
+	if (exposure != lut_exposure) {
+		/* 2^(1/20) a level up from 64 * 2^-6.4 at level 0, without libm in the library */
+		for (i = 0, v = 64 * 0.0118415 * exposure; i < 256; ++i, v *= 1.0352649238)
+			lut[i] = v > 255 ? 255 : (unsigned char)(v + 0.5);
+		lut_exposure = exposure;
+	}
+	for (i = 0; i < n; ++i)
+		buf[i * step] = lut[buf[i * step]];
+}
+
+/* Box filter of 2 * radius + 1 samples along a line, edges repeated */
+static void synth_box(const unsigned char *src, unsigned int src_step, unsigned char *dst, unsigned int dst_step,
+	unsigned int n, unsigned int radius)
+{
+	unsigned int x, taps = 2 * radius + 1, sum = 0;
+	int k;
+
+	for (k = -(int)radius; k <= (int)radius; ++k)
+		sum += src[(k < 0 ? 0 : k >= (int)n ? n - 1 : (unsigned int)k) * src_step];
+	for (x = 0; x < n; ++x) {
+		dst[x * dst_step] = (sum + taps / 2) / taps;
+		sum += src[(x + radius + 1 < n ? x + radius + 1 : n - 1) * src_step];
+		sum -= src[(x >= radius ? x - radius : 0) * src_step];
+	}
+}
+
+/**
+Function Name : synth_defocus
+Function Description : Blurs the luma of a rendered frame the way an out of focus lens would, with a box of
+                       2 * radius + 1 pixels across and down; chroma is left as it is
+Parameter : frame, width, height, fourcc and blur radius in pixels, 0 for sharp
+Return : void
+**/
+void synth_defocus(unsigned char *buf, unsigned int width, unsigned int height, unsigned int fourcc, unsigned int radius)
+{
+	unsigned int x, y, step = fourcc == V4L2_PIX_FMT_YUYV ? 2 : 1;
+	unsigned char *tmp;
+
+	if (!radius || (fourcc != V4L2_PIX_FMT_YUYV && fourcc != V4L2_PIX_FMT_NV12 && fourcc != V4L2_PIX_FMT_YUV420 &&
+	    fourcc != V4L2_PIX_FMT_GREY) || !(tmp = malloc(width * height)))
+		return;
+	for (y = 0; y < height; ++y)
+		synth_box(buf + y * width * step, step, tmp + y * width, 1, width, radius);
+	for (x = 0; x < width; ++x)
+		synth_box(tmp + x, width, buf + x * step, width * step, height, radius);
+	free(tmp);
+}
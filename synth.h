@@ -0,0 +1,25 @@
+#pragma once
+
+unsigned int synth_frame_size(unsigned int width, unsigned int height, unsigned int fourcc);
+void synth_fill_frame(unsigned char *buf, unsigned int width, unsigned int height, unsigned int fourcc, unsigned int frame_no);
+void synth_fill_clean(unsigned char *buf, unsigned int width, unsigned int height, unsigned int fourcc, unsigned int frame_no);
+void synth_grain(unsigned char *buf, unsigned int width, unsigned int height, unsigned int fourcc, unsigned int sigma,
+	unsigned int seed);
+void synth_expose(unsigned char *buf, unsigned int width, unsigned int height, unsigned int fourcc, double exposure);
+void synth_defocus(unsigned char *buf, unsigned int width, unsigned int height, unsigned int fourcc, unsigned int radius);
+
+struct dev_ops;
+
+/* Counters kept by the synthetic device, one per ioctl the capture path issues */
+struct synth_stats {
+	unsigned long long ioctls;
+	unsigned long long dqbuf;
+	unsigned long long qbuf;
+	unsigned long long reads;
+	unsigned long long overruns;    /* frames lost because every buffer was full when they were due */
+	unsigned long long unplugs;     /* times the device vanished (unplug=N) */
+};
+
+extern struct synth_stats synth_stats;
+
+int synth_dev_open(const char *path, const struct dev_ops **ops);
@@ -0,0 +1,684 @@
+#include "header.h"
+#include "v4l2capture.h"
+#include "synth.h"
+
+/*
+ * In-process stand-in for a V4L2 capture node, selected with -d synth[:options].
+ * Options: fps=N (0 = unpaced), error=N (flag every Nth buffer with V4L2_BUF_FLAG_ERROR),
+ * drop=N (skip a sequence number every Nth frame), static (render each buffer only once),
+ * freeze=N (from frame N on, every frame repeats frame N's image), short=N (every Nth frame has half its bytesused),
+ * unplug=N (the device vanishes at frame N: ENODEV on the open descriptor, ENOENT on open for replug=MS
+ * milliseconds, default 200; options apply again after each reopen, so it unplugs every N frames),
+ * focus=N (a lens with an absolute focus control, 0 to 250 in steps of 5, sharp at N and blurred one pixel
+ * further per step away; it starts at 0 under a hardware autofocus that has to be switched off to move it),
+ * lens=N (frames a focus change takes to show, default 2), hdr (a scene of about 12 stops behind exposure
+ * and gain controls, under auto exposure until set to manual), lag=N (frames an exposure or gain change takes
+ * to show, default 2), noise=N (low light: noise of sigma N levels on every sample, new each frame).
+ */
+
+#define SYNTH_MAX_BUFFERS 32
+#define SYNTH_PAGE 4096u
+#define SYNTH_FOCUS_MAX 250
+#define SYNTH_FOCUS_STEP 5
+#define SYNTH_EXPOSURE_DEFAULT 156
+#define SYNTH_GAIN_DEFAULT 64
+#define SYNTH_MAX_PENDING 16
+
+struct synth_buffer {
+	void *mem;                      /* MMAP backing store */
+	unsigned long userptr;          /* USERPTR memory handed in by QBUF */
+	unsigned int length;
+	unsigned int shown;             /* frame number whose image the buffer holds, 0 for none */
+};
+
+static struct {
+	unsigned int fps, error_every, drop_every, render, freeze_at, short_every, unplug_at, replug_ms;
+	int gone;
+	struct v4l2_pix_format pix;
+	unsigned int memory, n_buffers, streaming;
+	struct synth_buffer bufs[SYNTH_MAX_BUFFERS];
+	unsigned int queue[SYNTH_MAX_BUFFERS], q_head, q_count;
+	unsigned int sequence, frames;
+	struct timespec next;
+	int focus, focus_at, focus_pos, focus_target, focus_auto;
+	int hdr, exposure, exposure_target, exposure_auto, gain, gain_target;
+	unsigned int lens, lag, noise;
+	struct {
+		unsigned int due;       /* first sequence number showing it */
+		int *applied, value;
+	} pending[SYNTH_MAX_PENDING];   /* control changes not yet in the image, in the order made */
+	unsigned int n_pending;
+} synth;
+
+struct synth_stats synth_stats;
+static struct timespec replug_at;       /* survives the reset on reopen, open fails until then */
+
+static const unsigned int synth_formats[] = { V4L2_PIX_FMT_YUYV, V4L2_PIX_FMT_NV12, V4L2_PIX_FMT_GREY };
+static const char *synth_format_names[] = { "YUYV 4:2:2", "Y/CbCr 4:2:0", "8-bit Greyscale" };
+static const unsigned int synth_sizes[][2] = { { 160, 120 }, { 320, 240 }, { 640, 480 }, { 1280, 720 }, { 1920, 1080 }, { 3840, 2160 } };
+
+#define N_ELEMS(a) (sizeof(a) / sizeof((a)[0]))
+
+static unsigned int synth_buffer_size(void)
+{
+	return (synth.pix.sizeimage + SYNTH_PAGE - 1) & ~(SYNTH_PAGE - 1);
+}
+
+static void synth_set_format(struct v4l2_pix_format *pix)
+{
+	unsigned int i;
+
+	for (i = 0; i < N_ELEMS(synth_formats); ++i)
+		if (pix->pixelformat == synth_formats[i])
+			break;
+	if (i == N_ELEMS(synth_formats))
+		pix->pixelformat = V4L2_PIX_FMT_YUYV;
+
+	pix->width = pix->width < 16 ? 16 : pix->width > 4096 ? 4096 : pix->width & ~1u;
+	pix->height = pix->height < 16 ? 16 : pix->height > 2160 ? 2160 : pix->height & ~1u;
+	pix->field = V4L2_FIELD_NONE;
+	pix->bytesperline = pix->pixelformat == V4L2_PIX_FMT_YUYV ? pix->width * 2 : pix->width;
+	pix->sizeimage = synth_frame_size(pix->width, pix->height, pix->pixelformat);
+	pix->colorspace = V4L2_COLORSPACE_SRGB;
+}
+
+static void synth_free_buffers(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < synth.n_buffers; ++i)
+		free(synth.bufs[i].mem);
+	memset(synth.bufs, 0, sizeof(synth.bufs));
+	synth.n_buffers = 0;
+	synth.q_count = 0;
+}
+
+/*
+ * Sleeps until the next frame is due, like a blocking DQBUF on a real sensor. A consumer that falls further
+ * behind than the buffers the driver holds loses the frames in between, seen as sequence gaps
+ */
+static void synth_pace(void)
+{
+	struct timespec now;
+	long long behind;
+	long period;
+
+	if (!synth.fps)
+		return;
+	period = 1000000000L / synth.fps;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (synth.next.tv_sec == 0 || now.tv_sec > synth.next.tv_sec + 1)
+		synth.next = now;
+	behind = ((now.tv_sec - synth.next.tv_sec) * 1000000000LL + now.tv_nsec - synth.next.tv_nsec) / period;
+	if (behind > synth.q_count) {
+		behind -= synth.q_count;
+		synth.sequence += behind;
+		synth_stats.overruns += behind;
+		synth.next.tv_sec += behind * period / 1000000000L;
+		synth.next.tv_nsec += behind * period % 1000000000L;
+		if (synth.next.tv_nsec >= 1000000000L) {
+			synth.next.tv_nsec -= 1000000000L;
+			synth.next.tv_sec++;
+		}
+	}
+	clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &synth.next, NULL);
+	synth.next.tv_nsec += period;
+	while (synth.next.tv_nsec >= 1000000000L) {
+		synth.next.tv_nsec -= 1000000000L;
+		synth.next.tv_sec++;
+	}
+}
+
+/* Produces the next frame into mem and returns the flags the driver would report */
+static unsigned int synth_produce(void *mem, unsigned int *shown)
+{
+	unsigned int flags = V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC, image, i, n;
+
+	synth_pace();
+	synth.frames++;
+	if (synth.drop_every && synth.frames % synth.drop_every == 0)
+		synth.sequence++;
+	for (i = n = 0; i < synth.n_pending; ++i)
+		if ((int)(synth.sequence - synth.pending[i].due) >= 0)
+			*synth.pending[i].applied = synth.pending[i].value;
+		else
+			synth.pending[n++] = synth.pending[i];
+	synth.n_pending = n;
+	image = synth.freeze_at && synth.frames >= synth.freeze_at ? synth.freeze_at : synth.frames;
+	/* a lens, exposure or grain renders every frame, the buffer's last image is not the one due now */
+	if (synth.focus || synth.hdr || synth.noise ||
+	    (*shown != image && (synth.render || !*shown || image == synth.freeze_at))) {
+		synth_fill_frame(mem, synth.pix.width, synth.pix.height, synth.pix.pixelformat, image);
+		*shown = image;
+	}
+	if (synth.focus)
+		synth_defocus(mem, synth.pix.width, synth.pix.height, synth.pix.pixelformat,
+			abs(synth.focus_pos - synth.focus_at) / SYNTH_FOCUS_STEP);
+	if (synth.hdr)
+		synth_expose(mem, synth.pix.width, synth.pix.height, synth.pix.pixelformat,
+			(double)synth.exposure / SYNTH_EXPOSURE_DEFAULT * synth.gain / SYNTH_GAIN_DEFAULT);
+	if (synth.noise)
+		synth_grain(mem, synth.pix.width, synth.pix.height, synth.pix.pixelformat, synth.noise, synth.frames);
+	if (synth.error_every && synth.frames % synth.error_every == 0)
+		flags |= V4L2_BUF_FLAG_ERROR;
+
+	return flags;
+}
+
+/* Pulls the plug at the unplug frame; every later call on the old descriptor fails like a removed USB device */
+static int synth_gone(void)
+{
+	if (!synth.gone && synth.unplug_at && synth.frames >= synth.unplug_at) {
+		synth.gone = 1;
+		synth_stats.unplugs++;
+		clock_gettime(CLOCK_MONOTONIC, &replug_at);
+		replug_at.tv_sec += synth.replug_ms / 1000;
+		replug_at.tv_nsec += synth.replug_ms % 1000 * 1000000L;
+		if (replug_at.tv_nsec >= 1000000000L) {
+			replug_at.tv_nsec -= 1000000000L;
+			replug_at.tv_sec++;
+		}
+	}
+	if (synth.gone)
+		errno = ENODEV;
+
+	return synth.gone;
+}
+
+static int synth_dqbuf(struct v4l2_buffer *buf)
+{
+	struct synth_buffer *sb;
+	struct timespec now;
+	unsigned int index;
+
+	synth_stats.dqbuf++;
+	if (!synth.streaming) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (!synth.q_count) {
+		errno = EAGAIN;
+		return -1;
+	}
+
+	index = synth.queue[synth.q_head];
+	synth.q_head = (synth.q_head + 1) % SYNTH_MAX_BUFFERS;
+	synth.q_count--;
+	sb = &synth.bufs[index];
+
+	buf->index = index;
+	buf->flags = synth_produce(synth.memory == V4L2_MEMORY_MMAP ? sb->mem : (void *)sb->userptr, &sb->shown);
+	buf->bytesused = synth.pix.sizeimage;
+	if (synth.short_every && synth.frames % synth.short_every == 0)
+		buf->bytesused /= 2;
+	buf->field = V4L2_FIELD_NONE;
+	buf->sequence = synth.sequence++;
+	buf->length = sb->length;
+	if (synth.memory == V4L2_MEMORY_USERPTR)
+		buf->m.userptr = sb->userptr;
+	else
+		buf->m.offset = index * synth_buffer_size();
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	buf->timestamp.tv_sec = now.tv_sec;
+	buf->timestamp.tv_usec = now.tv_nsec / 1000;
+
+	return 0;
+}
+
+static int synth_qbuf(struct v4l2_buffer *buf)
+{
+	struct synth_buffer *sb;
+
+	synth_stats.qbuf++;
+	if (buf->index >= synth.n_buffers || buf->memory != synth.memory || synth.q_count == SYNTH_MAX_BUFFERS) {
+		errno = EINVAL;
+		return -1;
+	}
+	sb = &synth.bufs[buf->index];
+	if (synth.memory == V4L2_MEMORY_USERPTR) {
+		if (buf->length < synth.pix.sizeimage) {
+			errno = EINVAL;
+			return -1;
+		}
+		if (sb->userptr != buf->m.userptr)
+			sb->shown = 0;
+		sb->userptr = buf->m.userptr;
+		sb->length = buf->length;
+	}
+	synth.queue[(synth.q_head + synth.q_count) % SYNTH_MAX_BUFFERS] = buf->index;
+	synth.q_count++;
+
+	return 0;
+}
+
+static int synth_reqbufs(struct v4l2_requestbuffers *req)
+{
+	unsigned int i;
+
+	if (synth.streaming || (req->memory != V4L2_MEMORY_MMAP && req->memory != V4L2_MEMORY_USERPTR)) {
+		errno = req->memory != V4L2_MEMORY_MMAP && req->memory != V4L2_MEMORY_USERPTR ? EINVAL : EBUSY;
+		return -1;
+	}
+
+	synth_free_buffers();
+	synth.memory = req->memory;
+	if (!req->count)
+		return 0;
+	if (req->count < 2)
+		req->count = 2;
+	if (req->count > SYNTH_MAX_BUFFERS)
+		req->count = SYNTH_MAX_BUFFERS;
+
+	for (i = 0; i < req->count; ++i) {
+		synth.bufs[i].length = synth.pix.sizeimage;
+		if (req->memory == V4L2_MEMORY_MMAP) {
+			synth.bufs[i].mem = aligned_alloc(SYNTH_PAGE, synth_buffer_size());
+			if (!synth.bufs[i].mem) {
+				synth_free_buffers();
+				errno = ENOMEM;
+				return -1;
+			}
+		}
+	}
+	synth.n_buffers = req->count;
+
+	return 0;
+}
+
+/* The lens and exposure controls in id order, as VIDIOC_QUERYCTRL with V4L2_CTRL_FLAG_NEXT_CTRL walks them */
+static const struct v4l2_queryctrl synth_controls[] = {
+	{ .id = V4L2_CID_GAIN, .type = V4L2_CTRL_TYPE_INTEGER, .name = "Gain",
+	  .minimum = 16, .maximum = 255, .step = 1, .default_value = SYNTH_GAIN_DEFAULT },
+	{ .id = V4L2_CID_EXPOSURE_AUTO, .type = V4L2_CTRL_TYPE_MENU, .name = "Auto Exposure",
+	  .minimum = V4L2_EXPOSURE_MANUAL, .maximum = V4L2_EXPOSURE_APERTURE_PRIORITY, .step = 1,
+	  .default_value = V4L2_EXPOSURE_APERTURE_PRIORITY },
+	{ .id = V4L2_CID_EXPOSURE_ABSOLUTE, .type = V4L2_CTRL_TYPE_INTEGER, .name = "Exposure Time, Absolute",
+	  .minimum = 3, .maximum = 2047, .step = 1, .default_value = SYNTH_EXPOSURE_DEFAULT },
+	{ .id = V4L2_CID_FOCUS_ABSOLUTE, .type = V4L2_CTRL_TYPE_INTEGER, .name = "Focus, Absolute",
+	  .minimum = 0, .maximum = SYNTH_FOCUS_MAX, .step = SYNTH_FOCUS_STEP, .default_value = 0 },
+	{ .id = V4L2_CID_FOCUS_AUTO, .type = V4L2_CTRL_TYPE_BOOLEAN, .name = "Focus, Auto",
+	  .minimum = 0, .maximum = 1, .step = 1, .default_value = 1 },
+};
+
+static const struct v4l2_queryctrl *synth_find_control(unsigned int id)
+{
+	unsigned int i;
+
+	for (i = 0; i < N_ELEMS(synth_controls); ++i)
+		if (synth_controls[i].id == id)
+			return &synth_controls[i];
+
+	return NULL;
+}
+
+static int synth_has_control(unsigned int id)
+{
+	if (id == V4L2_CID_FOCUS_ABSOLUTE || id == V4L2_CID_FOCUS_AUTO)
+		return synth.focus;
+
+	return synth.hdr;
+}
+
+static int synth_queryctrl(struct v4l2_queryctrl *qc)
+{
+	unsigned int id = qc->id & ~V4L2_CTRL_FLAG_NEXT_CTRL, i;
+
+	for (i = 0; i < N_ELEMS(synth_controls); ++i)
+		if (synth_has_control(synth_controls[i].id) &&
+		    (qc->id & V4L2_CTRL_FLAG_NEXT_CTRL ? synth_controls[i].id > id : synth_controls[i].id == id)) {
+			*qc = synth_controls[i];
+			/* like UVC, a manual control is inactive while the camera sets it itself */
+			if ((qc->id == V4L2_CID_FOCUS_ABSOLUTE && synth.focus_auto) ||
+			    (qc->id == V4L2_CID_EXPOSURE_ABSOLUTE && synth.exposure_auto != V4L2_EXPOSURE_MANUAL))
+				qc->flags |= V4L2_CTRL_FLAG_INACTIVE;
+			return 0;
+		}
+	errno = EINVAL;
+
+	return -1;
+}
+
+static int synth_querymenu(struct v4l2_querymenu *qm)
+{
+	if (qm->id != V4L2_CID_EXPOSURE_AUTO || !synth.hdr ||
+	    (qm->index != V4L2_EXPOSURE_MANUAL && qm->index != V4L2_EXPOSURE_APERTURE_PRIORITY)) {
+		errno = EINVAL;
+		return -1;
+	}
+	strcpy((char *)qm->name, qm->index == V4L2_EXPOSURE_MANUAL ? "Manual Mode" : "Aperture Priority Mode");
+
+	return 0;
+}
+
+/*
+ * A change reaches the image delay sequence numbers after the last frame, dropped frames included as the sensor
+ * still exposed them; changes made on consecutive frames queue up
+ */
+static void synth_schedule(int *applied, int value, unsigned int delay)
+{
+	if (!delay || synth.n_pending == SYNTH_MAX_PENDING) {
+		*applied = value;
+		return;
+	}
+	synth.pending[synth.n_pending].due = synth.sequence - 1 + delay;
+	synth.pending[synth.n_pending].applied = applied;
+	synth.pending[synth.n_pending].value = value;
+	synth.n_pending++;
+}
+
+static int synth_control(unsigned long request, struct v4l2_control *ctrl)
+{
+	const struct v4l2_queryctrl *qc = synth_find_control(ctrl->id);
+	int *value = ctrl->id == V4L2_CID_FOCUS_ABSOLUTE ? &synth.focus_target :
+		ctrl->id == V4L2_CID_FOCUS_AUTO ? &synth.focus_auto :
+		ctrl->id == V4L2_CID_EXPOSURE_AUTO ? &synth.exposure_auto :
+		ctrl->id == V4L2_CID_EXPOSURE_ABSOLUTE ? &synth.exposure_target : &synth.gain_target;
+
+	if (!qc || !synth_has_control(ctrl->id)) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (request == VIDIOC_G_CTRL) {
+		ctrl->value = *value;
+		return 0;
+	}
+	if ((value == &synth.focus_target && synth.focus_auto) ||
+	    (value == &synth.exposure_target && synth.exposure_auto != V4L2_EXPOSURE_MANUAL)) {
+		errno = EBUSY;
+		return -1;
+	}
+	if (ctrl->id == V4L2_CID_EXPOSURE_AUTO && ctrl->value != V4L2_EXPOSURE_MANUAL &&
+	    ctrl->value != V4L2_EXPOSURE_APERTURE_PRIORITY) {
+		errno = EINVAL;
+		return -1;
+	}
+	/* integers are clamped and rounded down to the step, as the control framework does */
+	ctrl->value = ctrl->value < qc->minimum ? qc->minimum : ctrl->value > qc->maximum ? qc->maximum : ctrl->value;
+	ctrl->value -= (ctrl->value - qc->minimum) % qc->step;
+	*value = ctrl->value;
+	if (value == &synth.focus_target)
+		synth_schedule(&synth.focus_pos, ctrl->value, synth.lens);
+	else if (value == &synth.exposure_target)
+		synth_schedule(&synth.exposure, ctrl->value, synth.lag);
+	else if (value == &synth.gain_target)
+		synth_schedule(&synth.gain, ctrl->value, synth.lag);
+
+	return 0;
+}
+
+static int synth_ioctl(int fd, unsigned long request, void *arg)
+{
+	(void)fd;
+	synth_stats.ioctls++;
+	if (synth_gone())
+		return -1;
+
+	switch (request) {
+	case VIDIOC_DQBUF:
+		return synth_dqbuf(arg);
+
+	case VIDIOC_QBUF:
+		return synth_qbuf(arg);
+
+	case VIDIOC_QUERYCAP: {
+		struct v4l2_capability *cap = arg;
+
+		CLEAR(*cap);
+		strcpy((char *)cap->driver, "synth");
+		strcpy((char *)cap->card, "Synthetic camera");
+		strcpy((char *)cap->bus_info, "platform:synth");
+		cap->version = 0x060000;
+		cap->device_caps = V4L2_CAP_VIDEO_CAPTURE | V4L2_CAP_STREAMING | V4L2_CAP_READWRITE;
+		cap->capabilities = cap->device_caps | V4L2_CAP_DEVICE_CAPS;
+		return 0;
+	}
+
+	case VIDIOC_ENUM_FMT: {
+		struct v4l2_fmtdesc *desc = arg;
+
+		if (desc->index >= N_ELEMS(synth_formats)) {
+			errno = EINVAL;
+			return -1;
+		}
+		desc->pixelformat = synth_formats[desc->index];
+		desc->flags = 0;
+		strcpy((char *)desc->description, synth_format_names[desc->index]);
+		return 0;
+	}
+
+	case VIDIOC_ENUM_FRAMESIZES: {
+		struct v4l2_frmsizeenum *fs = arg;
+
+		if (fs->index >= N_ELEMS(synth_sizes)) {
+			errno = EINVAL;
+			return -1;
+		}
+		fs->type = V4L2_FRMSIZE_TYPE_DISCRETE;
+		fs->discrete.width = synth_sizes[fs->index][0];
+		fs->discrete.height = synth_sizes[fs->index][1];
+		return 0;
+	}
+
+	case VIDIOC_ENUM_FRAMEINTERVALS: {
+		struct v4l2_frmivalenum *fi = arg;
+
+		if (fi->index > 0) {
+			errno = EINVAL;
+			return -1;
+		}
+		fi->type = V4L2_FRMIVAL_TYPE_DISCRETE;
+		fi->discrete.numerator = 1;
+		fi->discrete.denominator = synth.fps ? synth.fps : 1000;
+		return 0;
+	}
+
+	case VIDIOC_G_FMT:
+		((struct v4l2_format *)arg)->fmt.pix = synth.pix;
+		return 0;
+
+	case VIDIOC_TRY_FMT:
+		synth_set_format(&((struct v4l2_format *)arg)->fmt.pix);
+		return 0;
+
+	case VIDIOC_S_FMT:
+		if (synth.n_buffers) {
+			errno = EBUSY;
+			return -1;
+		}
+		synth_set_format(&((struct v4l2_format *)arg)->fmt.pix);
+		synth.pix = ((struct v4l2_format *)arg)->fmt.pix;
+		return 0;
+
+	case VIDIOC_REQBUFS:
+		return synth_reqbufs(arg);
+
+	case VIDIOC_QUERYBUF: {
+		struct v4l2_buffer *buf = arg;
+
+		if (buf->index >= synth.n_buffers) {
+			errno = EINVAL;
+			return -1;
+		}
+		buf->length = synth.pix.sizeimage;
+		buf->m.offset = buf->index * synth_buffer_size();
+		buf->flags = 0;
+		return 0;
+	}
+
+	case VIDIOC_STREAMON:
+		synth.streaming = 1;
+		synth.next.tv_sec = 0;
+		return 0;
+
+	case VIDIOC_STREAMOFF:
+		synth.streaming = 0;
+		synth.q_count = 0;
+		return 0;
+
+	case VIDIOC_QUERYCTRL:
+		return synth_queryctrl(arg);
+
+	case VIDIOC_QUERYMENU:
+		return synth_querymenu(arg);
+
+	case VIDIOC_G_CTRL:
+	case VIDIOC_S_CTRL:
+		return synth_control(request, arg);
+
+	case VIDIOC_G_PARM:
+	case VIDIOC_S_PARM: {
+		struct v4l2_streamparm *parm = arg;
+
+		if (request == VIDIOC_S_PARM && parm->parm.capture.timeperframe.numerator)
+			synth.fps = parm->parm.capture.timeperframe.denominator / parm->parm.capture.timeperframe.numerator;
+		parm->parm.capture.capability = V4L2_CAP_TIMEPERFRAME;
+		parm->parm.capture.timeperframe.numerator = 1;
+		parm->parm.capture.timeperframe.denominator = synth.fps;
+		return 0;
+	}
+	}
+
+	errno = ENOTTY;
+	return -1;
+}
+
+static void *synth_mmap(void *addr, size_t length, int prot, int flags, int fd, off_t offset)
+{
+	unsigned int index = offset / synth_buffer_size();
+
+	(void)addr;
+	(void)prot;
+	(void)flags;
+	(void)fd;
+	if (index >= synth.n_buffers || length > synth_buffer_size())
+		return MAP_FAILED;
+
+	return synth.bufs[index].mem;
+}
+
+static int synth_munmap(void *addr, size_t length)
+{
+	(void)addr;
+	(void)length;
+	return 0;
+}
+
+static ssize_t synth_read(int fd, void *buf, size_t count)
+{
+	static void *last_buf;
+	static unsigned int shown;
+
+	(void)fd;
+	if (synth_gone())
+		return -1;
+	if (buf != last_buf)
+		shown = 0;
+	last_buf = buf;
+	synth_stats.reads++;
+	if (count < synth.pix.sizeimage) {
+		errno = EINVAL;
+		return -1;
+	}
+	synth_produce(buf, &shown);
+	synth.sequence++;
+
+	return synth.short_every && synth.frames % synth.short_every == 0 ? synth.pix.sizeimage / 2 : synth.pix.sizeimage;
+}
+
+static int synth_open(const char *path, int flags)
+{
+	struct timespec now;
+
+	(void)path;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (now.tv_sec < replug_at.tv_sec || (now.tv_sec == replug_at.tv_sec && now.tv_nsec < replug_at.tv_nsec)) {
+		errno = ENOENT;
+		return -1;
+	}
+
+	return open("/dev/null", flags);
+}
+
+static int synth_close(int fd)
+{
+	synth_free_buffers();
+	synth.streaming = 0;
+	return close(fd);
+}
+
+static const struct dev_ops synth_dev_ops = {
+	.open   = synth_open,
+	.close  = synth_close,
+	.ioctl  = synth_ioctl,
+	.mmap   = synth_mmap,
+	.munmap = synth_munmap,
+	.read   = synth_read,
+};
+
+/**
+Function Name : synth_dev_open
+Function Description : Resets the synthetic device and applies the options in "synth:opt=val,..."
+Parameter : device path, where to store the synthetic device operations
+Return : 0 for success, -EINVAL for an unknown option, -ENOMEM
+**/
+int synth_dev_open(const char *path, const struct dev_ops **ops)
+{
+	char *opts = strdup(strchr(path, ':') ? strchr(path, ':') + 1 : ""), *item, *save;
+	int ret = 0;
+
+	if (!opts)
+		return -ENOMEM;
+
+	synth_free_buffers();
+	memset(&synth, 0, sizeof(synth));
+	synth.fps = 30;
+	synth.render = 1;
+	synth.replug_ms = 200;
+	synth.lens = 2;
+	synth.focus_auto = 1;
+	synth.lag = 2;
+	synth.exposure = synth.exposure_target = SYNTH_EXPOSURE_DEFAULT;
+	synth.exposure_auto = V4L2_EXPOSURE_APERTURE_PRIORITY;
+	synth.gain = synth.gain_target = SYNTH_GAIN_DEFAULT;
+	synth.pix.width = 640;
+	synth.pix.height = 480;
+	synth.pix.pixelformat = V4L2_PIX_FMT_YUYV;
+	synth_set_format(&synth.pix);
+
+	for (item = strtok_r(opts, ",", &save); item; item = strtok_r(NULL, ",", &save)) {
+		if (strncmp(item, "fps=", 4) == 0)
+			synth.fps = strtol(item + 4, NULL, 10);
+		else if (strncmp(item, "error=", 6) == 0)
+			synth.error_every = strtol(item + 6, NULL, 10);
+		else if (strncmp(item, "drop=", 5) == 0)
+			synth.drop_every = strtol(item + 5, NULL, 10);
+		else if (strncmp(item, "freeze=", 7) == 0)
+			synth.freeze_at = strtol(item + 7, NULL, 10);
+		else if (strncmp(item, "short=", 6) == 0)
+			synth.short_every = strtol(item + 6, NULL, 10);
+		else if (strncmp(item, "unplug=", 7) == 0)
+			synth.unplug_at = strtol(item + 7, NULL, 10);
+		else if (strncmp(item, "replug=", 7) == 0)
+			synth.replug_ms = strtol(item + 7, NULL, 10);
+		else if (strncmp(item, "focus=", 6) == 0) {
+			synth.focus = 1;
+			synth.focus_at = strtol(item + 6, NULL, 10);
+		} else if (strncmp(item, "lens=", 5) == 0)
+			synth.lens = strtol(item + 5, NULL, 10);
+		else if (strcmp(item, "hdr") == 0)
+			synth.hdr = 1;
+		else if (strncmp(item, "lag=", 4) == 0)
+			synth.lag = strtol(item + 4, NULL, 10);
+		else if (strncmp(item, "noise=", 6) == 0)
+			synth.noise = strtol(item + 6, NULL, 10);
+		else if (strcmp(item, "static") == 0)
+			synth.render = 0;
+		else
+			ret = -EINVAL;
+	}
+	free(opts);
+	if (ret == 0)
+		*ops = &synth_dev_ops;
+
+	return ret;
+}
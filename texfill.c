@@ -0,0 +1,144 @@
+#include "header.h"
+#include <setjmp.h>
+#include <jpeglib.h>
+#include "texfill.h"
+#include "isp.h"
+
+/*
+ * Converts or decodes a captured frame directly into locked texture memory, so the frame is read once and
+ * the texture written once between DQBUF and present. There is no staging copy as with SDL_UpdateTexture().
+ * Rows are written at the pitch the lock returned, which may be wider than the frame.
+ */
+
+struct texfill_stats texfill_stats;
+
+struct mjpeg_error {
+	struct jpeg_error_mgr mgr;
+	jmp_buf jump;
+};
+
+static struct jpeg_decompress_struct dinfo;
+static struct mjpeg_error derr;
+static int dinfo_ready;
+
+/**
+Function Name : texfill_layout
+Function Description : Picks the texture layout a pixel format is written into
+Parameter : V4L2 fourcc
+Return : enum texfill_layout, -1 for a format the renderer cannot show
+**/
+int texfill_layout(unsigned int fourcc)
+{
+	switch (fourcc) {
+	case V4L2_PIX_FMT_YUYV:
+	case V4L2_PIX_FMT_GREY:
+		return TEXFILL_YUY2;
+	case V4L2_PIX_FMT_NV12:
+		return TEXFILL_NV12;
+	case V4L2_PIX_FMT_MJPEG:
+	case V4L2_PIX_FMT_JPEG:
+		return TEXFILL_RGB24;
+	}
+
+	return isp_is_bayer(fourcc) ? TEXFILL_RGB24 : -1;
+}
+
+static void mjpeg_error_exit(j_common_ptr cinfo)
+{
+	longjmp(((struct mjpeg_error *)cinfo->err)->jump, 1);
+}
+
+static void mjpeg_silent(j_common_ptr cinfo, int level)
+{
+	(void)cinfo;
+	(void)level;
+}
+
+/* libjpeg writes every scanline straight into the locked rows; UVC MJPG without DHT gets the standard tables */
+static int fill_mjpeg(unsigned char *dst, int pitch, const unsigned char *src, unsigned int len, unsigned int width,
+	unsigned int height)
+{
+	JSAMPROW rows[16];
+	unsigned int i, n;
+
+	if (!dinfo_ready) {
+		dinfo.err = jpeg_std_error(&derr.mgr);
+		derr.mgr.error_exit = mjpeg_error_exit;
+		derr.mgr.emit_message = mjpeg_silent;
+		jpeg_create_decompress(&dinfo);
+		dinfo_ready = 1;
+	}
+	if (setjmp(derr.jump)) {
+		jpeg_abort_decompress(&dinfo);
+		return -1;
+	}
+
+	jpeg_mem_src(&dinfo, (unsigned char *)src, len);
+	jpeg_read_header(&dinfo, TRUE);
+	if (dinfo.image_width != width || dinfo.image_height != height) {
+		jpeg_abort_decompress(&dinfo);
+		return -1;
+	}
+	dinfo.out_color_space = JCS_RGB;
+	dinfo.dct_method = JDCT_IFAST;
+	dinfo.do_fancy_upsampling = FALSE;
+	jpeg_start_decompress(&dinfo);
+	while (dinfo.output_scanline < dinfo.output_height) {
+		n = dinfo.rec_outbuf_height < 16 ? dinfo.rec_outbuf_height : 16;
+		for (i = 0; i < n; ++i)
+			rows[i] = dst + (size_t)(dinfo.output_scanline + i) * pitch;
+		jpeg_read_scanlines(&dinfo, rows, n);
+	}
+	jpeg_finish_decompress(&dinfo);
+
+	return width * 3 * height;
+}
+
+/**
+Function Name : texfill_decode
+Function Description : Decodes the formats that are not copied: MJPG through libjpeg, raw Bayer through the ISP
+Parameter : locked pixels and pitch, and the frame's view
+Return : bytes written, -1 for a format it cannot show or a frame that failed to decode
+**/
+int texfill_decode(unsigned char *dst, int pitch, const struct frame_view *v)
+{
+	if (v->fourcc == V4L2_PIX_FMT_MJPEG || v->fourcc == V4L2_PIX_FMT_JPEG)
+		return fill_mjpeg(dst, pitch, v->plane[0], v->bytesused, v->width, v->height);
+
+	return isp_process(dst, pitch, v->plane[0], v->bytesused, v->width, v->height, v->fourcc);
+}
+
+/**
+Function Name : texfill_frame
+Function Description : texfill_view() for a frame given as a pointer and bytesused, its rows packed
+Parameter : locked pixels and pitch, frame and bytesused, negotiated width, height and fourcc
+Return : bytes written, -1 for a short frame, a format it cannot show or an MJPG frame that failed to decode
+**/
+int texfill_frame(void *pixels, int pitch, const void *frame, unsigned int bytesused, unsigned int width,
+	unsigned int height, unsigned int fourcc)
+{
+	struct frame_view view;
+
+	frame_view_init(&view, frame, bytesused, 0, width, height, fourcc, 0);
+
+	return texfill_view(pixels, pitch, &view);
+}
+
+/**
+Function Name : texfill_finish
+Function Description : Prints the bytes written per frame and releases the MJPG decoder
+Parameter : void
+Return : void
+**/
+void texfill_finish(void)
+{
+	if (texfill_stats.frames)
+		printf("render: %llu frames, %.0f bytes in and %.0f bytes written into locked textures per frame, "
+			"no staging copy, %llu frames not shown\n", texfill_stats.frames,
+			(double)texfill_stats.frame_bytes / texfill_stats.frames,
+			(double)texfill_stats.written_bytes / texfill_stats.frames, texfill_stats.decode_errors);
+	if (dinfo_ready) {
+		jpeg_destroy_decompress(&dinfo);
+		dinfo_ready = 0;
+	}
+}
@@ -0,0 +1,92 @@
+#pragma once
+#include <stdint.h>
+#include <string.h>
+#include "frameview.h"
+
+/* Texture memory layouts a captured frame can be written into; each maps to one SDL streaming format */
+enum texfill_layout {
+	TEXFILL_YUY2,                   /* packed 4:2:2, YUYV as is and GREY with neutral chroma */
+	TEXFILL_NV12,                   /* Y plane then interleaved UV plane, both at the locked pitch */
+	TEXFILL_RGB24,                  /* MJPG decoded by libjpeg, raw Bayer developed by the ISP */
+};
+
+struct texfill_stats {
+	unsigned long long frames;
+	unsigned long long frame_bytes;         /* bytesused of the frames that came in */
+	unsigned long long written_bytes;       /* bytes written into texture memory, the only copy made */
+	unsigned long long decode_errors;
+};
+
+extern struct texfill_stats texfill_stats;
+
+int texfill_layout(unsigned int fourcc);
+int texfill_decode(unsigned char *dst, int pitch, const struct frame_view *v);
+int texfill_frame(void *pixels, int pitch, const void *frame, unsigned int bytesused, unsigned int width,
+	unsigned int height, unsigned int fourcc);
+void texfill_finish(void);
+
+/*
+ * The raw layouts are copied here, in the header, so a capture loop built for one format inlines its copy.
+ * Decoded formats (MJPG, Bayer) go out of line to texfill_decode().
+ */
+static inline unsigned int texfill_rows(unsigned char *dst, int pitch, const unsigned char *src,
+	unsigned int src_pitch, unsigned int row_bytes, unsigned int rows)
+{
+	unsigned int y;
+
+	if ((unsigned int)pitch == row_bytes && src_pitch == row_bytes)
+		memcpy(dst, src, (size_t)row_bytes * rows);
+	else
+		for (y = 0; y < rows; ++y)
+			memcpy(dst + (size_t)y * pitch, src + (size_t)y * src_pitch, row_bytes);
+
+	return row_bytes * rows;
+}
+
+/* GREY shown through the YUY2 texture: each pair of luma bytes becomes Y0 80 Y1 80 */
+static inline unsigned int texfill_grey(unsigned char *dst, int pitch, const unsigned char *src, int src_pitch,
+	unsigned int width, unsigned int height)
+{
+	unsigned int x, y;
+	uint32_t *out;
+
+	for (y = 0; y < height; ++y, src += src_pitch) {
+		out = (uint32_t *)(dst + (size_t)y * pitch);
+		for (x = 0; x + 1 < width; x += 2)
+			out[x / 2] = src[x] | 0x80u << 8 | (uint32_t)src[x + 1] << 16 | 0x80u << 24;
+	}
+
+	return width * 2 * height;
+}
+
+/**
+Function Name : texfill_view
+Function Description : Writes one frame into locked texture memory in the layout texfill_layout() picked
+Parameter : locked pixels and pitch, and the frame's view
+Return : bytes written, -1 for a short frame, a format it cannot show or an MJPG frame that failed to decode
+**/
+static inline int texfill_view(unsigned char *dst, int pitch, const struct frame_view *v)
+{
+	int written;
+
+	if (!frame_view_complete(v))
+		written = -1;
+	else if (v->fourcc == V4L2_PIX_FMT_YUYV)
+		written = texfill_rows(dst, pitch, v->plane[0], v->pitch[0], v->width * 2, v->rows[0]);
+	else if (v->fourcc == V4L2_PIX_FMT_NV12)
+		written = texfill_rows(dst, pitch, v->plane[0], v->pitch[0], v->width, v->rows[0]) +
+			texfill_rows(dst + (size_t)pitch * v->rows[0], pitch, v->plane[1], v->pitch[1], v->width, v->rows[1]);
+	else if (v->fourcc == V4L2_PIX_FMT_GREY)
+		written = texfill_grey(dst, pitch, v->plane[0], v->pitch[0], v->width, v->height);
+	else
+		written = texfill_decode(dst, pitch, v);
+
+	texfill_stats.frames++;
+	texfill_stats.frame_bytes += v->bytesused;
+	if (written < 0)
+		texfill_stats.decode_errors++;
+	else
+		texfill_stats.written_bytes += written;
+
+	return written;
+}
@@ -0,0 +1,498 @@
+#include "header.h"
+#include <pthread.h>
+
+#include "tilepool.h"
+#include "metrics.h"
+#include "trace.h"
+
+/*
+ * A persistent pool of workers, each owning a deque of tasks. A task is a range of items from one
+ * submission. A worker takes the newest task from the tail of its own deque. It halves the range,
+ * pushing the upper half back, until one item is left, then runs that item. Idle workers steal the oldest
+ * (and so the largest) range from the head of another worker's deque. Neighbouring tiles therefore stay
+ * on one core, and the rest spreads out as cores free up.
+ */
+
+unsigned int tile_threads;
+
+struct tile_task {
+	tile_fn fn;
+	void *arg;
+	struct tile_future *future;
+	unsigned int begin, end;
+};
+
+struct tile_worker {
+	pthread_t thread;
+	int started;
+	unsigned int index;
+	pthread_mutex_t lock;           /* guards the deque, the owner works the tail and thieves the head */
+	struct tile_task *tasks;
+	unsigned int head, tail, cap;   /* head and tail only count up, cap is a power of two */
+	unsigned char *scratch[2];
+	size_t scratch_size[2];
+	struct tile_stats stats;
+};
+
+static struct tile_worker *workers;
+static struct tile_worker inline_worker;        /* scratch for items run on the caller when the pool is down */
+static unsigned int n_workers;
+static atomic_uint next_worker;
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* idle workers sleep until something is queued; a waiter sleeps until its future is done */
+static pthread_mutex_t idle_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t idle_cond = PTHREAD_COND_INITIALIZER;
+static pthread_mutex_t done_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t done_cond = PTHREAD_COND_INITIALIZER;
+static atomic_uint queued, sleepers;
+static int stopping;
+
+static void push_task(struct tile_worker *w, const struct tile_task *task)
+{
+	struct tile_task *grown;
+	unsigned int i;
+
+	pthread_mutex_lock(&w->lock);
+	if (w->tail - w->head == w->cap) {
+		grown = malloc(sizeof(*grown) * w->cap * 2);
+		for (i = 0; i < w->cap; ++i)
+			grown[i] = w->tasks[(w->head + i) & (w->cap - 1)];
+		free(w->tasks);
+		w->tasks = grown;
+		w->tail -= w->head;
+		w->head = 0;
+		w->cap *= 2;
+	}
+	w->tasks[w->tail++ & (w->cap - 1)] = *task;
+	pthread_mutex_unlock(&w->lock);
+
+	atomic_fetch_add(&queued, 1);
+	if (atomic_load(&sleepers)) {
+		pthread_mutex_lock(&idle_lock);
+		pthread_cond_signal(&idle_cond);
+		pthread_mutex_unlock(&idle_lock);
+	}
+}
+
+static int take_task(struct tile_worker *w, struct tile_task *task, int steal)
+{
+	int found = 0;
+
+	pthread_mutex_lock(&w->lock);
+	if (w->tail != w->head) {
+		*task = steal ? w->tasks[w->head++ & (w->cap - 1)] : w->tasks[--w->tail & (w->cap - 1)];
+		found = 1;
+	}
+	pthread_mutex_unlock(&w->lock);
+	if (found)
+		atomic_fetch_sub(&queued, 1);
+
+	return found;
+}
+
+static int find_task(struct tile_worker *w, struct tile_task *task)
+{
+	unsigned int i;
+
+	if (take_task(w, task, 0))
+		return 1;
+	for (i = 1; i < n_workers; ++i)
+		if (take_task(&workers[(w->index + i) % n_workers], task, 1)) {
+			w->stats.steals++;
+			return 1;
+		}
+
+	return 0;
+}
+
+static void complete(struct tile_future *future)
+{
+	if (atomic_fetch_sub(&future->pending, 1) != 1)
+		return;
+	future->done_ns = metric_now_ns();
+	pthread_mutex_lock(&done_lock);
+	atomic_store(&future->done, 1);
+	pthread_cond_broadcast(&done_cond);
+	pthread_mutex_unlock(&done_lock);
+}
+
+static void run_task(struct tile_worker *w, struct tile_task *task)
+{
+	unsigned long long t0 = metric_now_ns();
+	struct tile_task half;
+
+	while (task->end - task->begin > 1) {
+		half = *task;
+		half.begin = task->begin + (task->end - task->begin) / 2;
+		task->end = half.begin;
+		push_task(w, &half);
+	}
+	TRACE_BEGIN(ts);
+	task->fn(task->arg, task->begin, w->index);
+	TRACE_END(ts, "tile");
+	w->stats.items++;
+	w->stats.busy_ns += metric_now_ns() - t0;
+	complete(task->future);
+}
+
+static void *tile_worker_main(void *arg)
+{
+	struct tile_worker *w = arg;
+	struct tile_task task;
+
+	TRACE_THREAD("tile");
+	for (;;) {
+		if (find_task(w, &task)) {
+			run_task(w, &task);
+			continue;
+		}
+		pthread_mutex_lock(&idle_lock);
+		atomic_fetch_add(&sleepers, 1);
+		while (!atomic_load(&queued) && !stopping)
+			pthread_cond_wait(&idle_cond, &idle_lock);
+		atomic_fetch_sub(&sleepers, 1);
+		if (stopping && !atomic_load(&queued)) {
+			pthread_mutex_unlock(&idle_lock);
+			break;
+		}
+		pthread_mutex_unlock(&idle_lock);
+	}
+
+	return NULL;
+}
+
+/* starts the workers on first use, tile_threads of them or one per online CPU */
+static int tile_pool_start(void)
+{
+	unsigned int n = tile_threads, i;
+	long cpus;
+
+	pthread_mutex_lock(&pool_lock);
+	if (workers) {
+		pthread_mutex_unlock(&pool_lock);
+		return 0;
+	}
+	if (!n) {
+		cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		n = cpus > 0 ? (unsigned int)cpus : 1;
+	}
+	if (n > TILE_MAX_WORKERS)
+		n = TILE_MAX_WORKERS;
+	workers = calloc(n, sizeof(*workers));
+	for (i = 0; i < n; ++i) {
+		workers[i].index = i;
+		workers[i].cap = 64;
+		workers[i].tasks = malloc(sizeof(struct tile_task) * workers[i].cap);
+		pthread_mutex_init(&workers[i].lock, NULL);
+	}
+	n_workers = n;
+	for (i = 0; i < n; ++i) {
+		if (pthread_create(&workers[i].thread, NULL, tile_worker_main, &workers[i])) {
+			fprintf(stderr, "tile pool: cannot start worker %u\n", i);
+			break;
+		}
+		workers[i].started = 1;
+	}
+	pthread_mutex_unlock(&pool_lock);
+	/* the workers that started steal what is pushed to the others */
+	if (!i) {
+		tile_pool_shutdown();
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+Function Name : tile_pool_threads
+Function Description : Number of workers in the pool, starting it if needed
+Parameter : void
+Return : worker count, 0 when the pool could not start
+**/
+unsigned int tile_pool_threads(void)
+{
+	if (tile_pool_start() != 0)
+		return 0;
+
+	return n_workers;
+}
+
+/**
+Function Name : tile_for
+Function Description : Runs fn for every item from 0 to n_items - 1 on the pool and returns at once; the
+                       future completes when the last item has finished
+Parameter : future to complete, the function and its argument, number of items
+Return : void
+**/
+void tile_for(struct tile_future *future, tile_fn fn, void *arg, unsigned int n_items)
+{
+	struct tile_task task = { fn, arg, future, 0, n_items };
+	unsigned int i;
+
+	future->submit_ns = metric_now_ns();
+	atomic_store(&future->pending, n_items);
+	atomic_store(&future->done, 0);
+	if (!n_items || tile_pool_start() != 0) {
+		/* nothing to run on, so run it here */
+		for (i = 0; i < n_items; ++i)
+			fn(arg, i, 0);
+		future->done_ns = metric_now_ns();
+		atomic_store(&future->done, 1);
+		return;
+	}
+	push_task(&workers[atomic_fetch_add(&next_worker, 1) % n_workers], &task);
+}
+
+int tile_done(struct tile_future *future)
+{
+	return atomic_load(&future->done);
+}
+
+/**
+Function Name : tile_wait
+Function Description : Blocks until every item of a submission has finished. Not to be called from an
+                       item, the worker it runs on may be the one the submission needs
+Parameter : the submission's future
+Return : nanoseconds from submission to completion
+**/
+unsigned long long tile_wait(struct tile_future *future)
+{
+	if (!atomic_load(&future->done)) {
+		pthread_mutex_lock(&done_lock);
+		while (!atomic_load(&future->done))
+			pthread_cond_wait(&done_cond, &done_lock);
+		pthread_mutex_unlock(&done_lock);
+	}
+
+	return future->done_ns - future->submit_ns;
+}
+
+/**
+Function Name : tile_scratch
+Function Description : A per-worker buffer for the item running on that worker, kept between items
+Parameter : worker index passed to the item, which of the two buffers, bytes needed
+Return : the buffer, NULL when it could not grow
+**/
+void *tile_scratch(unsigned int worker, unsigned int which, size_t size)
+{
+	struct tile_worker *w = workers ? &workers[worker] : &inline_worker;
+	unsigned char *grown;
+
+	if (w->scratch_size[which] < size) {
+		grown = realloc(w->scratch[which], size);
+		if (!grown)
+			return NULL;
+		w->scratch[which] = grown;
+		w->scratch_size[which] = size;
+	}
+
+	return w->scratch[which];
+}
+
+static void tile_chain_run(void *arg, unsigned int item, unsigned int worker)
+{
+	struct tile_chain *chain = arg;
+	const struct tile_filter *f;
+	unsigned int y = item * chain->tile_rows, rows = chain->height - y, i;
+	const unsigned char *in = chain->src + (size_t)y * chain->src_pitch;
+	int in_pitch = chain->src_pitch, out_pitch;
+	unsigned char *out;
+
+	if (rows > chain->tile_rows)
+		rows = chain->tile_rows;
+	for (i = 0; i < chain->n_filters; ++i) {
+		f = &chain->filters[i];
+		if (i + 1 == chain->n_filters) {
+			out = chain->dst + (size_t)y * chain->dst_pitch;
+			out_pitch = chain->dst_pitch;
+		} else {
+			out_pitch = chain->width * f->out_bpp;
+			out = tile_scratch(worker, i & 1, (size_t)out_pitch * rows);
+		}
+		f->run(f->arg, in, in_pitch, out, out_pitch, chain->width, y, rows);
+		in = out;
+		in_pitch = out_pitch;
+	}
+}
+
+/**
+Function Name : tile_chain_submit
+Function Description : Cuts the frame into bands of rows sized so the widest buffer of a band is about
+                       TILE_BYTES, and runs the whole chain on each band; wait on chain->future
+Parameter : the chain, which must stay valid until its future is done
+Return : void
+**/
+void tile_chain_submit(struct tile_chain *chain)
+{
+	unsigned int bpp = chain->src_bpp, i, rows;
+
+	for (i = 0; i < chain->n_filters; ++i)
+		if (chain->filters[i].out_bpp > bpp)
+			bpp = chain->filters[i].out_bpp;
+	rows = TILE_BYTES / (chain->width * bpp);
+	chain->tile_rows = rows < 1 ? 1 : rows > chain->height ? chain->height : rows;
+	tile_for(&chain->future, tile_chain_run, chain, (chain->height + chain->tile_rows - 1) / chain->tile_rows);
+}
+
+/**
+Function Name : tile_pool_stats
+Function Description : Sums the item, steal and busy counters of all workers
+Parameter : totals to fill
+Return : void
+**/
+void tile_pool_stats(struct tile_stats *total)
+{
+	unsigned int i;
+
+	memset(total, 0, sizeof(*total));
+	for (i = 0; i < n_workers; ++i) {
+		total->items += workers[i].stats.items;
+		total->steals += workers[i].stats.steals;
+		total->busy_ns += workers[i].stats.busy_ns;
+	}
+}
+
+/**
+Function Name : tile_pool_shutdown
+Function Description : Lets the workers finish what is queued, joins them and frees the pool; the next
+                       submission starts a new one with the current tile_threads
+Parameter : void
+Return : void
+**/
+void tile_pool_shutdown(void)
+{
+	unsigned int i;
+
+	pthread_mutex_lock(&pool_lock);
+	if (!workers) {
+		pthread_mutex_unlock(&pool_lock);
+		return;
+	}
+	pthread_mutex_lock(&idle_lock);
+	stopping = 1;
+	pthread_cond_broadcast(&idle_cond);
+	pthread_mutex_unlock(&idle_lock);
+	for (i = 0; i < n_workers; ++i)
+		if (workers[i].started)
+			pthread_join(workers[i].thread, NULL);
+	/* only now, a worker still running may steal from any deque */
+	for (i = 0; i < n_workers; ++i) {
+		pthread_mutex_destroy(&workers[i].lock);
+		free(workers[i].tasks);
+		free(workers[i].scratch[0]);
+		free(workers[i].scratch[1]);
+	}
+	free(workers);
+	workers = NULL;
+	n_workers = 0;
+	stopping = 0;
+	pthread_mutex_unlock(&pool_lock);
+}
+
+/**
+Function Name : tile_pool_finish
+Function Description : Prints how the items spread over the workers, then shuts the pool down
+Parameter : void
+Return : void
+**/
+void tile_pool_finish(void)
+{
+	struct tile_stats total;
+	unsigned int i;
+
+	if (!workers)
+		return;
+	tile_pool_stats(&total);
+	if (total.items) {
+		printf("tiles: %u workers, %llu items, %llu stolen, busy", n_workers, total.items, total.steals);
+		for (i = 0; i < n_workers; ++i)
+			printf(" %.0f%%", total.busy_ns ? workers[i].stats.busy_ns * 100.0 / total.busy_ns : 0);
+		printf(" of the pool's time\n");
+	}
+	tile_pool_shutdown();
+}
+
+/**
+Function Name : tile_yuyv_rgb
+Function Description : Chain filter, YUYV to RGB24 with BT.601 studio range coefficients
+Parameter : filter argument (unused), tile input and output rows with their pitches, width, first row, rows
+Return : void
+**/
+void tile_yuyv_rgb(void *arg, const unsigned char *in, int in_pitch, unsigned char *out, int out_pitch,
+	unsigned int width, unsigned int y, unsigned int rows)
+{
+	const unsigned char *s;
+	unsigned char *d;
+	unsigned int i, x, k;
+	int luma[2], u, v, r, g, b, c;
+
+	(void)arg;
+	(void)y;
+	for (i = 0; i < rows; ++i) {
+		s = in + (size_t)i * in_pitch;
+		d = out + (size_t)i * out_pitch;
+		for (x = 0; x + 1 < width; x += 2, s += 4) {
+			luma[0] = 298 * (s[0] - 16);
+			luma[1] = 298 * (s[2] - 16);
+			u = s[1] - 128;
+			v = s[3] - 128;
+			r = 409 * v + 128;
+			g = -100 * u - 208 * v + 128;
+			b = 516 * u + 128;
+			for (k = 0; k < 2; ++k, d += 3) {
+				c = (luma[k] + r) >> 8;
+				d[0] = c < 0 ? 0 : c > 255 ? 255 : c;
+				c = (luma[k] + g) >> 8;
+				d[1] = c < 0 ? 0 : c > 255 ? 255 : c;
+				c = (luma[k] + b) >> 8;
+				d[2] = c < 0 ? 0 : c > 255 ? 255 : c;
+			}
+		}
+	}
+}
+
+/**
+Function Name : tile_rgb_lut
+Function Description : Chain filter, maps every byte of RGB24 through a 256 entry table (gamma, contrast)
+Parameter : the table, tile input and output rows with their pitches, width, first row, rows
+Return : void
+**/
+void tile_rgb_lut(void *arg, const unsigned char *in, int in_pitch, unsigned char *out, int out_pitch,
+	unsigned int width, unsigned int y, unsigned int rows)
+{
+	const unsigned char *lut = arg, *s;
+	unsigned char *d;
+	unsigned int i, x;
+
+	(void)y;
+	for (i = 0; i < rows; ++i) {
+		s = in + (size_t)i * in_pitch;
+		d = out + (size_t)i * out_pitch;
+		for (x = 0; x < width * 3; ++x)
+			d[x] = lut[s[x]];
+	}
+}
+
+/**
+Function Name : tile_rgb_luma
+Function Description : Chain filter, RGB24 to 8-bit luma with BT.601 weights
+Parameter : filter argument (unused), tile input and output rows with their pitches, width, first row, rows
+Return : void
+**/
+void tile_rgb_luma(void *arg, const unsigned char *in, int in_pitch, unsigned char *out, int out_pitch,
+	unsigned int width, unsigned int y, unsigned int rows)
+{
+	const unsigned char *s;
+	unsigned char *d;
+	unsigned int i, x;
+
+	(void)arg;
+	(void)y;
+	for (i = 0; i < rows; ++i) {
+		s = in + (size_t)i * in_pitch;
+		d = out + (size_t)i * out_pitch;
+		for (x = 0; x < width; ++x, s += 3)
+			d[x] = (77 * s[0] + 150 * s[1] + 29 * s[2] + 128) >> 8;
+	}
+}
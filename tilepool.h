@@ -0,0 +1,65 @@
+#pragma once
+#include <stdatomic.h>
+
+#define TILE_MAX_WORKERS 64
+#define TILE_BYTES (64 * 1024)          /* target size of one tile of the widest buffer in a chain */
+
+/* Completion of one submission; poll it with tile_done() or block in tile_wait() */
+struct tile_future {
+	atomic_uint pending;            /* items not yet finished */
+	atomic_int done;
+	unsigned long long submit_ns, done_ns;
+};
+
+/* One item of a submission, run on the worker given by index (for tile_scratch()) */
+typedef void (*tile_fn)(void *arg, unsigned int item, unsigned int worker);
+
+/*
+ * A filter turns the rows of one tile into rows of its output. Between filters of a chain the rows live in
+ * the worker's scratch, only the first filter reads the frame and only the last writes the destination.
+ */
+struct tile_filter {
+	const char *name;
+	unsigned int out_bpp;           /* bytes per pixel written */
+	void (*run)(void *arg, const unsigned char *in, int in_pitch, unsigned char *out, int out_pitch,
+		unsigned int width, unsigned int y, unsigned int rows);
+	void *arg;
+};
+
+struct tile_chain {
+	const struct tile_filter *filters;
+	unsigned int n_filters;
+	const unsigned char *src;
+	int src_pitch;
+	unsigned int src_bpp;
+	unsigned char *dst;
+	int dst_pitch;
+	unsigned int width, height;
+	unsigned int tile_rows;         /* set by tile_chain_submit() */
+	struct tile_future future;
+};
+
+struct tile_stats {
+	unsigned long long items;       /* tiles, bands or other items run */
+	unsigned long long steals;      /* tasks taken from another worker's deque */
+	unsigned long long busy_ns;
+};
+
+extern unsigned int tile_threads;
+
+unsigned int tile_pool_threads(void);
+void tile_for(struct tile_future *future, tile_fn fn, void *arg, unsigned int n_items);
+int tile_done(struct tile_future *future);
+unsigned long long tile_wait(struct tile_future *future);
+void *tile_scratch(unsigned int worker, unsigned int which, size_t size);
+void tile_chain_submit(struct tile_chain *chain);
+void tile_pool_stats(struct tile_stats *total);
+void tile_pool_shutdown(void);
+void tile_pool_finish(void);
+
+void tile_yuyv_rgb(void *arg, const unsigned char *in, int in_pitch, unsigned char *out, int out_pitch,
+	unsigned int width, unsigned int y, unsigned int rows);
+void tile_rgb_lut(void *arg, const unsigned char *in, int in_pitch, unsigned char *out, int out_pitch,
+	unsigned int width, unsigned int y, unsigned int rows);
+void tile_rgb_luma(void *arg, const unsigned char *in, int in_pitch, unsigned char *out, int out_pitch,
+	unsigned int width, unsigned int y, unsigned int rows);
@@ -0,0 +1,196 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdatomic.h>
+#include <sys/syscall.h>
+
+#include "trace.h"
+
+const char *trace_path;
+volatile sig_atomic_t trace_dump_requested;
+
+#ifdef V4L2_TRACE
+
+#define TRACE_EVENTS 65536              /* per thread, oldest events are overwritten */
+
+struct trace_event {
+	atomic_ulong seq;               /* 2 * index + 1 while written, 2 * index + 2 once complete */
+	const char *name;
+	unsigned long long start_ns;
+	unsigned long long dur_ns;
+};
+
+/*
+ * One per thread: only the owner writes, dumps read up to the published head. A dump may run while the owner
+ * keeps tracing and wraps over the oldest events, so each event is read as a seqlock: it counts only if its
+ * sequence says the same complete event before and after the copy.
+ */
+struct trace_buffer {
+	struct trace_buffer *next;
+	const char *thread_name;
+	long tid;
+	atomic_ulong head;
+	struct trace_event events[TRACE_EVENTS];
+};
+
+static _Atomic(struct trace_buffer *) trace_buffers;
+static __thread struct trace_buffer *trace_self;
+
+static struct trace_buffer *trace_buffer_get(void)
+{
+	struct trace_buffer *tb = trace_self, *head;
+
+	if (tb)
+		return tb;
+
+	tb = calloc(1, sizeof(*tb));
+	if (!tb)
+		return NULL;
+	tb->tid = syscall(SYS_gettid);
+	tb->thread_name = "thread";
+	head = atomic_load(&trace_buffers);
+	do {
+		tb->next = head;
+	} while (!atomic_compare_exchange_weak(&trace_buffers, &head, tb));
+	trace_self = tb;
+
+	return tb;
+}
+
+/**
+Function Name : trace_record
+Function Description : Appends one complete event to the calling thread's buffer without locking
+Parameter : static event name, start and end in CLOCK_MONOTONIC nanoseconds
+Return : void
+**/
+void trace_record(const char *name, unsigned long long start_ns, unsigned long long end_ns)
+{
+	struct trace_buffer *tb = trace_buffer_get();
+	unsigned long head;
+	struct trace_event *ev;
+
+	if (!tb)
+		return;
+	head = atomic_load_explicit(&tb->head, memory_order_relaxed);
+	ev = &tb->events[head % TRACE_EVENTS];
+	atomic_store_explicit(&ev->seq, 2 * head + 1, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+	__atomic_store_n(&ev->name, name, __ATOMIC_RELAXED);
+	__atomic_store_n(&ev->start_ns, start_ns, __ATOMIC_RELAXED);
+	__atomic_store_n(&ev->dur_ns, end_ns - start_ns, __ATOMIC_RELAXED);
+	atomic_store_explicit(&ev->seq, 2 * head + 2, memory_order_release);
+	atomic_store_explicit(&tb->head, head + 1, memory_order_release);
+}
+
+void trace_thread_name(const char *name)
+{
+	struct trace_buffer *tb = trace_buffer_get();
+
+	if (tb)
+		tb->thread_name = name;
+}
+
+/**
+Function Name : trace_dump
+Function Description : Writes every thread's events as Chrome trace-event JSON, loadable in chrome://tracing
+                       and ui.perfetto.dev. Other threads may keep tracing: an event they overwrite while it
+                       is copied is left out and counted as skipped
+Parameter : output path
+Return : number of events written, -1 for failure
+**/
+int trace_dump(const char *path)
+{
+	struct trace_buffer *tb;
+	struct trace_event *ev, copy;
+	unsigned long head, i, seq;
+	int pid = getpid(), count = 0, skipped = 0, first = 1;
+	FILE *fp;
+
+	if (!path)
+		return -1;
+	fp = fopen(path, "w");
+	if (!fp) {
+		perror("trace");
+		return -1;
+	}
+
+	fprintf(fp, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+	for (tb = atomic_load(&trace_buffers); tb; tb = tb->next) {
+		fprintf(fp, "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%ld,\"args\":{\"name\":\"%s\"}}",
+			first ? "" : ",", pid, tb->tid, tb->thread_name);
+		first = 0;
+
+		head = atomic_load_explicit(&tb->head, memory_order_acquire);
+		for (i = head > TRACE_EVENTS ? head - TRACE_EVENTS : 0; i < head; ++i) {
+			ev = &tb->events[i % TRACE_EVENTS];
+			seq = atomic_load_explicit(&ev->seq, memory_order_acquire);
+			copy.name = __atomic_load_n(&ev->name, __ATOMIC_RELAXED);
+			copy.start_ns = __atomic_load_n(&ev->start_ns, __ATOMIC_RELAXED);
+			copy.dur_ns = __atomic_load_n(&ev->dur_ns, __ATOMIC_RELAXED);
+			atomic_thread_fence(memory_order_acquire);
+			if (seq != 2 * i + 2 || atomic_load_explicit(&ev->seq, memory_order_relaxed) != seq) {
+				skipped++;      /* overwritten by a newer event, or being written */
+				continue;
+			}
+			fprintf(fp, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%ld,\"ts\":%.3f,\"dur\":%.3f}",
+				copy.name, pid, tb->tid, copy.start_ns / 1e3, copy.dur_ns / 1e3);
+			count++;
+		}
+	}
+	fprintf(fp, "\n]}\n");
+	fclose(fp);
+	fprintf(stderr, "\ntrace: %d events written to %s", count, path);
+	if (skipped)
+		fprintf(stderr, ", %d overwritten while dumping left out", skipped);
+	fprintf(stderr, "\n");
+
+	return count;
+}
+
+#else
+
+void trace_thread_name(const char *name)
+{
+	(void)name;
+}
+
+int trace_dump(const char *path)
+{
+	(void)path;
+	fprintf(stderr, "trace: built without V4L2_TRACE, rebuild with make TRACE=1\n");
+	return -1;
+}
+
+#endif
+
+static void trace_signal(int sig)
+{
+	(void)sig;
+	trace_dump_requested = 1;
+}
+
+/**
+Function Name : trace_install_signal
+Function Description : SIGUSR1 requests a dump of the trace collected so far
+Parameter : void
+Return : void
+**/
+void trace_install_signal(void)
+{
+	signal(SIGUSR1, trace_signal);
+}
+
+/**
+Function Name : trace_poll
+Function Description : Performs a dump requested by SIGUSR1, called from the capture and event loops
+Parameter : void
+Return : void
+**/
+void trace_poll(void)
+{
+	if (!trace_dump_requested)
+		return;
+	trace_dump_requested = 0;
+	trace_dump(trace_path);
+}
@@ -0,0 +1,36 @@
+#pragma once
+#include <signal.h>
+
+/*
+ * Trace points compile to nothing unless built with -DV4L2_TRACE (make TRACE=1).
+ * TRACE_BEGIN declares a timestamp, so keep it out of the first statement after a label.
+ */
+#ifdef V4L2_TRACE
+#include <time.h>
+
+static inline unsigned long long trace_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+void trace_record(const char *name, unsigned long long start_ns, unsigned long long end_ns);
+
+#define TRACE_BEGIN(ts)         unsigned long long ts = trace_now_ns()
+#define TRACE_END(ts, name)     trace_record(name, ts, trace_now_ns())
+#define TRACE_THREAD(name)      trace_thread_name(name)
+#else
+#define TRACE_BEGIN(ts)         do { } while (0)
+#define TRACE_END(ts, name)     do { } while (0)
+#define TRACE_THREAD(name)      do { } while (0)
+#endif
+
+extern const char *trace_path;
+extern volatile sig_atomic_t trace_dump_requested;
+
+void trace_thread_name(const char *name);
+int trace_dump(const char *path);
+void trace_install_signal(void);
+void trace_poll(void);
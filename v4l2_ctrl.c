@@ -9,7 +9,7 @@ void deviceInfo()
 	struct v4l2_capability cap;
 	int index;
 	
-	 if (-1 == ioctl(fd, VIDIOC_QUERYCAP, &cap)) 
+	 if (-1 == xioctl(fd, VIDIOC_QUERYCAP, &cap)) 
 	 {
                 if (EINVAL == errno) {
                         fprintf(stderr, "%s is no V4L2 device\\n",
@@ -132,7 +132,7 @@ int listFormats()
 
 	struct v4l2_capability cap;
 	
-	if (-1 == ioctl(fd, VIDIOC_QUERYCAP, &cap)) 
+	if (-1 == xioctl(fd, VIDIOC_QUERYCAP, &cap)) 
  	{
             if (EINVAL == errno) 
             {
@@ -159,7 +159,7 @@ int listFormats()
 	fmt.index = 0;
 	fmt.type = type;
 	
-	while (ioctl(fd, VIDIOC_ENUM_FMT, &fmt) >= 0) {
+	while (xioctl(fd, VIDIOC_ENUM_FMT, &fmt) >= 0) {
 		printf("\tIndex       : %d\n", fmt.index);
 		printf("\tType        : ");	bufferTypeToString(fmt.type); printf("\n");
 		printf("\tPixel Format: "); fcc2s(fmt.pixelformat);
@@ -174,14 +174,14 @@ int listFormats()
 		printf("\tName        : %s\n", fmt.description);
 		frmsize.pixel_format = fmt.pixelformat;
 		frmsize.index = 0;
-		while (ioctl(fd, VIDIOC_ENUM_FRAMESIZES, &frmsize) >= 0) {
+		while (xioctl(fd, VIDIOC_ENUM_FRAMESIZES, &frmsize) >= 0) {
 			print_frmsize(frmsize, "\t");
 			if (frmsize.type == V4L2_FRMSIZE_TYPE_DISCRETE) {
 				frmival.index = 0;
 				frmival.pixel_format = fmt.pixelformat;
 				frmival.width = frmsize.discrete.width;
 				frmival.height = frmsize.discrete.height;
-				while (ioctl(fd, VIDIOC_ENUM_FRAMEINTERVALS, &frmival) >= 0) {
+				while (xioctl(fd, VIDIOC_ENUM_FRAMEINTERVALS, &frmival) >= 0) {
 					print_frmival(frmival, "\t\t");
 					frmival.index++;
 				}
@@ -204,7 +204,7 @@ void enumerateMenu(struct v4l2_queryctrl queryctrl)
 	printf("\n");
 	for (querymenu.index = queryctrl.minimum; querymenu.index <= queryctrl.maximum; querymenu.index++) 
     {
-        if (0 != ioctl(fd, VIDIOC_QUERYMENU, &querymenu)) 
+        if (0 != xioctl(fd, VIDIOC_QUERYMENU, &querymenu)) 
         	continue;
         if (queryctrl.type == V4L2_CTRL_TYPE_MENU)
 				printf("\t\t\t\t%d: %s\n", querymenu.index, querymenu.name);
@@ -221,7 +221,7 @@ void listControls()
 	CLEAR(queryctrl);
 	
 	queryctrl.id = V4L2_CTRL_FLAG_NEXT_CTRL;
-	while (0 == ioctl(fd, VIDIOC_QUERYCTRL, &queryctrl)) 
+	while (0 == xioctl(fd, VIDIOC_QUERYCTRL, &queryctrl)) 
 	{
     	if (!(queryctrl.flags & V4L2_CTRL_FLAG_DISABLED)) 
     	{
@@ -302,7 +302,7 @@ void listControls()
         	CLEAR(control);
 			control.id = queryctrl.id;
 
-			if (0 == ioctl(fd, VIDIOC_G_CTRL, &control)) 
+			if (0 == xioctl(fd, VIDIOC_G_CTRL, &control)) 
 			{
 				printf(" value=%d", control.value);
 			}
@@ -1,8 +1,6 @@
 extern int fd;
 extern char *dev_path, *outfile, *pix_format_str;
 extern enum io_method io;
-extern struct buffer *buffers;
-extern unsigned int n_buffers;
 extern unsigned int width , height, capture, frame_count, type, pix_format;
 extern struct timeval start_time, end_time;
 extern double elapsed_time;
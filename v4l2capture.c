@@ -0,0 +1,586 @@
+#include "header.h"
+#include <poll.h>
+#include "v4l2capture.h"
+#include "synth.h"
+
+struct v4l2cap_buffer {
+	void *start;
+	unsigned int length;
+};
+
+struct v4l2cap {
+	int fd;
+	const struct dev_ops *ops;
+	char *path;
+	int flags;
+	enum v4l2cap_io io;
+	struct v4l2cap_buffer *buffers;
+	unsigned int n_buffers;
+	unsigned int sizeimage;
+	int configured, streaming;
+	int read_busy;                  /* the read() buffer is out with the caller */
+	unsigned int read_sequence;     /* read() has no sequence numbers, frames are counted instead */
+	struct v4l2cap_stats stats;
+	struct v4l2cap_config config;   /* last successful configuration, reapplied by v4l2cap_reopen() */
+	int lost;                       /* detached from a vanished device: 1, or 2 if it was streaming */
+	struct v4l2cap_buffer *pool;    /* read/userptr memory kept across a reopen */
+	unsigned int n_pool;
+};
+
+static int sys_open(const char *path, int flags)
+{
+	return open(path, flags);
+}
+
+static int sys_ioctl(int fd, unsigned long request, void *arg)
+{
+	return ioctl(fd, request, arg);
+}
+
+static const struct dev_ops sys_dev_ops = {
+	.open   = sys_open,
+	.close  = close,
+	.ioctl  = sys_ioctl,
+	.mmap   = mmap,
+	.munmap = munmap,
+	.read   = read,
+};
+
+static int cap_ioctl(struct v4l2cap *ctx, unsigned long request, void *arg)
+{
+	int r;
+
+	do {
+		r = ctx->ops->ioctl(ctx->fd, request, arg);
+	} while (-1 == r && EINTR == errno);
+
+	return r == -1 ? -errno : r;
+}
+
+static unsigned int cap_memory(const struct v4l2cap *ctx)
+{
+	return ctx->io == V4L2CAP_IO_MMAP ? V4L2_MEMORY_MMAP : V4L2_MEMORY_USERPTR;
+}
+
+static int cap_queue(struct v4l2cap *ctx, unsigned int index)
+{
+	struct v4l2_buffer buf;
+	int ret;
+
+	CLEAR(buf);
+	buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	buf.memory = cap_memory(ctx);
+	buf.index = index;
+	if (ctx->io == V4L2CAP_IO_USERPTR) {
+		buf.m.userptr = (unsigned long)ctx->buffers[index].start;
+		buf.length = ctx->buffers[index].length;
+	}
+
+	ret = cap_ioctl(ctx, VIDIOC_QBUF, &buf);
+	if (ret == 0)
+		ctx->stats.queued++;
+	return ret;
+}
+
+/* Picks the backend for ctx->path and opens it; shared by v4l2cap_open and v4l2cap_reopen */
+static int cap_attach(struct v4l2cap *ctx)
+{
+	int ret;
+
+	ctx->ops = &sys_dev_ops;
+	if (strncmp(ctx->path, "synth", 5) == 0 && (ret = synth_dev_open(ctx->path, &ctx->ops)) < 0)
+		return ret;
+	ctx->fd = ctx->ops->open(ctx->path, ctx->flags);
+
+	return ctx->fd < 0 ? -errno : 0;
+}
+
+/**
+Function Name : v4l2cap_open
+Function Description : Opens a capture node, or the synthetic device for paths starting with "synth"
+Parameter : where to store the new context, device path and open(2) flags (O_NONBLOCK makes dequeue return -EAGAIN)
+Return : 0 for success, -errno for failure
+**/
+int v4l2cap_open(struct v4l2cap **ctx, const char *path, int flags)
+{
+	struct v4l2cap *c = calloc(1, sizeof(*c));
+	int ret;
+
+	if (!c)
+		return -ENOMEM;
+
+	c->path = strdup(path);
+	c->flags = flags;
+	if (!c->path || (ret = cap_attach(c)) < 0) {
+		ret = c->path ? ret : -ENOMEM;
+		free(c->path);
+		free(c);
+		return ret;
+	}
+
+	*ctx = c;
+	return 0;
+}
+
+/* Memory from before a reopen, if a pooled buffer is big enough */
+static void *cap_pool_take(struct v4l2cap *ctx, unsigned int *length)
+{
+	unsigned int i;
+	void *start;
+
+	for (i = 0; i < ctx->n_pool; ++i) {
+		if (ctx->pool[i].length < ctx->sizeimage)
+			continue;
+		start = ctx->pool[i].start;
+		*length = ctx->pool[i].length;
+		ctx->pool[i] = ctx->pool[--ctx->n_pool];
+		return start;
+	}
+	*length = ctx->sizeimage;
+
+	return malloc(ctx->sizeimage);
+}
+
+static void cap_pool_free(struct v4l2cap *ctx)
+{
+	while (ctx->n_pool)
+		free(ctx->pool[--ctx->n_pool].start);
+	free(ctx->pool);
+	ctx->pool = NULL;
+}
+
+/**
+Function Name : v4l2cap_configure
+Function Description : Checks the device can capture with the requested I/O method and format, sets the format
+                       and allocates or maps the buffers. Reconfiguring releases the previous buffers first.
+Parameter : context and requested configuration, updated with the negotiated size
+Return : 0 for success, -errno for failure (-EINVAL for an unsupported I/O method or pixel format)
+**/
+int v4l2cap_configure(struct v4l2cap *ctx, struct v4l2cap_config *config)
+{
+	struct v4l2_capability cap;
+	struct v4l2_fmtdesc fmtdesc;
+	struct v4l2_format fmt;
+	struct v4l2_requestbuffers req;
+	struct v4l2_buffer buf;
+	unsigned int count = config->buffers ? config->buffers : V4L2CAP_DEFAULT_BUFFERS;
+	int ret;
+
+	if (ctx->streaming)
+		return -EBUSY;
+	if ((ret = v4l2cap_unconfigure(ctx)) < 0)
+		return ret;
+
+	CLEAR(cap);
+	if ((ret = cap_ioctl(ctx, VIDIOC_QUERYCAP, &cap)) < 0)
+		return ret;
+	if (!(cap.capabilities & V4L2_CAP_VIDEO_CAPTURE))
+		return -EINVAL;
+	if (!(cap.capabilities & (config->io == V4L2CAP_IO_READ ? V4L2_CAP_READWRITE : V4L2_CAP_STREAMING)))
+		return -EINVAL;
+
+	CLEAR(fmtdesc);
+	fmtdesc.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	while ((ret = cap_ioctl(ctx, VIDIOC_ENUM_FMT, &fmtdesc)) == 0 && fmtdesc.pixelformat != config->pixelformat)
+		fmtdesc.index++;
+	if (ret < 0)
+		return -EINVAL;
+
+	CLEAR(fmt);
+	fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	fmt.fmt.pix.width = config->width;
+	fmt.fmt.pix.height = config->height;
+	fmt.fmt.pix.pixelformat = config->pixelformat;
+	if ((ret = cap_ioctl(ctx, VIDIOC_S_FMT, &fmt)) < 0)
+		return ret;
+
+	config->width = fmt.fmt.pix.width;
+	config->height = fmt.fmt.pix.height;
+	config->bytesperline = fmt.fmt.pix.bytesperline;
+	config->sizeimage = fmt.fmt.pix.sizeimage;
+	ctx->io = config->io;
+	ctx->sizeimage = fmt.fmt.pix.sizeimage;
+
+	if (ctx->io == V4L2CAP_IO_READ)
+		count = 1;
+	else {
+		CLEAR(req);
+		req.count = count;
+		req.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+		req.memory = cap_memory(ctx);
+		if ((ret = cap_ioctl(ctx, VIDIOC_REQBUFS, &req)) < 0)
+			return ret;
+		if (req.count < 2)
+			return -ENOMEM;
+		count = req.count;
+	}
+
+	ctx->buffers = calloc(count, sizeof(*ctx->buffers));
+	if (!ctx->buffers)
+		return -ENOMEM;
+	ctx->configured = 1;
+
+	for (ctx->n_buffers = 0; ctx->n_buffers < count; ++ctx->n_buffers) {
+		struct v4l2cap_buffer *b = &ctx->buffers[ctx->n_buffers];
+
+		if (ctx->io != V4L2CAP_IO_MMAP) {
+			b->start = cap_pool_take(ctx, &b->length);
+			if (!b->start)
+				ret = -ENOMEM;
+		} else {
+			CLEAR(buf);
+			buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+			buf.memory = V4L2_MEMORY_MMAP;
+			buf.index = ctx->n_buffers;
+			if ((ret = cap_ioctl(ctx, VIDIOC_QUERYBUF, &buf)) == 0) {
+				b->length = buf.length;
+				b->start = ctx->ops->mmap(NULL, buf.length, PROT_READ | PROT_WRITE, MAP_SHARED,
+					ctx->fd, buf.m.offset);
+				if (MAP_FAILED == b->start)
+					ret = -errno;
+			}
+		}
+		if (ret < 0) {
+			v4l2cap_unconfigure(ctx);
+			return ret;
+		}
+	}
+	cap_pool_free(ctx);
+	ctx->config = *config;
+
+	return 0;
+}
+
+/**
+Function Name : v4l2cap_unconfigure
+Function Description : Unmaps or frees the buffers and hands the driver buffers back with a zero REQBUFS
+Parameter : context, which must not be streaming
+Return : 0 for success, -EBUSY while streaming
+**/
+int v4l2cap_unconfigure(struct v4l2cap *ctx)
+{
+	struct v4l2_requestbuffers req;
+	unsigned int i;
+
+	if (ctx->streaming)
+		return -EBUSY;
+	if (!ctx->configured)
+		return 0;
+
+	for (i = 0; i < ctx->n_buffers; ++i) {
+		if (ctx->io == V4L2CAP_IO_MMAP)
+			ctx->ops->munmap(ctx->buffers[i].start, ctx->buffers[i].length);
+		else
+			free(ctx->buffers[i].start);
+	}
+	free(ctx->buffers);
+	ctx->buffers = NULL;
+	ctx->n_buffers = 0;
+	ctx->configured = 0;
+
+	if (ctx->io != V4L2CAP_IO_READ) {
+		CLEAR(req);
+		req.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+		req.memory = cap_memory(ctx);
+		cap_ioctl(ctx, VIDIOC_REQBUFS, &req);
+	}
+
+	return 0;
+}
+
+/**
+Function Name : v4l2cap_start
+Function Description : Queues every buffer and turns the stream on
+Parameter : configured context
+Return : 0 for success, -errno for failure
+**/
+int v4l2cap_start(struct v4l2cap *ctx)
+{
+	enum v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	unsigned int i;
+	int ret;
+
+	if (!ctx->configured)
+		return -EINVAL;
+	if (ctx->streaming)
+		return -EBUSY;
+
+	ctx->stats.error_run = 0;
+	if (ctx->io != V4L2CAP_IO_READ) {
+		ctx->stats.queued = 0;
+		for (i = 0; i < ctx->n_buffers; ++i)
+			if ((ret = cap_queue(ctx, i)) < 0)
+				return ret;
+		if ((ret = cap_ioctl(ctx, VIDIOC_STREAMON, &type)) < 0)
+			return ret;
+	}
+	ctx->streaming = 1;
+
+	return 0;
+}
+
+/**
+Function Name : v4l2cap_dequeue
+Function Description : Waits for the next good frame. Buffers flagged V4L2_BUF_FLAG_ERROR are requeued and
+                       counted, giving up after V4L2CAP_MAX_ERROR_RUN of them in a row.
+Parameter : streaming context and the frame to fill in
+Return : 0 for success, -EAGAIN when non-blocking and nothing is ready, -EIO after too many corrupted
+         frames, -errno for other failures
+**/
+int v4l2cap_dequeue(struct v4l2cap *ctx, struct v4l2cap_frame *frame)
+{
+	struct v4l2_buffer buf;
+	ssize_t n;
+	int ret;
+
+	if (!ctx->streaming)
+		return -EINVAL;
+
+	if (ctx->io == V4L2CAP_IO_READ) {
+		if (ctx->read_busy)
+			return -EBUSY;
+		n = ctx->ops->read(ctx->fd, ctx->buffers[0].start, ctx->buffers[0].length);
+		if (n < 0)
+			return -errno;
+		CLEAR(*frame);
+		frame->data = ctx->buffers[0].start;
+		frame->bytesused = n;
+		frame->sequence = ctx->read_sequence++;
+		gettimeofday(&frame->timestamp, NULL);
+		ctx->read_busy = 1;
+		ctx->stats.frames++;
+		return 0;
+	}
+
+	for (;;) {
+		CLEAR(buf);
+		buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+		buf.memory = cap_memory(ctx);
+		if ((ret = cap_ioctl(ctx, VIDIOC_DQBUF, &buf)) < 0)
+			return ret;
+		ctx->stats.queued--;
+
+		/* Corrupted frame: hand the buffer straight back and wait for the next one */
+		if (buf.flags & V4L2_BUF_FLAG_ERROR) {
+			ctx->stats.errors++;
+			if (++ctx->stats.error_run > ctx->stats.longest_error_run)
+				ctx->stats.longest_error_run = ctx->stats.error_run;
+			if ((ret = cap_queue(ctx, buf.index)) < 0)
+				return ret;
+			if (ctx->stats.error_run >= V4L2CAP_MAX_ERROR_RUN)
+				return -EIO;
+			continue;
+		}
+
+		if (buf.index >= ctx->n_buffers)
+			return -EINVAL;
+		ctx->stats.error_run = 0;
+		ctx->stats.frames++;
+		frame->data = ctx->buffers[buf.index].start;
+		frame->bytesused = buf.bytesused;
+		frame->index = buf.index;
+		frame->sequence = buf.sequence;
+		frame->flags = buf.flags;
+		frame->timestamp = buf.timestamp;
+		return 0;
+	}
+}
+
+/**
+Function Name : v4l2cap_release
+Function Description : Gives a dequeued frame back to the driver. Releasing after v4l2cap_stop() is a no-op,
+                       since STREAMOFF already took every buffer back.
+Parameter : context and the frame from v4l2cap_dequeue
+Return : 0 for success, -errno for failure
+**/
+int v4l2cap_release(struct v4l2cap *ctx, const struct v4l2cap_frame *frame)
+{
+	if (!ctx->streaming)
+		return 0;
+	if (ctx->io == V4L2CAP_IO_READ) {
+		ctx->read_busy = 0;
+		return 0;
+	}
+	if (frame->index >= ctx->n_buffers)
+		return -EINVAL;
+
+	return cap_queue(ctx, frame->index);
+}
+
+/**
+Function Name : v4l2cap_run
+Function Description : Dequeues frames into a callback and releases each one when it returns
+Parameter : streaming context, number of frames (0 for no limit), callback and its argument
+Return : frames delivered, or -errno if the device failed before any were
+**/
+long v4l2cap_run(struct v4l2cap *ctx, unsigned long frames, v4l2cap_frame_fn fn, void *user)
+{
+	struct v4l2cap_frame frame;
+	unsigned long done = 0;
+	int ret, stop;
+
+	while (frames == 0 || done < frames) {
+		if ((ret = v4l2cap_dequeue(ctx, &frame)) < 0) {
+			if (ret == -EAGAIN) {
+				struct pollfd pfd = { .fd = ctx->fd, .events = POLLIN };
+
+				poll(&pfd, 1, -1);
+				continue;
+			}
+			return done ? (long)done : ret;
+		}
+		stop = fn(&frame, user);
+		done++;
+		if ((ret = v4l2cap_release(ctx, &frame)) < 0)
+			return done ? (long)done : ret;
+		if (stop)
+			break;
+	}
+
+	return done;
+}
+
+/**
+Function Name : v4l2cap_stop
+Function Description : Turns the stream off; the driver takes back every buffer, including unreleased frames
+Parameter : context
+Return : 0 for success, -errno for failure
+**/
+int v4l2cap_stop(struct v4l2cap *ctx)
+{
+	enum v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	int ret = 0;
+
+	if (!ctx->streaming)
+		return 0;
+	if (ctx->io != V4L2CAP_IO_READ)
+		ret = cap_ioctl(ctx, VIDIOC_STREAMOFF, &type);
+	ctx->streaming = 0;
+	ctx->read_busy = 0;
+	ctx->stats.queued = 0;
+
+	return ret;
+}
+
+/**
+Function Name : v4l2cap_close
+Function Description : Stops, releases the buffers and closes the device
+Parameter : context, may be NULL
+Return : void
+**/
+void v4l2cap_close(struct v4l2cap *ctx)
+{
+	if (!ctx)
+		return;
+	if (ctx->fd >= 0) {
+		v4l2cap_stop(ctx);
+		v4l2cap_unconfigure(ctx);
+		ctx->ops->close(ctx->fd);
+	}
+	cap_pool_free(ctx);
+	free(ctx->path);
+	free(ctx);
+}
+
+/* Lets go of a vanished device without talking to it; read/userptr memory is pooled for the reopen */
+static void cap_detach(struct v4l2cap *ctx)
+{
+	struct v4l2cap_buffer *pool = NULL;
+	unsigned int i;
+
+	ctx->lost = ctx->streaming ? 2 : 1;
+	if (ctx->io != V4L2CAP_IO_MMAP && ctx->n_buffers)
+		pool = realloc(ctx->pool, (ctx->n_pool + ctx->n_buffers) * sizeof(*ctx->pool));
+	if (pool) {
+		memcpy(pool + ctx->n_pool, ctx->buffers, ctx->n_buffers * sizeof(*pool));
+		ctx->pool = pool;
+		ctx->n_pool += ctx->n_buffers;
+	} else
+		for (i = 0; i < ctx->n_buffers; ++i)
+			if (ctx->io == V4L2CAP_IO_MMAP)
+				ctx->ops->munmap(ctx->buffers[i].start, ctx->buffers[i].length);
+			else
+				free(ctx->buffers[i].start);
+	free(ctx->buffers);
+	ctx->buffers = NULL;
+	ctx->n_buffers = 0;
+	ctx->configured = 0;
+	ctx->streaming = 0;
+	ctx->read_busy = 0;
+	ctx->stats.queued = 0;
+	ctx->ops->close(ctx->fd);
+	ctx->fd = -1;
+}
+
+/**
+Function Name : v4l2cap_reopen
+Function Description : Recovers from a device that went away (-ENODEV, -EIO from dequeue or release): drops the
+                       old descriptor and buffers, opens the same path again, reapplies the last configuration and
+                       restarts the stream if it was running. Read and user pointer memory is reused. Meant to be
+                       called again until it succeeds, the first call only detaches if the node is not back yet.
+                       Frames dequeued before the loss must not be released afterwards
+Parameter : context
+Return : 0 for success, -errno while the device is not back (-ENOENT while the node is missing), -ERANGE if it
+         came back unable to deliver the same frame size
+**/
+int v4l2cap_reopen(struct v4l2cap *ctx)
+{
+	struct v4l2cap_config prev = ctx->config, config = ctx->config;
+	int resume, ret;
+
+	if (ctx->fd >= 0)
+		cap_detach(ctx);
+	resume = ctx->lost == 2;
+	if ((ret = cap_attach(ctx)) < 0)
+		return ret;
+
+	if (prev.width && (ret = v4l2cap_configure(ctx, &config)) == 0 &&
+	    (config.width != prev.width || config.height != prev.height || config.sizeimage != prev.sizeimage))
+		ret = -ERANGE;
+	if (ret == 0 && resume)
+		ret = v4l2cap_start(ctx);
+	if (ret < 0) {
+		v4l2cap_stop(ctx);
+		cap_detach(ctx);
+		ctx->lost = resume ? 2 : 1;
+		ctx->config = prev;
+		return ret;
+	}
+	ctx->lost = 0;
+
+	return 0;
+}
+
+/**
+Function Name : v4l2cap_ioctl
+Function Description : Issues any other ioctl (controls, enumeration) on the context's device, retrying on EINTR
+Parameter : context, request and argument
+Return : the ioctl result, -errno for failure
+**/
+int v4l2cap_ioctl(struct v4l2cap *ctx, unsigned long request, void *arg)
+{
+	return cap_ioctl(ctx, request, arg);
+}
+
+int v4l2cap_fd(const struct v4l2cap *ctx)
+{
+	return ctx->fd;
+}
+
+unsigned int v4l2cap_buffer_count(const struct v4l2cap *ctx)
+{
+	return ctx->n_buffers;
+}
+
+const struct v4l2cap_stats *v4l2cap_get_stats(const struct v4l2cap *ctx)
+{
+	return &ctx->stats;
+}
+
+void v4l2cap_reset_stats(struct v4l2cap *ctx)
+{
+	unsigned int queued = ctx->stats.queued;
+
+	memset(&ctx->stats, 0, sizeof(ctx->stats));
+	ctx->stats.queued = queued;
+}
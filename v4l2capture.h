@@ -0,0 +1,86 @@
+#pragma once
+#include <sys/types.h>
+#include <sys/time.h>
+#include <linux/videodev2.h>
+
+/*
+ * libv4l2capture: the capture engine behind ./main as an embeddable library.
+ * Every call takes a context from v4l2cap_open() and returns 0 (or a count) on success and -errno on
+ * failure; nothing in the library prints or exits. A context is used from one thread at a time.
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define V4L2CAP_MAX_ERROR_RUN 64        /* consecutive error-flagged buffers before dequeue gives up with -EIO */
+#define V4L2CAP_DEFAULT_BUFFERS 4
+
+struct v4l2cap;
+
+enum v4l2cap_io {
+	V4L2CAP_IO_READ,                /* same order as the CLI's enum io_method */
+	V4L2CAP_IO_MMAP,
+	V4L2CAP_IO_USERPTR,
+};
+
+struct v4l2cap_config {
+	unsigned int width, height;     /* requested, updated to what the driver negotiated */
+	unsigned int pixelformat;       /* V4L2 fourcc, must be one the device enumerates */
+	enum v4l2cap_io io;
+	unsigned int buffers;           /* driver buffers for mmap/userptr, 0 for the default */
+	unsigned int bytesperline;      /* out */
+	unsigned int sizeimage;         /* out */
+};
+
+/* A dequeued buffer; it belongs to the caller until v4l2cap_release() */
+struct v4l2cap_frame {
+	void *data;
+	unsigned int bytesused;
+	unsigned int index;
+	unsigned int sequence;
+	unsigned int flags;             /* V4L2_BUF_FLAG_* */
+	struct timeval timestamp;
+};
+
+struct v4l2cap_stats {
+	unsigned long long frames;      /* frames handed to the caller */
+	unsigned long long errors;      /* buffers requeued because of V4L2_BUF_FLAG_ERROR */
+	unsigned int error_run;         /* current run of error-flagged buffers */
+	unsigned int longest_error_run;
+	unsigned int queued;            /* buffers owned by the driver */
+};
+
+/* Everything the library does to the device goes through these, so a synthetic device can stand in */
+struct dev_ops {
+	int (*open)(const char *path, int flags);
+	int (*close)(int fd);
+	int (*ioctl)(int fd, unsigned long request, void *arg);
+	void *(*mmap)(void *addr, size_t length, int prot, int flags, int fd, off_t offset);
+	int (*munmap)(void *addr, size_t length);
+	ssize_t (*read)(int fd, void *buf, size_t count);
+};
+
+/* Returns nonzero to stop v4l2cap_run() after this frame */
+typedef int (*v4l2cap_frame_fn)(const struct v4l2cap_frame *frame, void *user);
+
+int v4l2cap_open(struct v4l2cap **ctx, const char *path, int flags);
+int v4l2cap_configure(struct v4l2cap *ctx, struct v4l2cap_config *config);
+int v4l2cap_unconfigure(struct v4l2cap *ctx);
+int v4l2cap_start(struct v4l2cap *ctx);
+int v4l2cap_dequeue(struct v4l2cap *ctx, struct v4l2cap_frame *frame);
+int v4l2cap_release(struct v4l2cap *ctx, const struct v4l2cap_frame *frame);
+long v4l2cap_run(struct v4l2cap *ctx, unsigned long frames, v4l2cap_frame_fn fn, void *user);
+int v4l2cap_stop(struct v4l2cap *ctx);
+void v4l2cap_close(struct v4l2cap *ctx);
+int v4l2cap_reopen(struct v4l2cap *ctx);
+
+int v4l2cap_ioctl(struct v4l2cap *ctx, unsigned long request, void *arg);
+int v4l2cap_fd(const struct v4l2cap *ctx);
+unsigned int v4l2cap_buffer_count(const struct v4l2cap *ctx);
+const struct v4l2cap_stats *v4l2cap_get_stats(const struct v4l2cap *ctx);
+void v4l2cap_reset_stats(struct v4l2cap *ctx);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,157 @@
+#pragma once
+#include <cerrno>
+#include <cstddef>
+#include <string>
+#include <system_error>
+#include <utility>
+#include <fcntl.h>
+#include <poll.h>
+#include "v4l2capture.h"
+
+/*
+ * Header-only C++ wrapper over libv4l2capture. Failures throw std::system_error carrying the errno.
+ * Frames are move-only handles that give their buffer back to the driver when destroyed, so holding a
+ * Frame is what keeps a buffer away from the device. Frames must not outlive the Device they came from.
+ * Needs no more than C++11.
+ */
+
+namespace v4l2capture {
+
+inline int check(int ret, const char *what)
+{
+	if (ret < 0)
+		throw std::system_error(-ret, std::generic_category(), what);
+	return ret;
+}
+
+class Frame {
+public:
+	Frame() noexcept : ctx_(nullptr), frame_() {}
+	Frame(v4l2cap *ctx, const v4l2cap_frame &frame) noexcept : ctx_(ctx), frame_(frame) {}
+	Frame(Frame &&other) noexcept : ctx_(other.ctx_), frame_(other.frame_) { other.ctx_ = nullptr; }
+	Frame &operator=(Frame &&other) noexcept
+	{
+		if (this != &other) {
+			release();
+			ctx_ = other.ctx_;
+			frame_ = other.frame_;
+			other.ctx_ = nullptr;
+		}
+		return *this;
+	}
+	Frame(const Frame &) = delete;
+	Frame &operator=(const Frame &) = delete;
+	~Frame() { release(); }
+
+	explicit operator bool() const noexcept { return ctx_ != nullptr; }
+	const unsigned char *data() const noexcept { return static_cast<const unsigned char *>(frame_.data); }
+	std::size_t size() const noexcept { return frame_.bytesused; }
+	unsigned int sequence() const noexcept { return frame_.sequence; }
+	unsigned int flags() const noexcept { return frame_.flags; }
+	const timeval &timestamp() const noexcept { return frame_.timestamp; }
+	const v4l2cap_frame &raw() const noexcept { return frame_; }
+
+	/* Requeues the buffer now instead of at destruction; errors are dropped as in the destructor */
+	void release() noexcept
+	{
+		v4l2cap *ctx = ctx_;
+
+		ctx_ = nullptr;
+		if (ctx)
+			v4l2cap_release(ctx, &frame_);
+	}
+
+private:
+	v4l2cap *ctx_;
+	v4l2cap_frame frame_;
+};
+
+class Device {
+public:
+	explicit Device(const std::string &path, int flags = O_RDWR) : ctx_(nullptr)
+	{
+		check(v4l2cap_open(&ctx_, path.c_str(), flags), "v4l2cap_open");
+	}
+	Device(Device &&other) noexcept : ctx_(other.ctx_) { other.ctx_ = nullptr; }
+	Device &operator=(Device &&other) noexcept
+	{
+		if (this != &other) {
+			v4l2cap_close(ctx_);
+			ctx_ = other.ctx_;
+			other.ctx_ = nullptr;
+		}
+		return *this;
+	}
+	Device(const Device &) = delete;
+	Device &operator=(const Device &) = delete;
+	~Device() { v4l2cap_close(ctx_); }
+
+	/* Returns the configuration with the size the driver negotiated filled in */
+	v4l2cap_config configure(v4l2cap_config config)
+	{
+		check(v4l2cap_configure(ctx_, &config), "v4l2cap_configure");
+		return config;
+	}
+	void start() { check(v4l2cap_start(ctx_), "v4l2cap_start"); }
+	void stop() { check(v4l2cap_stop(ctx_), "v4l2cap_stop"); }
+
+	/* Empty Frame when the device was opened O_NONBLOCK and nothing is ready */
+	Frame next()
+	{
+		v4l2cap_frame frame;
+		int ret = v4l2cap_dequeue(ctx_, &frame);
+
+		if (ret == -EAGAIN)
+			return Frame();
+		check(ret, "v4l2cap_dequeue");
+		return Frame(ctx_, frame);
+	}
+
+	/*
+	 * Calls fn(Frame &&) for up to frames frames (0 for no limit) until it returns false; fn may keep the Frame.
+	 * On an O_NONBLOCK device it waits in poll() for the next frame, as v4l2cap_run() does
+	 */
+	template <typename Fn>
+	unsigned long run(unsigned long frames, Fn &&fn)
+	{
+		unsigned long done = 0;
+
+		while (frames == 0 || done < frames) {
+			Frame frame = next();
+
+			if (!frame) {
+				pollfd pfd = { fd(), POLLIN, 0 };
+
+				poll(&pfd, 1, -1);
+				continue;
+			}
+			done++;
+			if (!fn(std::move(frame)))
+				break;
+		}
+		return done;
+	}
+
+	/*
+	 * After next() threw ENODEV or EIO: true once the device is back with the same format (and streaming, if
+	 * it was), false while its node is still missing. Frames from before the loss must be destroyed first
+	 */
+	bool reopen()
+	{
+		int ret = v4l2cap_reopen(ctx_);
+
+		if (ret == -ENOENT || ret == -ENODEV || ret == -ENXIO || ret == -EACCES)
+			return false;
+		check(ret, "v4l2cap_reopen");
+		return true;
+	}
+
+	const v4l2cap_stats &stats() const noexcept { return *v4l2cap_get_stats(ctx_); }
+	int fd() const noexcept { return v4l2cap_fd(ctx_); }
+	v4l2cap *get() const noexcept { return ctx_; }
+
+private:
+	v4l2cap *ctx_;
+};
+
+} // namespace v4l2capture